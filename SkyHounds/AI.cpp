@@ -2,16 +2,87 @@
 
 #include "AI.h"
 
+#include "Scenario.h"
+
+// How far an AI can see, in map pixels.
+static const float AI_SIGHT_RANGE = 400.0f;
+
+// How far other teams' presence may outweigh our own before an AI falls back.
+static const float AI_RETREAT_THRESHOLD = 2.0f;
+
 AI::AI (Script * _script, Scenario * _scenario)
 	: Avatar(_script,_scenario) {
+	Extra<Mind> () = Mind ();
 }
 
-// Advance simuation by a time-step.
-void AI::SimTick () {
+// Chooses a target and where to go.
+void AI::Think () {
 	// If playing, decide what to do next.
 	if (scenario_v.on_map) {
-		// TO DO: Decide how to update scenario_p parameters.
+		AcquireTarget ();
+		AvoidThreat ();
+		// TO DO: Decide how to update other intentions.
+	}
+}
+
+// Starts playing once spawned, holding where it landed until it decides
+// to go somewhere, and keeps aiming at the target.
+void AI::SimTick () {
+	StateAvatarScenario & intent = Intent ();
+	if (scenario_v.on_map && ! intent.playing) {
+		intent.playing = true;
+		intent.motion_goal_x = scenario_v.map_x;
+		intent.motion_goal_y = scenario_v.map_y;
+	}
+	const StateScenarioAvatar * other = scenario->GetAvatarState (Extra<Mind> ().target);
+	if (other && other->on_map) {
+		intent.target_x = other->map_x;
+		intent.target_y = other->map_y;
 	}
 	// Do lower-level simulation.
 	Avatar::SimTick ();
 }
+
+// Chooses as target the nearest avatar on another team, if one is in sight:
+// within AI_SIGHT_RANGE, with no wall in between.
+void AI::AcquireTarget () {
+	nearby.clear ();
+	scenario->FindNearestAvatars (scenario_v.map_x, scenario_v.map_y,
+		SpatialGrid::MAX_NEAREST, AI_SIGHT_RANGE, nearby);
+	const CollisionMap & walls = scenario->GetCollisionMap ();
+	int i;
+	for (i = 0; i < (signed) nearby.size(); i++) {
+		const StateScenarioAvatar * other = scenario->GetAvatarState (nearby[i]);
+		if (other && other->team_assignment != scenario_v.team_assignment &&
+			walls.SegmentClear (scenario_v.map_x, scenario_v.map_y, other->map_x, other->map_y)) {
+			Extra<Mind> ().target = nearby[i];
+			return;
+		}
+	}
+	Extra<Mind> ().target = AvatarHandle ();
+}
+
+// Falls back toward friendly ground when outnumbered.
+// Looks one influence cell away in each of eight directions and heads for
+// the one where our team has the most control.
+void AI::AvoidThreat () {
+	const InfluenceMap & influence = scenario->GetInfluence ();
+	int team = scenario_v.team_assignment;
+	float x = scenario_v.map_x, y = scenario_v.map_y;
+	float best = influence.Control (team, x, y);
+	if (best > -AI_RETREAT_THRESHOLD)
+		return;
+	float step = influence.get_cell_size ();
+	StateAvatarScenario & intent = Intent ();
+	int dx, dy;
+	for (dy = -1; dy <= 1; dy++) {
+		for (dx = -1; dx <= 1; dx++) {
+			float control = influence.Control (team, x + dx * step, y + dy * step);
+			if (control > best) {
+				best = control;
+				intent.motion_goal_x = x + dx * step;
+				intent.motion_goal_y = y + dy * step;
+			}
+		}
+	}
+}
@@ -8,11 +8,31 @@ Avatar with artificial intelligence.
 #include "Avatar.h"
 
 class AI : public Avatar {
+	// Avatars near this one, reused between ticks.
+	std::vector<AvatarHandle> nearby;
+
+	// What an AI keeps from tick to tick (see Avatar::Extra).
+	struct Mind {
+		AvatarHandle target;  // Who we are aiming at, as of the last think.
+	};
+
 public:
 	AI (Script * _script, Scenario * _scenario);
 
+	virtual bool Thinks () const { return true; }
+
+	// Chooses a target and where to go.
+	virtual void Think ();
+
+	// Starts playing once spawned, and keeps aiming at the target.
 	virtual void SimTick ();
 
+private:
+	// Chooses as target the nearest avatar on another team, if one is in sight.
+	void AcquireTarget ();
+
+	// Falls back toward friendly ground when outnumbered.
+	void AvoidThreat ();
 };
 
 #endif
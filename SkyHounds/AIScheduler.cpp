@@ -0,0 +1,114 @@
+#include "libraries.h"
+
+#include "AIScheduler.h"
+
+#include "Avatar.h"
+#include "InfluenceMap.h"
+#include "RollbackRing.h"
+
+const float AIScheduler::PLAYER_BOOST = 4.0f;
+const float AIScheduler::THREAT_BOOST = 2.0f;
+const float AIScheduler::PLAYER_RANGE = 600.0f;
+const float AIScheduler::THREAT_LEVEL = 1.0f;
+
+// Ticks a new avatar is treated as having gone without thinking.
+static const int NEVER_THOUGHT = 1000000;
+
+// A new avatar is in a slot. It thinks as soon as there is room.
+void AIScheduler::Reset (int slot) {
+	if (slot >= (signed) last_thought.size())
+		last_thought.resize (slot + 1);
+	last_thought[slot] = tick - NEVER_THOUGHT;
+}
+
+// Picks this tick's thinkers.
+// An avatar's claim is the ticks since it last thought, times its boosts.
+// The strongest claims are picked, as many as the budget should allow
+// at the average cost of a think (at least one).
+void AIScheduler::Plan (const AvatarStore & perAvatar, const InfluenceMap & influence) {
+	int n = perAvatar.size();
+	picked.assign (n, 0);
+	atomic_exchange (&spent, 0);
+	atomic_exchange (&thinkers, 0);
+
+	players.clear ();
+	int i;
+	for (i = 0; i < n; i++) {
+		const StateScenarioAvatar & p = perAvatar.scenario_p (i);
+		if (p.on_map && ! perAvatar.avatar (i)->Thinks ())
+			players.push_back (std::make_pair (p.map_x, p.map_y));
+	}
+
+	claims.clear ();
+	for (i = 0; i < n; i++) {
+		if (! perAvatar.avatar (i)->Thinks ())
+			continue;
+		const StateScenarioAvatar & p = perAvatar.scenario_p (i);
+		float claim = (float) (tick - last_thought[perAvatar.Slot (i)]);
+		if (p.on_map) {
+			int k;
+			for (k = 0; k < (signed) players.size(); k++) {
+				float dx = players[k].first - p.map_x, dy = players[k].second - p.map_y;
+				if (dx * dx + dy * dy < PLAYER_RANGE * PLAYER_RANGE) {
+					claim *= PLAYER_BOOST;
+					break;
+				}
+			}
+			if (influence.Threat (p.team_assignment, p.map_x, p.map_y) > THREAT_LEVEL)
+				claim *= THREAT_BOOST;
+		}
+		claims.push_back (std::make_pair (claim, i));
+	}
+
+	int count = (signed) claims.size();
+	if (think_limit > 0) {
+		if (think_limit < count) {
+			std::nth_element (claims.begin(), claims.begin() + think_limit, claims.end(),
+				std::greater<std::pair<float,int> > ());
+			count = think_limit;
+		}
+	} else if (average_cost > 0) {
+		int affordable = (int) (budget / average_cost);
+		if (affordable < 1)
+			affordable = 1;
+		if (affordable < count) {
+			std::nth_element (claims.begin(), claims.begin() + affordable, claims.end(),
+				std::greater<std::pair<float,int> > ());
+			count = affordable;
+		}
+	}
+	for (i = 0; i < count; i++)
+		picked[claims[i].second] = 1;
+}
+
+// The avatar in a slot thought for some microseconds.
+void AIScheduler::Thought (int slot, long microseconds) {
+	last_thought[slot] = tick;
+	atomic_add (&spent, microseconds);
+	atomic_increment (&thinkers);
+}
+
+// Ends the tick: updates the average cost of a think.
+void AIScheduler::Finish () {
+	long n = atomic_read (&thinkers);
+	if (n > 0) {
+		float cost = (float) atomic_read (&spent) / n;
+		if (cost < 1)
+			cost = 1;
+		average_cost = average_cost > 0 ? average_cost * 0.9f + cost * 0.1f : cost;
+	}
+	tick++;
+}
+
+// Saves who last thought when. The average cost is left alone: it is
+// about this machine, not the game.
+void AIScheduler::Save (StateBlock & block) const {
+	block.Put (tick);
+	block.PutArray (last_thought);
+}
+
+// Puts back what Save saved.
+void AIScheduler::Restore (StateBlock & block) {
+	block.Get (tick);
+	block.GetArray (last_thought);
+}
@@ -0,0 +1,83 @@
+/**
+An AIScheduler decides which avatars get to think each tick.
+
+Every avatar steers every tick (Avatar::SimTick), but only some think
+(Avatar::Think), which is where expensive decisions go. Each tick the
+scheduler picks the thinkers with the best claim: how long since each last
+thought, boosted for avatars near a player or under threat. Avatars left
+out this tick have a better claim next tick, so everyone gets a turn.
+
+Think time is measured, and once the tick's budget is spent, the rest of
+the picked avatars wait for a later tick. How many to pick is judged from
+the average cost of a think, so the budget is seldom overshot by much.
+
+Plan and Finish run on the simulation thread; ShouldThink and Thought may
+be called from avatar threads in between.
+*/
+
+#ifndef AI_SCHEDULER_H
+#define AI_SCHEDULER_H
+
+#include "AvatarStore.h"
+
+class InfluenceMap;  // forward declaration
+class StateBlock;  // forward declaration
+
+class AIScheduler {
+	long budget;                      // Microseconds of thinking per tick.
+	int tick;
+
+	std::vector<int> last_thought;    // Tick each slot last thought. (by slot)
+	std::vector<char> picked;         // Picked to think this tick? (by dense index)
+	std::vector<std::pair<float,int> > claims;  // Scratch: (claim, dense index).
+	std::vector<std::pair<float,float> > players;  // Scratch: player positions.
+
+	mutable volatile long spent;      // Microseconds thought this tick.
+	volatile long thinkers;           // Avatars that thought this tick.
+	float average_cost;               // Microseconds per think, smoothed. (0=unknown)
+	int think_limit;                  // Thinkers per tick. (0=as the budget allows)
+
+public:
+	AIScheduler () : budget(2000), tick(0), spent(0), thinkers(0), average_cost(0), think_limit(0) { }
+
+	// Sets the microseconds of thinking allowed per tick.
+	void SetBudget (long microseconds) { budget = microseconds; }
+
+	// Lets exactly this many avatars think per tick, however long they
+	// take, so that who thinks when doesn't depend on the machine's speed.
+	// (0=use the time budget)
+	void SetThinkLimit (int count) { think_limit = count; }
+
+	// A new avatar is in a slot. It thinks as soon as there is room.
+	void Reset (int slot);
+
+	// Picks this tick's thinkers.
+	void Plan (const AvatarStore & perAvatar, const InfluenceMap & influence);
+
+	// Should the avatar at a dense index think now?
+	bool ShouldThink (int i) const {
+		return picked[i] && (think_limit > 0 || atomic_read (&spent) < budget);
+	}
+
+	// The avatar in a slot thought for some microseconds.
+	void Thought (int slot, long microseconds);
+
+	// Ends the tick: updates the average cost of a think.
+	void Finish ();
+
+	// Saves who last thought when, or puts back what was saved.
+	// Call between ticks.
+	void Save (StateBlock & block) const;
+	void Restore (StateBlock & block);
+
+private:
+	// How much more than usual avatars near players, or under threat, want to think.
+	static const float PLAYER_BOOST;
+	static const float THREAT_BOOST;
+	// How near is near a player, in pixels.
+	static const float PLAYER_RANGE;
+	// How much threat counts as under threat.
+	static const float THREAT_LEVEL;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "libraries.h"
+
+#include "Arena.h"
+
+Arena::Arena ()
+	: cursor(NULL), left(0), bytes_in_use(0), bytes_reserved(0)
+{
+	int c;
+	for (c = 0; c < SIZE_CLASSES; c++)
+		free_lists[c] = NULL;
+}
+
+Arena::~Arena () {
+	if (bytes_in_use > 0) {
+		warning (this, "Arena destroyed with %d bytes still in use", (int) bytes_in_use);
+		breakpoint ();
+	}
+	int c;
+	for (c = 0; c < (signed) chunks.size(); c++)
+		free (chunks[c]);
+}
+
+// A block of at least size bytes, aligned for any type.
+// Small blocks come off the free list for their size, or else off the
+// end of the newest chunk; a new chunk is started when that runs out.
+void * Arena::Allocate (size_t size) {
+	if (size == 0)
+		size = 1;
+	size_t rounded = (size + GRAIN - 1) / GRAIN * GRAIN;
+	if (rounded > MAX_SMALL) {
+		void * block = malloc (size);
+		if (! block) {
+			warning (this, "Out of memory allocating %d bytes", (int) size);
+			breakpoint ();
+			return NULL;
+		}
+		bytes_in_use += size;
+		bytes_reserved += size;
+		return block;
+	}
+
+	int size_class = (int) (rounded / GRAIN) - 1;
+	void * block = free_lists[size_class];
+	if (block) {
+		free_lists[size_class] = *(void **) block;
+	} else {
+		if (left < rounded) {
+			char * chunk = (char *) malloc (CHUNK_BYTES);
+			if (! chunk) {
+				warning (this, "Out of memory allocating an arena chunk");
+				breakpoint ();
+				return NULL;
+			}
+			chunks.push_back (chunk);
+			bytes_reserved += CHUNK_BYTES;
+			cursor = chunk;
+			left = CHUNK_BYTES;
+		}
+		block = cursor;
+		cursor += rounded;
+		left -= rounded;
+	}
+	bytes_in_use += rounded;
+	return block;
+}
+
+// Gives back a block, with the size it was asked for with.
+void Arena::Free (void * block, size_t size) {
+	if (! block)
+		return;
+	if (size == 0)
+		size = 1;
+	size_t rounded = (size + GRAIN - 1) / GRAIN * GRAIN;
+	if (rounded > MAX_SMALL) {
+		free (block);
+		bytes_in_use -= size;
+		bytes_reserved -= size;
+		return;
+	}
+	int size_class = (int) (rounded / GRAIN) - 1;
+	*(void **) block = free_lists[size_class];
+	free_lists[size_class] = block;
+	bytes_in_use -= rounded;
+}
@@ -0,0 +1,47 @@
+/**
+An Arena hands out memory from large chunks of its own, so that what
+belongs to one owner (e.g., one match's avatars; see MemoryPool) sits
+together, apart from everything else in the process, and is counted and
+given back together.
+
+Blocks of up to MAX_SMALL bytes are carved out of CHUNK_BYTES chunks.
+Freed blocks go on a free list for their size, to be reused by the same
+arena; chunks only go back to the system when the arena is destroyed.
+Larger blocks come from the heap, but are still counted.
+
+Not thread-safe: an arena is used by one thread at a time (e.g., whichever
+is running its scenario).
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+class Arena {
+	enum { CHUNK_BYTES = 64 * 1024 };
+	enum { GRAIN = 16 };                       // Sizes are rounded up to this.
+	enum { MAX_SMALL = 1024 };
+	enum { SIZE_CLASSES = MAX_SMALL / GRAIN };
+
+	std::vector<char*> chunks;
+	char * cursor;                             // Free space in the newest chunk.
+	size_t left;
+	void * free_lists[SIZE_CLASSES];           // Freed blocks by size class.
+
+	size_t bytes_in_use;
+	size_t bytes_reserved;                     // Chunks and large blocks.
+
+public:
+	Arena ();
+	~Arena ();
+
+	// A block of at least size bytes, aligned for any type.
+	void * Allocate (size_t size);
+
+	// Gives back a block, with the size it was asked for with.
+	void Free (void * block, size_t size);
+
+	size_t get_bytes_in_use () const { return bytes_in_use; }
+	size_t get_bytes_reserved () const { return bytes_reserved; }
+};
+
+#endif
@@ -0,0 +1,146 @@
+#include "libraries.h"
+
+#include "AssetLoader.h"
+
+AssetLoader::AssetLoader ()
+	: thread(NULL), threads(0), loaded(0), cancelled(0)
+{
+}
+
+// Skips what is left, waits for what is being loaded, and frees anything
+// not taken.
+AssetLoader::~AssetLoader () {
+	if (thread) {
+		atomic_exchange (&cancelled, 1);
+		al_join_thread (thread, NULL);
+		al_destroy_thread (thread);
+	}
+	int i;
+	for (i = 0; i < (signed) assets.size(); i++) {
+		if (assets[i].image)
+			al_destroy_bitmap (assets[i].image);
+		delete assets[i].parsed;
+	}
+}
+
+// Adds an image to decode into a memory bitmap.
+void AssetLoader::AddImage (std::string file_name) {
+	Add (file_name, false);
+}
+
+// Adds a script to parse.
+void AssetLoader::AddScript (std::string file_name) {
+	Add (file_name, true);
+}
+
+// Starts the loading thread. Everything must have been added.
+// Without the thread, loads everything on this one (keeping its bitmap
+// flags), so that the loader still becomes ready.
+void AssetLoader::Start (int _threads) {
+	if (thread) {
+		warning (this, "Asset loader started twice");
+		breakpoint ();
+		return;
+	}
+	threads = _threads > 0 ? _threads : cpu_count ();
+	thread = al_create_thread (LoaderMain, this);
+	if (! thread) {
+		warning (this, "Could not create asset loader thread");
+		breakpoint ();
+		int flags = al_get_new_bitmap_flags ();
+		LoadJob job;
+		job.loader = this;
+		job.Run (0, (signed) assets.size());
+		al_set_new_bitmap_flags (flags);
+		return;
+	}
+	al_start_thread (thread);
+}
+
+// Fraction of files loaded so far.
+float AssetLoader::get_progress () const {
+	if (assets.size() == 0)
+		return 1.0f;
+	return (float) atomic_read (&loaded) / assets.size();
+}
+
+// Has everything been loaded?
+bool AssetLoader::is_ready () const {
+	return atomic_read (&loaded) == (signed) assets.size();
+}
+
+// Waits until everything has been loaded.
+void AssetLoader::Wait () {
+	while (! is_ready ())
+		al_rest (0.001);
+}
+
+// Hands over a loaded image.
+ALLEGRO_BITMAP * AssetLoader::TakeImage (std::string file_name) {
+	std::map<std::string, int>::const_iterator found = index.find (file_name);
+	if (found == index.end () || ! is_ready ())
+		return NULL;
+	ALLEGRO_BITMAP * image = assets[found->second].image;
+	assets[found->second].image = NULL;
+	return image;
+}
+
+// Hands over a parsed script.
+Script * AssetLoader::TakeScript (std::string file_name) {
+	std::map<std::string, int>::const_iterator found = index.find (file_name);
+	if (found == index.end () || ! is_ready ())
+		return NULL;
+	Script * parsed = assets[found->second].parsed;
+	assets[found->second].parsed = NULL;
+	return parsed;
+}
+
+// Adds a file, once.
+void AssetLoader::Add (std::string file_name, bool script) {
+	if (thread) {
+		warning (this, "%s added after loading started", file_name.c_str());
+		breakpoint ();
+		return;
+	}
+	if (index.count (file_name) > 0)
+		return;
+	Asset asset;
+	asset.file_name = file_name;
+	asset.script = script;
+	asset.image = NULL;
+	asset.parsed = NULL;
+	index[file_name] = (signed) assets.size();
+	assets.push_back (asset);
+}
+
+// Loads a range of assets, on whichever thread the pool gives it. New
+// bitmap flags belong to each thread, so they are set here: images are
+// decoded into memory, as there is no display on these threads.
+void AssetLoader::LoadJob::Run (int begin, int end) {
+	al_set_new_bitmap_flags (ALLEGRO_MEMORY_BITMAP);
+	int i;
+	for (i = begin; i < end; i++) {
+		if (! atomic_read (&loader->cancelled)) {
+			Asset & asset = loader->assets[i];
+			if (! asset.script)
+				asset.image = al_load_bitmap (asset.file_name.c_str());
+			else if (al_filename_exists (asset.file_name.c_str()))
+				asset.parsed = new Script (asset.file_name);
+		}
+		atomic_increment (&loader->loaded);
+	}
+}
+
+// Loading thread: shares the assets out over a pool, one at a time, so
+// that a large image on one thread doesn't hold up the rest. The main
+// thread is pinned to a core, and this thread and its workers would be
+// pinned with it, so it lets go of that first.
+void * AssetLoader::LoaderMain (ALLEGRO_THREAD * thread, void * arg) {
+	AssetLoader * loader = (AssetLoader *) arg;
+	unpin_current_thread ();
+	ThreadPool pool (loader->threads - 1);
+	LoadJob job;
+	job.loader = loader;
+	pool.ParallelFor (&job, (signed) loader->assets.size(), 1);
+	return NULL;
+}
@@ -0,0 +1,83 @@
+/**
+An AssetLoader reads a scenario's files before it starts: decodes images
+into memory bitmaps and parses scripts, on every core, while the display
+shows how far it has got.
+
+Files are added first (see Scenario::Preload), then Start loads them all
+on a thread of its own, which shares them out over a ThreadPool. Progress
+and readiness can be polled from any thread. Once ready, the scenario
+takes the results by file name; making textures of the images is left to
+it, on the thread with the display.
+
+A file added twice is loaded once. A file that can't be loaded (an image
+that won't decode, or a file that isn't there) gives NULL when taken, so
+the taker can say what was wrong with it.
+*/
+
+#ifndef ASSET_LOADER_H
+#define ASSET_LOADER_H
+
+#include "Script.h"
+#include "ThreadPool.h"
+
+class AssetLoader {
+public:
+	AssetLoader ();
+
+	// Stops loading what hasn't been loaded yet, and frees what hasn't
+	// been taken.
+	~AssetLoader ();
+
+	// Adds an image or script to load. Call before Start.
+	void AddImage (std::string file_name);
+	void AddScript (std::string file_name);
+
+	// Starts loading, on this many threads. (0=one per core) If no thread
+	// can be made, loads everything here before returning.
+	void Start (int threads);
+
+	// Fraction of files loaded so far, from 0 to 1.
+	float get_progress () const;
+
+	// Has everything been loaded?
+	bool is_ready () const;
+
+	// Waits until everything has been loaded.
+	void Wait ();
+
+	// Was a file added?
+	bool Has (std::string file_name) const { return index.count (file_name) > 0; }
+
+	// Hands over a loaded image (a memory bitmap) or script, to be freed by
+	// the taker. Call once ready. (NULL=not added, taken already, or
+	// couldn't be loaded)
+	ALLEGRO_BITMAP * TakeImage (std::string file_name);
+	Script * TakeScript (std::string file_name);
+
+private:
+	struct Asset {
+		std::string file_name;
+		bool script;
+		ALLEGRO_BITMAP * image;
+		Script * parsed;
+	};
+	std::vector<Asset> assets;
+	std::map<std::string, int> index;   // File name -> assets.
+
+	ALLEGRO_THREAD * thread;
+	int threads;
+	mutable volatile long loaded;       // Assets loaded (or failed).
+	volatile long cancelled;            // Set to skip what is left.
+
+	class LoadJob : public ThreadPool::Job {
+	public:
+		AssetLoader * loader;
+		virtual void Run (int begin, int end);
+	};
+
+	void Add (std::string file_name, bool script);
+
+	static void * LoaderMain (ALLEGRO_THREAD * thread, void * arg);
+};
+
+#endif
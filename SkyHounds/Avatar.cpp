@@ -9,12 +9,31 @@
 
 Avatar::Avatar (Script * _script, Scenario * _scenario)
 	: MemoryBinding(_scenario), script(_script), scenario(_scenario) {
+	if (scenario)
+		handle = scenario->AddAvatar (this);
+}
+
+Avatar::~Avatar () {
+	if (scenario)
+		scenario->RemoveAvatar (handle);
+	delete script;
+}
+
+// What this avatar wants of the scenario. Sent to it every SimTick.
+StateAvatarScenario & Avatar::Intent () {
+	return Memory ().intent;
+}
+
+// This avatar's entry in the scenario's AvatarStore.
+AvatarMemory & Avatar::Memory () {
+	return *scenario->GetAvatarMemory (handle);
 }
 
 // Register an intention to join a given team.
 void Avatar::JoinGame (int desired_team) {
-	scenario_p.join_team = desired_team;
-	scenario->UpdateAvatarInfo (scenario_p, this);
+	StateAvatarScenario & intent = Intent ();
+	intent.join_team = desired_team;
+	scenario->UpdateAvatarInfo (intent, this);
 }
 
 // Receives information from the scenario.
@@ -25,25 +44,29 @@ void Avatar::UpdateScenarioInfo (const StateScenarioAvatar & v, Scenario * scena
 // Advance simuation by a time-step.
 void Avatar::SimTick () {
 	// Make sure the scenario is aware of any changes the avatar has made.
-	scenario->UpdateAvatarInfo (scenario_p, this);
+	scenario->UpdateAvatarInfo (Intent (), this);
 }
 
 Avatar * Avatar::Make (std::string avatar_type, std::string agency_type, Scenario * scenario) {
-	// Load the script for the avatar type.
-	Script * script = new Script (std::string("avatars/") + avatar_type + "/script.txt");
+	// Copy the script for the avatar type, read once per scenario.
+	Script * script = scenario->MakeAvatarScript (avatar_type);
 
 	// Decide what kind of agency the avatar has: player or ai.
 	// Avatar may ignore certain script commands, depending on agency type.
 	Avatar * avatar;
 	if (agency_type == "player")
-		avatar = new Player (script, scenario);
+		avatar = new (scenario) Player (script, scenario);
 	else if (agency_type == "ai")
-		avatar = new AI (script, scenario);
+		avatar = new (scenario) AI (script, scenario);
 	else {
 		warning (NULL, "Unrecognized agency_type: %s\n", agency_type.c_str());
 		breakpoint ();
 		avatar = NULL;
 	}
+	if (avatar) {
+		avatar->avatar_type = avatar_type;
+		avatar->agency_type = agency_type;
+	}
 
 	return avatar;
 }
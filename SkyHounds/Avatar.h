@@ -1,11 +1,17 @@
 /**
 An Avatar interfaces with the game scenario.
 The Avatar is deleted when the scenario is deleted.
+
+What an avatar keeps from tick to tick lives in the scenario's AvatarStore
+(see AvatarMemory), not in the Avatar, so that the scenario can save and
+restore it with everything else. Reach it through Intent and Extra, and
+keep only scratch space in Avatar members.
 */
 
 #ifndef AVATAR_H
 #define AVATAR_H
 
+#include "AvatarStore.h"
 #include "MemoryBinding.h"
 #include "Script.h"
 #include "StateAvatarScenario.h"
@@ -17,28 +23,64 @@ protected:
 	Scenario * scenario;
 	Script * script;
 
-	StateAvatarScenario scenario_p;
-	StateScenarioAvatar scenario_v;
+	StateScenarioAvatar scenario_v;  // Refreshed every tick; not kept.
+
+	AvatarHandle handle;  // How the scenario refers to this avatar.
+
+	// What Make was asked for. (empty=not made by Make)
+	std::string avatar_type;
+	std::string agency_type;
 	
 	Avatar (Script * _script, Scenario * _scenario);
 
-public:
+	// What this avatar wants of the scenario. Sent to it every SimTick.
+	StateAvatarScenario & Intent ();
 
-	virtual ~Avatar () {
-		delete script;
+	// A kind of avatar's own lasting state, of plain data, kept in the
+	// AvatarMemory's extra bytes. Zeroed when the avatar is added, so set
+	// it up in the constructor. Don't hold on to the reference across
+	// avatars being added.
+	template <class T>
+	T & Extra () {
+		// (Fails to compile, as an array of negative size, if T doesn't fit.)
+		enum { fits_in_extra = sizeof (char [sizeof (T) <= AvatarMemory::EXTRA_BYTES ? 1 : -1]) };
+		return *(T *) Memory ().extra.bytes;
 	}
 
+public:
+
+	virtual ~Avatar ();
+
+	// Returns the handle by which the scenario refers to this avatar.
+	AvatarHandle GetHandle () const { return handle; }
+
+	// The types the avatar was made with (see Make).
+	const std::string & get_avatar_type () const { return avatar_type; }
+	const std::string & get_agency_type () const { return agency_type; }
+
 	// Register an intention to join a given team.
 	void JoinGame (int desired_team);
 
 	// Receives information from the scenario.
 	void UpdateScenarioInfo (const StateScenarioAvatar & v, Scenario * scenario);
 
+	// Does this avatar think (see Think)? Players don't.
+	virtual bool Thinks () const { return false; }
+
+	// Makes the expensive decisions. Called before SimTick, but only on
+	// some ticks, as the scenario's AI budget allows.
+	virtual void Think () { }
+
 	// Advance simuation by a time-step.
+	// Called every tick, so should be cheap.
 	virtual void SimTick ();
 
 	// Makes an avatar of the given type within a scenario.
 	static Avatar * Make (std::string avatar_type, std::string agency_type, Scenario * scenario);
+
+private:
+	// This avatar's entry in the scenario's AvatarStore.
+	AvatarMemory & Memory ();
 };
 
 #endif
@@ -0,0 +1,88 @@
+#include "libraries.h"
+
+#include "AvatarStore.h"
+
+#include "RollbackRing.h"
+
+// Adds an avatar. Returns the handle by which it should be referred to.
+AvatarHandle AvatarStore::Add (Avatar * avatar) {
+	// Reuse a free slot if there is one.
+	int slot;
+	if (free_slots.size() > 0) {
+		slot = free_slots.back ();
+		free_slots.pop_back ();
+	} else {
+		slot = (signed) slot_dense.size();
+		slot_dense.push_back (-1);
+		slot_generation.push_back (0);
+	}
+
+	// Append to the dense arrays.
+	int i = (signed) avatars.size();
+	avatars.push_back (avatar);
+	p.push_back (StateScenarioAvatar ());
+	v.push_back (StateAvatarScenario ());
+	v_next.push_back (StateAvatarScenario ());
+	memory.push_back (AvatarMemory ());
+	dense_slot.push_back (slot);
+	slot_dense[slot] = i;
+	changes++;
+
+	return AvatarHandle (slot, slot_generation[slot]);
+}
+
+// Removes the avatar with the given handle. Returns false if the handle is stale.
+bool AvatarStore::Remove (AvatarHandle handle) {
+	int i = Index (handle);
+	if (i < 0)
+		return false;
+
+	// Move the last dense entry into the hole, and fix up its slot.
+	int last = (signed) avatars.size() - 1;
+	if (i != last) {
+		avatars[i] = avatars[last];
+		p[i] = p[last];
+		v[i] = v[last];
+		v_next[i] = v_next[last];
+		memory[i] = memory[last];
+		dense_slot[i] = dense_slot[last];
+		slot_dense[dense_slot[i]] = i;
+	}
+	avatars.pop_back ();
+	p.pop_back ();
+	v.pop_back ();
+	v_next.pop_back ();
+	memory.pop_back ();
+	dense_slot.pop_back ();
+	changes++;
+
+	// Retire the slot. Bumping the generation invalidates outstanding handles.
+	slot_dense[handle.slot] = -1;
+	slot_generation[handle.slot]++;
+	free_slots.push_back (handle.slot);
+	return true;
+}
+
+// Saves the avatars' state, between ticks.
+// The slot table and dense order only change when avatars come and go,
+// which Restore refuses to undo, so only the per-avatar arrays are copied.
+// (v_next is not state: avatars fill it in afresh every tick.)
+void AvatarStore::Save (StateBlock & block) const {
+	block.Put (changes);
+	block.PutArray (p);
+	block.PutArray (v);
+	block.PutArray (memory);
+}
+
+// Puts back state saved by Save. Fails, changing nothing, if avatars
+// have been added or removed since.
+bool AvatarStore::Restore (StateBlock & block) {
+	int saved_changes = 0;
+	block.Get (saved_changes);
+	if (saved_changes != changes)
+		return false;
+	block.GetArray (p);
+	block.GetArray (v);
+	block.GetArray (memory);
+	return true;
+}
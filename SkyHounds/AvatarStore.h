@@ -0,0 +1,132 @@
+/**
+AvatarStore keeps per-avatar scenario state in parallel contiguous arrays.
+
+Avatars are referred to by an AvatarHandle, which names a slot and the
+generation of that slot. Slots are recycled when avatars leave, and each
+reuse bumps the generation, so a handle held by a departed avatar can never
+resolve to a newcomer.
+
+Slots point into the dense arrays. Removal swaps the last dense entry into
+the hole, so the dense arrays never have gaps and lookups and removals are O(1).
+Dense indices are NOT stable across removals; keep handles, not indices.
+
+StateAvatarScenario is double-buffered. Avatars write into the back buffer
+(avatar_v_next) during a tick while the scenario reads the front buffer
+(avatar_v); SwapAvatarBuffers makes the new values current.
+
+Each avatar's own lasting state (AvatarMemory) is kept here too, rather
+than in the Avatar, so that Save can copy the whole store a few arrays at
+a time for rollback (see RollbackRing).
+*/
+
+#ifndef AVATAR_STORE_H
+#define AVATAR_STORE_H
+
+#include "StateAvatarScenario.h"
+
+class Avatar;  // forward declaration
+class StateBlock;  // forward declaration
+
+struct AvatarHandle {
+	int slot;        // Index into the slot table. (-1=none)
+	int generation;  // Generation of the slot when the handle was issued.
+	AvatarHandle () : slot(-1), generation(0) { }
+	AvatarHandle (int _slot, int _generation) : slot(_slot), generation(_generation) { }
+	bool operator== (const AvatarHandle & h) const { return slot == h.slot && generation == h.generation; }
+	bool operator!= (const AvatarHandle & h) const { return ! (*this == h); }
+};
+
+// What an avatar keeps from tick to tick. Plain data only: it is saved and
+// restored by copying bytes.
+struct AvatarMemory {
+	enum { EXTRA_BYTES = 48 };
+
+	StateAvatarScenario intent;   // What the avatar wants (see Avatar::Intent).
+
+	// Room for a kind of avatar's own state (see Avatar::Extra). Zeroed
+	// when the avatar is added.
+	union {
+		unsigned char bytes[EXTRA_BYTES];
+		double align;
+	} extra;
+
+	AvatarMemory () { memset (&extra, 0, sizeof (extra)); }
+};
+
+class AvatarStore {
+	// Dense arrays, all indexed by dense index.
+	std::vector<Avatar*> avatars;
+	std::vector<StateScenarioAvatar> p;
+	std::vector<StateAvatarScenario> v;
+	std::vector<StateAvatarScenario> v_next;  // Back buffer of v.
+	std::vector<AvatarMemory> memory;
+	std::vector<int> dense_slot;          // Which slot owns each dense entry.
+
+	// Slot table, indexed by handle slot.
+	std::vector<int> slot_dense;          // Dense index of each slot. (-1=free)
+	std::vector<int> slot_generation;     // Current generation of each slot.
+	std::vector<int> free_slots;          // Slots available for reuse.
+
+	int changes;                          // Avatars added or removed, ever.
+
+public:
+	AvatarStore () : changes(0) { }
+
+	// Adds an avatar. Returns the handle by which it should be referred to.
+	AvatarHandle Add (Avatar * avatar);
+
+	// Removes the avatar with the given handle. Returns false if the handle is stale.
+	bool Remove (AvatarHandle handle);
+
+	// Returns the dense index of a handle, or -1 if the handle is stale.
+	int Index (AvatarHandle handle) const {
+		if (handle.slot < 0 || handle.slot >= (signed) slot_dense.size())
+			return -1;
+		if (slot_generation[handle.slot] != handle.generation)
+			return -1;
+		return slot_dense[handle.slot];
+	}
+
+	// Returns the handle of the avatar at a dense index.
+	AvatarHandle Handle (int i) const {
+		int slot = dense_slot[i];
+		return AvatarHandle (slot, slot_generation[slot]);
+	}
+
+	// Returns the slot of the avatar at a dense index.
+	int Slot (int i) const { return dense_slot[i]; }
+
+	// Returns the current handle for an occupied slot.
+	AvatarHandle HandleOfSlot (int slot) const {
+		return AvatarHandle (slot, slot_generation[slot]);
+	}
+
+	// Number of avatars in the store.
+	int size () const { return (signed) avatars.size(); }
+
+	// Number of slots ever allocated. Slot indices are always below this.
+	int slot_count () const { return (signed) slot_dense.size(); }
+
+	// Dense-index accessors.
+	Avatar * avatar (int i) const { return avatars[i]; }
+	StateScenarioAvatar & scenario_p (int i) { return p[i]; }
+	StateAvatarScenario & avatar_v (int i) { return v[i]; }
+	const StateScenarioAvatar & scenario_p (int i) const { return p[i]; }
+	const StateAvatarScenario & avatar_v (int i) const { return v[i]; }
+	StateAvatarScenario & avatar_v_next (int i) { return v_next[i]; }
+	AvatarMemory & avatar_memory (int i) { return memory[i]; }
+	const AvatarMemory & avatar_memory (int i) const { return memory[i]; }
+
+	// Makes the back buffer of avatar information current.
+	// Only call when no avatar is writing (i.e., between ticks).
+	void SwapAvatarBuffers () { v.swap (v_next); }
+
+	// Saves the avatars' state, between ticks.
+	void Save (StateBlock & block) const;
+
+	// Puts back state saved by Save. Fails, changing nothing, if avatars
+	// have been added or removed since.
+	bool Restore (StateBlock & block);
+};
+
+#endif
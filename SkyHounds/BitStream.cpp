@@ -0,0 +1,85 @@
+#include "libraries.h"
+
+#include "BitStream.h"
+
+// Writes the low bits of value. (bits <= 32)
+// In a buffer it was given, a value that doesn't fit is not written at all.
+void BitWriter::Write (uint32_t value, int bits) {
+	if (buffer && (overflowed || bit_count + bits > capacity * 8)) {
+		overflowed = true;
+		return;
+	}
+	if (bits < 32)
+		value &= ((uint32_t) 1 << bits) - 1;
+	while (bits > 0) {
+		int used = bit_count & 7;
+		if (used == 0) {
+			if (buffer)
+				buffer[bit_count >> 3] = 0;
+			else
+				bytes.push_back (0);
+		}
+		unsigned char & last = buffer ? buffer[bit_count >> 3] : bytes.back ();
+		int room = 8 - used;
+		int take = bits < room ? bits : room;
+		last |= (unsigned char) ((value & ((1u << take) - 1)) << used);
+		value = take < 32 ? value >> take : 0;
+		bits -= take;
+		bit_count += take;
+	}
+}
+
+// Writes an unsigned value in groups of 4 bits, so small values are short.
+// Each group is followed by a bit saying whether another group follows.
+void BitWriter::WriteVar (uint32_t value) {
+	for (;;) {
+		Write (value & 15, 4);
+		value >>= 4;
+		WriteBool (value != 0);
+		if (value == 0)
+			return;
+	}
+}
+
+// Appends everything written to another writer.
+void BitWriter::Append (const BitWriter & other) {
+	const unsigned char * data = other.get_data ();
+	int i;
+	for (i = 0; i + 8 <= other.bit_count; i += 8)
+		Write (data[i / 8], 8);
+	if (i < other.bit_count)
+		Write (data[i / 8], other.bit_count - i);
+}
+
+// Reads a value written with BitWriter::Write.
+uint32_t BitReader::Read (int bits) {
+	if (position + bits > bit_count) {
+		overflowed = true;
+		position = bit_count;
+		return 0;
+	}
+	uint32_t value = 0;
+	int done = 0;
+	while (done < bits) {
+		int used = position & 7;
+		int room = 8 - used;
+		int take = bits - done < room ? bits - done : room;
+		uint32_t part = (data[position >> 3] >> used) & ((1u << take) - 1);
+		value |= part << done;
+		done += take;
+		position += take;
+	}
+	return value;
+}
+
+// Reads a value written with BitWriter::WriteVar.
+uint32_t BitReader::ReadVar () {
+	uint32_t value = 0;
+	int shift;
+	for (shift = 0; shift < 32; shift += 4) {
+		value |= Read (4) << shift;
+		if (! ReadBool ())
+			break;
+	}
+	return value;
+}
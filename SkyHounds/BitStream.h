@@ -0,0 +1,93 @@
+/**
+BitWriter and BitReader pack values into a byte buffer using only as many
+bits as each value needs, for sending over the network.
+
+Values are written least significant bit first. Reading past the end of
+the data doesn't crash: it returns zeros and sets a flag, so a damaged
+packet can be detected (Overflowed) and thrown away.
+
+A BitWriter normally grows a buffer of its own. It can instead write into
+a buffer it is given (Reset), such as the datagram a message will be sent
+in, so that nothing needs copying afterwards. Writing past the end of
+that sets a flag too.
+*/
+
+#ifndef BIT_STREAM_H
+#define BIT_STREAM_H
+
+class BitWriter {
+	std::vector<unsigned char> bytes;   // Own buffer.
+	unsigned char * buffer;             // Someone else's buffer. (NULL=own)
+	int capacity;                       // Bytes in someone else's buffer.
+	int bit_count;
+	bool overflowed;
+
+public:
+	BitWriter () : buffer(NULL), capacity(0), bit_count(0), overflowed(false) { }
+
+	// Empties the buffer.
+	void Clear () { bytes.clear (); bit_count = 0; overflowed = false; }
+
+	// Starts writing afresh into a buffer of capacity bytes, which must
+	// last while the writer is used. (NULL=its own buffer again)
+	// Copies of the writer write to the same buffer.
+	void Reset (unsigned char * _buffer, int _capacity) {
+		Clear ();
+		buffer = _buffer;
+		capacity = _buffer ? _capacity : 0;
+	}
+
+	// Writes the low bits of value. (bits <= 32)
+	void Write (uint32_t value, int bits);
+
+	void WriteBool (bool value) { Write (value ? 1 : 0, 1); }
+
+	// Writes a signed value in bits, which must be enough to hold it.
+	void WriteSigned (int32_t value, int bits) { Write (ZigZag (value), bits); }
+
+	// Writes an unsigned value in groups of 4 bits, so small values are short.
+	void WriteVar (uint32_t value);
+
+	// Appends everything written to another writer.
+	void Append (const BitWriter & other);
+
+	// Did a write go past the end of a buffer it was given? Nothing more
+	// is written once it has.
+	bool Overflowed () const { return overflowed; }
+
+	int get_bit_count () const { return bit_count; }
+	int get_byte_count () const { return (bit_count + 7) / 8; }
+	const unsigned char * get_data () const {
+		return buffer ? buffer : bytes.size() > 0 ? &bytes[0] : NULL;
+	}
+
+	// Folds signed values onto unsigned ones: 0, -1, 1, -2, 2...
+	static uint32_t ZigZag (int32_t value) { return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31); }
+	static int32_t UnZigZag (uint32_t value) { return (int32_t) (value >> 1) ^ -(int32_t) (value & 1); }
+};
+
+class BitReader {
+	const unsigned char * data;
+	int bit_count;
+	int position;     // In bits.
+	bool overflowed;
+
+public:
+	BitReader (const unsigned char * _data, int byte_count)
+		: data(_data), bit_count(byte_count * 8), position(0), overflowed(false) { }
+
+	// Reads a value written with BitWriter::Write.
+	uint32_t Read (int bits);
+
+	bool ReadBool () { return Read (1) != 0; }
+	int32_t ReadSigned (int bits) { return BitWriter::UnZigZag (Read (bits)); }
+	uint32_t ReadVar ();
+
+	// Did a read go past the end of the data?
+	bool Overflowed () const { return overflowed; }
+
+	// Bits not yet read.
+	int get_bits_left () const { return bit_count - position; }
+};
+
+#endif
@@ -0,0 +1,288 @@
+#include "libraries.h"
+
+#include "CollisionMap.h"
+
+// Makes a map of the given size with nothing blocked.
+void CollisionMap::Clear (int width, int height) {
+	Allocate (width, height);
+	BuildPyramid ();
+}
+
+// Decodes a paths image. Light, opaque pixels are paths; everything
+// else is blocked. Returns false if the image could not be read.
+bool CollisionMap::Build (ALLEGRO_BITMAP * paths) {
+	int width = al_get_bitmap_width (paths);
+	int height = al_get_bitmap_height (paths);
+	Allocate (width, height);
+
+	// Bytes are R, G, B, A in memory order with this format.
+	ALLEGRO_LOCKED_REGION * region = al_lock_bitmap (paths,
+		ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+	if (! region) {
+		warning (this, "Can't lock paths image");
+		breakpoint ();
+		return false;
+	}
+
+	Level & l = levels[0];
+	int x, y;
+	for (y = 0; y < height; y++) {
+		const unsigned char * pixel = (const unsigned char *) region->data + y * region->pitch;
+		uint32_t * row = &l.bits[y * l.words_per_row];
+		for (x = 0; x < width; x++, pixel += 4) {
+			int brightness = pixel[0] + pixel[1] + pixel[2];
+			bool path = brightness >= 3 * 128 && pixel[3] >= 128;
+			if (! path)
+				row[x >> 5] |= (uint32_t) 1 << (x & 31);
+		}
+	}
+	al_unlock_bitmap (paths);
+
+	BuildPyramid ();
+	return true;
+}
+
+// Marks every pixel in the box [x0,x1] x [y0,y1] as blocked or free,
+// and updates the coarser levels above it.
+void CollisionMap::SetBox (int x0, int y0, int x1, int y1, bool blocked) {
+	if (levels.size() == 0)
+		return;
+	x0 = clamp (x0, 0, get_width () - 1);
+	y0 = clamp (y0, 0, get_height () - 1);
+	x1 = clamp (x1, 0, get_width () - 1);
+	y1 = clamp (y1, 0, get_height () - 1);
+	if (x1 < x0 || y1 < y0)
+		return;
+
+	int x, y, level;
+	for (y = y0; y <= y1; y++) {
+		for (x = x0; x <= x1; x++)
+			Set (0, x, y, blocked);
+	}
+	for (level = 1; level < level_count (); level++) {
+		x0 >>= 1; y0 >>= 1; x1 >>= 1; y1 >>= 1;
+		for (y = y0; y <= y1; y++) {
+			for (x = x0; x <= x1; x++) {
+				// Blocked() counts cells past the edge as blocked, so look
+				// only at children that exist.
+				const Level & fine = levels[level - 1];
+				bool any = false;
+				int dx, dy;
+				for (dy = 0; dy < 2; dy++) {
+					for (dx = 0; dx < 2; dx++) {
+						if (2 * x + dx < fine.width && 2 * y + dy < fine.height && Blocked (level - 1, 2 * x + dx, 2 * y + dy))
+							any = true;
+					}
+				}
+				Set (level, x, y, any);
+			}
+		}
+	}
+}
+
+// Is the pixel containing (x,y) free to move through?
+bool CollisionMap::Walkable (float x, float y) const {
+	if (levels.size() == 0 || x < 0 || y < 0)
+		return false;
+	return ! Blocked (0, (int) x, (int) y);
+}
+
+// Is every pixel in the box [x0,x1] x [y0,y1] free?
+bool CollisionMap::BoxClear (float x0, float y0, float x1, float y1) const {
+	if (levels.size() == 0 || x0 < 0 || y0 < 0)
+		return false;
+	int ix0 = (int) x0, iy0 = (int) y0, ix1 = (int) x1, iy1 = (int) y1;
+	if (ix1 < ix0 || iy1 < iy0)
+		return true;
+	if (ix1 >= get_width () || iy1 >= get_height ())
+		return false;
+
+	// Start at the level where the box's shorter side is about one cell.
+	int side = ix1 - ix0 < iy1 - iy0 ? ix1 - ix0 + 1 : iy1 - iy0 + 1;
+	int level = 0;
+	while (level + 1 < level_count () && (2 << level) <= side)
+		level++;
+	return BoxClearAt (level, ix0, iy0, ix1, iy1);
+}
+
+// Is every pixel the segment from (x0,y0) to (x1,y1) passes through free?
+bool CollisionMap::SegmentClear (float x0, float y0, float x1, float y1) const {
+	if (levels.size() == 0 || x0 < 0 || y0 < 0 || x1 < 0 || y1 < 0)
+		return false;
+	if (x0 >= get_width () || x1 >= get_width () || y0 >= get_height () || y1 >= get_height ())
+		return false;
+
+	// Start at a level where the segment crosses only a few cells.
+	float dx = x1 - x0, dy = y1 - y0;
+	float length = dx * dx > dy * dy ? (dx < 0 ? -dx : dx) : (dy < 0 ? -dy : dy);
+	int level = 0;
+	while (level + 1 < level_count () && (2 << level) <= length / 2)
+		level++;
+	const Level & l = levels[level];
+	return SegmentClearAt (level, x0, y0, x1, y1, 0, 0, l.width - 1, l.height - 1);
+}
+
+// Sets up level 0 for the given size, all clear.
+void CollisionMap::Allocate (int width, int height) {
+	levels.resize (1);
+	Level & l = levels[0];
+	l.width = width;
+	l.height = height;
+	l.words_per_row = (width + 31) / 32;
+	l.bits.assign (l.words_per_row * height, 0);
+}
+
+// Builds levels 1 and up from level 0.
+// Each bit of a level is the OR of a 2x2 square of bits below it: OR the two
+// rows together, OR each bit with its neighbour, then squeeze the even bits
+// of two words into one.
+void CollisionMap::BuildPyramid () {
+	levels.resize (1);
+	while (levels.back().width > 1 || levels.back().height > 1) {
+		levels.push_back (Level ());
+		const Level & fine = levels[levels.size() - 2];
+		Level & coarse = levels.back ();
+		coarse.width = (fine.width + 1) / 2;
+		coarse.height = (fine.height + 1) / 2;
+		coarse.words_per_row = (coarse.width + 31) / 32;
+		coarse.bits.assign (coarse.words_per_row * coarse.height, 0);
+
+		int x, y;
+		for (y = 0; y < coarse.height; y++) {
+			const uint32_t * row_a = &fine.bits[(2 * y) * fine.words_per_row];
+			const uint32_t * row_b = 2 * y + 1 < fine.height ? row_a + fine.words_per_row : row_a;
+			uint32_t * out = &coarse.bits[y * coarse.words_per_row];
+			for (x = 0; x < fine.words_per_row; x++) {
+				uint32_t w = row_a[x] | row_b[x];
+				w = (w | (w >> 1)) & 0x55555555;
+				w = (w | (w >> 1)) & 0x33333333;
+				w = (w | (w >> 2)) & 0x0F0F0F0F;
+				w = (w | (w >> 4)) & 0x00FF00FF;
+				w = (w | (w >> 8)) & 0x0000FFFF;
+				out[x >> 1] |= w << ((x & 1) * 16);
+			}
+		}
+	}
+}
+
+// Are cells x0..x1 of row y at a level all clear? (Word at a time.)
+bool CollisionMap::RowClear (int level, int y, int x0, int x1) const {
+	const Level & l = levels[level];
+	const uint32_t * row = &l.bits[y * l.words_per_row];
+	int w0 = x0 >> 5, w1 = x1 >> 5;
+	uint32_t first = ~(uint32_t) 0 << (x0 & 31);
+	uint32_t last = ~(uint32_t) 0 >> (31 - (x1 & 31));
+	if (w0 == w1)
+		return (row[w0] & first & last) == 0;
+	if (row[w0] & first)
+		return false;
+	int w;
+	for (w = w0 + 1; w < w1; w++) {
+		if (row[w])
+			return false;
+	}
+	return (row[w1] & last) == 0;
+}
+
+// Box test at a level, on full-resolution pixel coordinates.
+// A blocked coarse cell that lies wholly inside the box settles it;
+// one that straddles the edge is looked at more closely.
+bool CollisionMap::BoxClearAt (int level, int x0, int y0, int x1, int y1) const {
+	int y;
+	if (level == 0) {
+		for (y = y0; y <= y1; y++) {
+			if (! RowClear (0, y, x0, x1))
+				return false;
+		}
+		return true;
+	}
+
+	int cx0 = x0 >> level, cy0 = y0 >> level;
+	int cx1 = x1 >> level, cy1 = y1 >> level;
+	int size = 1 << level;
+	int cx, cy;
+	for (cy = cy0; cy <= cy1; cy++) {
+		if (RowClear (level, cy, cx0, cx1))
+			continue;
+		for (cx = cx0; cx <= cx1; cx++) {
+			if (! Blocked (level, cx, cy))
+				continue;
+			int ex0 = cx * size, ey0 = cy * size;
+			int ex1 = ex0 + size - 1, ey1 = ey0 + size - 1;
+			if (ex0 >= x0 && ex1 <= x1 && ey0 >= y0 && ey1 <= y1)
+				return false;
+			if (! BoxClearAt (level - 1,
+					ex0 > x0 ? ex0 : x0, ey0 > y0 ? ey0 : y0,
+					ex1 < x1 ? ex1 : x1, ey1 < y1 ? ey1 : y1))
+				return false;
+		}
+	}
+	return true;
+}
+
+// Segment test at a level, visiting only cells within [cx0,cx1] x [cy0,cy1].
+// Walks the cells the segment crosses (Amanatides & Woo). Clear cells are
+// skipped whole; the part of the segment inside a blocked cell is checked
+// again one level down.
+bool CollisionMap::SegmentClearAt (int level, float x0, float y0, float x1, float y1,
+		int cx0, int cy0, int cx1, int cy1) const {
+	float size = (float) (1 << level);
+	float dx = x1 - x0, dy = y1 - y0;
+
+	int cx = (int) (x0 / size), cy = (int) (y0 / size);
+	int end_x = (int) (x1 / size), end_y = (int) (y1 / size);
+	cx = clamp (cx, cx0, cx1);
+	cy = clamp (cy, cy0, cy1);
+	end_x = clamp (end_x, cx0, cx1);
+	end_y = clamp (end_y, cy0, cy1);
+
+	int step_x = dx > 0 ? 1 : (dx < 0 ? -1 : 0);
+	int step_y = dy > 0 ? 1 : (dy < 0 ? -1 : 0);
+	const float never = 2.0f;  // beyond the end of the segment (t > 1)
+	float t_delta_x = step_x ? size / (dx < 0 ? -dx : dx) : never;
+	float t_delta_y = step_y ? size / (dy < 0 ? -dy : dy) : never;
+	float t_max_x = step_x ? ((step_x > 0 ? (cx + 1) * size : cx * size) - x0) / dx : never;
+	float t_max_y = step_y ? ((step_y > 0 ? (cy + 1) * size : cy * size) - y0) / dy : never;
+
+	float t = 0;
+	int steps = (end_x > cx ? end_x - cx : cx - end_x) + (end_y > cy ? end_y - cy : cy - end_y) + 1;
+	for (; steps > 0; steps--) {
+		bool last = cx == end_x && cy == end_y;
+		float t_next = t_max_x < t_max_y ? t_max_x : t_max_y;
+		if (t_next > 1 || last)
+			t_next = 1;
+		if (Blocked (level, cx, cy)) {
+			if (level == 0)
+				return false;
+			// The last piece ends exactly at (x1,y1), not at a rounded copy of it.
+			float sx1 = t_next < 1 ? x0 + dx * t_next : x1;
+			float sy1 = t_next < 1 ? y0 + dy * t_next : y1;
+			if (! SegmentClearAt (level - 1, x0 + dx * t, y0 + dy * t, sx1, sy1,
+					2 * cx, 2 * cy, 2 * cx + 1, 2 * cy + 1))
+				return false;
+		}
+		if (last)
+			break;
+		if (t_max_x < t_max_y) {
+			cx += step_x;
+			t = t_max_x;
+			t_max_x += t_delta_x;
+		} else {
+			cy += step_y;
+			t = t_max_y;
+			t_max_y += t_delta_y;
+		}
+		if (cx < cx0 || cx > cx1 || cy < cy0 || cy > cy1)
+			break;
+	}
+
+	// A segment ending exactly on a cell corner can leave the walk one
+	// cell short. The end point itself still has to be clear.
+	if (! (cx == end_x && cy == end_y) && Blocked (level, end_x, end_y)) {
+		if (level == 0)
+			return false;
+		return SegmentClearAt (level - 1, x1, y1, x1, y1,
+			2 * end_x, 2 * end_y, 2 * end_x + 1, 2 * end_y + 1);
+	}
+	return true;
+}
@@ -0,0 +1,86 @@
+/**
+A CollisionMap records which map pixels avatars can move through.
+
+It is decoded once from a scenario's paths image into one bit per pixel
+(1 = blocked), packed 32 pixels to a word. Above that is a pyramid of
+coarser levels, in which each bit is set if any of the four bits beneath
+it is set. A clear coarse bit proves a whole square is clear, so point,
+box and segment queries only descend to full resolution near walls.
+
+Everything outside the map counts as blocked.
+*/
+
+#ifndef COLLISION_MAP_H
+#define COLLISION_MAP_H
+
+class CollisionMap {
+	struct Level {
+		int width, height;           // In cells of this level.
+		int words_per_row;
+		std::vector<uint32_t> bits;  // Row-major; bit (x & 31) of word x >> 5.
+	};
+	std::vector<Level> levels;       // levels[0] is full resolution.
+
+public:
+	// Makes a map of the given size with nothing blocked.
+	void Clear (int width, int height);
+
+	// Decodes a paths image. Light, opaque pixels are paths; everything
+	// else is blocked. Returns false if the image could not be read.
+	bool Build (ALLEGRO_BITMAP * paths);
+
+	// Marks every pixel in the box [x0,x1] x [y0,y1] as blocked or free,
+	// and updates the coarser levels above it.
+	void SetBox (int x0, int y0, int x1, int y1, bool blocked);
+
+	int get_width () const { return levels.size() ? levels[0].width : 0; }
+	int get_height () const { return levels.size() ? levels[0].height : 0; }
+
+	// Is the pixel containing (x,y) free to move through?
+	bool Walkable (float x, float y) const;
+
+	// Is every pixel in the box [x0,x1] x [y0,y1] free?
+	bool BoxClear (float x0, float y0, float x1, float y1) const;
+
+	// Is every pixel the segment from (x0,y0) to (x1,y1) passes through free?
+	bool SegmentClear (float x0, float y0, float x1, float y1) const;
+
+	// Raw pyramid access, for coarse consumers such as navigation.
+	// At level L each cell covers a square of 2^L pixels on a side.
+	int level_count () const { return (signed) levels.size(); }
+	bool Blocked (int level, int x, int y) const {
+		const Level & l = levels[level];
+		if (x < 0 || y < 0 || x >= l.width || y >= l.height)
+			return true;
+		return (l.bits[y * l.words_per_row + (x >> 5)] >> (x & 31)) & 1;
+	}
+
+private:
+	// Sets up level 0 for the given size, all clear.
+	void Allocate (int width, int height);
+
+	// Builds levels 1 and up from level 0.
+	void BuildPyramid ();
+
+	// Sets or clears one bit of a level.
+	void Set (int level, int x, int y, bool blocked) {
+		Level & l = levels[level];
+		uint32_t bit = (uint32_t) 1 << (x & 31);
+		if (blocked)
+			l.bits[y * l.words_per_row + (x >> 5)] |= bit;
+		else
+			l.bits[y * l.words_per_row + (x >> 5)] &= ~bit;
+	}
+
+	// Are cells x0..x1 of row y at a level all clear? (Word at a time.)
+	bool RowClear (int level, int y, int x0, int x1) const;
+
+	// Box test at a level, on full-resolution pixel coordinates.
+	bool BoxClearAt (int level, int x0, int y0, int x1, int y1) const;
+
+	// Segment test at a level, visiting only cells within [cx0,cx1] x [cy0,cy1].
+	bool SegmentClearAt (int level, float x0, float y0, float x1, float y1,
+		int cx0, int cy0, int cx1, int cy1) const;
+};
+
+#endif
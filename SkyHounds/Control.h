@@ -4,32 +4,63 @@
 #ifndef CONTROL_H
 #define CONTROL_H
 
+#include "NetOverlay.h"
 #include "Scenario.h"
+#include "TripleBuffer.h"
 
 class Control {
 protected:
 	Scenario * scenario;
 
-	int current_time;
+	// Counts key presses, so the most recent of two opposing keys wins.
+	int key_count;
 
 	int north;
 	int south;
 	int west;
 	int east;
 
+	// View position and scale. These belong to the render thread.
 	float centre_x, centre_y;
 	float zoom;
+	double last_display_time;
+
+	// Map position of the display's top-left corner, as last displayed.
+	float view_left, view_top;
+
+	// Mouse position on the display, and the avatar last clicked on
+	// (ringed on the display).
+	int mouse_x, mouse_y;
+	AvatarHandle selected;
+
+	// Network stats: counted on the simulation thread, and handed to the
+	// render thread about once a second, to show (see NetOverlay). The game
+	// has no connection to a server yet, so there is only the local
+	// scenario's serializing to count.
+	struct NetSample {
+		NetStats stats;
+		double seconds;     // Period they cover.
+		NetSample () : seconds(0) { }
+	};
+	NetStats local_stats;          // The local scenario's serializing.
+	double net_sampled_at;
+	TripleBuffer<NetSample> net_samples;
+	bool show_net;                 // Is the overlay shown? (F3 toggles it.)
 
 public:
 	Control (Scenario * _scenario, ALLEGRO_DISPLAY * display)
-		: current_time(0), north(0), south(0), west(0), east(0),
+		: key_count(0), north(0), south(0), west(0), east(0),
 		  centre_x(al_get_display_width (display) / 2),
 		  centre_y(al_get_display_height (display) / 2),
-		  zoom(1.0f),
+		  zoom(1.0f), last_display_time(0), view_left(0), view_top(0),
+		  mouse_x(0), mouse_y(0),
+		  net_sampled_at(0), show_net(false),
 		  scenario(_scenario)
 		{}
 
 	void Mouse (int x, int y) {
+		mouse_x = x;
+		mouse_y = y;
 	}
 
 	void MouseScrollUp (int amount) {
@@ -44,7 +75,11 @@ public:
 			zoom = 0.1f;
 	}
 
+	// Selects the avatar under the mouse, if any.
 	void MouseButton (int button) {
+		float map_x = view_left + mouse_x / zoom;
+		float map_y = view_top + mouse_y / zoom;
+		selected = scenario->PickAvatar (map_x, map_y, 16.0f);
 	}
 
 	void LostMouse () {
@@ -61,8 +96,9 @@ public:
 
 	void KeyDown (int k) {
 		switch (k) {
-		case ALLEGRO_KEY_UP: north = current_time; break;
-		case ALLEGRO_KEY_DOWN: south = current_time; break;
+		case ALLEGRO_KEY_UP: north = ++key_count; break;
+		case ALLEGRO_KEY_DOWN: south = ++key_count; break;
+		case ALLEGRO_KEY_F3: show_net = ! show_net; break;
 		}
 	}
 
@@ -73,20 +109,49 @@ public:
 		}
 	}
 
-	void SimTick () {
-		current_time++;
-		
-		if (north > south) centre_y--;
-		if (south > north) centre_y++;
-		if (west > east) centre_x--;
-		if (east > west) centre_x++;
+	// Shows or hides the network overlay.
+	void ShowNetOverlay (bool on) { show_net = on; }
 
+	// Runs on the simulation thread.
+	void SimTick () {
 		scenario->SimTick ();
+		local_stats.Tick (scenario->get_serialize_us ());
+		SampleNetStats ();
+	}
+
+	// Runs on the simulation thread.
+	// Hands the stats counted over the last second or so to the overlay,
+	// and starts counting afresh.
+	void SampleNetStats () {
+		double now = al_get_time ();
+		if (net_sampled_at == 0)
+			net_sampled_at = now;
+		if (now - net_sampled_at < 1.0)
+			return;
+		NetSample & sample = net_samples.Back ();
+		sample.stats = local_stats;
+		sample.seconds = now - net_sampled_at;
+		net_samples.Publish ();
+		local_stats.Reset ();
+		net_sampled_at = now;
 	}
 
-	void Display (ALLEGRO_DISPLAY * display) {
+	// Runs on the render thread.
+	// alpha is how far to interpolate from the previous tick to the latest.
+	void Display (ALLEGRO_DISPLAY * display, float alpha) {
 		al_set_target_backbuffer (display);
 
+		// Scroll the view at 60 pixels per second, however fast we are drawing.
+		double now = al_get_time ();
+		float scroll = last_display_time > 0 ? (float) (60.0 * (now - last_display_time)) : 0;
+		if (scroll > 6.0f)
+			scroll = 6.0f;
+		last_display_time = now;
+		if (north > south) centre_y -= scroll;
+		if (south > north) centre_y += scroll;
+		if (west > east) centre_x -= scroll;
+		if (east > west) centre_x += scroll;
+
 		// Correct zoom factor, if needed
 		float pix_across = al_get_display_width (display) / zoom;
 		if (pix_across > scenario->get_map_width ()) {
@@ -126,6 +191,9 @@ public:
 			left_corner_y = centre_y - pix_vertical / 2;  // recompute
 		}
 
+		view_left = left_corner_x;
+		view_top = left_corner_y;
+
 		// Build transformation matrix for Allegro
 		ALLEGRO_TRANSFORM T;
 		al_identity_transform (&T);
@@ -133,7 +201,13 @@ public:
 		al_scale_transform (&T, zoom, zoom);
 		al_use_transform (&T);
 
-		scenario->Display (al_get_backbuffer (display));
+		scenario->Display (al_get_backbuffer (display), alpha,
+			left_corner_x, left_corner_y, right_corner_x, right_corner_y, zoom, selected);
+
+		if (show_net) {
+			net_samples.Update ();
+			NetOverlay::Draw (net_samples.Front ().stats, net_samples.Front ().seconds, 8, 8);
+		}
 	}
 
 };
@@ -0,0 +1,53 @@
+/**
+Fixed-point arithmetic for the deterministic simulation mode.
+
+A fixed value is a map distance in 1/FIXED_ONE pixels, held in an int32_t.
+Integer arithmetic gives the same answer on every machine and compiler,
+which floating point does not promise, so peers running the same inputs
+stay in step.
+
+FIXED_ONE is small enough that any fixed position on a map up to 65535
+pixels across is exactly a float, so positions can still be kept in the
+float fields of StateScenarioAvatar and converted back without loss.
+*/
+
+#ifndef FIXED_H
+#define FIXED_H
+
+typedef int32_t fixed;
+
+enum { FIXED_SHIFT = 8, FIXED_ONE = 1 << FIXED_SHIFT };
+
+// Nearest fixed value to a float.
+inline fixed to_fixed (float x) {
+	return (fixed) floor (x * FIXED_ONE + 0.5f);
+}
+
+// Exact for positions on the map (see above).
+inline float to_float (fixed x) {
+	return (float) x / FIXED_ONE;
+}
+
+// Whole pixel containing a fixed position (rounding down).
+inline int fixed_pixel (fixed x) {
+	return x >> FIXED_SHIFT;
+}
+
+// Square root of a non-negative 64-bit value, rounded down.
+inline uint32_t isqrt64 (uint64_t n) {
+	uint64_t root = 0;
+	uint64_t bit = (uint64_t) 1 << 62;
+	while (bit > n)
+		bit >>= 2;
+	while (bit != 0) {
+		if (n >= root + bit) {
+			n -= root + bit;
+			root = (root >> 1) + bit;
+		} else
+			root >>= 1;
+		bit >>= 2;
+	}
+	return (uint32_t) root;
+}
+
+#endif
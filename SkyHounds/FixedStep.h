@@ -0,0 +1,57 @@
+/**
+FixedStep converts real time into a whole number of fixed simulation steps.
+
+Elapsed time is added to an accumulator, and each step spends one step's
+worth of it. If the simulation falls too far behind, at most max_steps are
+run at once and the rest of the backlog is dropped, so a slow machine runs
+slower instead of spiralling into ever-longer catch-up bursts.
+*/
+
+#ifndef FIXED_STEP_H
+#define FIXED_STEP_H
+
+class FixedStep {
+	double step;        // Seconds per step.
+	int max_steps;      // Most steps Advance will ever ask for.
+	double accumulator; // Seconds not yet simulated.
+	double last_time;   // Time of the previous Advance.
+
+public:
+	FixedStep (double _step, int _max_steps)
+		: step(_step), max_steps(_max_steps), accumulator(0), last_time(0)
+		{}
+
+	// Sets the time from which steps are counted.
+	void Start (double now) {
+		last_time = now;
+		accumulator = 0;
+	}
+
+	// Accounts for time elapsed up to now.
+	// Returns the number of steps that should be run now.
+	int Advance (double now) {
+		double elapsed = now - last_time;
+		last_time = now;
+		if (elapsed > 0)
+			accumulator += elapsed;
+		int steps = (int) (accumulator / step);
+		if (steps > max_steps) {
+			// Too far behind: drop the backlog instead of catching up.
+			steps = max_steps;
+			accumulator = step * steps;
+		}
+		accumulator -= step * steps;
+		return steps;
+	}
+
+	// How far (0 to 1) real time has progressed into the next step.
+	float Alpha () const { return (float) (accumulator / step); }
+
+	// Seconds until the next step is due.
+	double TimeToNextStep () const { return step - accumulator; }
+
+	// Seconds per step.
+	double StepLength () const { return step; }
+};
+
+#endif
@@ -0,0 +1,296 @@
+#include "libraries.h"
+
+#include "FlowFieldCache.h"
+
+// The eight directions. Even ones are straight, odd ones diagonal.
+static const int DIR_X[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+static const int DIR_Y[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+
+// Distance of a cell the search hasn't reached.
+static const uint32_t UNREACHED = 0xFFFFFFFF;
+
+// Min-heap order for (distance, cell) pairs.
+typedef std::greater<std::pair<uint32_t,int> > HeapOrder;
+
+FlowFieldCache::FlowFieldCache ()
+	: map(NULL), level(0), cell_size(1), width(0), height(0), memory_limit(0), tick(0), mark_no(0) {
+}
+
+FlowFieldCache::~FlowFieldCache () {
+	std::map<int, Field*>::iterator f;
+	for (f = fields.begin(); f != fields.end(); ++f)
+		delete f->second;
+}
+
+// Sets up the grid for a map, and drops all fields.
+// The map must outlive the cache.
+void FlowFieldCache::Build (const CollisionMap & _map) {
+	map = &_map;
+	std::map<int, Field*>::iterator f;
+	for (f = fields.begin(); f != fields.end(); ++f)
+		delete f->second;
+	fields.clear ();
+	demand.clear ();
+
+	width = height = 0;
+	open.clear ();
+	if (map->level_count () == 0)
+		return;
+	level = LEVEL < map->level_count () - 1 ? LEVEL : map->level_count () - 1;
+	cell_size = 1 << level;
+	width = (map->get_width () + cell_size - 1) >> level;
+	height = (map->get_height () + cell_size - 1) >> level;
+	open.resize (width * height);
+	int x, y;
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++)
+			open[y * width + x] = ! map->Blocked (level, x, y);
+	}
+	mark.assign (width * height, 0);
+	mark_no = 0;
+}
+
+// Sets the most memory fields may use, in bytes.
+void FlowFieldCache::SetMemoryLimit (size_t bytes) {
+	memory_limit = bytes;
+}
+
+// Notes that an avatar at (x,y) wants to go to (goal_x,goal_y).
+// If the goal has a finished field, gives the next point to head for:
+// the centre of the next cell, or the goal itself from the goal's cell.
+FlowFieldCache::Steering FlowFieldCache::Steer (float goal_x, float goal_y, float x, float y,
+		float & next_x, float & next_y) {
+	if (width == 0)
+		return STEER_NONE;
+	int goal = CellAt (goal_x, goal_y);
+	std::map<int, Field*>::iterator found = fields.find (goal);
+	if (found == fields.end()) {
+		int users = ++demand[goal];
+		return users >= MIN_USERS ? STEER_WAIT : STEER_NONE;
+	}
+
+	Field & field = *found->second;
+	field.last_used = tick;
+	if (! field.ready)
+		return STEER_WAIT;
+	int cell = CellAt (x, y);
+	if (field.dist[cell] == UNREACHED)
+		return STEER_NONE;
+	int d = field.dir[cell];
+	if (d == NO_DIRECTION) {
+		next_x = goal_x;
+		next_y = goal_y;
+	} else {
+		next_x = (cell % width + DIR_X[d]) * cell_size + cell_size * 0.5f;
+		next_y = (cell / width + DIR_Y[d]) * cell_size + cell_size * 0.5f;
+	}
+	return STEER_MOVE;
+}
+
+// Call once per tick: makes fields for goals that were popular since
+// the last call, and works on unfinished fields for up to the given
+// number of seconds.
+void FlowFieldCache::Update (double seconds) {
+	AddPopular ();
+	double deadline = al_get_time () + seconds;
+	int steps = -1;
+	std::map<int, Field*>::iterator f;
+	for (f = fields.begin(); f != fields.end() && al_get_time () < deadline; ++f) {
+		if (! f->second->ready)
+			Advance (*f->second, deadline, steps);
+	}
+	tick++;
+}
+
+// As Update, but works for a number of steps (cells settled) rather than
+// for a time, so that the result doesn't depend on the machine's speed.
+void FlowFieldCache::UpdateSteps (int steps) {
+	AddPopular ();
+	std::map<int, Field*>::iterator f;
+	for (f = fields.begin(); f != fields.end() && steps > 0; ++f) {
+		if (! f->second->ready)
+			Advance (*f->second, 0, steps);
+	}
+	tick++;
+}
+
+// The paths have changed within the pixel rectangle [x0,x1] x [y0,y1]
+// (the collision map is already updated). Repairs every field.
+// Cells in the rectangle, and cells whose way to the goal ran through
+// them, are forgotten; then the search is restarted from the cells around
+// them. Cells elsewhere keep their distances unless the change opened a
+// shorter way, in which case the restarted search improves them too.
+void FlowFieldCache::Repair (int x0, int y0, int x1, int y1) {
+	if (width == 0)
+		return;
+	int cx0 = clamp (x0 >> level, 0, width - 1), cy0 = clamp (y0 >> level, 0, height - 1);
+	int cx1 = clamp (x1 >> level, 0, width - 1), cy1 = clamp (y1 >> level, 0, height - 1);
+	int x, y, d;
+	for (y = cy0; y <= cy1; y++) {
+		for (x = cx0; x <= cx1; x++)
+			open[y * width + x] = ! map->Blocked (level, x, y);
+	}
+
+	std::map<int, Field*>::iterator f;
+	for (f = fields.begin(); f != fields.end(); ++f) {
+		Field & field = *f->second;
+		if (! field.ready) {
+			// Its heap may hold cells about to be forgotten; start over.
+			Restart (field);
+			continue;
+		}
+
+		// Forget the changed cells and everything downstream of them.
+		// (One cell around the change too: a diagonal step beside a newly
+		// blocked cell would now cut its corner.)
+		mark_no++;
+		queue.clear ();
+		for (y = (cy0 > 0 ? cy0 - 1 : 0); y <= cy1 + 1 && y < height; y++) {
+			for (x = (cx0 > 0 ? cx0 - 1 : 0); x <= cx1 + 1 && x < width; x++) {
+				mark[y * width + x] = mark_no;
+				queue.push_back (y * width + x);
+			}
+		}
+		size_t q;
+		for (q = 0; q < queue.size(); q++) {
+			int cell = queue[q];
+			int cx = cell % width, cy = cell / width;
+			for (d = 0; d < 8; d++) {
+				int nx = cx + DIR_X[d], ny = cy + DIR_Y[d];
+				if (nx < 0 || ny < 0 || nx >= width || ny >= height)
+					continue;
+				int n = ny * width + nx;
+				// Does n step into this cell? (The opposite direction is d+4.)
+				if (mark[n] != mark_no && field.dir[n] == (d + 4) % 8) {
+					mark[n] = mark_no;
+					queue.push_back (n);
+				}
+			}
+		}
+		for (q = 0; q < queue.size(); q++) {
+			field.dist[queue[q]] = UNREACHED;
+			field.dir[queue[q]] = NO_DIRECTION;
+		}
+
+		// Restart from the remembered cells around them.
+		if (mark[field.goal] == mark_no && open[field.goal]) {
+			field.dist[field.goal] = 0;
+			field.heap.push_back (std::make_pair ((uint32_t) 0, field.goal));
+		}
+		for (q = 0; q < queue.size(); q++) {
+			int cx = queue[q] % width, cy = queue[q] / width;
+			for (d = 0; d < 8; d++) {
+				int nx = cx + DIR_X[d], ny = cy + DIR_Y[d];
+				if (nx < 0 || ny < 0 || nx >= width || ny >= height)
+					continue;
+				int n = ny * width + nx;
+				if (mark[n] != mark_no && field.dist[n] != UNREACHED)
+					field.heap.push_back (std::make_pair (field.dist[n], n));
+			}
+		}
+		// A newly opened cell may also be a short cut for cells that were
+		// not forgotten; they get improved as the search passes.
+		std::make_heap (field.heap.begin(), field.heap.end(), HeapOrder ());
+		field.ready = field.heap.size() == 0;
+	}
+}
+
+// Cell containing a map position, clamped to the grid.
+int FlowFieldCache::CellAt (float x, float y) const {
+	int cx = clamp ((int) (x / cell_size), 0, width - 1);
+	int cy = clamp ((int) (y / cell_size), 0, height - 1);
+	return cy * width + cx;
+}
+
+// Can a step go from cell (x,y) in direction d? (No cutting corners.)
+bool FlowFieldCache::CanStep (int x, int y, int d) const {
+	int nx = x + DIR_X[d], ny = y + DIR_Y[d];
+	if (nx < 0 || ny < 0 || nx >= width || ny >= height || ! open[ny * width + nx])
+		return false;
+	if (d & 1)
+		return open[y * width + nx] && open[ny * width + x];
+	return true;
+}
+
+// Makes a field for a goal cell, evicting old fields to make room.
+// Fields used this tick are never evicted.
+void FlowFieldCache::AddField (int goal) {
+	if (fields.find (goal) != fields.end())
+		return;
+	while (memory_used () + FieldBytes () > memory_limit) {
+		std::map<int, Field*>::iterator oldest = fields.end(), f;
+		for (f = fields.begin(); f != fields.end(); ++f) {
+			if (oldest == fields.end() || f->second->last_used < oldest->second->last_used)
+				oldest = f;
+		}
+		if (oldest == fields.end() || oldest->second->last_used == tick)
+			return;  // no room
+		delete oldest->second;
+		fields.erase (oldest);
+	}
+
+	Field * field = new Field;
+	field->goal = goal;
+	field->last_used = tick;
+	Restart (*field);
+	fields[goal] = field;
+}
+
+// Forgets everything a field knows, and starts it again from the goal.
+void FlowFieldCache::Restart (Field & field) {
+	field.dist.assign (width * height, UNREACHED);
+	field.dir.assign (width * height, NO_DIRECTION);
+	field.heap.clear ();
+	field.ready = ! open[field.goal];
+	if (open[field.goal]) {
+		field.dist[field.goal] = 0;
+		field.heap.push_back (std::make_pair ((uint32_t) 0, field.goal));
+	}
+}
+
+// Makes fields for goals that were popular since the last update.
+void FlowFieldCache::AddPopular () {
+	std::map<int, int>::iterator d;
+	for (d = demand.begin(); d != demand.end(); ++d) {
+		if (d->second >= MIN_USERS)
+			AddField (d->first);
+	}
+	demand.clear ();
+}
+
+// Settles cells of a field until it is done, time runs out (deadline > 0)
+// or steps runs out (steps >= 0; counted down).
+// (Dijkstra from the goal; checks the time every so often.)
+void FlowFieldCache::Advance (Field & field, double deadline, int & steps) {
+	int count = 0;
+	while (field.heap.size() > 0) {
+		if (steps == 0)
+			return;
+		if (steps > 0)
+			steps--;
+		if (deadline > 0 && ++count % 1024 == 0 && al_get_time () >= deadline)
+			return;
+		std::pop_heap (field.heap.begin(), field.heap.end(), HeapOrder ());
+		uint32_t dist = field.heap.back().first;
+		int cell = field.heap.back().second;
+		field.heap.pop_back ();
+		if (dist > field.dist[cell])
+			continue;
+		int x = cell % width, y = cell / width;
+		int d;
+		for (d = 0; d < 8; d++) {
+			// Steps are symmetric, so a step from here to n is also one from n to here.
+			if (! CanStep (x, y, d))
+				continue;
+			int n = (y + DIR_Y[d]) * width + x + DIR_X[d];
+			uint32_t nd = dist + (d & 1 ? DIAGONAL : STRAIGHT);
+			if (nd < field.dist[n]) {
+				field.dist[n] = nd;
+				field.dir[n] = (unsigned char) ((d + 4) % 8);
+				field.heap.push_back (std::make_pair (nd, n));
+				std::push_heap (field.heap.begin(), field.heap.end(), HeapOrder ());
+			}
+		}
+	}
+	field.ready = true;
+}
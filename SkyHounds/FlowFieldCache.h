@@ -0,0 +1,115 @@
+/**
+A FlowFieldCache steers many avatars toward the same goal at once.
+
+For a goal that several avatars are heading for, a flow field records, for
+every cell of a coarse grid over the collision map, its distance from the
+goal and which neighbouring cell is one step nearer. Steering an avatar is
+then a lookup, however many avatars share the goal.
+
+Fields are made for goals that at least MIN_USERS avatars ask about in one
+tick, and are computed a slice at a time within a per-tick budget. When
+the memory used passes the limit, the least recently used field goes.
+When the paths change, each field is repaired around the change rather
+than recomputed.
+
+Not thread-safe: call only from the simulation thread.
+*/
+
+#ifndef FLOW_FIELD_CACHE_H
+#define FLOW_FIELD_CACHE_H
+
+#include "CollisionMap.h"
+
+class FlowFieldCache {
+public:
+	enum Steering {
+		STEER_NONE,  // No field for this goal, or it can't help from here.
+		STEER_WAIT,  // A field for this goal is on its way.
+		STEER_MOVE   // Head for the point returned.
+	};
+
+	FlowFieldCache ();
+	~FlowFieldCache ();
+
+	// Sets up the grid for a map, and drops all fields.
+	// The map must outlive the cache.
+	void Build (const CollisionMap & _map);
+
+	// Sets the most memory fields may use, in bytes.
+	void SetMemoryLimit (size_t bytes);
+
+	// Notes that an avatar at (x,y) wants to go to (goal_x,goal_y).
+	// If the goal has a finished field, gives the next point to head for.
+	Steering Steer (float goal_x, float goal_y, float x, float y, float & next_x, float & next_y);
+
+	// Call once per tick: makes fields for goals that were popular since
+	// the last call, and works on unfinished fields for up to the given
+	// number of seconds.
+	void Update (double seconds);
+
+	// As Update, but works for a number of steps (cells settled) rather than
+	// for a time, so that the result doesn't depend on the machine's speed.
+	void UpdateSteps (int steps);
+
+	// The paths have changed within the pixel rectangle [x0,x1] x [y0,y1]
+	// (the collision map is already updated). Repairs every field.
+	void Repair (int x0, int y0, int x1, int y1);
+
+	int field_count () const { return (signed) fields.size(); }
+	size_t memory_used () const { return (size_t) fields.size() * FieldBytes (); }
+
+private:
+	// Pyramid level of the collision map used as the grid.
+	enum { LEVEL = 3 };
+	// Avatars that must share a goal in one tick before it gets a field.
+	enum { MIN_USERS = 4 };
+	// Step costs. (Diagonal is about straight * sqrt(2).)
+	enum { STRAIGHT = 10, DIAGONAL = 14 };
+	// dir of a cell with no way on (the goal, or unreachable).
+	enum { NO_DIRECTION = 8 };
+
+	struct Field {
+		int goal;                           // Goal cell.
+		std::vector<uint32_t> dist;         // Cost to the goal. (0xFFFFFFFF=unreached)
+		std::vector<unsigned char> dir;     // Neighbour one step nearer. (0-7, or NO_DIRECTION)
+		std::vector<std::pair<uint32_t,int> > heap;  // Cells still to settle.
+		bool ready;                         // Is the heap empty?
+		unsigned last_used;                 // Tick of the last Steer.
+	};
+
+	const CollisionMap * map;
+	int level, cell_size;                   // Pyramid level of the grid, and its cell size in pixels.
+	int width, height;                      // In cells.
+	std::vector<unsigned char> open;        // Is each cell open?
+	size_t memory_limit;
+	unsigned tick;
+
+	std::map<int, Field*> fields;           // By goal cell.
+	std::map<int, int> demand;              // Goal cells without fields, and how many asked this tick.
+
+	// Scratch for Repair.
+	std::vector<int> mark;
+	int mark_no;
+	std::vector<int> queue;
+
+	size_t FieldBytes () const { return (size_t) width * height * (sizeof(uint32_t) + 1); }
+	int CellAt (float x, float y) const;
+
+	// Can a step go from cell (x,y) in direction d? (No cutting corners.)
+	bool CanStep (int x, int y, int d) const;
+
+	// Makes a field for a goal cell, evicting old fields to make room.
+	void AddField (int goal);
+
+	// Forgets everything a field knows, and starts it again from the goal.
+	void Restart (Field & field);
+
+	// Makes fields for goals that were popular since the last update.
+	void AddPopular ();
+
+	// Settles cells of a field until it is done, time runs out (deadline > 0)
+	// or steps runs out (steps >= 0; counted down).
+	void Advance (Field & field, double deadline, int & steps);
+};
+
+#endif
@@ -0,0 +1,377 @@
+#include "libraries.h"
+
+#include "InfluenceMap.h"
+
+#include "RollbackRing.h"
+
+const float InfluenceMap::PRESENCE_DECAY = 0.9f;
+const float InfluenceMap::SEEN_DECAY = 0.995f;
+
+// Kernels. Each works on count cells (a multiple of 4), reading one cell
+// either side of the row, which must be there.
+
+// dst = 1/4 left + 1/2 centre + 1/4 right.
+static void BlurRow (const float * src, float * dst, int count) {
+	int i = 0;
+#ifdef HAVE_SSE2
+	const __m128 quarter = _mm_set1_ps (0.25f), half = _mm_set1_ps (0.5f);
+	for (; i < count; i += 4) {
+		__m128 left = _mm_loadu_ps (src + i - 1);
+		__m128 centre = _mm_loadu_ps (src + i);
+		__m128 right = _mm_loadu_ps (src + i + 1);
+		__m128 sum = _mm_add_ps (_mm_mul_ps (_mm_add_ps (left, right), quarter), _mm_mul_ps (centre, half));
+		_mm_storeu_ps (dst + i, sum);
+	}
+#endif
+	for (; i < count; i++)
+		dst[i] = (src[i - 1] + src[i + 1]) * 0.25f + src[i] * 0.5f;
+}
+
+// dst = (1/4 above + 1/2 row + 1/4 below) * decay * open + source.
+static void BlurColumn (const float * above, const float * row, const float * below,
+		const float * open, const float * source, float decay, float * dst, int count) {
+	int i = 0;
+#ifdef HAVE_SSE2
+	const __m128 quarter = _mm_set1_ps (0.25f), half = _mm_set1_ps (0.5f);
+	const __m128 fade = _mm_set1_ps (decay);
+	for (; i < count; i += 4) {
+		__m128 sum = _mm_add_ps (_mm_mul_ps (_mm_add_ps (_mm_loadu_ps (above + i), _mm_loadu_ps (below + i)), quarter),
+			_mm_mul_ps (_mm_loadu_ps (row + i), half));
+		sum = _mm_mul_ps (_mm_mul_ps (sum, fade), _mm_loadu_ps (open + i));
+		_mm_storeu_ps (dst + i, _mm_add_ps (sum, _mm_loadu_ps (source + i)));
+	}
+#endif
+	for (; i < count; i++)
+		dst[i] = ((above[i] + below[i]) * 0.25f + row[i] * 0.5f) * decay * open[i] + source[i];
+}
+
+// dst = max (src * decay, min (watchers, 1)) on open cells, else 0.
+static void Fade (const float * src, const float * watchers, const float * open, float decay, float * dst, int count) {
+	int i = 0;
+#ifdef HAVE_SSE2
+	const __m128 fade = _mm_set1_ps (decay), one = _mm_set1_ps (1), zero = _mm_setzero_ps ();
+	for (; i < count; i += 4) {
+		__m128 faded = _mm_mul_ps (_mm_loadu_ps (src + i), fade);
+		__m128 seen = _mm_max_ps (faded, _mm_min_ps (_mm_loadu_ps (watchers + i), one));
+		__m128 on_map = _mm_cmpgt_ps (_mm_loadu_ps (open + i), zero);
+		_mm_storeu_ps (dst + i, _mm_and_ps (seen, on_map));
+	}
+#endif
+	for (; i < count; i++) {
+		float seen = src[i] * decay;
+		float watched = watchers[i] < 1 ? watchers[i] : 1;
+		dst[i] = open[i] > 0 ? (seen > watched ? seen : watched) : 0;
+	}
+}
+
+InfluenceMap::InfluenceMap ()
+	: width(0), height(0), stride(0), thread(NULL), pending_steps(0)
+{
+	mutex = al_create_mutex ();
+	wake = al_create_cond ();
+}
+
+InfluenceMap::~InfluenceMap () {
+	StopThread ();
+	al_destroy_cond (wake);
+	al_destroy_mutex (mutex);
+}
+
+// Sets up the grid over a map. Call before anything else.
+// A cell's openness is the fraction of it that is path, measured on the
+// collision pyramid's 4-pixel level.
+void InfluenceMap::Build (const CollisionMap & map) {
+	width = (map.get_width () + CELL - 1) / CELL;
+	height = (map.get_height () + CELL - 1) / CELL;
+	stride = GUARD + (width + 3) / 4 * 4 + GUARD;
+	open.assign (stride * (height + 2), 0);
+
+	int level = map.level_count () > 2 ? 2 : map.level_count () - 1;
+	int sub = CELL >> (level > 0 ? level : 0);  // Level cells per cell, on a side.
+	int x, y, sx, sy;
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			int clear = 0, total = 0;
+			for (sy = 0; sy < sub; sy++) {
+				for (sx = 0; sx < sub; sx++) {
+					int lx = x * sub + sx, ly = y * sub + sy;
+					if ((lx << level) >= map.get_width () || (ly << level) >= map.get_height ())
+						continue;
+					total++;
+					if (! map.Blocked (level, lx, ly))
+						clear++;
+				}
+			}
+			open[Index (x, y)] = total > 0 ? (float) clear / total : 0;
+		}
+	}
+
+	int t;
+	for (t = 0; t < MAX_TEAMS; t++) {
+		source[t].assign (open.size(), 0);
+		watchers[t].assign (open.size(), 0);
+	}
+	// Size all three buffers, leaving one of them in front.
+	Clear (current);
+	Clear (views.Back ());
+	views.Publish ();
+	views.Update ();
+	Clear (views.Back ());
+	views.Publish ();
+	Clear (views.Back ());
+	views.Update ();
+	scratch.assign (open.size(), 0);
+	tracked.clear ();
+	moves.clear ();
+}
+
+// Runs the layer updates on a worker thread, or in Step.
+void InfluenceMap::SetThreaded (bool threaded) {
+	StopThread ();
+	if (! threaded)
+		return;
+	thread = al_create_thread (ThreadMain, this);
+	if (! thread) {
+		warning (this, "Could not create influence map thread");
+		breakpoint ();
+		return;
+	}
+	al_start_thread (thread);
+}
+
+// Simulation thread: reports where an item (e.g., an avatar slot) is.
+// Only changes of team or cell are passed on.
+void InfluenceMap::Track (int item, int team, bool on_map, float x, float y) {
+	if (item >= (signed) tracked.size()) {
+		Tracked none = { 0, -1 };
+		tracked.resize (item + 1, none);
+	}
+	if (! on_map || team < 1 || team > MAX_TEAMS || width == 0)
+		team = 0;
+	int cell = team ? CellAt (x, y) : -1;
+	Tracked & was = tracked[item];
+	if (was.team == team && was.cell == cell)
+		return;
+	if (was.team == team) {
+		Move move = { team, was.cell, cell };
+		moves.push_back (move);
+	} else {
+		if (was.team) {
+			Move leave = { was.team, was.cell, -1 };
+			moves.push_back (leave);
+		}
+		if (team) {
+			Move arrive = { team, -1, cell };
+			moves.push_back (arrive);
+		}
+	}
+	was.team = team;
+	was.cell = cell;
+}
+
+// Simulation thread, end of tick: hands the tick's changes over to be
+// spread into the layers.
+void InfluenceMap::Step () {
+	if (width == 0)
+		return;
+	if (! thread) {
+		work.swap (moves);
+		moves.clear ();
+		Update (1);
+		return;
+	}
+	al_lock_mutex (mutex);
+	handed.insert (handed.end(), moves.begin(), moves.end());
+	pending_steps++;
+	al_signal_cond (wake);
+	al_unlock_mutex (mutex);
+	moves.clear ();
+}
+
+// Samples of the acquired layers at map position (x,y), for a team.
+float InfluenceMap::Threat (int team, float x, float y) const {
+	if (width == 0)
+		return 0;
+	const Layers & layers = views.Front ();
+	int cell = CellAt (x, y);
+	float threat = 0;
+	int t;
+	for (t = 0; t < MAX_TEAMS; t++) {
+		if (t + 1 != team)
+			threat += layers.presence[t][cell];
+	}
+	return threat;
+}
+
+float InfluenceMap::Control (int team, float x, float y) const {
+	if (width == 0 || team < 1 || team > MAX_TEAMS)
+		return 0;
+	return views.Front ().presence[team - 1][CellAt (x, y)] - Threat (team, x, y);
+}
+
+float InfluenceMap::Visible (int team, float x, float y) const {
+	if (width == 0 || team < 1 || team > MAX_TEAMS)
+		return 0;
+	return views.Front ().seen[team - 1][CellAt (x, y)];
+}
+
+// Index of the cell containing a map position, clamped to the grid.
+int InfluenceMap::CellAt (float x, float y) const {
+	return Index (clamp ((int) (x / CELL), 0, width - 1), clamp ((int) (y / CELL), 0, height - 1));
+}
+
+// Sizes a set of layers and zeroes them.
+void InfluenceMap::Clear (Layers & layers) {
+	int t;
+	for (t = 0; t < MAX_TEAMS; t++) {
+		layers.presence[t].assign (open.size(), 0);
+		layers.seen[t].assign (open.size(), 0);
+	}
+}
+
+// Applies moves to the sources, then runs steps updates and publishes.
+// (Worker thread, or simulation thread if not threaded.)
+void InfluenceMap::Update (int steps) {
+	int m;
+	for (m = 0; m < (signed) work.size(); m++) {
+		const Move & move = work[m];
+		int t = move.team - 1;
+		if (move.from >= 0) {
+			source[t][move.from] -= 1;
+			Watch (t, move.from, -1);
+		}
+		if (move.to >= 0) {
+			source[t][move.to] += 1;
+			Watch (t, move.to, 1);
+		}
+	}
+	work.clear ();
+
+	Layers & next = views.Back ();
+	int count = (width + 3) / 4 * 4;
+	int step, t, y;
+	for (step = 0; step < steps; step++) {
+		for (t = 0; t < MAX_TEAMS; t++) {
+			const float * presence = &current.presence[t][0];
+			for (y = 0; y < height; y++)
+				BlurRow (presence + Index (0, y), &scratch[Index (0, y)], count);
+			for (y = 0; y < height; y++) {
+				int row = Index (0, y);
+				BlurColumn (&scratch[row - stride], &scratch[row], &scratch[row + stride],
+					&open[row], &source[t][row], PRESENCE_DECAY, &next.presence[t][row], count);
+			}
+			for (y = 0; y < height; y++) {
+				int row = Index (0, y);
+				Fade (&current.seen[t][row], &watchers[t][row], &open[row], SEEN_DECAY, &next.seen[t][row], count);
+			}
+			current.presence[t] = next.presence[t];
+			current.seen[t] = next.seen[t];
+		}
+	}
+	views.Publish ();
+}
+
+// Adds weight to the watchers of every cell within SIGHT of a cell.
+void InfluenceMap::Watch (int team, int cell, float weight) {
+	int cx = cell % stride - GUARD, cy = cell / stride - 1;
+	int x, y;
+	for (y = cy - SIGHT; y <= cy + SIGHT; y++) {
+		if (y < 0 || y >= height)
+			continue;
+		for (x = cx - SIGHT; x <= cx + SIGHT; x++) {
+			if (x >= 0 && x < width && (x - cx) * (x - cx) + (y - cy) * (y - cy) <= SIGHT * SIGHT)
+				watchers[team][Index (x, y)] += weight;
+		}
+	}
+}
+
+// Simulation thread, between ticks: saves the sources and layers.
+void InfluenceMap::Save (StateBlock & block) const {
+	bool saved = thread == NULL;
+	block.Put (saved);
+	if (! saved)
+		return;
+	block.PutArray (tracked);
+	int t;
+	for (t = 0; t < MAX_TEAMS; t++) {
+		block.PutArray (source[t]);
+		block.PutArray (watchers[t]);
+		block.PutArray (current.presence[t]);
+		block.PutArray (current.seen[t]);
+	}
+}
+
+// Simulation thread, between ticks: puts back what Save saved, and
+// publishes it to be acquired at the next tick.
+void InfluenceMap::Restore (StateBlock & block) {
+	bool saved = false;
+	block.Get (saved);
+	if (! saved)
+		return;
+	if (thread) {
+		warning (this, "Restoring an influence map that has since been threaded");
+		breakpoint ();
+		return;
+	}
+	block.GetArray (tracked);
+	int t;
+	for (t = 0; t < MAX_TEAMS; t++) {
+		block.GetArray (source[t]);
+		block.GetArray (watchers[t]);
+		block.GetArray (current.presence[t]);
+		block.GetArray (current.seen[t]);
+	}
+	moves.clear ();
+	Layers & next = views.Back ();
+	for (t = 0; t < MAX_TEAMS; t++) {
+		next.presence[t] = current.presence[t];
+		next.seen[t] = current.seen[t];
+	}
+	views.Publish ();
+}
+
+// Stops the worker thread.
+void InfluenceMap::StopThread () {
+	if (! thread)
+		return;
+	al_set_thread_should_stop (thread);
+	al_lock_mutex (mutex);
+	al_broadcast_cond (wake);
+	al_unlock_mutex (mutex);
+	al_join_thread (thread, NULL);
+	al_destroy_thread (thread);
+	thread = NULL;
+
+	// Anything handed over but not taken is applied here.
+	work.swap (handed);
+	handed.clear ();
+	if (pending_steps > 0 || work.size() > 0)
+		Update (pending_steps > 0 ? pending_steps : 1);
+	pending_steps = 0;
+}
+
+// Worker thread: waits for steps, and runs them. If the simulation gets
+// ahead, several steps are run at once (up to 4; the rest are dropped).
+// Runs on any core, not that of the thread that started it.
+void * InfluenceMap::ThreadMain (ALLEGRO_THREAD * thread, void * arg) {
+	InfluenceMap * map = (InfluenceMap *) arg;
+	unpin_current_thread ();
+	al_lock_mutex (map->mutex);
+	for (;;) {
+		while (map->pending_steps == 0 && ! al_get_thread_should_stop (thread))
+			al_wait_cond (map->wake, map->mutex);
+		if (al_get_thread_should_stop (thread))
+			break;
+		int steps = map->pending_steps < 4 ? map->pending_steps : 4;
+		map->pending_steps = 0;
+		map->work.swap (map->handed);
+		map->handed.clear ();
+		al_unlock_mutex (map->mutex);
+
+		map->Update (steps);
+
+		al_lock_mutex (map->mutex);
+	}
+	al_unlock_mutex (map->mutex);
+	return NULL;
+}
@@ -0,0 +1,144 @@
+/**
+An InfluenceMap summarises where each team is strong, and what it can see,
+on a coarse grid over the scenario, so that AI can weigh up its
+surroundings by reading a few cells instead of looking at every avatar.
+
+Each team has two layers:
+  presence: spreads out from the team's avatars and fades with time.
+	Walls hold it back. Threat and control are worked out from it.
+  seen: 1 within SIGHT cells of one of the team's avatars, fading with
+	time after they leave. Walls don't block it, so it is only a guess
+	at what the team could see; test sight itself with the CollisionMap.
+
+The simulation thread reports avatars as they move (Track); only avatars
+that change cells change the sources the layers are made from. Once per
+tick, Step hands the changes to a worker thread, which spreads and fades
+the layers with vector (SSE2) kernels and publishes them. Acquire picks up
+the latest layers for a tick, after which they are read-only, so any
+number of avatar threads may sample them.
+*/
+
+#ifndef INFLUENCE_MAP_H
+#define INFLUENCE_MAP_H
+
+#include "CollisionMap.h"
+#include "TripleBuffer.h"
+
+class StateBlock;  // forward declaration
+
+class InfluenceMap {
+public:
+	// Teams 1..MAX_TEAMS have layers. Others are ignored.
+	enum { MAX_TEAMS = 4 };
+
+	InfluenceMap ();
+	~InfluenceMap ();
+
+	// Sets up the grid over a map. Call before anything else.
+	void Build (const CollisionMap & map);
+
+	// Runs the layer updates on a worker thread, or in Step.
+	void SetThreaded (bool threaded);
+
+	// Simulation thread: reports where an item (e.g., an avatar slot) is.
+	void Track (int item, int team, bool on_map, float x, float y);
+
+	// Simulation thread: the item is gone.
+	void Untrack (int item) { Track (item, 0, false, 0, 0); }
+
+	// Simulation thread, end of tick: hands the tick's changes over to be
+	// spread into the layers.
+	void Step ();
+
+	// Simulation thread, start of tick: picks up the latest layers.
+	// They don't change again until the next Acquire.
+	void Acquire () { views.Update (); }
+
+	// Samples of the acquired layers at map position (x,y), for a team.
+	// Threat is other teams' presence; control is own presence less threat;
+	// visible runs from 0 (not seen lately) to 1 (in sight).
+	float Threat (int team, float x, float y) const;
+	float Control (int team, float x, float y) const;
+	float Visible (int team, float x, float y) const;
+
+	// Size of a grid cell, in pixels.
+	float get_cell_size () const { return (float) CELL; }
+
+	// Simulation thread, between ticks: saves the sources and layers, or
+	// puts back what was saved, to be acquired at the next tick. Only a
+	// map that is not threaded is saved; a threaded one is always partway
+	// through an update, and is left as it is.
+	void Save (StateBlock & block) const;
+	void Restore (StateBlock & block);
+
+private:
+	enum { CELL = 32 };          // Pixels per cell.
+	enum { SIGHT = 12 };         // How far an avatar sees, in cells.
+	enum { GUARD = 4 };          // Zero floats either side of each row.
+
+	// Per-tick fading.
+	static const float PRESENCE_DECAY;
+	static const float SEEN_DECAY;
+
+	// One set of layers. Rows are padded so kernels can work four
+	// cells at a time: cell (x,y) is at (y + 1) * stride + GUARD + x, and
+	// the padding (including one row above and below) stays zero.
+	struct Layers {
+		std::vector<float> presence[MAX_TEAMS];
+		std::vector<float> seen[MAX_TEAMS];
+	};
+
+	// Where an item was last reported.
+	struct Tracked {
+		int team;    // 0=not on the map, or not on a team with layers.
+		int cell;
+	};
+
+	// A change to the sources: an item of a team left one cell for another.
+	struct Move {
+		int team;
+		int from, to;  // Cells. (-1=none)
+	};
+
+	int width, height, stride;
+	std::vector<float> open;         // Fraction of each cell that is path (same layout).
+
+	// Simulation thread.
+	std::vector<Tracked> tracked;    // By item.
+	std::vector<Move> moves;         // Since the last Step.
+
+	// Worker side.
+	std::vector<float> source[MAX_TEAMS];    // Avatars per cell.
+	std::vector<float> watchers[MAX_TEAMS];  // Avatars that can see each cell.
+	Layers current;                  // Latest layers, kept for the next update.
+	std::vector<float> scratch;
+	std::vector<Move> work;          // Moves being applied.
+
+	TripleBuffer<Layers> views;
+
+	// Hand-over to the worker.
+	ALLEGRO_THREAD * thread;
+	ALLEGRO_MUTEX * mutex;
+	ALLEGRO_COND * wake;
+	std::vector<Move> handed;        // Moves handed over, not yet taken.
+	int pending_steps;               // Steps handed over, not yet run.
+
+	int Index (int x, int y) const { return (y + 1) * stride + GUARD + x; }
+	int CellAt (float x, float y) const;
+
+	// Sizes a set of layers and zeroes them.
+	void Clear (Layers & layers);
+
+	// Applies moves to the sources, then runs steps updates and publishes.
+	void Update (int steps);
+
+	// Adds weight to the watchers of every cell within SIGHT of a cell.
+	void Watch (int team, int cell, float weight);
+
+	// Stops the worker thread.
+	void StopThread ();
+
+	static void * ThreadMain (ALLEGRO_THREAD * thread, void * arg);
+};
+
+#endif
@@ -0,0 +1,65 @@
+#include "libraries.h"
+
+#include "InterestManager.h"
+
+#include "Scenario.h"
+
+const float InterestManager::FOCUS_WEIGHT = 4.0f;
+const float InterestManager::MARGIN_WEIGHT = 0.5f;
+const float InterestManager::TEAM_WEIGHT = 0.25f;
+const float InterestManager::VISIBLE_LEVEL = 0.5f;
+
+// Appends the avatars relevant to a client at a tick to out, in slot
+// order. Call between ticks.
+void InterestManager::Gather (const Scenario & scenario, int tick, const ClientView & view,
+		std::vector<Snapshot::Relevant> & out) {
+	int first = (signed) out.size();
+	found.clear ();
+	scenario.FindAvatarsIn (view.left - TEAM_RANGE, view.top - TEAM_RANGE,
+		view.right + TEAM_RANGE, view.bottom + TEAM_RANGE, found);
+
+	const InfluenceMap & influence = scenario.GetInfluence ();
+	bool have_focus = false;
+	int i;
+	for (i = 0; i < (signed) found.size(); i++) {
+		const StateScenarioAvatar * p = scenario.GetAvatarState (found[i]);
+		if (! p)
+			continue;
+		Snapshot::Relevant r;
+		r.who = found[i];
+		r.weight = 1;
+		r.due = true;
+		int slot = found[i].slot;
+		bool team_mate = view.team != 0 && p->team_assignment == view.team;
+		if (found[i] == view.focus) {
+			r.weight = FOCUS_WEIGHT;
+			have_focus = true;
+		} else if (p->map_x >= view.left - VIEW_EDGE && p->map_x <= view.right + VIEW_EDGE &&
+				p->map_y >= view.top - VIEW_EDGE && p->map_y <= view.bottom + VIEW_EDGE) {
+			// In view.
+		} else if (p->map_x >= view.left - MARGIN && p->map_x <= view.right + MARGIN &&
+				p->map_y >= view.top - MARGIN && p->map_y <= view.bottom + MARGIN) {
+			if (! team_mate && view.team != 0 && influence.Visible (view.team, p->map_x, p->map_y) < VISIBLE_LEVEL)
+				continue;
+			r.weight = MARGIN_WEIGHT;
+			r.due = Due (slot, tick, MARGIN_PERIOD);
+		} else if (team_mate) {
+			r.weight = TEAM_WEIGHT;
+			r.due = Due (slot, tick, TEAM_PERIOD);
+		} else {
+			continue;
+		}
+		out.push_back (r);
+	}
+
+	// The client's own avatar, even if it is off the map.
+	if (! have_focus && scenario.GetAvatarState (view.focus)) {
+		Snapshot::Relevant r;
+		r.who = view.focus;
+		r.weight = FOCUS_WEIGHT;
+		r.due = true;
+		out.push_back (r);
+	}
+
+	std::sort (out.begin() + first, out.end(), Before);
+}
@@ -0,0 +1,77 @@
+/**
+An InterestManager decides which avatars matter to a client, and how often
+their changes should be sent, before each snapshot is put together.
+
+Relevance comes from where the client is looking and which team it is on:
+  - its own avatar: every tick, and ahead of everything else;
+  - avatars in its view rectangle: every tick;
+  - avatars just outside the view (within MARGIN): every few ticks, so
+	they are already there when the view scrolls, but enemies only if the
+	client's team can see them (see InfluenceMap::Visible);
+  - team-mates further out (within TEAM_RANGE): now and then.
+Everything else is left out, and the client is told to forget it.
+
+Avatars are found with a spatial query around the view, so the work for a
+client depends on how crowded its part of the map is, not on how many
+avatars there are. Slower rates are staggered by slot, so avatars on the
+same rate don't all fall due on the same tick.
+*/
+
+#ifndef INTEREST_MANAGER_H
+#define INTEREST_MANAGER_H
+
+#include "Snapshot.h"
+
+class Scenario;  // forward declaration
+
+class InterestManager {
+public:
+	// What one client is looking at.
+	struct ClientView {
+		AvatarHandle focus;           // The client's own avatar. (none=spectator)
+		int team;                     // (0=none)
+		float left, top, right, bottom;  // Map rectangle on the client's display.
+		ClientView () : team(0), left(0), top(0), right(0), bottom(0) { }
+
+		// Sets the rectangle to width x height, centred on (x,y).
+		void CentreOn (float x, float y, float width, float height) {
+			left = x - width / 2;
+			right = x + width / 2;
+			top = y - height / 2;
+			bottom = y + height / 2;
+		}
+	};
+
+	// Appends the avatars relevant to a client at a tick to out, in slot
+	// order. Call between ticks.
+	void Gather (const Scenario & scenario, int tick, const ClientView & view,
+		std::vector<Snapshot::Relevant> & out);
+
+private:
+	// Pixels beyond the view's edge counted as in view (avatars have size).
+	enum { VIEW_EDGE = 64 };
+	// Pixels beyond the view's edge in which avatars are sent less often.
+	enum { MARGIN = 320 };
+	// Pixels beyond the view's edge in which team-mates are sent.
+	enum { TEAM_RANGE = 960 };
+
+	// Ticks between updates, and weights, for each kind of relevance.
+	enum { MARGIN_PERIOD = 3, TEAM_PERIOD = 8 };
+	static const float FOCUS_WEIGHT;
+	static const float MARGIN_WEIGHT;
+	static const float TEAM_WEIGHT;
+
+	// Seen less than this is not visible, for enemies in the margin.
+	static const float VISIBLE_LEVEL;
+
+	std::vector<AvatarHandle> found;  // Scratch.
+
+	// Is the avatar in a slot due an update at a tick, at a period?
+	static bool Due (int slot, int tick, int period) { return (tick + slot) % period == 0; }
+
+	static bool Before (const Snapshot::Relevant & a, const Snapshot::Relevant & b) {
+		return a.who.slot < b.who.slot;
+	}
+};
+
+#endif
@@ -0,0 +1,99 @@
+#include "libraries.h"
+
+#include "Lockstep.h"
+
+#include "Fixed.h"
+#include "Snapshot.h"
+
+// Rounds the positions in an avatar's intentions to what WriteInput can
+// send, and the rest to their ranges.
+void Lockstep::QuantizeInput (StateAvatarScenario & v) {
+	const fixed limit = (1 << (POSITION_BITS - 1)) - 1;
+	v.join_team = clamp (v.join_team, 0, (1 << TEAM_BITS) - 1);
+	v.desired_weapon_id = clamp (v.desired_weapon_id, -1, (1 << WEAPON_BITS) - 2);
+	v.fire_rewind = clamp (v.fire_rewind, 0, (1 << REWIND_BITS) - 1);
+	v.motion_goal_x = to_float (clamp (to_fixed (v.motion_goal_x), -limit, limit));
+	v.motion_goal_y = to_float (clamp (to_fixed (v.motion_goal_y), -limit, limit));
+	v.target_x = to_float (clamp (to_fixed (v.target_x), -limit, limit));
+	v.target_y = to_float (clamp (to_fixed (v.target_y), -limit, limit));
+}
+
+// Are two (quantized) intentions the same, as far as WriteInput goes?
+bool Lockstep::SameInput (const StateAvatarScenario & a, const StateAvatarScenario & b) {
+	return a.join_team == b.join_team && a.playing == b.playing &&
+		a.motion_goal_x == b.motion_goal_x && a.motion_goal_y == b.motion_goal_y &&
+		a.target_x == b.target_x && a.target_y == b.target_y &&
+		a.desired_weapon_id == b.desired_weapon_id && a.fire_impulse == b.fire_impulse &&
+		a.fire_rewind == b.fire_rewind;
+}
+
+// Packs a frame, including the message kind.
+void Lockstep::WriteFrame (BitWriter & out, const Frame & frame) {
+	out.Write (Snapshot::MESSAGE_FRAME, Snapshot::KIND_BITS);
+	out.Write ((uint32_t) frame.tick, 32);
+	out.WriteBool (frame.checked_tick >= 0);
+	if (frame.checked_tick >= 0) {
+		out.WriteVar ((uint32_t) (frame.tick - frame.checked_tick));
+		out.Write (frame.checksum, 32);
+	}
+	out.WriteVar ((uint32_t) frame.inputs.size());
+	int previous = -1;
+	int i;
+	for (i = 0; i < (signed) frame.inputs.size(); i++) {
+		out.WriteVar ((uint32_t) (frame.inputs[i].slot - previous - 1));
+		WriteInput (out, frame.inputs[i].v);
+		previous = frame.inputs[i].slot;
+	}
+}
+
+// Unpacks a frame. Returns false if the data is not a whole frame.
+// Inputs must have been written in slot order.
+bool Lockstep::ReadFrame (BitReader & in, Frame & frame) {
+	if (in.Read (Snapshot::KIND_BITS) != Snapshot::MESSAGE_FRAME)
+		return false;
+	frame.tick = (int) in.Read (32);
+	frame.checked_tick = -1;
+	frame.checksum = 0;
+	if (in.ReadBool ()) {
+		frame.checked_tick = frame.tick - (int) in.ReadVar ();
+		frame.checksum = in.Read (32);
+	}
+	int count = (int) in.ReadVar ();
+	if (in.Overflowed () || count > in.get_bits_left ())
+		return false;
+	frame.inputs.resize (count);
+	int slot = -1;
+	int i;
+	for (i = 0; i < count; i++) {
+		slot += 1 + (int) in.ReadVar ();
+		frame.inputs[i].slot = slot;
+		ReadInput (in, frame.inputs[i].v);
+	}
+	return ! in.Overflowed ();
+}
+
+// Packs one avatar's (quantized) intentions.
+void Lockstep::WriteInput (BitWriter & out, const StateAvatarScenario & v) {
+	out.Write (v.join_team, TEAM_BITS);
+	out.WriteBool (v.playing);
+	out.WriteSigned (to_fixed (v.motion_goal_x), POSITION_BITS);
+	out.WriteSigned (to_fixed (v.motion_goal_y), POSITION_BITS);
+	out.WriteSigned (to_fixed (v.target_x), POSITION_BITS);
+	out.WriteSigned (to_fixed (v.target_y), POSITION_BITS);
+	out.Write (v.desired_weapon_id + 1, WEAPON_BITS);
+	out.WriteBool (v.fire_impulse);
+	out.Write (v.fire_rewind, REWIND_BITS);
+}
+
+// Unpacks one avatar's intentions.
+void Lockstep::ReadInput (BitReader & in, StateAvatarScenario & v) {
+	v.join_team = in.Read (TEAM_BITS);
+	v.playing = in.ReadBool ();
+	v.motion_goal_x = to_float (in.ReadSigned (POSITION_BITS));
+	v.motion_goal_y = to_float (in.ReadSigned (POSITION_BITS));
+	v.target_x = to_float (in.ReadSigned (POSITION_BITS));
+	v.target_y = to_float (in.ReadSigned (POSITION_BITS));
+	v.desired_weapon_id = (int) in.Read (WEAPON_BITS) - 1;
+	v.fire_impulse = in.ReadBool ();
+	v.fire_rewind = in.Read (REWIND_BITS);
+}
@@ -0,0 +1,70 @@
+/**
+Lockstep helpers for running the same scenario on several peers.
+
+In deterministic mode (Scenario::SetDeterministic) a scenario's state after
+a tick depends only on its state before and on the avatars' intentions
+(StateAvatarScenario) for the tick. So instead of sending state, peers
+send each other the intentions of the avatars they run, a frame per tick,
+and every peer steps its own copy of the scenario. A frame costs a few
+bytes per avatar that changed its mind, however many avatars there are.
+
+Each frame also carries the sender's checksum of an earlier tick (see
+Scenario::Checksum), so peers that have drifted apart find out.
+
+Intentions are quantized before use (QuantizeInput) on every peer,
+including the one that made them, so all peers act on the same values.
+*/
+
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "AvatarStore.h"
+#include "BitStream.h"
+
+class Lockstep {
+public:
+	// One avatar's intentions for a tick.
+	struct Input {
+		int slot;
+		StateAvatarScenario v;
+	};
+
+	// The intentions a peer sends for a tick.
+	struct Frame {
+		int tick;
+		int checked_tick;        // Tick the checksum is for. (-1=none)
+		uint32_t checksum;
+		std::vector<Input> inputs;  // Only avatars whose intentions changed.
+		Frame () : tick(0), checked_tick(-1), checksum(0) { }
+	};
+
+	// Rounds the positions in an avatar's intentions to what WriteInput can
+	// send, and the rest to their ranges.
+	static void QuantizeInput (StateAvatarScenario & v);
+
+	// Are two (quantized) intentions the same, as far as WriteInput goes?
+	static bool SameInput (const StateAvatarScenario & a, const StateAvatarScenario & b);
+
+	// Packs a frame, including the message kind.
+	static void WriteFrame (BitWriter & out, const Frame & frame);
+
+	// Unpacks a frame. Returns false if the data is not a whole frame.
+	static bool ReadFrame (BitReader & in, Frame & frame);
+
+	// Packs one avatar's (quantized) intentions. Also used by clients
+	// sending their player's input to a server (see PlayerPredictor).
+	static void WriteInput (BitWriter & out, const StateAvatarScenario & v);
+	static void ReadInput (BitReader & in, StateAvatarScenario & v);
+
+private:
+	enum { TEAM_BITS = 4 };
+	enum { WEAPON_BITS = 8 };
+	enum { REWIND_BITS = 6 };
+	enum { POSITION_BITS = 25 };     // Signed fixed values (see Fixed.h).
+
+public:
+	// Bits WriteInput takes.
+	enum { INPUT_BITS = TEAM_BITS + 1 + 4 * POSITION_BITS + WEAPON_BITS + 1 + REWIND_BITS };
+};
+
+#endif
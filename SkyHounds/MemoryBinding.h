@@ -5,6 +5,10 @@ MemoryPool is deleted.
 
 Essentially, the lifespan of a MemoryBinding is constrained to be
 less than or equal to the lifespan of its attached MemoryPool.
+
+A binding made with new (pool) T(...) is allocated in the pool's arena;
+one made with plain new is allocated on the heap. Either way, delete
+gives the memory back to where it came from.
 */
 
 #ifndef MEMORY_BINDING_H
@@ -27,6 +31,28 @@ public:
 		if (pool)
 			pool->RemoveMemoryBinding (this);
 	}
+
+	// Allocates in a pool's arena: new (pool) T(...).
+	static void * operator new (size_t size, MemoryPool * pool);
+
+	// Allocates on the heap.
+	static void * operator new (size_t size);
+
+	// Gives memory back to the arena or heap it came from.
+	static void operator delete (void * block);
+
+	// Used if a constructor throws during new (pool) T(...).
+	static void operator delete (void * block, MemoryPool * pool);
+
+private:
+	// Put in front of each binding's memory, to find where it came from.
+	union Header {
+		struct {
+			Arena * arena;    // (NULL=heap)
+			size_t size;
+		} from;
+		double align[2];
+	};
 };
 
 #endif
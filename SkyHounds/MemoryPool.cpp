@@ -18,4 +18,42 @@ MemoryPool::~MemoryPool () {
 	while (it != bindings.end())
 		delete *it++;
 }
-	
\ No newline at end of file
+	
+// Allocates in a pool's arena, with a header saying so.
+void * MemoryBinding::operator new (size_t size, MemoryPool * pool) {
+	if (! pool)
+		return operator new (size);
+	Arena & arena = pool->GetArena ();
+	Header * header = (Header *) arena.Allocate (sizeof (Header) + size);
+	if (! header)
+		throw std::bad_alloc ();
+	header->from.arena = &arena;
+	header->from.size = sizeof (Header) + size;
+	return header + 1;
+}
+
+// Allocates on the heap, with a header saying so.
+void * MemoryBinding::operator new (size_t size) {
+	Header * header = (Header *) malloc (sizeof (Header) + size);
+	if (! header)
+		throw std::bad_alloc ();
+	header->from.arena = NULL;
+	header->from.size = sizeof (Header) + size;
+	return header + 1;
+}
+
+// Gives memory back to the arena or heap it came from.
+void MemoryBinding::operator delete (void * block) {
+	if (! block)
+		return;
+	Header * header = (Header *) block - 1;
+	if (header->from.arena)
+		header->from.arena->Free (header, header->from.size);
+	else
+		free (header);
+}
+
+// Used if a constructor throws during new (pool) T(...).
+void MemoryBinding::operator delete (void * block, MemoryPool * pool) {
+	operator delete (block);
+}
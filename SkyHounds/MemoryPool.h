@@ -6,14 +6,23 @@ or compatible type.
 
 Essentially, the lifespan of a MemoryBinding is constrained to be
 less than or equal to the lifespan of its MemoryPool.
+
+Bindings made with new (pool) T(...) live in the pool's own Arena, so that
+the memory of everything in one pool (e.g., one match's avatars) is kept
+together, and can be measured.
 */
 
 #ifndef MEMORY_POOL_H
 #define MEMORY_POOL_H
 
+#include "Arena.h"
+
 class MemoryBinding;  // forward declaration
 
 class MemoryPool {
+	// Declared first, so that it outlives the bindings deleted by ~MemoryPool.
+	Arena arena;
+
 protected:
 	std::set<MemoryBinding * > bindings;
 public:
@@ -31,6 +40,10 @@ public:
 		onDeleting (thing);
 	}
 
+	// Memory for bindings made in this pool (see MemoryBinding::operator new).
+	Arena & GetArena () { return arena; }
+	const Arena & GetArena () const { return arena; }
+
 	virtual ~MemoryPool ();
 };
 
@@ -0,0 +1,180 @@
+#include "libraries.h"
+
+#include "MessageChannel.h"
+
+//----- Pool -----//
+
+// Every buffer should have been given back by now.
+DatagramPool::~DatagramPool () {
+	if ((signed) spare.size() != allocated) {
+		warning (this, "%d datagram buffers still in use", allocated - (signed) spare.size());
+		breakpoint ();
+	}
+	int i;
+	for (i = 0; i < (signed) spare.size(); i++)
+		delete [] spare[i];
+}
+
+// A buffer of MTU bytes: a spare one, or a new one if there are none.
+unsigned char * DatagramPool::Take () {
+	if (spare.empty ()) {
+		allocated++;
+		return new unsigned char[Transport::MTU];
+	}
+	unsigned char * buffer = spare.back ();
+	spare.pop_back ();
+	return buffer;
+}
+
+// Keeps a buffer for reuse.
+void DatagramPool::Give (unsigned char * buffer) {
+	spare.push_back (buffer);
+}
+
+//----- Channel -----//
+
+MessageChannel::MessageChannel (Transport * _lower, DatagramPool * _pool)
+	: lower(_lower), pool(_pool), stats(NULL), outgoing_count(0), message_at(0),
+	  incoming_count(0), reading(0), read_at(0),
+	  messages_sent(0), datagrams_sent(0), bytes_sent(0)
+{
+}
+
+// Gives back every buffer. Messages not yet flushed are dropped.
+MessageChannel::~MessageChannel () {
+	int i;
+	for (i = 0; i < outgoing_count; i++)
+		pool->Give (outgoing[i].data);
+	for (i = 0; i < incoming_count; i++)
+		pool->Give (incoming[i].data);
+}
+
+// Sends a message, copied into the next datagram to go.
+bool MessageChannel::Send (const unsigned char * data, int size) {
+	if (size > MAX_MESSAGE) {
+		warning (this, "Message of %d bytes is larger than a datagram holds", size);
+		breakpoint ();
+		return false;
+	}
+	BitWriter & out = BeginMessage (size);
+	int i;
+	for (i = 0; i < size; i++)
+		out.Write (data[i], 8);
+	EndMessage ();
+	return true;
+}
+
+// Takes the next message received, copied into buffer.
+int MessageChannel::Receive (unsigned char * buffer, int capacity) {
+	const unsigned char * data;
+	int size = ReceiveMessage (data);
+	if (size > capacity)
+		size = capacity;
+	if (size > 0)
+		memcpy (buffer, data, size);
+	return size;
+}
+
+// Starts a message in the datagram being filled, or a new one if it
+// hasn't room for max_bytes more. A full batch is sent first.
+BitWriter & MessageChannel::BeginMessage (int max_bytes) {
+	max_bytes = clamp (max_bytes, 0, (int) MAX_MESSAGE);
+	if (outgoing_count == 0 || outgoing[outgoing_count - 1].size + FRAME_BYTES + max_bytes > MTU) {
+		if (outgoing_count == MAX_BATCH)
+			Flush ();
+		outgoing[outgoing_count].data = pool->Take ();
+		outgoing[outgoing_count].size = 0;
+		outgoing_count++;
+	}
+	Datagram & datagram = outgoing[outgoing_count - 1];
+	message_at = datagram.size;
+	writer.Reset (datagram.data + message_at + FRAME_BYTES, max_bytes);
+	return writer;
+}
+
+// Puts the message's length in front of it. A message that didn't fit is
+// dropped.
+// Every message starts with its kind, in the low bits of its first byte
+// (see Snapshot::KIND_BITS), which is how the stats tell them apart.
+void MessageChannel::EndMessage () {
+	if (writer.Overflowed ()) {
+		warning (this, "Message is larger than it was begun for");
+		breakpoint ();
+		return;
+	}
+	int size = writer.get_byte_count ();
+	Datagram & datagram = outgoing[outgoing_count - 1];
+	datagram.data[message_at] = (unsigned char) (size & 255);
+	datagram.data[message_at + 1] = (unsigned char) (size >> 8);
+	datagram.size = message_at + FRAME_BYTES + size;
+	messages_sent++;
+	if (stats && size > 0)
+		stats->MessageOut (datagram.data[message_at + FRAME_BYTES], FRAME_BYTES + size);
+}
+
+// Sends the datagrams filled since the last call, together, and gives
+// their buffers back. Datagrams the lower transport won't take are lost,
+// as they might be on the way.
+void MessageChannel::Flush () {
+	if (outgoing_count == 0)
+		return;
+	lower->SendBatch (outgoing, outgoing_count);
+	int i;
+	for (i = 0; i < outgoing_count; i++) {
+		datagrams_sent++;
+		bytes_sent += outgoing[i].size;
+		if (stats)
+			stats->DatagramOut ();
+		pool->Give (outgoing[i].data);
+	}
+	outgoing_count = 0;
+}
+
+// Takes the next message received, where it lies in its datagram.
+// A datagram whose lengths don't add up is damaged, and the rest of it is
+// thrown away.
+int MessageChannel::ReceiveMessage (const unsigned char * & data) {
+	for (;;) {
+		if (reading >= incoming_count && ! ReceiveMore ())
+			return 0;
+		const Datagram & datagram = incoming[reading];
+		if (read_at + FRAME_BYTES > datagram.size) {
+			reading++;
+			read_at = 0;
+			continue;
+		}
+		int size = datagram.data[read_at] | datagram.data[read_at + 1] << 8;
+		if (read_at + FRAME_BYTES + size > datagram.size) {
+			reading++;
+			read_at = 0;
+			continue;
+		}
+		data = datagram.data + read_at + FRAME_BYTES;
+		read_at += FRAME_BYTES + size;
+		if (size > 0) {
+			if (stats)
+				stats->MessageIn (data[0], FRAME_BYTES + size);
+			return size;
+		}
+	}
+}
+
+// Gives back the received datagrams, and takes another batch.
+// Returns false if nothing more has been received.
+bool MessageChannel::ReceiveMore () {
+	int i;
+	for (i = 0; i < incoming_count; i++)
+		pool->Give (incoming[i].data);
+	for (i = 0; i < MAX_BATCH; i++)
+		incoming[i].data = pool->Take ();
+	incoming_count = lower->ReceiveBatch (incoming, MAX_BATCH);
+	for (i = incoming_count; i < MAX_BATCH; i++)
+		pool->Give (incoming[i].data);
+	reading = 0;
+	read_at = 0;
+	if (stats) {
+		for (i = 0; i < incoming_count; i++)
+			stats->DatagramIn ();
+	}
+	return incoming_count > 0;
+}
@@ -0,0 +1,109 @@
+/**
+A MessageChannel packs the messages for one peer into as few datagrams as
+it can. A client's tick sends an acknowledgement and an input; a join
+(join_team, then team_assignment, on_map and playing, see
+StateAvatarScenario) is several small messages more. Each datagram has a
+cost of its own (headers, a system call, a wakeup at the far end), so
+sending them together is far cheaper than sending them apart.
+
+The channel is a Transport, wrapped round the one that carries its
+datagrams, so whatever sends messages doesn't need to know about it.
+Messages are written straight into the datagram they go out in (see
+Transport::BeginMessage), each behind a FRAME_BYTES length. Flush sends
+the tick's datagrams in one batch (see Transport::SendBatch).
+
+Received datagrams are taken a batch at a time, and their messages handed
+out where they lie (see Transport::ReceiveMessage).
+
+Datagram buffers come from a DatagramPool, shared by the channels of one
+thread, so a server with many clients keeps a few buffers in use rather
+than some for each client.
+*/
+
+#ifndef MESSAGE_CHANNEL_H
+#define MESSAGE_CHANNEL_H
+
+#include "NetStats.h"
+#include "Transport.h"
+
+// Buffers of Transport::MTU bytes, for datagrams. Not thread-safe.
+class DatagramPool {
+	std::vector<unsigned char*> spare;
+	int allocated;
+
+public:
+	DatagramPool () : allocated(0) { }
+	~DatagramPool ();
+
+	// A buffer of MTU bytes, to give back when done with.
+	unsigned char * Take ();
+	void Give (unsigned char * buffer);
+
+	// Buffers made, in use or spare.
+	int get_allocated () const { return allocated; }
+};
+
+class MessageChannel : public Transport {
+public:
+	// Each message's length goes before it, in this many bytes.
+	enum { FRAME_BYTES = 2 };
+
+	// Largest message, framed, that fits in a datagram.
+	enum { MAX_MESSAGE = MTU - FRAME_BYTES };
+
+	// Most datagrams sent or received at once.
+	enum { MAX_BATCH = 32 };
+
+	MessageChannel (Transport * _lower, DatagramPool * _pool);
+	virtual ~MessageChannel ();
+
+	// Sends a message, in the next datagram to go.
+	virtual bool Send (const unsigned char * data, int size);
+
+	// Takes the next message received into buffer.
+	virtual int Receive (unsigned char * buffer, int capacity);
+
+	// Starts a message in the datagram being filled, or a new one if it
+	// hasn't room for max_bytes more.
+	virtual BitWriter & BeginMessage (int max_bytes);
+	virtual void EndMessage ();
+
+	// Sends the datagrams filled since the last call, together.
+	virtual void Flush ();
+
+	// Takes the next message received, where it was received.
+	virtual int ReceiveMessage (const unsigned char * & data);
+
+	// Counts messages in and out, by kind, and their datagrams, into stats
+	// from now on. (NULL=don't)
+	void SetStats (NetStats * _stats) { stats = _stats; }
+
+	// Counts, for measuring how well messages are packed.
+	long get_messages_sent () const { return messages_sent; }
+	long get_datagrams_sent () const { return datagrams_sent; }
+	long get_bytes_sent () const { return bytes_sent; }
+
+private:
+	Transport * lower;
+	DatagramPool * pool;
+	NetStats * stats;
+
+	// Filled, and waiting for Flush. The last may still be filling.
+	Datagram outgoing[MAX_BATCH];
+	int outgoing_count;
+	BitWriter writer;
+	int message_at;                 // Where the message being written starts.
+
+	// Received, with messages still to hand out.
+	Datagram incoming[MAX_BATCH];
+	int incoming_count;
+	int reading;                    // Datagram being read.
+	int read_at;                    // Its next message.
+
+	long messages_sent, datagrams_sent, bytes_sent;
+
+	// Gives back the received datagrams, and takes another batch.
+	bool ReceiveMore ();
+};
+
+#endif
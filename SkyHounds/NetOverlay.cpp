@@ -0,0 +1,165 @@
+#include "libraries.h"
+
+#include "NetOverlay.h"
+
+// Each character is 3 by 5 dots, drawn SCALE pixels square.
+static const int SCALE = 2;
+static const float ADVANCE = 4 * SCALE;
+
+struct Glyph {
+	char c;
+	const char * rows[5];
+};
+
+static const Glyph GLYPHS[] = {
+	{ '0', { "###", "#.#", "#.#", "#.#", "###" } },
+	{ '1', { ".#.", "##.", ".#.", ".#.", "###" } },
+	{ '2', { "###", "..#", "###", "#..", "###" } },
+	{ '3', { "###", "..#", "###", "..#", "###" } },
+	{ '4', { "#.#", "#.#", "###", "..#", "..#" } },
+	{ '5', { "###", "#..", "###", "..#", "###" } },
+	{ '6', { "###", "#..", "###", "#.#", "###" } },
+	{ '7', { "###", "..#", "..#", "..#", "..#" } },
+	{ '8', { "###", "#.#", "###", "#.#", "###" } },
+	{ '9', { "###", "#.#", "###", "..#", "###" } },
+	{ '.', { "...", "...", "...", "...", ".#." } },
+	{ '%', { "#.#", "..#", ".#.", "#..", "#.#" } },
+	{ '/', { "..#", "..#", ".#.", "#..", "#.." } },
+	{ 'B', { "##.", "#.#", "##.", "#.#", "##." } },
+	{ 'k', { "#..", "#.#", "##.", "#.#", "#.#" } },
+	{ 'm', { "...", "...", "##.", "###", "#.#" } },
+	{ 's', { "...", ".##", "#..", "..#", "##." } },
+	{ 'u', { "...", "...", "#.#", "#.#", "###" } }
+};
+
+// Bar colours, by kind of message (see Snapshot::MessageKind).
+static ALLEGRO_COLOR KindColour (int kind) {
+	switch (kind) {
+	case 1: return al_map_rgb (64, 200, 64);    // Snapshot.
+	case 2: return al_map_rgb (220, 220, 64);   // Acknowledgement.
+	case 3: return al_map_rgb (64, 128, 255);   // Lockstep frame.
+	case 4: return al_map_rgb (255, 150, 32);   // Input.
+	default: return al_map_rgb (160, 160, 160);
+	}
+}
+
+// Draws stats measured over a period of seconds at (x,y).
+// Bandwidth bars are scaled to a power of two kilobytes per second, so
+// the scale only changes when the rate doubles or halves.
+void NetOverlay::Draw (const NetStats & stats, double seconds, float x, float y) {
+	if (seconds <= 0)
+		seconds = 1;
+	ALLEGRO_TRANSFORM identity;
+	al_identity_transform (&identity);
+	al_use_transform (&identity);
+
+	ALLEGRO_COLOR white = al_map_rgb (255, 255, 255);
+	ALLEGRO_COLOR grey = al_map_rgb (96, 96, 96);
+	al_draw_filled_rectangle (x, y, x + WIDTH, y + HEIGHT, al_map_rgba (0, 0, 0, 176));
+	float left = x + 6;
+	float bar_width = 140;
+	float text_x = left + bar_width + 6;
+	char text[32];
+
+	// Bytes per second out and in, by kind.
+	float out_rate = (float) (stats.get_bytes_out () / seconds);
+	float in_rate = (float) (stats.get_bytes_in () / seconds);
+	float most = 1024;
+	while (most < out_rate || most < in_rate)
+		most *= 2;
+	int row;
+	for (row = 0; row < 2; row++) {
+		const long * bytes = row == 0 ? stats.bytes_out : stats.bytes_in;
+		float top = y + 6 + row * 16;
+		float start = left;
+		al_draw_filled_rectangle (left, top, left + bar_width, top + 10, grey);
+		int kind;
+		for (kind = 0; kind < NetStats::KINDS; kind++) {
+			float width = (float) (bytes[kind] / seconds / most * bar_width);
+			if (width <= 0)
+				continue;
+			al_draw_filled_rectangle (start, top, start + width, top + 10, KindColour (kind));
+			start += width;
+		}
+		sprintf (text, "%.1fkB/s", (row == 0 ? out_rate : in_rate) / 1024);
+		DrawText (text, text_x, top, white);
+	}
+
+	// Snapshots lost, with 10% filling the bar.
+	float top = y + 38;
+	DrawBar (stats.get_loss (), 0.1f, left, top, bar_width, 10, al_map_rgb (230, 48, 48));
+	sprintf (text, "%.1f%%", stats.get_loss () * 100);
+	DrawText (text, text_x, top, white);
+
+	// Round trip histogram.
+	top = y + 54;
+	long tallest = 1;
+	int i;
+	for (i = 0; i < NetStats::RTT_BUCKETS; i++) {
+		if (stats.rtt[i] > tallest)
+			tallest = stats.rtt[i];
+	}
+	for (i = 0; i < NetStats::RTT_BUCKETS; i++) {
+		float column = left + i * 12;
+		float height = 40.0f * stats.rtt[i] / tallest;
+		al_draw_filled_rectangle (column, top + 40, column + 10, top + 41, grey);
+		al_draw_filled_rectangle (column, top + 40 - height, column + 10, top + 40, al_map_rgb (64, 200, 220));
+	}
+	sprintf (text, "%.0fms", stats.get_median_rtt () * 1000);
+	DrawText (text, text_x, top + 30, white);
+
+	// Snapshot size histogram.
+	top = y + 104;
+	tallest = 1;
+	for (i = 0; i < NetStats::SIZE_BUCKETS; i++) {
+		if (stats.snapshot_sizes[i] > tallest)
+			tallest = stats.snapshot_sizes[i];
+	}
+	for (i = 0; i < NetStats::SIZE_BUCKETS; i++) {
+		float column = left + i * 18;
+		float height = 40.0f * stats.snapshot_sizes[i] / tallest;
+		al_draw_filled_rectangle (column, top + 40, column + 16, top + 41, grey);
+		al_draw_filled_rectangle (column, top + 40 - height, column + 16, top + 40, KindColour (1));
+	}
+	sprintf (text, "%.0fB", stats.snapshots_sent > 0 ? (double) stats.snapshot_bytes / stats.snapshots_sent : 0.0);
+	DrawText (text, text_x, top + 30, white);
+
+	// Serializing.
+	top = y + 156;
+	sprintf (text, "%.0fus", stats.ticks > 0 ? (double) stats.serialize_us / stats.ticks : 0.0);
+	DrawText (text, left, top, white);
+}
+
+// Draws text in the built-in digits. Characters without a glyph are left
+// as spaces.
+float NetOverlay::DrawText (const char * text, float x, float y, ALLEGRO_COLOR colour) {
+	for (; *text; text++) {
+		const Glyph * glyph = NULL;
+		int g;
+		for (g = 0; g < (signed) (sizeof(GLYPHS) / sizeof(GLYPHS[0])); g++) {
+			if (GLYPHS[g].c == *text)
+				glyph = &GLYPHS[g];
+		}
+		if (glyph) {
+			int r, c;
+			for (r = 0; r < 5; r++) {
+				for (c = 0; c < 3; c++) {
+					if (glyph->rows[r][c] == '#') {
+						al_draw_filled_rectangle (x + c * SCALE, y + r * SCALE,
+							x + (c + 1) * SCALE, y + (r + 1) * SCALE, colour);
+					}
+				}
+			}
+		}
+		x += ADVANCE;
+	}
+	return x;
+}
+
+// Draws a bar of value out of most, over a grey box.
+void NetOverlay::DrawBar (float value, float most, float x, float y, float width, float height, ALLEGRO_COLOR colour) {
+	al_draw_filled_rectangle (x, y, x + width, y + height, al_map_rgb (96, 96, 96));
+	float filled = clamp (value / most, 0.0f, 1.0f) * width;
+	if (filled > 0)
+		al_draw_filled_rectangle (x, y, x + filled, y + height, colour);
+}
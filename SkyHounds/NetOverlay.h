@@ -0,0 +1,40 @@
+/**
+NetOverlay draws a connection's NetStats over the game's display, so that
+bandwidth, loss and round trips can be watched while playing.
+
+From the top, it shows: bytes per second out, then in, as bars coloured
+by kind of message (snapshots green, acknowledgements yellow, lockstep
+frames blue, inputs orange, anything else grey), with the total; the
+share of snapshots lost; a histogram of round trip times (buckets as in
+NetStats, doubling from 1 ms), with the median; a histogram of snapshot
+sizes (doubling from 64 bytes), with the average; and microseconds per
+tick spent serializing.
+
+There is no font: numbers are drawn with a small built-in set of digits.
+Uses the primitives addon.
+*/
+
+#ifndef NET_OVERLAY_H
+#define NET_OVERLAY_H
+
+#include "NetStats.h"
+
+class NetOverlay {
+public:
+	// Width and height of the overlay, in display pixels.
+	enum { WIDTH = 224, HEIGHT = 176 };
+
+	// Draws stats measured over a period of seconds, with its top left
+	// corner at (x,y) on the target bitmap. Resets the transformation.
+	static void Draw (const NetStats & stats, double seconds, float x, float y);
+
+private:
+	// Draws text (digits, and . % / B m s u) in the built-in digits.
+	// Returns where the next character would go.
+	static float DrawText (const char * text, float x, float y, ALLEGRO_COLOR colour);
+
+	// Draws a bar of value out of most, in a box of width by height.
+	static void DrawBar (float value, float most, float x, float y, float width, float height, ALLEGRO_COLOR colour);
+};
+
+#endif
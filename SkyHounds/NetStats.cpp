@@ -0,0 +1,186 @@
+#include "libraries.h"
+
+#include "NetStats.h"
+
+// Names of the kinds of message, for reports. (See Snapshot::MessageKind.)
+static const char * KIND_NAMES[NetStats::KINDS] = {
+	"0", "snapshot", "ack", "frame", "input", "5", "6", "7",
+	"8", "9", "10", "11", "12", "13", "14", "15"
+};
+
+// Starts counting afresh.
+void NetStats::Reset () {
+	memset (this, 0, sizeof(*this));
+}
+
+// Adds another's counts to these.
+void NetStats::Add (const NetStats & other) {
+	int i;
+	for (i = 0; i < KINDS; i++) {
+		bytes_out[i] += other.bytes_out[i];
+		bytes_in[i] += other.bytes_in[i];
+		messages_out[i] += other.messages_out[i];
+		messages_in[i] += other.messages_in[i];
+	}
+	datagrams_out += other.datagrams_out;
+	datagrams_in += other.datagrams_in;
+	snapshots_sent += other.snapshots_sent;
+	snapshot_bytes += other.snapshot_bytes;
+	if (other.largest_snapshot > largest_snapshot)
+		largest_snapshot = other.largest_snapshot;
+	for (i = 0; i < SIZE_BUCKETS; i++)
+		snapshot_sizes[i] += other.snapshot_sizes[i];
+	snapshots_received += other.snapshots_received;
+	snapshots_lost += other.snapshots_lost;
+	round_trips += other.round_trips;
+	total_rtt += other.total_rtt;
+	if (other.worst_rtt > worst_rtt)
+		worst_rtt = other.worst_rtt;
+	for (i = 0; i < RTT_BUCKETS; i++)
+		rtt[i] += other.rtt[i];
+	ticks += other.ticks;
+	serialize_us += other.serialize_us;
+}
+
+// A message sent, of a kind, taking bytes.
+void NetStats::MessageOut (int kind, int bytes) {
+	kind &= KINDS - 1;
+	messages_out[kind]++;
+	bytes_out[kind] += bytes;
+}
+
+// A message received, of a kind, taking bytes.
+void NetStats::MessageIn (int kind, int bytes) {
+	kind &= KINDS - 1;
+	messages_in[kind]++;
+	bytes_in[kind] += bytes;
+}
+
+// A snapshot sent, of bytes in all its fragments, taking encode_us to encode.
+void NetStats::SnapshotSent (int bytes, int64_t encode_us) {
+	snapshots_sent++;
+	snapshot_bytes += bytes;
+	if (bytes > largest_snapshot)
+		largest_snapshot = bytes;
+	int bucket = 0;
+	while (bucket < SIZE_BUCKETS - 1 && bytes >= SizeBucketTop (bucket))
+		bucket++;
+	snapshot_sizes[bucket]++;
+	serialize_us += encode_us;
+}
+
+// A snapshot completed, after lost others that never will be.
+void NetStats::SnapshotReceived (int lost) {
+	snapshots_received++;
+	snapshots_lost += lost;
+}
+
+// A round trip measured.
+void NetStats::RoundTrip (double seconds) {
+	round_trips++;
+	total_rtt += seconds;
+	if (seconds > worst_rtt)
+		worst_rtt = seconds;
+	int bucket = 0;
+	while (bucket < RTT_BUCKETS - 1 && seconds >= RttBucketTop (bucket))
+		bucket++;
+	rtt[bucket]++;
+}
+
+// Bytes sent, of every kind.
+long NetStats::get_bytes_out () const {
+	long total = 0;
+	int i;
+	for (i = 0; i < KINDS; i++)
+		total += bytes_out[i];
+	return total;
+}
+
+// Bytes received, of every kind.
+long NetStats::get_bytes_in () const {
+	long total = 0;
+	int i;
+	for (i = 0; i < KINDS; i++)
+		total += bytes_in[i];
+	return total;
+}
+
+// Share of snapshots lost.
+float NetStats::get_loss () const {
+	long expected = snapshots_received + snapshots_lost;
+	return expected > 0 ? (float) snapshots_lost / expected : 0.0f;
+}
+
+// The top of the bucket the middle round trip falls in.
+double NetStats::get_median_rtt () const {
+	long seen = 0;
+	int i;
+	for (i = 0; i < RTT_BUCKETS; i++) {
+		seen += rtt[i];
+		if (seen * 2 >= round_trips && round_trips > 0)
+			return RttBucketTop (i);
+	}
+	return 0;
+}
+
+// Writes the counts over a period as lines of text.
+void NetStats::WriteText (FILE * file, double seconds, const char * indent) const {
+	if (seconds <= 0)
+		seconds = 1;
+	fprintf (file, "%s%.0f bytes/s out in %.1f datagrams/s, %.0f bytes/s in in %.1f datagrams/s\n", indent,
+		get_bytes_out () / seconds, datagrams_out / seconds, get_bytes_in () / seconds, datagrams_in / seconds);
+	int i;
+	for (i = 0; i < KINDS; i++) {
+		if (messages_out[i] == 0 && messages_in[i] == 0)
+			continue;
+		fprintf (file, "%s  %-8s %7.0f bytes/s out (%.1f/s), %7.0f bytes/s in (%.1f/s)\n", indent, KIND_NAMES[i],
+			bytes_out[i] / seconds, messages_out[i] / seconds, bytes_in[i] / seconds, messages_in[i] / seconds);
+	}
+	if (snapshots_sent > 0) {
+		fprintf (file, "%ssnapshots sent: %ld, %.0f bytes on average, %d at most; sizes", indent,
+			snapshots_sent, (double) snapshot_bytes / snapshots_sent, largest_snapshot);
+		for (i = 0; i < SIZE_BUCKETS; i++)
+			fprintf (file, " %ld", snapshot_sizes[i]);
+		fprintf (file, "\n");
+	}
+	if (snapshots_received + snapshots_lost > 0) {
+		fprintf (file, "%ssnapshots received: %ld, %ld lost (%.1f%%)\n", indent,
+			snapshots_received, snapshots_lost, get_loss () * 100);
+	}
+	if (round_trips > 0) {
+		fprintf (file, "%sround trip: %.1f ms on average, under %.0f ms for half, %.1f ms at worst; ms", indent,
+			total_rtt / round_trips * 1000, get_median_rtt () * 1000, worst_rtt * 1000);
+		for (i = 0; i < RTT_BUCKETS; i++)
+			fprintf (file, " <%.0f:%ld", RttBucketTop (i) * 1000, rtt[i]);
+		fprintf (file, "\n");
+	}
+	if (ticks > 0 || serialize_us > 0) {
+		fprintf (file, "%sserializing: %.0f us per tick\n", indent,
+			ticks > 0 ? (double) serialize_us / ticks : (double) serialize_us);
+	}
+}
+
+// Writes the counts over a period as a JSON object.
+void NetStats::WriteJson (FILE * file, double seconds) const {
+	fprintf (file, "{\"seconds\":%.3f,\"datagrams_out\":%ld,\"datagrams_in\":%ld,\"kinds\":{",
+		seconds, datagrams_out, datagrams_in);
+	bool first = true;
+	int i;
+	for (i = 0; i < KINDS; i++) {
+		if (messages_out[i] == 0 && messages_in[i] == 0)
+			continue;
+		fprintf (file, "%s\"%s\":{\"bytes_out\":%ld,\"messages_out\":%ld,\"bytes_in\":%ld,\"messages_in\":%ld}",
+			first ? "" : ",", KIND_NAMES[i], bytes_out[i], messages_out[i], bytes_in[i], messages_in[i]);
+		first = false;
+	}
+	fprintf (file, "},\"snapshots_sent\":%ld,\"snapshot_bytes\":%ld,\"largest_snapshot\":%d,\"snapshot_sizes\":[",
+		snapshots_sent, snapshot_bytes, largest_snapshot);
+	for (i = 0; i < SIZE_BUCKETS; i++)
+		fprintf (file, "%s%ld", i > 0 ? "," : "", snapshot_sizes[i]);
+	fprintf (file, "],\"snapshots_received\":%ld,\"snapshots_lost\":%ld,\"round_trips\":%ld,\"rtt_ms\":{\"mean\":%.3f,\"worst\":%.3f,\"histogram\":[",
+		snapshots_received, snapshots_lost, round_trips,
+		round_trips > 0 ? total_rtt / round_trips * 1000 : 0.0, worst_rtt * 1000);
+	for (i = 0; i < RTT_BUCKETS; i++)
+		fprintf (file, "%s%ld", i > 0 ? "," : "", rtt[i]);
+	fprintf (file, "]},\"ticks\":%d,\"serialize_us\":%lld}", ticks, (long long) serialize_us);
+}
@@ -0,0 +1,104 @@
+/**
+NetStats counts what goes over one connection, so that update rates and
+byte budgets (see SnapshotSender) can be tuned on measurements:
+
+- bytes and messages in and out, by kind of message (see
+  Snapshot::MessageKind), and the datagrams they went in;
+- snapshots sent, and how big they were;
+- snapshots received, and how many never arrived (loss);
+- round trip times, from a snapshot going out to its acknowledgement
+  coming back, as a histogram;
+- time spent serializing: encoding snapshots, and the scenario saving its
+  state and recording its replay (see Scenario::get_serialize_us).
+
+The MessageChannel, SnapshotSender and SnapshotReceiver of a connection
+each count into the NetStats they are given. Counters only ever go up,
+until Reset; whoever reports them (the server's periodic dump, or the
+client's overlay, see NetOverlay) resets them after each report, so each
+report covers one period.
+
+Not thread-safe: a connection's stats belong to the thread that runs it.
+Copy them to hand them to another.
+*/
+
+#ifndef NET_STATS_H
+#define NET_STATS_H
+
+class NetStats {
+public:
+	// Kinds of message told apart. (1 << Snapshot::KIND_BITS)
+	enum { KINDS = 16 };
+
+	// Round trip times, in buckets of doubling width: under 1 ms, under
+	// 2 ms, under 4 ms... and the last for anything longer.
+	enum { RTT_BUCKETS = 12 };
+
+	// Snapshot sizes, the same way: under 64 bytes, under 128...
+	enum { SIZE_BUCKETS = 8 };
+
+	long bytes_out[KINDS], bytes_in[KINDS];        // Framing included.
+	long messages_out[KINDS], messages_in[KINDS];
+	long datagrams_out, datagrams_in;
+
+	long snapshots_sent;
+	long snapshot_bytes;
+	int largest_snapshot;
+	long snapshot_sizes[SIZE_BUCKETS];
+
+	long snapshots_received;
+	long snapshots_lost;       // Never completed: skipped by a newer one.
+
+	long round_trips;
+	double total_rtt;          // Seconds.
+	double worst_rtt;
+	long rtt[RTT_BUCKETS];
+
+	int ticks;
+	int64_t serialize_us;      // Microseconds, over all ticks.
+
+	NetStats () { Reset (); }
+
+	// Starts counting afresh.
+	void Reset ();
+
+	// Adds another's counts to these, to sum connections.
+	void Add (const NetStats & other);
+
+	// Counting, by the parts of a connection.
+	void MessageOut (int kind, int bytes);
+	void MessageIn (int kind, int bytes);
+	void DatagramOut () { datagrams_out++; }
+	void DatagramIn () { datagrams_in++; }
+	void SnapshotSent (int bytes, int64_t encode_us);
+	void SnapshotReceived (int lost);
+	void RoundTrip (double seconds);
+
+	// A tick run, with the microseconds its scenario spent serializing.
+	void Tick (int64_t us) { ticks++; serialize_us += us; }
+
+	// Totals over every kind.
+	long get_bytes_out () const;
+	long get_bytes_in () const;
+
+	// Share of snapshots lost (0 to 1).
+	float get_loss () const;
+
+	// Round trip time below which half fall, in seconds, going by the
+	// histogram. (0=none measured)
+	double get_median_rtt () const;
+
+	// Writes the counts over a period of seconds, as lines of text, each
+	// starting with indent.
+	void WriteText (FILE * file, double seconds, const char * indent) const;
+
+	// Writes them as a JSON object, on one line without an ending.
+	void WriteJson (FILE * file, double seconds) const;
+
+	// Upper bound of a round trip bucket, in seconds.
+	static double RttBucketTop (int bucket) { return (1 << bucket) / 1000.0; }
+
+	// Upper bound of a snapshot size bucket, in bytes.
+	static int SizeBucketTop (int bucket) { return 64 << bucket; }
+};
+
+#endif
@@ -0,0 +1,594 @@
+#include "libraries.h"
+
+#include "PathFinder.h"
+
+// Cost of a diagonal step, in cells.
+static const float DIAGONAL = 1.41421356f;
+
+// Min-heap order for (distance, item) pairs.
+typedef std::greater<std::pair<float,int> > HeapOrder;
+
+PathFinder::PathFinder ()
+	: map(NULL), level(0), cell_size(1), nav_width(0), nav_height(0),
+	clusters_x(0), clusters_y(0), caching(true), deadline(0), stopping(false)
+{
+	cache_mutex = al_create_mutex ();
+	mutex = al_create_mutex ();
+	wake = al_create_cond ();
+}
+
+PathFinder::~PathFinder () {
+	StopWorkers ();
+	al_destroy_cond (wake);
+	al_destroy_mutex (mutex);
+	al_destroy_mutex (cache_mutex);
+}
+
+// Builds the navigation grid and abstract graph for a map.
+// The map must outlive the PathFinder. Call before any requests.
+void PathFinder::Build (const CollisionMap & _map) {
+	map = &_map;
+	nodes.clear ();
+	edges.clear ();
+	cache.clear ();
+	cache_order.clear ();
+	if (map->level_count () == 0) {
+		nav_width = nav_height = clusters_x = clusters_y = 0;
+		open.clear ();
+		cluster_start.assign (1, 0);
+		cluster_nodes.clear ();
+		return;
+	}
+
+	// The navigation grid is a level of the collision pyramid.
+	level = NAV_LEVEL < map->level_count () - 1 ? NAV_LEVEL : map->level_count () - 1;
+	cell_size = 1 << level;
+	nav_width = (map->get_width () + cell_size - 1) >> level;
+	nav_height = (map->get_height () + cell_size - 1) >> level;
+	open.resize (nav_width * nav_height);
+	int x, y;
+	for (y = 0; y < nav_height; y++) {
+		for (x = 0; x < nav_width; x++)
+			open[y * nav_width + x] = ! map->Blocked (level, x, y);
+	}
+	clusters_x = (nav_width + CLUSTER - 1) / CLUSTER;
+	clusters_y = (nav_height + CLUSTER - 1) / CLUSTER;
+
+	// Entrances on each border between neighbouring clusters.
+	std::vector< std::vector<Edge> > adjacency;
+	std::map<int,int> cell_node;
+	int cx, cy;
+	for (cy = 0; cy < clusters_y; cy++) {
+		for (cx = 0; cx < clusters_x; cx++) {
+			int x0 = cx * CLUSTER, y0 = cy * CLUSTER;
+			int w = nav_width - x0 < CLUSTER ? nav_width - x0 : CLUSTER;
+			int h = nav_height - y0 < CLUSTER ? nav_height - y0 : CLUSTER;
+			if (cx + 1 < clusters_x)
+				AddBorder (x0 + CLUSTER - 1, y0, 0, 1, h, 1, 0, adjacency, cell_node);
+			if (cy + 1 < clusters_y)
+				AddBorder (x0, y0 + CLUSTER - 1, 1, 0, w, 0, 1, adjacency, cell_node);
+		}
+	}
+
+	// Group nodes by cluster.
+	int clusters = clusters_x * clusters_y;
+	int n;
+	cluster_start.assign (clusters + 1, 0);
+	for (n = 0; n < (signed) nodes.size(); n++)
+		cluster_start[nodes[n].cluster + 1]++;
+	int c;
+	for (c = 0; c < clusters; c++)
+		cluster_start[c + 1] += cluster_start[c];
+	cluster_nodes.resize (nodes.size());
+	std::vector<int> cursor (cluster_start.begin(), cluster_start.end() - 1);
+	for (n = 0; n < (signed) nodes.size(); n++)
+		cluster_nodes[cursor[nodes[n].cluster]++] = n;
+
+	// Costs of crossing each cluster between its entrances.
+	Search & s = inline_search;
+	for (c = 0; c < clusters; c++) {
+		int a, b;
+		for (a = cluster_start[c]; a < cluster_start[c + 1]; a++) {
+			int from = cluster_nodes[a];
+			ClusterDijkstra (s, c, nodes[from].cell);
+			for (b = cluster_start[c]; b < cluster_start[c + 1]; b++) {
+				int to = cluster_nodes[b];
+				float d = ClusterDistance (s, nodes[to].cell);
+				if (to != from && d >= 0) {
+					Edge e = { to, d };
+					adjacency[from].push_back (e);
+				}
+			}
+		}
+	}
+
+	// Flatten the edge lists.
+	for (n = 0; n < (signed) nodes.size(); n++) {
+		nodes[n].first_edge = (signed) edges.size();
+		nodes[n].edge_count = (signed) adjacency[n].size();
+		edges.insert (edges.end(), adjacency[n].begin(), adjacency[n].end());
+	}
+}
+
+// Builds again from the same map, after it has changed.
+// Pauses the workers while doing so.
+void PathFinder::Rebuild () {
+	if (! map)
+		return;
+	int threads = (signed) workers.size();
+	StopWorkers ();
+	Build (*map);
+	SetThreads (threads);
+}
+
+// Sets how many worker threads answer requests. (0=answer in RunFor)
+void PathFinder::SetThreads (int threads) {
+	StopWorkers ();
+	stopping = false;
+	int i;
+	for (i = 0; i < threads; i++) {
+		Worker * worker = new Worker;
+		worker->finder = this;
+		worker->thread = al_create_thread (WorkerMain, worker);
+		if (! worker->thread) {
+			warning (this, "Could not create path finding thread %d", i);
+			breakpoint ();
+			delete worker;
+			continue;
+		}
+		workers.push_back (worker);
+		al_start_thread (worker->thread);
+	}
+}
+
+// Asks for a route for an avatar. serial is handed back with the
+// result, so the caller can tell an answer to an old request.
+void PathFinder::Request (AvatarHandle who, int serial, float from_x, float from_y, float to_x, float to_y) {
+	PathRequest request = { who, serial, from_x, from_y, to_x, to_y };
+	al_lock_mutex (mutex);
+	requests.push_back (request);
+	al_signal_cond (wake);
+	al_unlock_mutex (mutex);
+}
+
+// Lets requests be worked on for the given number of seconds, from now.
+// With workers this returns at once; otherwise it does the work itself
+// (always finishing at least one request, so requests can't starve).
+void PathFinder::RunFor (double seconds) {
+	double now = al_get_time ();
+	al_lock_mutex (mutex);
+	deadline = now + seconds;
+	if (workers.size() > 0) {
+		if (requests.size() > 0)
+			al_broadcast_cond (wake);
+		al_unlock_mutex (mutex);
+		return;
+	}
+	bool first = true;
+	while (requests.size() > 0 && (first || al_get_time () < deadline)) {
+		PathRequest request = requests.front ();
+		requests.pop_front ();
+		al_unlock_mutex (mutex);
+		Result result;
+		Solve (inline_search, request, result);
+		al_lock_mutex (mutex);
+		results.push_back (result);
+		first = false;
+	}
+	al_unlock_mutex (mutex);
+}
+
+// Answers every queued request on the calling thread, so that when
+// answers arrive doesn't depend on timing. Don't use with workers.
+void PathFinder::RunAll () {
+	al_lock_mutex (mutex);
+	while (requests.size() > 0) {
+		PathRequest request = requests.front ();
+		requests.pop_front ();
+		al_unlock_mutex (mutex);
+		Result result;
+		Solve (inline_search, request, result);
+		al_lock_mutex (mutex);
+		results.push_back (result);
+	}
+	al_unlock_mutex (mutex);
+}
+
+// Moves finished results into out, replacing its contents.
+void PathFinder::TakeResults (std::vector<Result> & out) {
+	out.clear ();
+	al_lock_mutex (mutex);
+	out.swap (results);
+	al_unlock_mutex (mutex);
+}
+
+// Stops and deletes the worker threads.
+void PathFinder::StopWorkers () {
+	al_lock_mutex (mutex);
+	stopping = true;
+	al_broadcast_cond (wake);
+	al_unlock_mutex (mutex);
+
+	int i;
+	for (i = 0; i < (signed) workers.size(); i++) {
+		al_join_thread (workers[i]->thread, NULL);
+		al_destroy_thread (workers[i]->thread);
+		delete workers[i];
+	}
+	workers.clear ();
+}
+
+// Cell containing a map position, clamped to the grid.
+int PathFinder::CellAt (float x, float y) const {
+	int cx = clamp ((int) x >> level, 0, nav_width - 1);
+	int cy = clamp ((int) y >> level, 0, nav_height - 1);
+	return cy * nav_width + cx;
+}
+
+// Octile distance between two cells: a lower bound on the route between them.
+float PathFinder::Heuristic (int cell_a, int cell_b) const {
+	int dx = cell_a % nav_width - cell_b % nav_width;
+	int dy = cell_a / nav_width - cell_b / nav_width;
+	if (dx < 0) dx = -dx;
+	if (dy < 0) dy = -dy;
+	return dx > dy ? dx + (DIAGONAL - 1) * dy : dy + (DIAGONAL - 1) * dx;
+}
+
+// An open cell at or near the given one, or -1 if there is none close by.
+// (Avatars can stand in gaps narrower than a navigation cell.)
+int PathFinder::NearestOpen (int cell) const {
+	int x = cell % nav_width, y = cell / nav_width;
+	if (Open (x, y))
+		return cell;
+	int ring, dx, dy;
+	for (ring = 1; ring <= 2; ring++) {
+		for (dy = -ring; dy <= ring; dy++) {
+			for (dx = -ring; dx <= ring; dx++) {
+				if ((dx == -ring || dx == ring || dy == -ring || dy == ring) && Open (x + dx, y + dy))
+					return (y + dy) * nav_width + x + dx;
+			}
+		}
+	}
+	return -1;
+}
+
+// Adds entrances along one cluster border. The border's cells on this
+// side are (x,y) + i*(step_x,step_y) for i < length; their neighbours
+// on the other side are offset by (across_x,across_y).
+// A short run of open cells gets one entrance in its middle; a long one
+// gets one at each end, so routes needn't detour through the middle.
+void PathFinder::AddBorder (int x, int y, int step_x, int step_y, int length, int across_x, int across_y,
+		std::vector< std::vector<Edge> > & adjacency, std::map<int,int> & cell_node) {
+	int run_start = -1;
+	int i;
+	for (i = 0; i <= length; i++) {
+		int bx = x + i * step_x, by = y + i * step_y;
+		bool both = i < length && Open (bx, by) && Open (bx + across_x, by + across_y);
+		if (both && run_start < 0)
+			run_start = i;
+		if (both || run_start < 0)
+			continue;
+
+		int run_end = i - 1;
+		int picks[2], n_picks = 0;
+		if (run_end - run_start + 1 < ENTRANCE_SPLIT)
+			picks[n_picks++] = (run_start + run_end) / 2;
+		else {
+			picks[n_picks++] = run_start;
+			picks[n_picks++] = run_end;
+		}
+		int p;
+		for (p = 0; p < n_picks; p++) {
+			int ax = x + picks[p] * step_x, ay = y + picks[p] * step_y;
+			int a = NodeAt (ay * nav_width + ax, adjacency, cell_node);
+			int b = NodeAt ((ay + across_y) * nav_width + ax + across_x, adjacency, cell_node);
+			Edge ab = { b, 1 }, ba = { a, 1 };
+			adjacency[a].push_back (ab);
+			adjacency[b].push_back (ba);
+		}
+		run_start = -1;
+	}
+}
+
+// The node for an entrance cell, making it if need be.
+int PathFinder::NodeAt (int cell, std::vector< std::vector<Edge> > & adjacency, std::map<int,int> & cell_node) {
+	std::map<int,int>::iterator found = cell_node.find (cell);
+	if (found != cell_node.end())
+		return found->second;
+	Node node;
+	node.cell = cell;
+	node.cluster = ClusterOf (cell);
+	node.first_edge = node.edge_count = 0;
+	nodes.push_back (node);
+	adjacency.push_back (std::vector<Edge> ());
+	int n = (signed) nodes.size() - 1;
+	cell_node[cell] = n;
+	return n;
+}
+
+// Shortest distances from a cell to every cell of its cluster.
+// Moves are to the 8 neighbours, without cutting corners.
+void PathFinder::ClusterDijkstra (Search & s, int cluster, int start_cell) const {
+	s.x0 = (cluster % clusters_x) * CLUSTER;
+	s.y0 = (cluster / clusters_x) * CLUSTER;
+	s.w = nav_width - s.x0 < CLUSTER ? nav_width - s.x0 : CLUSTER;
+	s.h = nav_height - s.y0 < CLUSTER ? nav_height - s.y0 : CLUSTER;
+	s.dist.assign (s.w * s.h, -1);
+	s.parent.assign (s.w * s.h, -1);
+	s.heap.clear ();
+
+	int sx = start_cell % nav_width - s.x0, sy = start_cell / nav_width - s.y0;
+	if (sx < 0 || sy < 0 || sx >= s.w || sy >= s.h || ! open[start_cell])
+		return;
+	s.dist[sy * s.w + sx] = 0;
+	s.heap.push_back (std::make_pair (0.0f, sy * s.w + sx));
+
+	while (s.heap.size() > 0) {
+		std::pop_heap (s.heap.begin(), s.heap.end(), HeapOrder ());
+		float d = s.heap.back().first;
+		int i = s.heap.back().second;
+		s.heap.pop_back ();
+		if (d > s.dist[i])
+			continue;
+		int x = i % s.w, y = i / s.w;
+		int dx, dy;
+		for (dy = -1; dy <= 1; dy++) {
+			for (dx = -1; dx <= 1; dx++) {
+				int nx = x + dx, ny = y + dy;
+				if ((dx == 0 && dy == 0) || nx < 0 || ny < 0 || nx >= s.w || ny >= s.h)
+					continue;
+				int gx = s.x0 + nx, gy = s.y0 + ny;
+				if (! Open (gx, gy))
+					continue;
+				if (dx != 0 && dy != 0 && (! Open (s.x0 + x, gy) || ! Open (gx, s.y0 + y)))
+					continue;
+				float nd = d + (dx != 0 && dy != 0 ? DIAGONAL : 1);
+				int j = ny * s.w + nx;
+				if (s.dist[j] < 0 || nd < s.dist[j]) {
+					s.dist[j] = nd;
+					s.parent[j] = i;
+					s.heap.push_back (std::make_pair (nd, j));
+					std::push_heap (s.heap.begin(), s.heap.end(), HeapOrder ());
+				}
+			}
+		}
+	}
+}
+
+// Distance to a cell after ClusterDijkstra. (negative=unreachable)
+float PathFinder::ClusterDistance (const Search & s, int cell) const {
+	int x = cell % nav_width - s.x0, y = cell / nav_width - s.y0;
+	if (x < 0 || y < 0 || x >= s.w || y >= s.h)
+		return -1;
+	return s.dist[y * s.w + x];
+}
+
+// Appends the cells after start up to and including cell, after ClusterDijkstra.
+void PathFinder::AppendClusterPath (const Search & s, int cell, std::vector<int> & out) const {
+	int first = (signed) out.size();
+	int i = (cell / nav_width - s.y0) * s.w + cell % nav_width - s.x0;
+	while (s.parent[i] >= 0) {
+		out.push_back ((s.y0 + i / s.w) * nav_width + s.x0 + i % s.w);
+		i = s.parent[i];
+	}
+	std::reverse (out.begin() + first, out.end());
+}
+
+// Searches the abstract graph from start to goal. Fills s.node_path.
+// The start and goal join the graph through the entrances of their own
+// clusters; the search stops once no open node can beat the best route.
+bool PathFinder::AbstractSearch (Search & s, int start_cell, int goal_cell) {
+	int n_nodes = (signed) nodes.size();
+	if ((signed) s.g.size() < n_nodes) {
+		s.g.resize (n_nodes);
+		s.from.resize (n_nodes);
+		s.seen.resize (n_nodes, 0);
+		s.goal_cost.resize (n_nodes);
+		s.goal_seen.resize (n_nodes, 0);
+	}
+	s.search_no++;
+	int c, k;
+
+	// Links from the goal's entrances to the goal. (Costs are symmetric.)
+	c = ClusterOf (goal_cell);
+	ClusterDijkstra (s, c, goal_cell);
+	bool any_goal = false;
+	for (k = cluster_start[c]; k < cluster_start[c + 1]; k++) {
+		int n = cluster_nodes[k];
+		float d = ClusterDistance (s, nodes[n].cell);
+		if (d >= 0) {
+			s.goal_cost[n] = d;
+			s.goal_seen[n] = s.search_no;
+			any_goal = true;
+		}
+	}
+	if (! any_goal)
+		return false;
+
+	// Links from the start to its entrances.
+	c = ClusterOf (start_cell);
+	ClusterDijkstra (s, c, start_cell);
+	s.heap.clear ();
+	for (k = cluster_start[c]; k < cluster_start[c + 1]; k++) {
+		int n = cluster_nodes[k];
+		float d = ClusterDistance (s, nodes[n].cell);
+		if (d >= 0) {
+			s.g[n] = d;
+			s.from[n] = -1;
+			s.seen[n] = s.search_no;
+			s.heap.push_back (std::make_pair (d + Heuristic (nodes[n].cell, goal_cell), n));
+		}
+	}
+	std::make_heap (s.heap.begin(), s.heap.end(), HeapOrder ());
+
+	float best = -1;
+	int best_node = -1;
+	while (s.heap.size() > 0) {
+		std::pop_heap (s.heap.begin(), s.heap.end(), HeapOrder ());
+		float f = s.heap.back().first;
+		int n = s.heap.back().second;
+		s.heap.pop_back ();
+		if (best >= 0 && f >= best)
+			break;
+		float g = s.g[n];
+		if (f > g + Heuristic (nodes[n].cell, goal_cell) + 0.001f)
+			continue;  // stale entry
+		if (s.goal_seen[n] == s.search_no && (best < 0 || g + s.goal_cost[n] < best)) {
+			best = g + s.goal_cost[n];
+			best_node = n;
+		}
+		int e;
+		for (e = nodes[n].first_edge; e < nodes[n].first_edge + nodes[n].edge_count; e++) {
+			int to = edges[e].to;
+			float ng = g + edges[e].cost;
+			if (s.seen[to] != s.search_no || ng < s.g[to]) {
+				s.g[to] = ng;
+				s.from[to] = n;
+				s.seen[to] = s.search_no;
+				s.heap.push_back (std::make_pair (ng + Heuristic (nodes[to].cell, goal_cell), to));
+				std::push_heap (s.heap.begin(), s.heap.end(), HeapOrder ());
+			}
+		}
+	}
+	if (best_node < 0)
+		return false;
+
+	s.node_path.clear ();
+	int n;
+	for (n = best_node; n >= 0; n = s.from[n])
+		s.node_path.push_back (n);
+	std::reverse (s.node_path.begin(), s.node_path.end());
+	return true;
+}
+
+// Fills s.node_path from the cache, if there is a route cached between
+// these clusters and this start and goal can reach its ends.
+bool PathFinder::CachedRoute (Search & s, int start_cell, int goal_cell) {
+	CacheKey key (ClusterOf (start_cell), ClusterOf (goal_cell));
+	al_lock_mutex (cache_mutex);
+	std::map<CacheKey, std::vector<int> >::iterator found = cache.find (key);
+	bool hit = found != cache.end();
+	if (hit)
+		s.node_path = found->second;
+	al_unlock_mutex (cache_mutex);
+	if (! hit)
+		return false;
+
+	ClusterDijkstra (s, key.first, start_cell);
+	if (ClusterDistance (s, nodes[s.node_path.front()].cell) < 0)
+		return false;
+	ClusterDijkstra (s, key.second, goal_cell);
+	return ClusterDistance (s, nodes[s.node_path.back()].cell) >= 0;
+}
+
+// Plans a route for a request.
+void PathFinder::Solve (Search & s, const PathRequest & request, Result & out) {
+	out.who = request.who;
+	out.serial = request.serial;
+	out.found = false;
+	out.points.clear ();
+	if (nav_width == 0)
+		return;
+
+	int start = NearestOpen (CellAt (request.from_x, request.from_y));
+	int goal = NearestOpen (CellAt (request.to_x, request.to_y));
+	if (start < 0 || goal < 0)
+		return;
+
+	// Route as a list of cells: straight through the cluster if start and
+	// goal share one and are connected within it, otherwise by way of the
+	// abstract graph, filling in each leg within a cluster.
+	s.cells.clear ();
+	s.cells.push_back (start);
+	bool direct = false;
+	if (ClusterOf (start) == ClusterOf (goal)) {
+		ClusterDijkstra (s, ClusterOf (start), start);
+		if (ClusterDistance (s, goal) >= 0) {
+			AppendClusterPath (s, goal, s.cells);
+			direct = true;
+		}
+	}
+	if (! direct) {
+		if (! caching || ! CachedRoute (s, start, goal)) {
+			if (! AbstractSearch (s, start, goal))
+				return;
+			if (caching) {
+				CacheKey key (ClusterOf (start), ClusterOf (goal));
+				al_lock_mutex (cache_mutex);
+				if (cache.find (key) == cache.end()) {
+					if ((signed) cache_order.size() >= CACHE_SIZE) {
+						cache.erase (cache_order.front());
+						cache_order.pop_front ();
+					}
+					cache[key] = s.node_path;
+					cache_order.push_back (key);
+				}
+				al_unlock_mutex (cache_mutex);
+			}
+		}
+		int k;
+		for (k = 0; k <= (signed) s.node_path.size(); k++) {
+			int from = s.cells.back ();
+			int to = k < (signed) s.node_path.size() ? nodes[s.node_path[k]].cell : goal;
+			if (from == to)
+				continue;
+			if (ClusterOf (from) != ClusterOf (to))
+				s.cells.push_back (to);  // across a border: neighbours
+			else {
+				ClusterDijkstra (s, ClusterOf (from), from);
+				AppendClusterPath (s, to, s.cells);
+			}
+		}
+	}
+
+	// Straighten: keep a cell only where the line from the last kept point
+	// to the cell after it is blocked.
+	float half = cell_size * 0.5f;
+	float ax = request.from_x, ay = request.from_y;
+	int i;
+	for (i = 1; i < (signed) s.cells.size(); i++) {
+		float x = (s.cells[i] % nav_width) * cell_size + half;
+		float y = (s.cells[i] / nav_width) * cell_size + half;
+		float nx = request.to_x, ny = request.to_y;
+		if (i + 1 < (signed) s.cells.size()) {
+			nx = (s.cells[i + 1] % nav_width) * cell_size + half;
+			ny = (s.cells[i + 1] / nav_width) * cell_size + half;
+		}
+		if (! map->SegmentClear (ax, ay, nx, ny)) {
+			Waypoint w = { x, y };
+			out.points.push_back (w);
+			ax = x;
+			ay = y;
+		}
+	}
+	Waypoint end = { request.to_x, request.to_y };
+	out.points.push_back (end);
+	out.found = true;
+}
+
+// Worker thread: answers requests while the tick's time lasts. Runs on
+// any core, not that of the thread that started it.
+void * PathFinder::WorkerMain (ALLEGRO_THREAD * thread, void * arg) {
+	Worker * worker = (Worker *) arg;
+	PathFinder * finder = worker->finder;
+	unpin_current_thread ();
+
+	al_lock_mutex (finder->mutex);
+	for (;;) {
+		while (! finder->stopping && (finder->requests.size() == 0 || al_get_time () >= finder->deadline))
+			al_wait_cond (finder->wake, finder->mutex);
+		if (finder->stopping)
+			break;
+		PathRequest request = finder->requests.front ();
+		finder->requests.pop_front ();
+		al_unlock_mutex (finder->mutex);
+
+		Result result;
+		finder->Solve (worker->search, request, result);
+
+		al_lock_mutex (finder->mutex);
+		finder->results.push_back (result);
+	}
+	al_unlock_mutex (finder->mutex);
+	return NULL;
+}
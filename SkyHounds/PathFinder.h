@@ -0,0 +1,207 @@
+/**
+A PathFinder plans routes across a scenario's collision map with
+hierarchical A* (HPA*).
+
+The collision map is viewed through a coarse navigation grid (a cell is
+open only if its whole square of pixels is clear), and the grid is cut
+into square clusters. Where two clusters share a run of open border cells,
+an entrance joins them. Entrances are the nodes of a small abstract graph;
+the cost of crossing a cluster between two of its entrances is worked out
+once, when the map is loaded.
+
+A route is planned by linking the start and goal into the abstract graph,
+searching that graph, then filling in the steps within each cluster and
+straightening the result against the collision map. Abstract routes are
+cached by start and goal cluster, so avatars heading the same way share
+the expensive part of the work.
+
+Requests are queued and answered on worker threads, which only run for a
+limited time each tick (see RunFor). With no workers, RunFor answers
+requests on the calling thread.
+*/
+
+#ifndef PATH_FINDER_H
+#define PATH_FINDER_H
+
+#include "AvatarStore.h"
+#include "CollisionMap.h"
+
+class PathFinder {
+public:
+	struct Waypoint {
+		float x, y;
+	};
+
+	// A planned route. points runs from just after the start to the goal.
+	struct Result {
+		AvatarHandle who;
+		int serial;          // As given to Request.
+		bool found;          // False if the goal can't be reached.
+		std::vector<Waypoint> points;
+	};
+
+	PathFinder ();
+	~PathFinder ();
+
+	// Builds the navigation grid and abstract graph for a map.
+	// The map must outlive the PathFinder. Call before any requests.
+	void Build (const CollisionMap & _map);
+
+	// Builds again from the same map, after it has changed.
+	// Pauses the workers while doing so.
+	void Rebuild ();
+
+	// Sets how many worker threads answer requests. (0=answer in RunFor)
+	void SetThreads (int threads);
+
+	// Turns the abstract route cache on or off. With it off, a route
+	// depends only on its start and goal, not on what was asked before.
+	// Call when no requests are being worked on.
+	void SetCaching (bool on) { caching = on; }
+
+	// Asks for a route for an avatar. serial is handed back with the
+	// result, so the caller can tell an answer to an old request.
+	void Request (AvatarHandle who, int serial, float from_x, float from_y, float to_x, float to_y);
+
+	// Lets requests be worked on for the given number of seconds, from now.
+	// With workers this returns at once; otherwise it does the work itself
+	// (always finishing at least one request, so requests can't starve).
+	void RunFor (double seconds);
+
+	// Answers every queued request on the calling thread, so that when
+	// answers arrive doesn't depend on timing. Don't use with workers.
+	void RunAll ();
+
+	// Moves finished results into out, replacing its contents.
+	void TakeResults (std::vector<Result> & out);
+
+private:
+	// Size of a cluster, in navigation cells.
+	enum { CLUSTER = 16 };
+	// Pyramid level of the collision map used as the navigation grid.
+	enum { NAV_LEVEL = 2 };
+	// Border runs at least this long get an entrance at each end.
+	enum { ENTRANCE_SPLIT = 6 };
+	// Most abstract routes kept in the cache.
+	enum { CACHE_SIZE = 4096 };
+
+	struct Edge {
+		int to;
+		float cost;
+	};
+
+	// An entrance cell, on one side of a cluster border.
+	struct Node {
+		int cell;
+		int cluster;
+		int first_edge, edge_count;
+	};
+
+	struct PathRequest {
+		AvatarHandle who;
+		int serial;
+		float from_x, from_y, to_x, to_y;
+	};
+
+	// Scratch space for one search. Each thread has its own.
+	struct Search {
+		// Within one cluster, indexed by cell within the cluster.
+		std::vector<float> dist;
+		std::vector<int> parent;
+		std::vector<std::pair<float,int> > heap;
+		int x0, y0, w, h;
+
+		// Over the abstract graph, indexed by node.
+		std::vector<float> g;
+		std::vector<int> from;
+		std::vector<int> seen;       // Search number that last set g/from.
+		std::vector<float> goal_cost;
+		std::vector<int> goal_seen;  // Search number that last set goal_cost.
+		int search_no;
+
+		std::vector<int> node_path;
+		std::vector<int> cells;
+
+		Search () : x0(0), y0(0), w(0), h(0), search_no(0) { }
+	};
+
+	struct Worker {
+		PathFinder * finder;
+		Search search;
+		ALLEGRO_THREAD * thread;
+	};
+
+	const CollisionMap * map;
+	int level, cell_size;                  // Pyramid level of the grid, and its cell size in pixels.
+	int nav_width, nav_height;             // In cells.
+	std::vector<unsigned char> open;       // Is each cell open?
+	int clusters_x, clusters_y;
+
+	std::vector<Node> nodes;
+	std::vector<Edge> edges;
+	std::vector<int> cluster_start;        // Nodes of cluster c are cluster_nodes[cluster_start[c]..cluster_start[c+1]).
+	std::vector<int> cluster_nodes;
+
+	// Abstract routes (entrance nodes), by start and goal cluster.
+	typedef std::pair<int,int> CacheKey;
+	std::map<CacheKey, std::vector<int> > cache;
+	std::deque<CacheKey> cache_order;      // Oldest first, for eviction.
+	ALLEGRO_MUTEX * cache_mutex;
+	bool caching;
+
+	ALLEGRO_MUTEX * mutex;                 // Guards the queues, deadline and stopping.
+	ALLEGRO_COND * wake;                   // Signalled when there may be work.
+	std::deque<PathRequest> requests;
+	std::vector<Result> results;
+	double deadline;                       // al_get_time() after which workers pause.
+	bool stopping;
+	std::vector<Worker*> workers;
+	Search inline_search;                  // Used by Build and by RunFor without workers.
+
+	// Stops and deletes the worker threads.
+	void StopWorkers ();
+
+	// Grid helpers.
+	bool Open (int x, int y) const {
+		return x >= 0 && y >= 0 && x < nav_width && y < nav_height && open[y * nav_width + x];
+	}
+	int ClusterOf (int cell) const {
+		return (cell / nav_width / CLUSTER) * clusters_x + (cell % nav_width) / CLUSTER;
+	}
+	int CellAt (float x, float y) const;
+	float Heuristic (int cell_a, int cell_b) const;
+
+	// An open cell at or near the given one, or -1 if there is none close by.
+	int NearestOpen (int cell) const;
+
+	// Adds entrances along one cluster border. The border's cells on this
+	// side are (x,y) + i*(step_x,step_y) for i < length; their neighbours
+	// on the other side are offset by (across_x,across_y).
+	void AddBorder (int x, int y, int step_x, int step_y, int length, int across_x, int across_y,
+		std::vector< std::vector<Edge> > & adjacency, std::map<int,int> & cell_node);
+
+	// The node for an entrance cell, making it if need be.
+	int NodeAt (int cell, std::vector< std::vector<Edge> > & adjacency, std::map<int,int> & cell_node);
+
+	// Shortest distances from a cell to every cell of its cluster.
+	void ClusterDijkstra (Search & s, int cluster, int start_cell) const;
+
+	// Distance to a cell after ClusterDijkstra. (negative=unreachable)
+	float ClusterDistance (const Search & s, int cell) const;
+
+	// Appends the cells after start up to and including cell, after ClusterDijkstra.
+	void AppendClusterPath (const Search & s, int cell, std::vector<int> & out) const;
+
+	// Searches the abstract graph from start to goal. Fills s.node_path.
+	bool AbstractSearch (Search & s, int start_cell, int goal_cell);
+
+	// Fills s.node_path from the cache, if the cached route fits.
+	bool CachedRoute (Search & s, int start_cell, int goal_cell);
+
+	// Plans a route for a request.
+	void Solve (Search & s, const PathRequest & request, Result & out);
+
+	static void * WorkerMain (ALLEGRO_THREAD * thread, void * arg);
+};
+
+#endif
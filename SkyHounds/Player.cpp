@@ -1,6 +1,7 @@
 #include "libraries.h"
 
 #include "Player.h"
+#include "Scenario.h"
 
 Player::Player (Script * _script, Scenario * _scenario)
 	: Avatar(_script,_scenario) {
@@ -8,24 +9,35 @@ Player::Player (Script * _script, Scenario * _scenario)
 
 // What is the player aiming at?
 void Player::SetAimTarget (float map_x, float map_y) {
-	scenario_p.target_x = map_x;
-	scenario_p.target_y = map_y;
+	StateAvatarScenario & intent = Intent ();
+	intent.target_x = map_x;
+	intent.target_y = map_y;
 }
 
 // Where is the player moving to?
 void Player::SetMotionTarget (float map_x, float map_y) {
-	scenario_p.motion_goal_x = map_x;
-	scenario_p.motion_goal_y = map_y;
+	StateAvatarScenario & intent = Intent ();
+	intent.motion_goal_x = map_x;
+	intent.motion_goal_y = map_y;
 }
 
 // Fire the given weapon, if possible. (if weapon_id < 0, then do not fire.)
 // (More accurately: Registers an intention to fire the given weapon.)
 // Precondition: Player must possess weapon, and weapon must be ready to fire.
 void Player::Fire (int weapon_id) {
+	StateAvatarScenario & intent = Intent ();
 	if (weapon_id < 0)
-		scenario_p.fire_impulse = false;
+		intent.fire_impulse = false;
 	else {
-		scenario_p.desired_weapon_id = weapon_id;
-		scenario_p.fire_impulse = true;
+		intent.desired_weapon_id = weapon_id;
+		intent.fire_impulse = true;
 	}
 }
+
+// Takes intentions sent by the player's client.
+// Its shots are judged by where avatars were on its display.
+void Player::ApplyInput (const StateAvatarScenario & v, int view_tick) {
+	StateAvatarScenario & intent = Intent ();
+	intent = v;
+	intent.fire_rewind = scenario->RewindTicks (view_tick);
+}
@@ -21,6 +21,14 @@ public:
 	// (More accurately: Registers an intention to fire the given weapon.)
 	// Precondition: Player must possess weapon, and weapon must be ready to fire.
 	void Fire (int weapon_id);
+
+	// The player's intentions as they stand, for a client to send to the
+	// server (see PlayerPredictor).
+	const StateAvatarScenario & GetInput () { return Intent (); }
+
+	// Takes intentions sent by the player's client, made while it showed
+	// view_tick (-1=unknown). On the server, call between ticks.
+	void ApplyInput (const StateAvatarScenario & v, int view_tick);
 };
 
 #endif
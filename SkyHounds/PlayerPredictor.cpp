@@ -0,0 +1,116 @@
+#include "libraries.h"
+
+#include "Lockstep.h"
+#include "PlayerPredictor.h"
+#include "Scenario.h"
+
+const float PlayerPredictor::SMOOTHING = 0.85f;
+const float PlayerPredictor::SNAP_DISTANCE = 64.0f;
+
+PlayerPredictor::PlayerPredictor (Transport * _transport)
+	: transport(_transport), slot(-1), sequence(0), predicting(false), error_x(0), error_y(0)
+{
+	ResetStats ();
+}
+
+// Sets the slot of the avatar the client plays.
+// A different avatar starts afresh, once the server has said where it is.
+void PlayerPredictor::SetPlayer (int _slot) {
+	if (_slot == slot)
+		return;
+	slot = _slot;
+	predicting = false;
+	error_x = error_y = 0;
+}
+
+// Sends this tick's input, and moves the player by it.
+// The input is quantized first, so the client predicts with the same
+// values the server will act on. It is the last message of the client's
+// tick, so the transport is flushed: over a MessageChannel, it goes in the
+// same datagram as the tick's acknowledgement.
+void PlayerPredictor::Tick (const Scenario & scenario, const StateAvatarScenario & v, int view_tick) {
+	Input input;
+	input.sequence = sequence;
+	input.v = v;
+	Lockstep::QuantizeInput (input.v);
+	sequence = (sequence + 1) & 0xFFFF;
+
+	BitWriter & out = transport->BeginMessage (Snapshot::INPUT_BYTES);
+	Snapshot::WriteInput (out, input.sequence, view_tick, input.v);
+	transport->EndMessage ();
+	transport->Flush ();
+
+	if (predicting)
+		scenario.PredictStep (predicted, input.v);
+	input.x = predicted.map_x;
+	input.y = predicted.map_y;
+	pending.push_back (input);
+	if ((signed) pending.size() > MAX_PENDING)
+		pending.pop_front ();
+
+	error_x *= SMOOTHING;
+	error_y *= SMOOTHING;
+}
+
+// Puts the player where the newest snapshot says, and runs the inputs
+// it doesn't include again.
+// The acknowledged input's prediction is compared with the server's
+// state, to measure how good predictions are.
+void PlayerPredictor::Reconcile (const Scenario & scenario, const SnapshotReceiver & receiver) {
+	int k = slot >= 0 ? receiver.Find (slot) : -1;
+	if (k < 0) {
+		predicting = false;
+		return;
+	}
+	const StateScenarioAvatar server = receiver.State (k);
+
+	int ack = receiver.get_input_ack ();
+	bool acked = false;
+	float acked_x = 0, acked_y = 0;
+	while (ack >= 0 && pending.size() > 0 && ! Snapshot::Newer (pending.front ().sequence, ack)) {
+		acked = true;
+		acked_x = pending.front ().x;
+		acked_y = pending.front ().y;
+		pending.pop_front ();
+	}
+	if (predicting && acked) {
+		float dx = server.map_x - acked_x;
+		float dy = server.map_y - acked_y;
+		float error = sqrt (dx * dx + dy * dy);
+		corrections++;
+		total_error += error;
+		if (error > worst_error)
+			worst_error = error;
+	}
+
+	// Run the unacknowledged inputs again, from the server's state.
+	float shown_x = predicted.map_x + error_x;
+	float shown_y = predicted.map_y + error_y;
+	bool was_predicting = predicting;
+	predicted = server;
+	predicting = true;
+	std::deque<Input>::iterator it;
+	for (it = pending.begin(); it != pending.end(); ++it) {
+		scenario.PredictStep (predicted, it->v);
+		it->x = predicted.map_x;
+		it->y = predicted.map_y;
+	}
+
+	// Keep the player where it was shown, and let the difference fade.
+	error_x = error_y = 0;
+	if (was_predicting) {
+		float dx = shown_x - predicted.map_x;
+		float dy = shown_y - predicted.map_y;
+		if (dx * dx + dy * dy < SNAP_DISTANCE * SNAP_DISTANCE) {
+			error_x = dx;
+			error_y = dy;
+		}
+	}
+}
+
+// Starts measuring afresh.
+void PlayerPredictor::ResetStats () {
+	corrections = 0;
+	total_error = 0;
+	worst_error = 0;
+}
@@ -0,0 +1,94 @@
+/**
+A PlayerPredictor hides the round trip to the server from a client's own
+player. Without it, a click on the map goes to the server, and the player
+only starts moving when a snapshot comes back.
+
+Each tick the client's input (the player's intentions) is numbered and
+sent to the server, and the client moves its copy of the player at once,
+as the server's tick will (see Scenario::PredictStep). Inputs are kept
+until a snapshot says the server has acted on them (see
+SnapshotReceiver::get_input_ack). When one does, the player is put where
+the server says it was, and the inputs still unacknowledged are run again
+on top of that: what is shown is the server's state, plus the client's
+latest inputs.
+
+Where the prediction was wrong (the server routed round a wall, or
+something got in the way), the player would jump. Instead the difference
+is kept as a display offset that fades over a few ticks.
+*/
+
+#ifndef PLAYER_PREDICTOR_H
+#define PLAYER_PREDICTOR_H
+
+#include "Snapshot.h"
+
+class Scenario;  // forward declaration
+
+class PlayerPredictor {
+	// An input sent, and where it was predicted to leave the player.
+	struct Input {
+		int sequence;
+		StateAvatarScenario v;
+		float x, y;
+	};
+
+	Transport * transport;
+	int slot;                        // The player's slot. (-1=none)
+	int sequence;                    // Of the next input.
+	std::deque<Input> pending;       // Sent, not yet acknowledged, oldest first.
+
+	StateScenarioAvatar predicted;
+	bool predicting;                 // Has the server said where the player is?
+	float error_x, error_y;          // Display offset, fading.
+
+	// How good the predictions were.
+	int corrections;
+	double total_error;
+	float worst_error;
+
+public:
+	// Inputs kept unacknowledged, at most. (A few seconds' worth.)
+	enum { MAX_PENDING = 256 };
+
+	// Each tick, the display offset keeps this share of itself.
+	static const float SMOOTHING;
+
+	// Corrections larger than this (in pixels) are not smoothed.
+	static const float SNAP_DISTANCE;
+
+	PlayerPredictor (Transport * _transport);
+
+	// Sets the slot of the avatar the client plays.
+	void SetPlayer (int _slot);
+
+	// Sends this tick's input, with whatever else the transport holds for
+	// the server, and moves the player by it. view_tick is the tick of the
+	// snapshot on the client's display (-1=none), so the server can judge
+	// shots by what the player saw.
+	void Tick (const Scenario & scenario, const StateAvatarScenario & v, int view_tick);
+
+	// Puts the player where the newest snapshot says, and runs the inputs
+	// it doesn't include again. Call when the receiver has a newer snapshot.
+	void Reconcile (const Scenario & scenario, const SnapshotReceiver & receiver);
+
+	// The player as predicted after the latest input.
+	bool is_predicting () const { return predicting; }
+	const StateScenarioAvatar & get_predicted () const { return predicted; }
+
+	// Where to draw the player: predicted, plus what is left of corrections.
+	void GetDisplayPosition (float & x, float & y) const {
+		x = predicted.map_x + error_x;
+		y = predicted.map_y + error_y;
+	}
+
+	// How far the player was from where it was predicted to be, when the
+	// server's word on it came back, in pixels.
+	int get_corrections () const { return corrections; }
+	float get_average_error () const { return corrections > 0 ? (float) (total_error / corrections) : 0.0f; }
+	float get_worst_error () const { return worst_error; }
+
+	// Starts measuring afresh.
+	void ResetStats ();
+};
+
+#endif
@@ -0,0 +1,66 @@
+#include "libraries.h"
+
+#include "PositionHistory.h"
+
+PositionHistory::PositionHistory () {
+	Clear ();
+}
+
+// Makes room for avatars in slots up to slot_count - 1.
+void PositionHistory::Reserve (int slot_count) {
+	if (slot_count <= (signed) frames[0].size())
+		return;
+	Entry none;
+	none.generation = -1;
+	none.on_map = false;
+	none.x = none.y = 0;
+	int f;
+	for (f = 0; f < TICKS; f++)
+		frames[f].resize (slot_count, none);
+}
+
+// Records where avatars are after a tick, replacing the oldest tick kept.
+// Slots are marked empty first, then the avatars present are filled in.
+void PositionHistory::Record (int tick, const AvatarStore & store) {
+	std::vector<Entry> & frame = frames[tick % TICKS];
+	ticks[tick % TICKS] = tick;
+	int slot;
+	for (slot = 0; slot < (signed) frame.size(); slot++)
+		frame[slot].generation = -1;
+	int i;
+	for (i = 0; i < store.size(); i++) {
+		AvatarHandle who = store.Handle (i);
+		if (who.slot >= (signed) frame.size()) {
+			warning (this, "Avatar slot %d has no room in the position history", who.slot);
+			breakpoint ();
+			continue;
+		}
+		const StateScenarioAvatar & p = store.scenario_p (i);
+		Entry & e = frame[who.slot];
+		e.generation = who.generation;
+		e.on_map = p.on_map;
+		e.x = p.map_x;
+		e.y = p.map_y;
+	}
+}
+
+// Where an avatar was after a tick, or NULL if the tick is no longer
+// kept, or the avatar was not on the map then.
+const PositionHistory::Entry * PositionHistory::Find (int tick, AvatarHandle who) const {
+	if (! Has (tick))
+		return NULL;
+	const std::vector<Entry> & frame = frames[tick % TICKS];
+	if (who.slot < 0 || who.slot >= (signed) frame.size())
+		return NULL;
+	const Entry & e = frame[who.slot];
+	if (e.generation != who.generation || ! e.on_map)
+		return NULL;
+	return &e;
+}
+
+// Forgets every tick.
+void PositionHistory::Clear () {
+	int f;
+	for (f = 0; f < TICKS; f++)
+		ticks[f] = -1;
+}
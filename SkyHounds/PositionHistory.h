@@ -0,0 +1,56 @@
+/**
+A PositionHistory keeps where every avatar was after each of the last few
+ticks, so that the server can look at the map as a client saw it. A client
+draws the world as of the last snapshot it had, a round trip behind the
+server, so a shot aimed at an avatar on the client's display is tested
+against where that avatar was then (see Scenario::SetMaxRewind).
+
+The history is a ring of TICKS frames, each an array of positions by
+avatar slot. The arrays only grow when an avatar is added in a slot past
+their end (between ticks), so recording a tick copies each avatar's
+position into memory that is already there, and allocates nothing.
+*/
+
+#ifndef POSITION_HISTORY_H
+#define POSITION_HISTORY_H
+
+#include "AvatarStore.h"
+
+class PositionHistory {
+public:
+	// Ticks kept.
+	enum { TICKS = 64 };
+
+	// Where an avatar was after a tick.
+	struct Entry {
+		int generation;    // Of the avatar in the slot. (-1=none)
+		bool on_map;
+		float x, y;
+	};
+
+private:
+	int ticks[TICKS];                    // Tick in each frame. (-1=none)
+	std::vector<Entry> frames[TICKS];    // By slot.
+
+public:
+	PositionHistory ();
+
+	// Makes room for avatars in slots up to slot_count - 1.
+	// Call between ticks (e.g., as avatars are added).
+	void Reserve (int slot_count);
+
+	// Records where avatars are after a tick, replacing the oldest tick kept.
+	void Record (int tick, const AvatarStore & store);
+
+	// Is a tick still kept?
+	bool Has (int tick) const { return tick >= 0 && ticks[tick % TICKS] == tick; }
+
+	// Where an avatar was after a tick, or NULL if the tick is no longer
+	// kept, or the avatar was not on the map then.
+	const Entry * Find (int tick, AvatarHandle who) const;
+
+	// Forgets every tick.
+	void Clear ();
+};
+
+#endif
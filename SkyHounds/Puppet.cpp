@@ -0,0 +1,7 @@
+#include "libraries.h"
+
+#include "Puppet.h"
+
+Puppet::Puppet (Script * _script, Scenario * _scenario)
+	: Avatar(_script,_scenario) {
+}
@@ -0,0 +1,17 @@
+/**
+Avatar with no mind of its own. It wants whatever its intentions are set
+to from outside (e.g., by a replay; see ReplayReader), through the
+scenario's AvatarMemory.
+*/
+
+#ifndef PUPPET_H
+#define PUPPET_H
+
+#include "Avatar.h"
+
+class Puppet : public Avatar {
+public:
+	Puppet (Script * _script, Scenario * _scenario);
+};
+
+#endif
@@ -0,0 +1,508 @@
+#include "libraries.h"
+
+#include "Replay.h"
+
+#include "Avatar.h"
+#include "Puppet.h"
+#include "Scenario.h"
+
+const char Replay::MAGIC[8] = { 'S', 'K', 'Y', 'R', 'P', 'L', 'Y', '1' };
+
+// Packs a string: its length, then its bytes.
+static void WriteString (BitWriter & out, const std::string & text) {
+	out.WriteVar ((uint32_t) text.size());
+	int i;
+	for (i = 0; i < (signed) text.size(); i++)
+		out.Write ((unsigned char) text[i], 8);
+}
+
+// Unpacks a string written by WriteString.
+static std::string ReadString (BitReader & in) {
+	int length = (int) in.ReadVar ();
+	std::string text;
+	if (in.Overflowed () || length * 8 > in.get_bits_left ())
+		return text;
+	int i;
+	for (i = 0; i < length; i++)
+		text += (char) in.Read (8);
+	return text;
+}
+
+// A record's intentions, rounded as the record keeps them.
+static StateAvatarScenario Quantized (const StateAvatarScenario & v) {
+	StateAvatarScenario q = v;
+	Lockstep::QuantizeInput (q);
+	return q;
+}
+
+//----- ReplayWriter -----//
+
+ReplayWriter::ReplayWriter ()
+	: file(NULL), keyframe_ticks(0), latest(-1) {
+}
+
+ReplayWriter::~ReplayWriter () {
+	Close ();
+}
+
+// Starts a replay file. Call before any avatars are added to the scenario.
+bool ReplayWriter::Open (std::string file_name, const ReplaySettings & settings) {
+	Close ();
+	file = fopen (file_name.c_str(), "wb");
+	if (! file) {
+		warning (this, "Can't create replay %s", file_name.c_str());
+		breakpoint ();
+		return false;
+	}
+	fwrite (Replay::MAGIC, 1, sizeof (Replay::MAGIC), file);
+	WriteString (bits, settings.scenario_name);
+	bits.WriteBool (settings.deterministic);
+	bits.WriteVar ((uint32_t) settings.rollback_ticks);
+	bits.WriteVar ((uint32_t) settings.flow_field_mb);
+	WriteBits (Replay::RECORD_SETTINGS);
+	joining.clear ();
+	last.clear ();
+	latest = -1;
+	return true;
+}
+
+void ReplayWriter::Close () {
+	if (! file)
+		return;
+	WriteJoins ();
+	fclose (file);
+	file = NULL;
+}
+
+void ReplayWriter::Joined (Avatar * avatar) {
+	if (file)
+		joining.push_back (avatar);
+}
+
+void ReplayWriter::Left (AvatarHandle handle) {
+	if (! file)
+		return;
+	WriteJoins ();
+	bits.WriteVar ((uint32_t) handle.slot);
+	bits.WriteVar ((uint32_t) handle.generation);
+	WriteBits (Replay::RECORD_LEAVE);
+}
+
+void ReplayWriter::Edited (int x0, int y0, int x1, int y1, bool blocked) {
+	if (! file)
+		return;
+	WriteJoins ();
+	bits.WriteSigned (x0, 32);
+	bits.WriteSigned (y0, 32);
+	bits.WriteSigned (x1, 32);
+	bits.WriteSigned (y1, 32);
+	bits.WriteBool (blocked);
+	WriteBits (Replay::RECORD_EDIT);
+}
+
+// Before a tick: records intentions that have been set since the last
+// tick. At the end of a tick each avatar's intentions are what it sent the
+// scenario, which is what was recorded, so any that differ now were set
+// from outside.
+void ReplayWriter::Starting (const Scenario & scenario) {
+	if (! file || scenario.get_tick () < latest)
+		return;
+	WriteJoins ();
+	const AvatarStore & avatars = scenario.GetAvatars ();
+	frame.tick = scenario.get_tick () + 1;
+	frame.checked_tick = -1;
+	frame.inputs.clear ();
+	int slot;
+	for (slot = 0; slot < avatars.slot_count (); slot++) {
+		int i = avatars.Index (avatars.HandleOfSlot (slot));
+		if (i < 0)
+			continue;
+		Lockstep::Input input;
+		input.slot = slot;
+		input.v = Quantized (avatars.avatar_memory (i).intent);
+		if (! Lockstep::SameInput (input.v, last[slot]))
+			frame.inputs.push_back (input);
+	}
+	if (frame.inputs.size() > 0) {
+		Lockstep::WriteFrame (bits, frame);
+		WriteBits (Replay::RECORD_POKE);
+	}
+}
+
+// After a tick: records the intentions the scenario acted on, where they
+// changed, and the checksum; and every so often, the whole state.
+void ReplayWriter::Finished (const Scenario & scenario) {
+	if (! file || scenario.get_tick () <= latest)
+		return;
+	latest = scenario.get_tick ();
+	WriteJoins ();
+	const AvatarStore & avatars = scenario.GetAvatars ();
+	frame.tick = scenario.get_tick ();
+	frame.checked_tick = frame.tick;
+	frame.checksum = scenario.Checksum ();
+	frame.inputs.clear ();
+	int slot;
+	for (slot = 0; slot < avatars.slot_count (); slot++) {
+		int i = avatars.Index (avatars.HandleOfSlot (slot));
+		if (i < 0)
+			continue;
+		Lockstep::Input input;
+		input.slot = slot;
+		input.v = Quantized (avatars.avatar_v (i));
+		if (! Lockstep::SameInput (input.v, last[slot])) {
+			frame.inputs.push_back (input);
+			last[slot] = input.v;
+		}
+	}
+	Lockstep::WriteFrame (bits, frame);
+	WriteBits (Replay::RECORD_TICK);
+
+	if (keyframe_ticks > 0 && frame.tick % keyframe_ticks == 0) {
+		keyframe.Clear ();
+		scenario.WriteState (keyframe);
+		WriteRecord (Replay::RECORD_KEYFRAME, keyframe.get_data (), (int) keyframe.get_size ());
+	}
+	fflush (file);
+}
+
+// Records avatars added since the last record.
+// (Only done later, so that Make has finished with them.)
+void ReplayWriter::WriteJoins () {
+	int a;
+	for (a = 0; a < (signed) joining.size(); a++) {
+		Avatar * avatar = joining[a];
+		AvatarHandle handle = avatar->GetHandle ();
+		bits.WriteVar ((uint32_t) handle.slot);
+		bits.WriteVar ((uint32_t) handle.generation);
+		WriteString (bits, avatar->get_avatar_type ());
+		WriteString (bits, avatar->get_agency_type ());
+		WriteBits (Replay::RECORD_JOIN);
+		if ((signed) last.size() <= handle.slot)
+			last.resize (handle.slot + 1);
+		last[handle.slot] = StateAvatarScenario ();
+	}
+	joining.clear ();
+}
+
+// Writes bits as a record of a kind.
+void ReplayWriter::WriteBits (int kind) {
+	WriteRecord (kind, bits.get_data (), bits.get_byte_count ());
+	bits.Clear ();
+}
+
+// A record is its kind (a byte), its size (7 bits a byte, low first, with
+// the top bit set on all but the last byte), then its data.
+void ReplayWriter::WriteRecord (int kind, const unsigned char * data, int size) {
+	fputc (kind, file);
+	uint32_t rest = (uint32_t) size;
+	while (rest >= 0x80) {
+		fputc ((int) (rest & 0x7F) | 0x80, file);
+		rest >>= 7;
+	}
+	fputc ((int) rest, file);
+	if (size > 0)
+		fwrite (data, 1, size, file);
+}
+
+//----- ReplayReader -----//
+
+ReplayReader::ReplayReader ()
+	: file(NULL), first_record(0), last_tick(0), live_ai(false),
+	desync_tick(-1), ai_mismatches(0), ai_mismatch_tick(-1) {
+}
+
+ReplayReader::~ReplayReader () {
+	Close ();
+}
+
+// Opens a replay file, and finds its keyframes.
+// A record cut short (e.g., by a crash while recording) ends the replay.
+bool ReplayReader::Open (std::string file_name) {
+	Close ();
+	file = fopen (file_name.c_str(), "rb");
+	if (! file) {
+		warning (this, "Can't open replay %s", file_name.c_str());
+		breakpoint ();
+		return false;
+	}
+	char magic[sizeof (Replay::MAGIC)];
+	if (fread (magic, 1, sizeof (magic), file) != sizeof (magic) ||
+			memcmp (magic, Replay::MAGIC, sizeof (magic)) != 0 ||
+			ReadRecord () != Replay::RECORD_SETTINGS) {
+		warning (this, "%s is not a replay", file_name.c_str());
+		breakpoint ();
+		Close ();
+		return false;
+	}
+	BitReader in (&record[0], (int) record.size());
+	settings.scenario_name = ReadString (in);
+	settings.deterministic = in.ReadBool ();
+	settings.rollback_ticks = (int) in.ReadVar ();
+	settings.flow_field_mb = (int) in.ReadVar ();
+	first_record = ftell (file);
+
+	keyframes.clear ();
+	last_tick = 0;
+	for (;;) {
+		long offset = ftell (file);
+		uint32_t size;
+		int kind = ReadRecordHead (size);
+		if (kind < 0)
+			break;
+		if (kind == Replay::RECORD_KEYFRAME) {
+			// Keyframes start with their tick (see Scenario::WriteState).
+			// The rest is skipped until needed.
+			int tick = 0;
+			if (size < sizeof (tick) || fread (&tick, sizeof (tick), 1, file) != 1)
+				break;
+			keyframes.push_back (std::make_pair (tick, offset));
+			fseek (file, size - sizeof (tick), SEEK_CUR);
+			continue;
+		}
+		record.resize (size);
+		if (size > 0 && fread (&record[0], 1, size, file) != size)
+			break;
+		if (kind == Replay::RECORD_TICK) {
+			BitReader tick (&record[0], (int) record.size());
+			if (Lockstep::ReadFrame (tick, frame))
+				last_tick = frame.tick;
+		}
+	}
+	fseek (file, first_record, SEEK_SET);
+	return true;
+}
+
+void ReplayReader::Close () {
+	if (file)
+		fclose (file);
+	file = NULL;
+}
+
+// Plays up to a tick, starting from the latest keyframe before it.
+// The scenario must be new. Until the keyframe, avatars only come and go
+// and paths are edited, so that the keyframe finds the same avatars in
+// the same slots; then the keyframe's state is put in place.
+bool ReplayReader::Seek (Scenario & scenario, int tick) {
+	if (! file)
+		return false;
+	if (scenario.get_tick () != 0 || scenario.GetAvatars ().size () > 0) {
+		warning (this, "Replays can only be played into a new scenario");
+		breakpoint ();
+		return false;
+	}
+	fseek (file, first_record, SEEK_SET);
+
+	int k = -1;
+	int n;
+	for (n = 0; n < (signed) keyframes.size() && keyframes[n].first <= tick; n++)
+		k = n;
+	if (k >= 0) {
+		while (ftell (file) < keyframes[k].second) {
+			int kind = ReadRecord ();
+			bool ok = true;
+			if (kind == Replay::RECORD_JOIN)
+				ok = Join (scenario);
+			else if (kind == Replay::RECORD_LEAVE)
+				ok = Leave (scenario);
+			else if (kind == Replay::RECORD_EDIT)
+				ok = Edit (scenario);
+			if (kind < 0 || ! ok)
+				return false;
+		}
+		ReadRecord ();
+		keyframe.Clear ();
+		keyframe.PutBytes (&record[0], record.size());
+		if (! scenario.ReadState (keyframe)) {
+			warning (this, "Replay keyframe for tick %d doesn't fit the scenario", keyframes[k].first);
+			breakpoint ();
+			return false;
+		}
+		// The latest recorded intentions are the ones the scenario last acted on.
+		const AvatarStore & avatars = scenario.GetAvatars ();
+		int i;
+		for (i = 0; i < avatars.size (); i++)
+			last[avatars.Slot (i)] = Quantized (avatars.avatar_v (i));
+	}
+
+	while (scenario.get_tick () < tick) {
+		if (! Step (scenario))
+			return false;
+	}
+	return true;
+}
+
+// Plays the next tick. Returns false at the end of the replay.
+// Puppets are given the intentions recorded for the tick; live avatars
+// decide for themselves, and are checked against the recording after.
+bool ReplayReader::Step (Scenario & scenario) {
+	if (! file)
+		return false;
+	int kind;
+	do {
+		kind = ReadRecord ();
+		bool ok = true;
+		if (kind == Replay::RECORD_JOIN)
+			ok = Join (scenario);
+		else if (kind == Replay::RECORD_LEAVE)
+			ok = Leave (scenario);
+		else if (kind == Replay::RECORD_EDIT)
+			ok = Edit (scenario);
+		else if (kind == Replay::RECORD_POKE)
+			Poke (scenario);
+		if (kind < 0 || ! ok)
+			return false;
+	} while (kind != Replay::RECORD_TICK);
+
+	BitReader in (&record[0], (int) record.size());
+	if (! Lockstep::ReadFrame (in, frame)) {
+		warning (this, "Bad tick record in replay");
+		breakpoint ();
+		return false;
+	}
+	const AvatarStore & avatars = scenario.GetAvatars ();
+	int n;
+	for (n = 0; n < (signed) frame.inputs.size(); n++) {
+		const Lockstep::Input & input = frame.inputs[n];
+		if (input.slot >= (signed) last.size())
+			continue;
+		last[input.slot] = input.v;
+		AvatarMemory * memory = scenario.GetAvatarMemory (avatars.HandleOfSlot (input.slot));
+		if (memory && ! live[input.slot])
+			memory->intent = input.v;
+	}
+
+	scenario.SimTick ();
+
+	if (frame.tick != scenario.get_tick ()) {
+		warning (this, "Replay tick %d played as tick %d", frame.tick, scenario.get_tick ());
+		breakpoint ();
+	}
+	if (settings.deterministic && desync_tick < 0 && frame.checked_tick == scenario.get_tick () &&
+			frame.checksum != scenario.Checksum ())
+		desync_tick = frame.tick;
+	if (live_ai) {
+		int i;
+		for (i = 0; i < avatars.size (); i++) {
+			int slot = avatars.Slot (i);
+			if (live[slot] && ! Lockstep::SameInput (Quantized (avatars.avatar_v (i)), last[slot])) {
+				ai_mismatches++;
+				if (ai_mismatch_tick < 0)
+					ai_mismatch_tick = frame.tick;
+			}
+		}
+	}
+	return true;
+}
+
+// Reads the next record into record. Returns its kind, or -1 at the end.
+int ReplayReader::ReadRecord () {
+	uint32_t size;
+	int kind = ReadRecordHead (size);
+	if (kind < 0)
+		return -1;
+	record.resize (size);
+	if (size > 0 && fread (&record[0], 1, size, file) != size)
+		return -1;
+	return kind;
+}
+
+// Reads the kind and size of the next record (see ReplayWriter::WriteRecord).
+// Returns the kind, or -1 at the end.
+int ReplayReader::ReadRecordHead (uint32_t & size) {
+	int kind = fgetc (file);
+	if (kind == EOF)
+		return -1;
+	size = 0;
+	int shift = 0;
+	int c;
+	do {
+		c = fgetc (file);
+		if (c == EOF || shift > 28)
+			return -1;
+		size |= (uint32_t) (c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return kind;
+}
+
+// An avatar was added. Live AI avatars are made as the recording made
+// them; any others are puppets. The avatar must land in the same slot as
+// it did when recorded, or the rest of the replay would be misread.
+bool ReplayReader::Join (Scenario & scenario) {
+	BitReader in (&record[0], (int) record.size());
+	int slot = (int) in.ReadVar ();
+	int generation = (int) in.ReadVar ();
+	std::string avatar_type = ReadString (in);
+	std::string agency_type = ReadString (in);
+	bool make_live = live_ai && agency_type == "ai" && avatar_type.size() > 0;
+	Avatar * avatar;
+	if (make_live)
+		avatar = Avatar::Make (avatar_type, agency_type, &scenario);
+	else
+		avatar = new (&scenario) Puppet (NULL, &scenario);
+	if (! avatar)
+		return false;
+	AvatarHandle handle = avatar->GetHandle ();
+	if (handle.slot != slot || handle.generation != generation) {
+		warning (this, "Replay avatar joined as (%d, %d), recorded as (%d, %d)",
+			handle.slot, handle.generation, slot, generation);
+		breakpoint ();
+		return false;
+	}
+	if ((signed) last.size() <= slot) {
+		last.resize (slot + 1);
+		live.resize (slot + 1, 0);
+	}
+	last[slot] = StateAvatarScenario ();
+	live[slot] = make_live;
+	return true;
+}
+
+// An avatar was removed.
+bool ReplayReader::Leave (Scenario & scenario) {
+	BitReader in (&record[0], (int) record.size());
+	AvatarHandle handle;
+	handle.slot = (int) in.ReadVar ();
+	handle.generation = (int) in.ReadVar ();
+	const AvatarStore & avatars = scenario.GetAvatars ();
+	int i = avatars.Index (handle);
+	if (i < 0) {
+		warning (this, "Replay avatar (%d, %d) left, but isn't here", handle.slot, handle.generation);
+		breakpoint ();
+		return false;
+	}
+	delete avatars.avatar (i);
+	return true;
+}
+
+// The paths were edited.
+bool ReplayReader::Edit (Scenario & scenario) {
+	BitReader in (&record[0], (int) record.size());
+	int x0 = in.ReadSigned (32);
+	int y0 = in.ReadSigned (32);
+	int x1 = in.ReadSigned (32);
+	int y1 = in.ReadSigned (32);
+	bool blocked = in.ReadBool ();
+	if (in.Overflowed ())
+		return false;
+	scenario.EditPaths (x0, y0, x1, y1, blocked);
+	return true;
+}
+
+// Sets live avatars' intentions as they were set between ticks.
+// (Puppets are given the intentions the tick acted on instead.)
+void ReplayReader::Poke (Scenario & scenario) {
+	BitReader in (&record[0], (int) record.size());
+	if (! Lockstep::ReadFrame (in, frame))
+		return;
+	const AvatarStore & avatars = scenario.GetAvatars ();
+	int n;
+	for (n = 0; n < (signed) frame.inputs.size(); n++) {
+		const Lockstep::Input & input = frame.inputs[n];
+		if (input.slot >= (signed) live.size() || ! live[input.slot])
+			continue;
+		AvatarMemory * memory = scenario.GetAvatarMemory (avatars.HandleOfSlot (input.slot));
+		if (memory)
+			memory->intent = input.v;
+	}
+}
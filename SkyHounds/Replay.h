@@ -0,0 +1,173 @@
+/**
+A replay records what went into a scenario, so that a match can be run
+again offline: to find where peers fell out of step, to catch an AI bug in
+the act, or to time ticks on a real match rather than a made-up one.
+
+A replay file is a header (ReplaySettings) and then an append-only run of
+records, in the order things happened:
+  join, leave  An avatar was added or removed: its slot and generation,
+               and the types it was made with (see Avatar::Make).
+  edit         The paths were edited (see Scenario::EditPaths).
+  poke         Intentions set from outside between ticks (e.g., by
+               JoinGame), for the avatars whose intentions changed.
+  tick         The intentions the scenario acted on in a tick, for the
+               avatars whose intentions changed, and the checksum after it.
+  keyframe     The whole state after a tick (see Scenario::WriteState),
+               every so many ticks, so that playback can start partway.
+Each record is a kind byte, a length and the record itself. Poke and tick
+records are Lockstep frames, so a tick costs a few bytes per avatar that
+changed its mind. Keyframes are copies of the scenario's memory as this
+build lays it out, so only the same build can seek with them.
+
+Playback makes each avatar a Puppet that wants just what was recorded,
+and runs the ticks as fast as they go. Or AI avatars can be made live, to
+think for themselves, and what they decide is checked against what was
+recorded. In deterministic mode (Scenario::SetDeterministic) playback goes
+through the same states as the recording, and checksums show the first
+tick where it doesn't.
+*/
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "AvatarStore.h"
+#include "Lockstep.h"
+#include "RollbackRing.h"
+
+class Avatar;    // forward declaration
+class Scenario;  // forward declaration
+
+// How the recorded scenario was set up, as far as it changes what ticks do.
+// Playback should set the scenario up the same way.
+struct ReplaySettings {
+	std::string scenario_name;
+	bool deterministic;
+	int rollback_ticks;
+	int flow_field_mb;
+	ReplaySettings () : deterministic(false), rollback_ticks(0), flow_field_mb(0) { }
+};
+
+class Replay {
+public:
+	enum RecordKind {
+		RECORD_SETTINGS = 1,
+		RECORD_JOIN,
+		RECORD_LEAVE,
+		RECORD_EDIT,
+		RECORD_POKE,
+		RECORD_TICK,
+		RECORD_KEYFRAME
+	};
+
+	// Start of every replay file.
+	static const char MAGIC[8];
+};
+
+// Records a scenario (see Scenario::SetRecorder).
+class ReplayWriter {
+	FILE * file;
+	int keyframe_ticks;                     // (0=no keyframes)
+	int latest;                             // Latest tick recorded. (-1=none)
+
+	std::vector<Avatar*> joining;           // Added, not yet recorded.
+	std::vector<StateAvatarScenario> last;  // Latest recorded intentions, by slot.
+
+	// Scratch.
+	Lockstep::Frame frame;
+	BitWriter bits;
+	StateBlock keyframe;
+
+public:
+	ReplayWriter ();
+	~ReplayWriter ();
+
+	// Starts a replay file. Call before any avatars are added to the scenario.
+	bool Open (std::string file_name, const ReplaySettings & settings);
+
+	// Writes the whole state every so many ticks, for seeking. (0=never)
+	void SetKeyframeTicks (int ticks) { keyframe_ticks = ticks; }
+
+	void Close ();
+
+	// Called by the scenario.
+	void Joined (Avatar * avatar);
+	void Left (AvatarHandle handle);
+	void Edited (int x0, int y0, int x1, int y1, bool blocked);
+	// Before and after a tick. Ticks run again after a rollback (see
+	// Scenario::RestoreState) have been recorded already, and are skipped.
+	void Starting (const Scenario & scenario);
+	void Finished (const Scenario & scenario);
+
+private:
+	// Records avatars added since the last record.
+	// (Only done later, so that Make has finished with them.)
+	void WriteJoins ();
+
+	// Writes bits as a record of a kind.
+	void WriteBits (int kind);
+	void WriteRecord (int kind, const unsigned char * data, int size);
+};
+
+// Plays a replay back into a new scenario, set up as get_settings says.
+class ReplayReader {
+	FILE * file;
+	ReplaySettings settings;
+	long first_record;                      // File offset after the settings.
+	std::vector<std::pair<int,long> > keyframes;  // (tick, file offset), in order.
+	int last_tick;                          // Latest tick recorded.
+	bool live_ai;
+
+	std::vector<StateAvatarScenario> last;  // Latest recorded intentions, by slot.
+	std::vector<char> live;                 // Is the avatar in a slot live? (by slot)
+
+	int desync_tick;                        // First tick with a different checksum. (-1=none)
+	int ai_mismatches;                      // Live AI decisions unlike the recording.
+	int ai_mismatch_tick;                   // First of them. (-1=none)
+
+	// Scratch.
+	std::vector<unsigned char> record;
+	Lockstep::Frame frame;
+	StateBlock keyframe;
+
+public:
+	ReplayReader ();
+	~ReplayReader ();
+
+	// Opens a replay file, and finds its keyframes.
+	bool Open (std::string file_name);
+	void Close ();
+
+	const ReplaySettings & get_settings () const { return settings; }
+	int get_last_tick () const { return last_tick; }
+
+	// Makes AI avatars live, rather than puppets. Call before playing.
+	void SetLiveAI (bool on) { live_ai = on; }
+
+	// Plays up to a tick, starting from the latest keyframe before it.
+	// The scenario must be new.
+	bool Seek (Scenario & scenario, int tick);
+
+	// Plays the next tick. Returns false at the end of the replay.
+	bool Step (Scenario & scenario);
+
+	int get_desync_tick () const { return desync_tick; }
+	int get_ai_mismatches () const { return ai_mismatches; }
+	int get_ai_mismatch_tick () const { return ai_mismatch_tick; }
+
+private:
+	// Reads the next record into record. Returns its kind, or -1 at the end.
+	int ReadRecord ();
+
+	// Reads the kind and size of the next record. Returns the kind, or -1 at the end.
+	int ReadRecordHead (uint32_t & size);
+
+	// Applies a join, leave or edit record.
+	bool Join (Scenario & scenario);
+	bool Leave (Scenario & scenario);
+	bool Edit (Scenario & scenario);
+
+	// Sets live avatars' intentions as they were set between ticks.
+	void Poke (Scenario & scenario);
+};
+
+#endif
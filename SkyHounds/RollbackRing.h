@@ -0,0 +1,128 @@
+/**
+A RollbackRing keeps the scenario's state as of the last few ticks, so the
+simulation can be put back to one of them and run forward again (e.g., when
+a late input turns up for an earlier tick).
+
+Each tick's state is a StateBlock: a run of bytes that each part of the
+scenario appends its arrays to with memcpy, and reads back from in the same
+order. Everything saved is plain data in contiguous arrays, so saving is a
+handful of block copies whatever is in the scenario; nothing is visited
+object by object.
+
+Blocks keep their memory once they have grown to fit a tick, so after the
+first pass around the ring, saving allocates nothing.
+*/
+
+#ifndef ROLLBACK_RING_H
+#define ROLLBACK_RING_H
+
+class StateBlock {
+	std::vector<unsigned char> bytes;
+	size_t used;     // Bytes written.
+	size_t cursor;   // Next byte to read.
+	int tick;        // Tick the state is for. (-1=none)
+
+	friend class RollbackRing;
+
+public:
+	StateBlock () : used(0), cursor(0), tick(-1) { }
+
+	int get_tick () const { return tick; }
+	size_t get_size () const { return used; }
+	const unsigned char * get_data () const { return used > 0 ? &bytes[0] : NULL; }
+
+	// Empties the block, keeping its memory.
+	void Clear () { used = 0; cursor = 0; }
+
+	// Goes back to the start, to get what was put.
+	void Rewind () { cursor = 0; }
+
+	// Appends raw bytes.
+	void PutBytes (const void * data, size_t size) {
+		if (used + size > bytes.size())
+			bytes.resize (used + size);
+		if (size > 0)
+			memcpy (&bytes[used], data, size);
+		used += size;
+	}
+
+	// Reads back raw bytes, in the order they were put.
+	void GetBytes (void * data, size_t size) {
+		if (cursor + size > used) {
+			warning (this, "Reading past the end of a state block");
+			breakpoint ();
+			return;
+		}
+		if (size > 0)
+			memcpy (data, &bytes[cursor], size);
+		cursor += size;
+	}
+
+	// A value of plain data (no pointers it owns, no virtual functions).
+	template <class T>
+	void Put (const T & value) { PutBytes (&value, sizeof (T)); }
+	template <class T>
+	void Get (T & value) { GetBytes (&value, sizeof (T)); }
+
+	// An array of plain data, with its length.
+	template <class T>
+	void PutArray (const std::vector<T> & values) {
+		int count = (signed) values.size();
+		Put (count);
+		if (count > 0)
+			PutBytes (&values[0], count * sizeof (T));
+	}
+	template <class T>
+	void GetArray (std::vector<T> & values) {
+		int count = 0;
+		Get (count);
+		values.resize (count);
+		if (count > 0)
+			GetBytes (&values[0], count * sizeof (T));
+	}
+};
+
+class RollbackRing {
+	std::vector<StateBlock> blocks;
+
+public:
+	// Keeps the state of this many ticks. (0=none)
+	void Resize (int count) {
+		blocks.clear ();
+		blocks.resize (count);
+	}
+
+	int size () const { return (signed) blocks.size(); }
+
+	// Empties the block for a tick, ready to put the tick's state into.
+	// It replaces the oldest tick kept.
+	StateBlock & Begin (int tick) {
+		StateBlock & block = blocks[tick % blocks.size()];
+		block.tick = tick;
+		block.Clear ();
+		return block;
+	}
+
+	// The block for a tick, ready to get the state from, or NULL if the
+	// tick is no longer (or not yet) kept.
+	StateBlock * Find (int tick) {
+		if (blocks.size() == 0 || tick < 0)
+			return NULL;
+		StateBlock & block = blocks[tick % blocks.size()];
+		if (block.tick != tick)
+			return NULL;
+		block.Rewind ();
+		return &block;
+	}
+
+	// Drops the ticks after a tick, which are no longer what happened.
+	void ForgetAfter (int tick) {
+		int b;
+		for (b = 0; b < (signed) blocks.size(); b++) {
+			if (blocks[b].tick > tick)
+				blocks[b].tick = -1;
+		}
+	}
+};
+
+#endif
@@ -2,96 +2,1112 @@
 
 #include "Scenario.h"
 
-Scenario::Scenario (std::string name, std::string dropbox) : area_width(0), area_height(0) {
+#include "Lockstep.h"
+
+// Updates and advances a range of avatars, letting those the scheduler
+// picked think first.
+// Avatars only read their own front-buffer state and only write their own
+// back-buffer slot, so ranges can run on different threads.
+class AvatarTickJob : public ThreadPool::Job {
+	Scenario * scenario;
+	AvatarStore & perAvatar;
+	AIScheduler & thinking;
+public:
+	AvatarTickJob (Scenario * _scenario, AvatarStore & _perAvatar, AIScheduler & _thinking)
+		: scenario(_scenario), perAvatar(_perAvatar), thinking(_thinking) { }
+
+	virtual void Run (int begin, int end) {
+		int i;
+		for (i = begin; i < end; i++) {
+			Avatar * avatar = perAvatar.avatar (i);
+			avatar->UpdateScenarioInfo (perAvatar.scenario_p (i), scenario);
+			if (thinking.ShouldThink (i)) {
+				int64_t start = microseconds ();
+				avatar->Think ();
+				thinking.Thought (perAvatar.Slot (i), (long) (microseconds () - start));
+			}
+			avatar->SimTick ();
+		}
+	}
+};
+
+// Names of the folders (or files) in a folder, without the folder.
+// A missing folder has none.
+static void ListFolder (std::string folder, bool folders, std::vector<std::string> & names) {
+	ALLEGRO_FS_ENTRY * dir = al_create_fs_entry (folder.c_str());
+	if (! dir || ! al_open_directory (dir)) {
+		if (dir)
+			al_destroy_fs_entry (dir);
+		return;
+	}
+	ALLEGRO_FS_ENTRY * entry;
+	while ((entry = al_read_directory (dir)) != NULL) {
+		bool is_folder = (al_get_fs_entry_mode (entry) & ALLEGRO_FILEMODE_ISDIR) != 0;
+		if (is_folder == folders)
+			names.push_back (base_name (al_get_fs_entry_name (entry)));
+		al_destroy_fs_entry (entry);
+	}
+	al_close_directory (dir);
+	al_destroy_fs_entry (dir);
+}
+
+// A token frame image, avatars/TYPE/ANIM_NAMEx.png.
+struct TokenFile {
+	std::string type, animation;
+	int frame;
+	std::string path;
+};
+
+// Finds the token frames in a folder of avatar type folders.
+static void FindTokenFiles (std::string folder, std::vector<TokenFile> & files) {
+	std::vector<std::string> types;
+	ListFolder (folder, true, types);
+	int t, i;
+	for (t = 0; t < (signed) types.size(); t++) {
+		std::vector<std::string> names;
+		ListFolder (folder + types[t] + "/", false, names);
+		for (i = 0; i < (signed) names.size(); i++) {
+			const std::string & name = names[i];
+			if (name.size() < 5 || name.substr (name.size() - 4) != ".png")
+				continue;
+			std::string stem = name.substr (0, name.size() - 4);
+			std::string::size_type digits = stem.find_last_not_of ("0123456789") + 1;
+			if (digits == 0 || digits == stem.size())
+				continue;   // no animation name, or no frame number
+			TokenFile file;
+			file.type = types[t];
+			file.animation = stem.substr (0, digits);
+			file.frame = atoi (stem.c_str() + digits);
+			file.path = folder + types[t] + "/" + name;
+			files.push_back (file);
+		}
+	}
+}
+
+Scenario::Scenario (std::string name, std::string dropbox, bool _headless, AssetLoader * loader)
+	: headless(_headless), area_width(0), area_height(0), path_budget(0), path_serial(0), path_edits(0), flow_budget(0), deterministic(false), sim_tick(0), recorder(NULL), serialize_us(0), sim_pool(NULL), max_rewind(0), token_reach(0) {
 	// Locations of data.
 	std::string folder = std::string("scenarios/") + name + "/";
 	std::string image_folder = dropbox + "scenarios/" + name + "/";
 
-	// Load scenario data.
-	background = LoadAreaImage (image_folder + "background.png");
-	//paths_image = LoadAreaImage (image_folder + "paths.png");
+	// Load scenario data, taking what was preloaded from loader.
+	// The background is only for display, and is drawn in tiles paged in
+	// around the view (see TiledBackground). The paths image is only read by
+	// the simulation, so it is loaded into memory rather than as a texture,
+	// decoded into the collision map, and freed; a headless scenario
+	// depends on it for its dimensions.
+	if (! headless) {
+		ALLEGRO_BITMAP * image = loader ? loader->TakeImage (image_folder + "background.png") : NULL;
+		if (background.Open (image_folder, image))
+			CheckAreaSize (image_folder + "background.png", background.get_width (), background.get_height ());
+		LoadTokens (dropbox + "avatars/", loader);
+	}
+	int flags = al_get_new_bitmap_flags ();
+	al_set_new_bitmap_flags (ALLEGRO_MEMORY_BITMAP);
+	ALLEGRO_BITMAP * paths_image = LoadAreaImage (image_folder + "paths.png", headless, loader);
+	al_set_new_bitmap_flags (flags);
+	if (loader) {
+		std::vector<std::string> types;
+		ListFolder ("avatars/", true, types);
+		int t;
+		for (t = 0; t < (signed) types.size(); t++) {
+			Script * script = loader->TakeScript (std::string("avatars/") + types[t] + "/script.txt");
+			if (script)
+				avatar_scripts[types[t]] = script;
+		}
+	}
+
+	// Perform processing.
+	if (paths_image) {
+		collision.Build (paths_image);
+		al_destroy_bitmap (paths_image);
+	} else
+		collision.Clear (area_width, area_height);  // no paths: open field
+	paths.Build (collision);
+	flows.Build (collision);
+	influence.Build (collision);
+	avatarGrid.Resize ((float) area_width, (float) area_height, AVATAR_GRID_CELL);
+}
+
+// Avatars are deleted here rather than by ~MemoryPool, because their
+// destructors remove them from perAvatar, which must still be alive.
+Scenario::~Scenario () {
+	while (perAvatar.size() > 0)
+		delete perAvatar.avatar (perAvatar.size() - 1);
+	delete sim_pool;
+	std::map<std::string, Script*>::iterator s;
+	for (s = avatar_scripts.begin(); s != avatar_scripts.end(); s++)
+		delete s->second;
+}
+
 
-	// Perform processing. (collision map, etc?)
+// Sets how many threads run avatar time-steps. (0=one per core, 1=serial)
+void Scenario::SetSimThreads (int threads) {
+	if (threads <= 0)
+		threads = cpu_count ();
+	delete sim_pool;
+	sim_pool = NULL;
+	// The calling thread also does work, so start one fewer worker.
+	if (threads > 1)
+		sim_pool = new ThreadPool (threads - 1);
 }
 
+// Sets how many threads plan routes (0=plan on the simulation thread),
+// and for how many seconds per tick they may run.
+void Scenario::SetPathThreads (int threads, double budget) {
+	paths.SetThreads (threads);
+	path_budget = budget;
+}
+
+// Sets the most memory flow fields may use, in megabytes, and for how
+// many seconds per tick they may be worked on.
+void Scenario::SetFlowFields (int megabytes, double budget) {
+	flows.SetMemoryLimit ((size_t) megabytes << 20);
+	flow_budget = budget;
+}
+
+// Makes each tick depend only on the state before it and the avatars'
+// intentions. Work done in the background or to a time budget is done on
+// the simulation thread, to a fixed amount per tick; intentions are
+// quantized; movements are resolved in slot order, in fixed point.
+// (Avatars may still think on several threads, as each writes only its
+// own intentions.)
+void Scenario::SetDeterministic (bool on) {
+	deterministic = on;
+	if (on) {
+		paths.SetThreads (0);
+		influence.SetThreaded (false);
+		thinking.SetThinkLimit (DETERMINISTIC_THINKERS);
+	} else
+		thinking.SetThinkLimit (0);
+	paths.SetCaching (! Replayable ());
+}
+
+// Keeps the state after each of the last ticks ticks (see RestoreState).
+// The ring holds one more, for the tick just run.
+// In deterministic mode, the route cache and flow fields are then not
+// used: they are not saved, and would let a tick run again turn out
+// differently from the first time.
+void Scenario::SetRollbackTicks (int ticks) {
+	rollback.Resize (ticks > 0 ? ticks + 1 : 0);
+	paths.SetCaching (! Replayable ());
+}
+
+// Saves the state after the tick just run into the rollback ring.
+void Scenario::SaveState () {
+	WriteState (rollback.Begin (sim_tick));
+}
+
+// Judges shots up to this many ticks back.
+void Scenario::SetMaxRewind (int ticks) {
+	max_rewind = clamp (ticks, 0, (int) PositionHistory::TICKS - 1);
+}
+
+// How many ticks back to judge the shots of an avatar whose client was
+// showing view_tick. Inputs taken between ticks act in the next tick,
+// which starts from the state after sim_tick.
+int Scenario::RewindTicks (int view_tick) const {
+	if (view_tick < 0)
+		return 0;
+	return clamp (sim_tick - view_tick, 0, max_rewind);
+}
+
+// Puts the scenario back to how it was after a tick. Fails, changing
+// nothing, if the tick is not kept, or if avatars have come or gone or
+// the paths have been edited since. Call between ticks.
+// The ticks after it are forgotten; they are saved again as they are run.
+bool Scenario::RestoreState (int tick) {
+	StateBlock * block = rollback.Find (tick);
+	if (! block || ! ReadState (*block))
+		return false;
+	rollback.ForgetAfter (tick);
+	return true;
+}
+
+// Appends the scenario's state to a block: the tick, the per-avatar arrays
+// (including what avatars keep themselves), routes, the avatar grid, who
+// last thought, and the influence layers, each copied as a whole. The map,
+// and caches that only make things faster, are not saved.
+void Scenario::WriteState (StateBlock & block) const {
+	block.Put (sim_tick);
+	block.Put (path_edits);
+	perAvatar.Save (block);
+	block.PutArray (routes);
+	avatarGrid.Save (block);
+	thinking.Save (block);
+	influence.Save (block);
+}
+
+// Puts back state written by WriteState, from the start of the block.
+// Fails, changing nothing, if avatars have come or gone or the paths have
+// been edited since it was written.
+bool Scenario::ReadState (StateBlock & block) {
+	block.Rewind ();
+	int tick = 0, edits = 0;
+	block.Get (tick);
+	block.Get (edits);
+	if (edits != path_edits || ! perAvatar.Restore (block))
+		return false;
+	block.GetArray (routes);
+	avatarGrid.Restore (block);
+	thinking.Restore (block);
+	influence.Restore (block);
+	sim_tick = tick;
+
+	// Routes that were awaited then may have been handed over since, so
+	// ask for them again. (Deterministic mode has none awaited between ticks.)
+	int slot;
+	for (slot = 0; slot < (signed) routes.size(); slot++) {
+		Route & route = routes[slot];
+		if (route.serial == 0)
+			continue;
+		AvatarHandle handle = perAvatar.HandleOfSlot (slot);
+		int i = perAvatar.Index (handle);
+		if (i < 0) {
+			route.serial = 0;
+			continue;
+		}
+		const StateScenarioAvatar & p = perAvatar.scenario_p (i);
+		route.serial = ++path_serial;
+		paths.Request (handle, route.serial, p.map_x, p.map_y, route.goal_x, route.goal_y);
+	}
+	return true;
+}
+
+// A hash (FNV-1a) of the scenario's state: each avatar's slot, generation,
+// team and position, in slot order, and the tick.
+uint32_t Scenario::Checksum () const {
+	uint32_t hash = 2166136261u;
+	int32_t words[8];
+	int slot;
+	for (slot = 0; slot < perAvatar.slot_count (); slot++) {
+		AvatarHandle handle = perAvatar.HandleOfSlot (slot);
+		int i = perAvatar.Index (handle);
+		if (i < 0)
+			continue;
+		const StateScenarioAvatar & p = perAvatar.scenario_p (i);
+		words[0] = slot;
+		words[1] = handle.generation;
+		words[2] = p.team_assignment;
+		words[3] = p.on_map;
+		words[4] = to_fixed (p.map_x);
+		words[5] = to_fixed (p.map_y);
+		words[6] = to_fixed (p.aim_x);
+		words[7] = to_fixed (p.aim_y);
+		int w, b;
+		for (w = 0; w < 8; w++) {
+			for (b = 0; b < 32; b += 8) {
+				hash ^= ((uint32_t) words[w] >> b) & 0xFF;
+				hash *= 16777619u;
+			}
+		}
+	}
+	hash ^= (uint32_t) sim_tick;
+	hash *= 16777619u;
+	return hash;
+}
+
+// Avatars spawned on the map.
+int Scenario::CountOnMap () const {
+	int count = 0;
+	int i;
+	for (i = 0; i < perAvatar.size(); i++) {
+		if (perAvatar.scenario_p (i).on_map)
+			count++;
+	}
+	return count;
+}
+
+// Makes the pixels in the box [x0,x1] x [y0,y1] walls or paths.
+// Call between ticks, from the simulation thread.
+// Flow fields are repaired around the change; the route planner's graph
+// is rebuilt, and avatars' routes are planned again.
+void Scenario::EditPaths (int x0, int y0, int x1, int y1, bool blocked) {
+	collision.SetBox (x0, y0, x1, y1, blocked);
+	flows.Repair (x0, y0, x1, y1);
+	paths.Rebuild ();
+	path_edits++;
+	if (recorder)
+		recorder->Edited (x0, y0, x1, y1, blocked);
+	int slot;
+	for (slot = 0; slot < (signed) routes.size(); slot++)
+		routes[slot] = Route ();
+}
 
 // Receives information from an avatar.
+// Takes effect at the end of the current tick (see AvatarStore).
 void Scenario::UpdateAvatarInfo (const StateAvatarScenario & v, Avatar * avatar) {
-	if (perAvatarIndex.count (avatar) == 0) {
-		warning (this, "Avatar pointer not found in index");
+	int i = perAvatar.Index (avatar->GetHandle ());
+	if (i < 0) {
+		warning (this, "Avatar handle not found in scenario");
 		breakpoint ();
 		return;
 	}
-	int i = perAvatarIndex[avatar];
-	PerAvatar & per_avatar = perAvatar[i];
-	per_avatar.v = v;
+	perAvatar.avatar_v_next (i) = v;
+}
+
+// What the scenario says about an avatar, or NULL if the handle is stale.
+const StateScenarioAvatar * Scenario::GetAvatarState (AvatarHandle handle) const {
+	int i = perAvatar.Index (handle);
+	if (i < 0)
+		return NULL;
+	return &perAvatar.scenario_p (i);
+}
+
+// An avatar's lasting state, or NULL if the handle is stale.
+AvatarMemory * Scenario::GetAvatarMemory (AvatarHandle handle) {
+	int i = perAvatar.Index (handle);
+	if (i < 0)
+		return NULL;
+	return &perAvatar.avatar_memory (i);
+}
+
+// Grid visitor that converts slots to handles.
+struct HandleCollector {
+	const AvatarStore & perAvatar;
+	std::vector<AvatarHandle> & out;
+	HandleCollector (const AvatarStore & _perAvatar, std::vector<AvatarHandle> & _out)
+		: perAvatar(_perAvatar), out(_out) { }
+	void operator() (int slot) { out.push_back (perAvatar.HandleOfSlot (slot)); }
+};
+
+// Avatars on the map within radius of (x,y).
+void Scenario::FindAvatarsNear (float x, float y, float radius, std::vector<AvatarHandle> & out) const {
+	HandleCollector collect (perAvatar, out);
+	avatarGrid.VisitRadius (x, y, radius, collect);
+}
+
+// Avatars on the map within the rectangle [x0,x1] x [y0,y1].
+void Scenario::FindAvatarsIn (float x0, float y0, float x1, float y1, std::vector<AvatarHandle> & out) const {
+	HandleCollector collect (perAvatar, out);
+	avatarGrid.VisitRect (x0, y0, x1, y1, collect);
+}
+
+// The k avatars nearest to (x,y), nearest first, no farther than max_radius.
+int Scenario::FindNearestAvatars (float x, float y, int k, float max_radius, std::vector<AvatarHandle> & out) const {
+	int slots[SpatialGrid::MAX_NEAREST];
+	int found = avatarGrid.Nearest (x, y, k, max_radius, slots);
+	int i;
+	for (i = 0; i < found; i++)
+		out.push_back (perAvatar.HandleOfSlot (slots[i]));
+	return found;
 }
 
 // Returns avatars that have requested to join the given team.
 std::vector<Avatar*> Scenario::GetJoinList (int team_no) {
 	std::vector<Avatar*> join_list;
 	int i;
-	for (i = 0; i < (signed) perAvatar.size(); i++) {
-		if (perAvatar[i].v.join_team == team_no)
-			join_list.push_back (perAvatar[i].avatar);
+	for (i = 0; i < perAvatar.size(); i++) {
+		if (perAvatar.avatar_v (i).join_team == team_no)
+			join_list.push_back (perAvatar.avatar (i));
 	}
 	return join_list;
 }
 
 // Advances the scenario simulation by one time-step.
+// Time spent saving and recording is measured, as serializing.
 void Scenario::SimTick () {
-	// Tell each avatar what its status in the scenario actually is.
-	int i;
-	for (i = 0; i < (signed) perAvatar.size(); i++) {
-		perAvatar[i].avatar->UpdateScenarioInfo (perAvatar[i].p, this);
+	int64_t start = microseconds ();
+	if (recorder)
+		recorder->Starting (*this);
+	serialize_us = microseconds () - start;
+	hits.clear ();
+
+	// Pick up routes planned since the last tick, and let planning carry on
+	// while avatars run. (Deterministic mode plans at the end of the tick.)
+	TakeRoutes ();
+	if (deterministic) {
+		if (! Replayable ())
+			flows.UpdateSteps (DETERMINISTIC_FLOW_STEPS);
+	} else {
+		paths.RunFor (path_budget);
+		flows.Update (flow_budget);
 	}
-	// Advance simulation time-step of avatars.
-	for (i = 0; i < (signed) perAvatar.size(); i++) {
-		perAvatar[i].avatar->SimTick ();
+	influence.Acquire ();
+
+	// Tell each avatar what its status in the scenario actually is,
+	// and advance simulation time-step of avatars.
+	thinking.Plan (perAvatar, influence);
+	AvatarTickJob tick (this, perAvatar, thinking);
+	if (sim_pool)
+		sim_pool->ParallelFor (&tick, perAvatar.size(), 16);
+	else
+		tick.Run (0, perAvatar.size());
+	thinking.Finish ();
+
+	// All avatars are done; make their new intentions current.
+	perAvatar.SwapAvatarBuffers ();
+
+	// Resolve avatar movements, recording where each avatar moved from
+	// and to for the renderer. Deterministic mode goes in slot order, as
+	// dense order depends on the order avatars came and went.
+	order.clear ();
+	int i;
+	if (deterministic) {
+		int slot;
+		for (slot = 0; slot < perAvatar.slot_count (); slot++) {
+			i = perAvatar.Index (perAvatar.HandleOfSlot (slot));
+			if (i >= 0) {
+				Lockstep::QuantizeInput (perAvatar.avatar_v (i));
+				order.push_back (i);
+			}
+		}
+	} else {
+		for (i = 0; i < perAvatar.size(); i++)
+			order.push_back (i);
 	}
-	// Resolve avatar movements.
-	for (i = 0; i < (signed) perAvatar.size(); i++) {
+	tick_views.resize (perAvatar.size());
+	int n;
+	for (n = 0; n < (signed) order.size(); n++) {
+		i = order[n];
+		StateScenarioAvatar & p = perAvatar.scenario_p (i);
+		const StateAvatarScenario & v = perAvatar.avatar_v (i);
+		if (v.join_team != p.team_assignment || (v.join_team != 0 && ! p.on_map))
+			Join (i);
+		AvatarView & seen = tick_views[i];
+		seen.from_x = p.map_x;
+		seen.from_y = p.map_y;
 		// Only move avatar if actually playing.
-		if (perAvatar[i].p.on_map && perAvatar[i].v.playing) {
-			// TO DO: convert motion goal/target/desired weapon into actual movement
+		if (p.on_map && v.playing) {
+			FollowRoute (i);
+			p.aim_x = v.target_x;
+			p.aim_y = v.target_y;
+			// TO DO: desired weapon
 		}
+		seen.handle = perAvatar.Handle (i);
+		seen.on_map = p.on_map;
+		seen.to_x = p.map_x;
+		seen.to_y = p.map_y;
+		seen.aim_x = p.aim_x;
+		seen.aim_y = p.aim_y;
+		seen.token = TokenOf (i);
+
+		// Keep the grid up to date. Only avatars that moved are re-bucketed.
+		int slot = perAvatar.Slot (i);
+		if (! p.on_map)
+			avatarGrid.Remove (slot);
+		else if (! avatarGrid.Contains (slot) || seen.to_x != seen.from_x || seen.to_y != seen.from_y)
+			avatarGrid.Move (slot, p.map_x, p.map_y);
+		influence.Track (slot, p.team_assignment, p.on_map, p.map_x, p.map_y);
+	}
+	influence.Step ();
+	ResolveShots ();
+
+	// Plan the routes asked for this tick, and hand them over now, so that
+	// no requests are left waiting between ticks, where saved state
+	// wouldn't include them.
+	if (deterministic) {
+		paths.RunAll ();
+		TakeRoutes ();
 	}
+	sim_tick++;
+	history.Record (sim_tick, perAvatar);
+	start = microseconds ();
+	if (rollback.size() > 0)
+		SaveState ();
+	if (recorder)
+		recorder->Finished (*this);
+	serialize_us += microseconds () - start;
+
+	if (! headless)
+		BuildView ();
 }
 
-// Displays map and objects.
-// target should already be selected on function entry.
-void Scenario::Display (ALLEGRO_BITMAP * target) {
-	al_draw_bitmap (background, 0, 0, 0);
+// Hands finished routes to the avatars that asked for them.
+// Only the first MAX_WAYPOINTS of a route are kept; the rest is asked for
+// again once those have been followed.
+void Scenario::TakeRoutes () {
+	paths.TakeResults (path_results);
+	int r;
+	for (r = 0; r < (signed) path_results.size(); r++) {
+		const PathFinder::Result & result = path_results[r];
+		if (perAvatar.Index (result.who) < 0)
+			continue;  // avatar has left
+		Route & route = routes[result.who.slot];
+		if (route.serial != result.serial)
+			continue;  // goal has changed since
+		int count = (signed) result.points.size();
+		route.serial = 0;
+		route.partial = count > MAX_WAYPOINTS;
+		route.count = route.partial ? (int) MAX_WAYPOINTS : count;
+		std::copy (result.points.begin(), result.points.begin() + route.count, route.points);
+		route.next = 0;
+	}
+}
+
+// Puts an avatar on the team it asked for, and on the map if it isn't
+// yet (team 0 takes it off). This is the scenario's half of the control
+// protocol (see StateAvatarScenario.h); clients learn of it in snapshots.
+// An avatar that finds no open pixel stays off the map, and tries again
+// next tick.
+void Scenario::Join (int i) {
+	StateScenarioAvatar & p = perAvatar.scenario_p (i);
+	int team = perAvatar.avatar_v (i).join_team;
+	p.team_assignment = team;
+	if (team == 0) {
+		p.on_map = false;
+		return;
+	}
+	if (p.on_map)
+		return;  // changing sides where it stands
+	float x, y;
+	if (! FindSpawn (perAvatar.Slot (i), x, y))
+		return;
+	p.map_x = p.aim_x = x;
+	p.map_y = p.aim_y = y;
+	p.on_map = true;
+	routes[perAvatar.Slot (i)] = Route ();
+}
+
+// Picks an open pixel for the avatar in a slot to spawn at: one of a few
+// spots scattered by slot and tick, or else the first open pixel, row by
+// row. Depends only on the map, slot and tick, so peers pick the same.
+// Returns false if the whole map is blocked.
+bool Scenario::FindSpawn (int slot, float & x, float & y) const {
+	int width = collision.get_width ();
+	int height = collision.get_height ();
+	uint32_t seed = (uint32_t) slot * 2654435761u ^ (uint32_t) sim_tick * 40503u;
+	int px, py;
+	int t;
+	for (t = 0; t < SPAWN_TRIES && width > 0 && height > 0; t++) {
+		seed = seed * 1664525u + 1013904223u;
+		px = (int) ((seed >> 8) % (uint32_t) width);
+		seed = seed * 1664525u + 1013904223u;
+		py = (int) ((seed >> 8) % (uint32_t) height);
+		if (! collision.Blocked (0, px, py)) {
+			x = px + 0.5f;
+			y = py + 0.5f;
+			return true;
+		}
+	}
+	for (py = 0; py < height; py++) {
+		for (px = 0; px < width; px++) {
+			if (! collision.Blocked (0, px, py)) {
+				x = px + 0.5f;
+				y = py + 0.5f;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Moves an avatar toward its motion goal: straight if nothing is in
+// the way, else by a shared flow field or a route of its own.
+// A route is only asked for if no flow field is, or soon will be, on hand;
+// until one arrives the avatar heads straight for the goal.
+void Scenario::FollowRoute (int i) {
+	StateScenarioAvatar & p = perAvatar.scenario_p (i);
+	const StateAvatarScenario & v = perAvatar.avatar_v (i);
+	Route & route = routes[perAvatar.Slot (i)];
+	if (v.motion_goal_x != route.goal_x || v.motion_goal_y != route.goal_y) {
+		route = Route ();
+		route.goal_x = v.motion_goal_x;
+		route.goal_y = v.motion_goal_y;
+		route.direct = collision.SegmentClear (p.map_x, p.map_y, route.goal_x, route.goal_y);
+	}
+
+	if (! route.direct) {
+		float x, y;
+		FlowFieldCache::Steering steer = FlowFieldCache::STEER_NONE;
+		if (! Replayable ())
+			steer = flows.Steer (route.goal_x, route.goal_y, p.map_x, p.map_y, x, y);
+		if (steer == FlowFieldCache::STEER_MOVE) {
+			MoveAvatar (p, x, y);
+			return;
+		}
+		if (steer == FlowFieldCache::STEER_NONE && ! route.requested) {
+			route.requested = true;
+			route.serial = ++path_serial;
+			paths.Request (perAvatar.Handle (i), route.serial, p.map_x, p.map_y, route.goal_x, route.goal_y);
+		}
+	}
+
+	if (route.next < route.count) {
+		const PathFinder::Waypoint & w = route.points[route.next];
+		if (MoveAvatar (p, w.x, w.y)) {
+			route.next++;
+			if (route.next == route.count && route.partial)
+				route.requested = false;  // ask for the rest
+		}
+	} else
+		MoveAvatar (p, route.goal_x, route.goal_y);
+}
+
+// Moves an avatar as a tick would, for a client predicting its own player.
+// Intentions are quantized as the server will have them (deterministic
+// servers quantize everyone's; others get them through Lockstep::ReadInput).
+void Scenario::PredictStep (StateScenarioAvatar & p, const StateAvatarScenario & v) const {
+	if (! p.on_map || ! v.playing)
+		return;
+	StateAvatarScenario q = v;
+	Lockstep::QuantizeInput (q);
+	MoveAvatar (p, q.motion_goal_x, q.motion_goal_y);
+}
+
+// Fires the shots avatars intend, and notes the hits.
+// Shots only look at where avatars are and were, and change nothing, so
+// the order they are fired in doesn't matter.
+void Scenario::ResolveShots () {
+	int n;
+	for (n = 0; n < (signed) order.size(); n++) {
+		int i = order[n];
+		const StateScenarioAvatar & p = perAvatar.scenario_p (i);
+		const StateAvatarScenario & v = perAvatar.avatar_v (i);
+		if (! p.on_map || ! v.playing || ! v.fire_impulse)
+			continue;
+		Hit hit;
+		if (Shoot (i, v.fire_rewind < max_rewind ? v.fire_rewind : max_rewind, hit))
+			hits.push_back (hit);
+	}
+}
+
+// The first avatar an avatar's shot hits, judged rewind ticks back.
+// The shot goes WEAPON_RANGE pixels from the shooter toward its target.
+// Candidates are found around the line by where avatars are now, widened
+// by how far they could have moved since the tick being judged; each is
+// then tested where it was at that tick. Walls stop shots, and team-mates
+// aren't hit. If the tick is no longer kept (e.g., just after a replay
+// keyframe was loaded), shots are judged by where avatars are now.
+bool Scenario::Shoot (int i, int rewind, Hit & hit) {
+	const StateScenarioAvatar & p = perAvatar.scenario_p (i);
+	const StateAvatarScenario & v = perAvatar.avatar_v (i);
+	float dx = v.target_x - p.map_x;
+	float dy = v.target_y - p.map_y;
+	float length = sqrt (dx * dx + dy * dy);
+	if (length <= 0)
+		return false;
+	dx *= WEAPON_RANGE / length;
+	dy *= WEAPON_RANGE / length;
+	float x0 = p.map_x, y0 = p.map_y;
+	float x1 = x0 + dx, y1 = y0 + dy;
+
+	int seen_tick = sim_tick - rewind;
+	bool rewound = history.Has (seen_tick);
+	float margin = HIT_RADIUS + (rewound ? rewind + 1 : 0) * (float) AVATAR_SPEED;
+	shot_candidates.clear ();
+	FindAvatarsIn ((x0 < x1 ? x0 : x1) - margin, (y0 < y1 ? y0 : y1) - margin,
+		(x0 > x1 ? x0 : x1) + margin, (y0 > y1 ? y0 : y1) + margin, shot_candidates);
+
+	AvatarHandle shooter = perAvatar.Handle (i);
+	float best = 2;  // How far along the line the nearest hit is. (0 to 1)
+	int c;
+	for (c = 0; c < (signed) shot_candidates.size(); c++) {
+		AvatarHandle who = shot_candidates[c];
+		int k = perAvatar.Index (who);
+		if (who == shooter || k < 0)
+			continue;
+		const StateScenarioAvatar & q = perAvatar.scenario_p (k);
+		if (q.team_assignment != 0 && q.team_assignment == p.team_assignment)
+			continue;
+		float x = q.map_x, y = q.map_y;
+		if (rewound) {
+			const PositionHistory::Entry * e = history.Find (seen_tick, who);
+			if (! e)
+				continue;  // wasn't on the map then
+			x = e->x;
+			y = e->y;
+		}
+
+		// Nearest point on the line to the avatar.
+		float t = clamp (((x - x0) * dx + (y - y0) * dy) / (float) (WEAPON_RANGE * WEAPON_RANGE), 0.0f, 1.0f);
+		float ex = x0 + t * dx - x;
+		float ey = y0 + t * dy - y;
+		if (t >= best || ex * ex + ey * ey > HIT_RADIUS * HIT_RADIUS)
+			continue;
+		if (! collision.SegmentClear (x0, y0, x0 + t * dx, y0 + t * dy))
+			continue;
+		best = t;
+		hit.target = who;
+		hit.x = x;
+		hit.y = y;
+	}
+	if (best > 1)
+		return false;
+	hit.shooter = shooter;
+	hit.seen_tick = rewound ? seen_tick : sim_tick;
+	return true;
+}
+
+// Moves an avatar up to AVATAR_SPEED toward (x,y), stopping at walls.
+// A blocked diagonal move slides along whichever axis is clear.
+// Returns true if the avatar got to (x,y).
+bool Scenario::MoveAvatar (StateScenarioAvatar & p, float x, float y) const {
+	if (deterministic)
+		return MoveAvatarFixed (p, x, y);
+	float dx = x - p.map_x;
+	float dy = y - p.map_y;
+	float distance = sqrt (dx * dx + dy * dy);
+	if (distance <= 0)
+		return true;
+	bool arriving = distance <= AVATAR_SPEED;
+	if (! arriving) {
+		dx *= AVATAR_SPEED / distance;
+		dy *= AVATAR_SPEED / distance;
+	}
+	if (collision.SegmentClear (p.map_x, p.map_y, p.map_x + dx, p.map_y + dy)) {
+		p.map_x += dx;
+		p.map_y += dy;
+		return arriving;
+	}
+	if (dx != 0 && collision.SegmentClear (p.map_x, p.map_y, p.map_x + dx, p.map_y))
+		p.map_x += dx;
+	else if (dy != 0 && collision.SegmentClear (p.map_x, p.map_y, p.map_x, p.map_y + dy))
+		p.map_y += dy;
+	return false;
+}
+
+// Scales v by num / den (all non-negative but v), rounding toward zero
+// whatever v's sign.
+static int64_t ScaleToward0 (int64_t v, int64_t num, int64_t den) {
+	return v >= 0 ? v * num / den : -(-v * num / den);
+}
+
+// MoveAvatar in deterministic mode: the same, in fixed point.
+// Positions are always whole fixed values, so converting them back and
+// forth loses nothing.
+bool Scenario::MoveAvatarFixed (StateScenarioAvatar & p, float x, float y) const {
+	fixed px = to_fixed (p.map_x), py = to_fixed (p.map_y);
+	int64_t dx = (int64_t) to_fixed (x) - px;
+	int64_t dy = (int64_t) to_fixed (y) - py;
+	if (dx == 0 && dy == 0)
+		return true;
+	const int64_t speed = AVATAR_SPEED * FIXED_ONE;
+	int64_t distance = isqrt64 ((uint64_t) (dx * dx + dy * dy));
+	bool arriving = distance <= speed;
+	if (! arriving) {
+		dx = ScaleToward0 (dx, speed, distance);
+		dy = ScaleToward0 (dy, speed, distance);
+	}
+	fixed nx = px + (fixed) dx, ny = py + (fixed) dy;
+	if (StepClear (px, py, nx, ny)) {
+		p.map_x = to_float (nx);
+		p.map_y = to_float (ny);
+		return arriving;
+	}
+	if (dx != 0 && StepClear (px, py, nx, py))
+		p.map_x = to_float (nx);
+	else if (dy != 0 && StepClear (px, py, px, ny))
+		p.map_y = to_float (ny);
+	return false;
+}
+
+// Are the pixels at the middle and end of a short step open?
+// (Steps are at most AVATAR_SPEED pixels, so these are at most a pixel apart.)
+bool Scenario::StepClear (fixed x0, fixed y0, fixed x1, fixed y1) const {
+	fixed mx = x0 + (x1 - x0) / 2, my = y0 + (y1 - y0) / 2;
+	return ! collision.Blocked (0, fixed_pixel (mx), fixed_pixel (my)) &&
+		! collision.Blocked (0, fixed_pixel (x1), fixed_pixel (y1));
+}
+
+// Sorts the tick's avatar views by grid cell into the view being built.
+// (A counting sort: count per cell, prefix-sum into cell_start, then place.)
+void Scenario::BuildView () {
+	ScenarioView & view = views.Back ();
+	int cells = avatarGrid.cell_count ();
+	view.columns = avatarGrid.get_columns ();
+	view.rows = avatarGrid.get_rows ();
+	view.cell_size = avatarGrid.get_cell_size ();
+	view.cell_start.assign (cells + 1, 0);
+
 	int i;
-	for (i = 0; i < (signed) perAvatar.size(); i++) {
-		// Only display avatar if actually on map.
-		if (perAvatar[i].p.on_map) {
-			// TO DO: display avatar
+	for (i = 0; i < (signed) tick_views.size(); i++) {
+		if (tick_views[i].on_map)
+			view.cell_start[avatarGrid.CellOf (tick_views[i].handle.slot) + 1]++;
+	}
+	int c;
+	for (c = 0; c < cells; c++)
+		view.cell_start[c + 1] += view.cell_start[c];
+
+	view.avatars.resize (view.cell_start[cells]);
+	view_cursor.assign (view.cell_start.begin(), view.cell_start.end() - 1);
+	for (i = 0; i < (signed) tick_views.size(); i++) {
+		if (tick_views[i].on_map)
+			view.avatars[view_cursor[avatarGrid.CellOf (tick_views[i].handle.slot)]++] = tick_views[i];
+	}
+}
+
+// Range of cells covering [x0,x1] x [y0,y1], clamped to the grid.
+void Scenario::ScenarioView::Cells (float x0, float y0, float x1, float y1,
+		int & c0, int & r0, int & c1, int & r1) const {
+	c0 = (int) (x0 / cell_size);
+	r0 = (int) (y0 / cell_size);
+	c1 = (int) (x1 / cell_size);
+	r1 = (int) (y1 / cell_size);
+	if (c0 < 0) c0 = 0;
+	if (r0 < 0) r0 = 0;
+	if (c1 >= columns) c1 = columns - 1;
+	if (r1 >= rows) r1 = rows - 1;
+}
+
+// Hands the state of the latest tick to the renderer.
+// lag is how far (0 to 1) real time has already moved into the next tick.
+// Call from the simulation thread, after one or more SimTicks.
+void Scenario::PublishView (float lag, double step_length) {
+	ScenarioView & view = views.Back ();
+	view.published_at = al_get_time ();
+	view.step_length = step_length;
+	view.lag = lag;
+	views.Publish ();
+}
+
+// Picks up the latest published view for display.
+// Returns the interpolation alpha to display it with at time now.
+// Call from the render thread.
+float Scenario::AcquireView (double now) {
+	views.Update ();
+	const ScenarioView & view = views.Front ();
+	float alpha = view.lag + (float) ((now - view.published_at) / view.step_length);
+	// Never extrapolate past the latest tick.
+	if (alpha > 1.0f)
+		alpha = 1.0f;
+	if (alpha < 0.0f)
+		alpha = 0.0f;
+	return alpha;
+}
+
+// Displays map and objects, alpha of the way from the previous tick
+// to the latest one. Only objects within the visible map rectangle
+// [x0,x1] x [y0,y1] are drawn; the background at the level of detail for
+// zoom (display pixels per map pixel). The selected avatar, if on view,
+// is ringed, a constant size on the display.
+// target should already be selected on function entry.
+void Scenario::Display (ALLEGRO_BITMAP * target, float alpha, float x0, float y0, float x1, float y1, float zoom,
+	AvatarHandle selected) {
+	background.Draw (x0, y0, x1, y1, zoom);
+	// Only the published view is safe to read here; the simulation
+	// thread may be partway through a tick.
+	// The view only holds avatars on the map, grouped by cell, so only
+	// the cells overlapping the visible rectangle need to be visited.
+	const ScenarioView & view = views.Front ();
+	if (view.cell_start.size() == 0)
+		return;
+
+	// A token can reach into view from an avatar just outside it, so the
+	// cells are those overlapping the rectangle grown by token_reach; each
+	// avatar's own token is then checked against the rectangle.
+	int c0, r0, c1, r1;
+	view.Cells (x0 - token_reach, y0 - token_reach, x1 + token_reach, y1 + token_reach, c0, r0, c1, r1);
+
+	// Each avatar's animation starts at a different frame, so that they
+	// don't all flap in step. A token faces right (+x) in its image, and is
+	// turned toward where the avatar aims.
+	int clock = (int) (al_get_time () * ANIMATION_FPS);
+	token_draws.clear ();
+	bool ringed = false;
+	float ring_x = 0, ring_y = 0;
+	int r, c, i;
+	for (r = r0; r <= r1; r++) {
+		for (c = c0; c <= c1; c++) {
+			int cell = r * view.columns + c;
+			for (i = view.cell_start[cell]; i < view.cell_start[cell + 1]; i++) {
+				const AvatarView & seen = view.avatars[i];
+				float x = seen.from_x + (seen.to_x - seen.from_x) * alpha;
+				float y = seen.from_y + (seen.to_y - seen.from_y) * alpha;
+				if (seen.handle == selected) {
+					ringed = true;
+					ring_x = x;
+					ring_y = y;
+				}
+				if (seen.token < 0)
+					continue;
+				const Token & token = tokens[seen.token];
+				const std::vector<int> & frames = token.animations[token.shown];
+				int sprite = frames[(clock + seen.handle.slot) % frames.size()];
+				ALLEGRO_BITMAP * image = atlas.get_sprite (sprite);
+				if (! image)
+					continue;
+				float w = (float) al_get_bitmap_width (image);
+				float h = (float) al_get_bitmap_height (image);
+				float reach = sqrt (w * w + h * h) / 2;
+				if (x + reach < x0 || x - reach > x1 || y + reach < y0 || y - reach > y1)
+					continue;
+				TokenDraw draw;
+				draw.page = atlas.get_page (sprite);
+				draw.image = image;
+				draw.x = x;
+				draw.y = y;
+				draw.angle = seen.aim_x != x || seen.aim_y != y ? atan2 (seen.aim_y - y, seen.aim_x - x) : 0;
+				draw.found = (signed) token_draws.size();
+				token_draws.push_back (draw);
+			}
 		}
 	}
+
+	// Tokens are sub-bitmaps of a few atlas pages. Held drawing is sent
+	// whenever the page changes, so tokens are drawn a page at a time (in
+	// cell order within a page): one batch per page on view.
+	std::sort (token_draws.begin(), token_draws.end());
+	al_hold_bitmap_drawing (true);
+	for (i = 0; i < (signed) token_draws.size(); i++) {
+		const TokenDraw & draw = token_draws[i];
+		al_draw_rotated_bitmap (draw.image, al_get_bitmap_width (draw.image) / 2.0f,
+			al_get_bitmap_height (draw.image) / 2.0f, draw.x, draw.y, draw.angle, 0);
+	}
+	al_hold_bitmap_drawing (false);
+
+	if (ringed)
+		al_draw_circle (ring_x, ring_y, SELECTION_RADIUS / zoom, al_map_rgb (255, 255, 0), 2 / zoom);
+}
+
+// The displayed avatar nearest to (x,y), if within radius.
+// Call from the render thread.
+AvatarHandle Scenario::PickAvatar (float x, float y, float radius) const {
+	AvatarHandle picked;
+	const ScenarioView & view = views.Front ();
+	if (view.cell_start.size() == 0)
+		return picked;
+	float best = radius * radius;
+	int c0, r0, c1, r1;
+	view.Cells (x - radius, y - radius, x + radius, y + radius, c0, r0, c1, r1);
+	int r, c, i;
+	for (r = r0; r <= r1; r++) {
+		for (c = c0; c <= c1; c++) {
+			int cell = r * view.columns + c;
+			for (i = view.cell_start[cell]; i < view.cell_start[cell + 1]; i++) {
+				const AvatarView & seen = view.avatars[i];
+				float dx = seen.to_x - x;
+				float dy = seen.to_y - y;
+				if (dx * dx + dy * dy <= best) {
+					best = dx * dx + dy * dy;
+					picked = seen.handle;
+				}
+			}
+		}
+	}
+	return picked;
 }
 
 // Loads a play area image.
 // All play area images should have the same dimensions.
-ALLEGRO_BITMAP * Scenario::LoadAreaImage (std::string file_name) {
-	ALLEGRO_BITMAP * bitmap = al_load_bitmap (file_name.c_str());
+// If the image is not required, a missing file is not an error.
+// An image preloaded by loader is taken from it.
+ALLEGRO_BITMAP * Scenario::LoadAreaImage (std::string file_name, bool required, AssetLoader * loader) {
+	ALLEGRO_BITMAP * bitmap = loader && loader->Has (file_name) ?
+		loader->TakeImage (file_name) : al_load_bitmap (file_name.c_str());
 	if (! bitmap) {
-		warning (this, "Can't load %s", file_name.c_str());
-		breakpoint ();
-	}
-	if (area_width <= 0) {
-		// Set area width and height
-		area_width = al_get_bitmap_width (bitmap);
-		area_height = al_get_bitmap_height (bitmap);
-	} else {
-		// Compare width and height with previously-loaded bitmap.
-		if (al_get_bitmap_width (bitmap) != area_width ||
-				al_get_bitmap_height (bitmap) != area_height) {
-			warning (this, "Image %s dimensions (%d, %d) don't match initial (%d, %d)",
-				file_name.c_str(), al_get_bitmap_width (bitmap),
-				al_get_bitmap_height (bitmap), area_width, area_height);
+		if (required) {
+			warning (this, "Can't load %s", file_name.c_str());
 			breakpoint ();
 		}
+		return NULL;
 	}
+	CheckAreaSize (file_name, al_get_bitmap_width (bitmap), al_get_bitmap_height (bitmap));
 	return bitmap;
 }
+
+// Adds what a scenario will load to loader, to be loaded in parallel
+// before it is made: the background (unless already cut into tiles),
+// token frames, the paths image, and the scripts of every avatar type in
+// avatars/.
+void Scenario::Preload (AssetLoader & loader, std::string name, std::string dropbox, bool headless) {
+	std::string image_folder = dropbox + "scenarios/" + name + "/";
+	if (! headless) {
+		if (! TiledBackground::IsCut (image_folder))
+			loader.AddImage (image_folder + "background.png");
+		std::vector<TokenFile> files;
+		FindTokenFiles (dropbox + "avatars/", files);
+		int i;
+		for (i = 0; i < (signed) files.size(); i++)
+			loader.AddImage (files[i].path);
+	}
+	loader.AddImage (image_folder + "paths.png");
+	std::vector<std::string> types;
+	ListFolder ("avatars/", true, types);
+	int t;
+	for (t = 0; t < (signed) types.size(); t++)
+		loader.AddScript (std::string("avatars/") + types[t] + "/script.txt");
+}
+
+// A new copy of an avatar type's script (avatars/TYPE/script.txt), parsed
+// the first time the type is asked for, unless preloaded.
+Script * Scenario::MakeAvatarScript (std::string avatar_type) {
+	std::map<std::string, Script*>::iterator found = avatar_scripts.find (avatar_type);
+	if (found == avatar_scripts.end ()) {
+		Script * script = new Script (std::string("avatars/") + avatar_type + "/script.txt");
+		found = avatar_scripts.insert (std::make_pair (avatar_type, script)).first;
+	}
+	return new Script (*found->second);
+}
+
+// Loads avatar token images: avatars/TYPE/ANIM_NAMEx.png is frame x of
+// animation ANIM_NAME of avatar type TYPE. Frames are loaded into memory
+// (or taken from loader), and packed into the atlas together. A missing
+// folder means no tokens.
+void Scenario::LoadTokens (std::string folder, AssetLoader * loader) {
+	std::vector<TokenFile> files;
+	FindTokenFiles (folder, files);
+
+	// Type -> animation name -> frame number -> sprite.
+	std::map<std::string, std::map<std::string, std::map<int, int> > > frames;
+	int flags = al_get_new_bitmap_flags ();
+	al_set_new_bitmap_flags (ALLEGRO_MEMORY_BITMAP);
+	int i;
+	for (i = 0; i < (signed) files.size(); i++) {
+		const TokenFile & file = files[i];
+		ALLEGRO_BITMAP * image = loader && loader->Has (file.path) ?
+			loader->TakeImage (file.path) : al_load_bitmap (file.path.c_str());
+		if (! image) {
+			warning (this, "Can't load %s", file.path.c_str());
+			breakpoint ();
+			continue;
+		}
+		frames[file.type][file.animation][file.frame] = atlas.Add (image);
+	}
+	al_set_new_bitmap_flags (flags);
+
+	std::map<std::string, std::map<std::string, std::map<int, int> > >::iterator t;
+	for (t = frames.begin(); t != frames.end(); t++) {
+		Token token;
+		token.shown = 0;
+		std::map<std::string, std::map<int, int> >::iterator a;
+		for (a = t->second.begin(); a != t->second.end(); a++) {
+			if (a->first == "idle")
+				token.shown = (signed) token.animations.size();
+			token.animation_names.push_back (a->first);
+			token.animations.push_back (std::vector<int> ());
+			std::map<int, int>::iterator f;
+			for (f = a->second.begin(); f != a->second.end(); f++)
+				token.animations.back().push_back (f->second);
+		}
+		token_types[t->first] = (signed) tokens.size();
+		tokens.push_back (token);
+	}
+	atlas.Pack ();
+
+	int sprite;
+	for (sprite = 0; sprite < atlas.sprite_count (); sprite++) {
+		ALLEGRO_BITMAP * image = atlas.get_sprite (sprite);
+		if (! image)
+			continue;
+		float w = (float) al_get_bitmap_width (image);
+		float h = (float) al_get_bitmap_height (image);
+		token_reach = std::max (token_reach, (float) sqrt (w * w + h * h) / 2);
+	}
+}
+
+// The token of the avatar at a dense index, looked up by type the first
+// time, once Avatar::Make has set the type. (-1=none)
+int Scenario::TokenOf (int i) {
+	int slot = perAvatar.Slot (i);
+	if (slot_tokens[slot] == -2) {
+		std::map<std::string, int>::const_iterator found = token_types.find (perAvatar.avatar (i)->get_avatar_type ());
+		slot_tokens[slot] = found != token_types.end () ? found->second : -1;
+	}
+	return slot_tokens[slot];
+}
+
+// Sets the play area size from the first image, and checks later ones
+// against it.
+void Scenario::CheckAreaSize (std::string file_name, int width, int height) {
+	if (area_width <= 0) {
+		// Set area width and height
+		area_width = width;
+		area_height = height;
+	} else if (width != area_width || height != area_height) {
+		// Compare width and height with previously-loaded image.
+		warning (this, "Image %s dimensions (%d, %d) don't match initial (%d, %d)",
+			file_name.c_str(), width, height, area_width, area_height);
+		breakpoint ();
+	}
+}
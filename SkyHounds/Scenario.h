@@ -6,63 +6,446 @@ and avatar information.
 #ifndef SCENARIO_H
 #define SCENARIO_H
 
+#include "AIScheduler.h"
+#include "AssetLoader.h"
 #include "Avatar.h"
+#include "AvatarStore.h"
+#include "CollisionMap.h"
+#include "Fixed.h"
+#include "FlowFieldCache.h"
+#include "InfluenceMap.h"
 #include "MemoryPool.h"
+#include "PathFinder.h"
+#include "PositionHistory.h"
+#include "Replay.h"
+#include "RollbackRing.h"
+#include "SpatialGrid.h"
+#include "SpriteAtlas.h"
 #include "StateAvatarScenario.h"
+#include "ThreadPool.h"
+#include "TiledBackground.h"
+#include "TripleBuffer.h"
 
 class Scenario : public MemoryPool {
-	ALLEGRO_BITMAP * background;
-	ALLEGRO_BITMAP * paths_image;
+	TiledBackground background;
 	int area_width, area_height;
 
-	struct PerAvatar {
-		Avatar * avatar;
-		StateScenarioAvatar p;
-		StateAvatarScenario v;
-		PerAvatar (Avatar *_avatar) : avatar(_avatar) { }
+	// Where avatars can move, decoded from the paths image.
+	CollisionMap collision;
+
+	// How far an avatar moves toward its motion goal in one tick, in pixels.
+	enum { AVATAR_SPEED = 2 };
+
+	// Scattered spots tried for a joining avatar before scanning for one.
+	enum { SPAWN_TRIES = 16 };
+
+	// Routes around walls, planned in the background.
+	PathFinder paths;
+	double path_budget;  // Seconds of path finding allowed per tick.
+	int path_serial;     // Number of the latest route request.
+	int path_edits;      // Times the paths have been edited.
+
+	// Where an avatar is heading, keyed by handle slot.
+	// Plain data, so that routes are saved with the rest of the state.
+	enum { MAX_WAYPOINTS = 16 };
+	struct Route {
+		float goal_x, goal_y;  // Motion goal the route is for. (-1=none yet)
+		bool direct;           // Was the goal in plain sight when it was set?
+		bool requested;        // Has a route been asked for?
+		bool partial;          // Was the route longer than points holds?
+		int serial;            // Request awaiting an answer. (0=none)
+		PathFinder::Waypoint points[MAX_WAYPOINTS];
+		int count;             // Waypoints in points.
+		int next;              // Index of the waypoint being headed for.
+		Route () : goal_x(-1), goal_y(-1), direct(true), requested(false), partial(false), serial(0), count(0), next(0) { }
+	};
+	std::vector<Route> routes;
+	std::vector<PathFinder::Result> path_results;
+
+	// Shared steering toward goals many avatars are heading for.
+	FlowFieldCache flows;
+	double flow_budget;  // Seconds of flow field work allowed per tick.
+
+	// Team presence and sight, for AI.
+	InfluenceMap influence;
+
+	// Which avatars think each tick.
+	AIScheduler thinking;
+
+	// Per-avatar state, in parallel arrays indexed by dense index.
+	AvatarStore perAvatar;
+
+	// In deterministic mode, ticks give the same result on every machine
+	// (see SetDeterministic).
+	bool deterministic;
+	int sim_tick;                 // Ticks run so far.
+	std::vector<int> order;       // Dense indices in the order movements are resolved.
+
+	// Work allowed per tick in deterministic mode, in place of time budgets.
+	enum { DETERMINISTIC_FLOW_STEPS = 20000 };
+	enum { DETERMINISTIC_THINKERS = 16 };
+
+	// The state after each of the last few ticks (see SetRollbackTicks).
+	RollbackRing rollback;
+
+	// Where inputs are recorded. (NULL=not recording)
+	ReplayWriter * recorder;
+
+	// Microseconds the latest tick spent saving rollback state and
+	// recording the replay.
+	int64_t serialize_us;
+
+	// Worker threads for avatar time-steps. (NULL=run serially)
+	ThreadPool * sim_pool;
+
+	// Avatars on the map, keyed by handle slot.
+	// Only changes while movements are resolved, so avatars may query it.
+	SpatialGrid avatarGrid;
+	enum { AVATAR_GRID_CELL = 64 };
+
+	// Where avatars were over the last few ticks, for judging shots by
+	// what the shooter saw (see SetMaxRewind).
+	PositionHistory history;
+	int max_rewind;               // Most ticks a shot is judged back in time.
+
+	// Shots reach WEAPON_RANGE pixels, and hit avatars within HIT_RADIUS
+	// pixels of their line.
+	enum { WEAPON_RANGE = 400 };
+	enum { HIT_RADIUS = 8 };
+
+	// What the renderer sees of an avatar: where it was at the last two ticks.
+	struct AvatarView {
+		AvatarHandle handle;
+		bool on_map;
+		float from_x, from_y;  // Position at the previous tick.
+		float to_x, to_y;      // Position at the latest tick.
+		float aim_x, aim_y;
+		int token;             // Index into tokens. (-1=none)
+	};
+
+	// Everything the renderer needs from the latest tick.
+	// Avatars on the map are grouped by avatarGrid cell: cell c holds
+	// avatars[cell_start[c]] up to (not including) avatars[cell_start[c+1]].
+	struct ScenarioView {
+		std::vector<AvatarView> avatars;
+		std::vector<int> cell_start;
+		int columns, rows;
+		float cell_size;
+		double published_at;   // al_get_time() at publication.
+		double step_length;    // Seconds per tick.
+		float lag;             // Fraction of a tick already elapsed at publication.
+		ScenarioView () : columns(0), rows(0), cell_size(1), published_at(0), step_length(1), lag(0) { }
+
+		// Range of cells covering [x0,x1] x [y0,y1], clamped to the grid.
+		void Cells (float x0, float y0, float x1, float y1, int & c0, int & r0, int & c1, int & r1) const;
 	};
-	std::vector<PerAvatar> perAvatar;
-	std::map<Avatar*,int> perAvatarIndex;
+
+	// Avatar token images: every frame of every avatar type's animations,
+	// packed into one atlas (see LoadTokens). Loaded for display only, and
+	// never changed after.
+	struct Token {
+		std::vector<std::string> animation_names;
+		std::vector<std::vector<int> > animations;  // Sprites, frame by frame.
+		int shown;             // Animation drawn ("idle", if there is one).
+	};
+	SpriteAtlas atlas;
+	std::vector<Token> tokens;
+	std::map<std::string, int> token_types;  // Avatar type -> index into tokens.
+	std::vector<int> slot_tokens;            // By slot. (-1=none, -2=not looked up)
+	float token_reach;     // Farthest any frame reaches from its centre, turned.
+
+	// Tokens on view, gathered by Display to be drawn a page at a time.
+	// Render thread only.
+	struct TokenDraw {
+		int page;
+		ALLEGRO_BITMAP * image;
+		float x, y, angle;
+		int found;             // Order it was found in, among those on view.
+		bool operator< (const TokenDraw & d) const { return page != d.page ? page < d.page : found < d.found; }
+	};
+	std::vector<TokenDraw> token_draws;
+
+	// Avatar scripts by type, parsed once (see MakeAvatarScript).
+	std::map<std::string, Script*> avatar_scripts;
+
+	// Frames per second of token animations.
+	enum { ANIMATION_FPS = 10 };
+
+	// Radius of the ring round the selected avatar, in display pixels.
+	enum { SELECTION_RADIUS = 20 };
+
+	// Views are filled in by the simulation thread and read by the render thread.
+	// A headless scenario has no render thread, so builds none.
+	TripleBuffer<ScenarioView> views;
+	bool headless;
+
+	// Scratch space for building views, in dense order / per cell.
+	std::vector<AvatarView> tick_views;
+	std::vector<int> view_cursor;
 
 public:
-	Scenario (std::string name, std::string dropbox);
+	// A shot that hit, in the latest tick.
+	struct Hit {
+		AvatarHandle shooter, target;
+		float x, y;           // Where the target was, as the shooter saw it.
+		int seen_tick;        // Tick the target was seen at.
+	};
+
+private:
+	std::vector<Hit> hits;
+	std::vector<AvatarHandle> shot_candidates;  // Scratch.
+
+public:
+	// A headless scenario loads only what the simulation needs (no background),
+	// and can run without a display; it builds no views to display (see
+	// PublishView). Files preloaded by loader (see
+	// Preload) are taken from it rather than loaded again.
+	Scenario (std::string name, std::string dropbox, bool headless = false, AssetLoader * loader = NULL);
+	virtual ~Scenario ();
+
+	// Adds the files a scenario will load to loader, so that they can be
+	// loaded in parallel before the scenario is made.
+	static void Preload (AssetLoader & loader, std::string name, std::string dropbox, bool headless = false);
+
+	// A new copy of an avatar type's script, for Avatar::Make. Each type's
+	// script is only read once.
+	Script * MakeAvatarScript (std::string avatar_type);
 
 	int get_map_width () const { return area_width; }
 	int get_map_height () const { return area_height; }
 
-	virtual void onBinding (MemoryBinding * thing) {
-		Avatar * avatar = dynamic_cast<Avatar*>(thing);
-		if (avatar) {
-			perAvatar.push_back (PerAvatar (avatar));
-			perAvatarIndex[avatar] = (signed) perAvatar.size() - 1;
-		}
+	// Where avatars can move. Never changes while avatars are running.
+	const CollisionMap & GetCollisionMap () const { return collision; }
+
+	// Team presence and sight as of the start of the tick.
+	// Read-only while avatars are running.
+	const InfluenceMap & GetInfluence () const { return influence; }
+
+	// Per-avatar state, e.g. for sending to clients. Read between ticks only.
+	const AvatarStore & GetAvatars () const { return perAvatar; }
+
+	// Adds an avatar to the scenario. Called by the Avatar constructor.
+	// (onBinding can't be used: during MemoryBinding construction the
+	// object is not yet an Avatar, so dynamic_cast<Avatar*> fails.)
+	AvatarHandle AddAvatar (Avatar * avatar) {
+		AvatarHandle handle = perAvatar.Add (avatar);
+		if ((signed) routes.size() <= handle.slot)
+			routes.resize (handle.slot + 1);
+		routes[handle.slot] = Route ();
+		if ((signed) slot_tokens.size() <= handle.slot)
+			slot_tokens.resize (handle.slot + 1);
+		slot_tokens[handle.slot] = -2;
+		thinking.Reset (handle.slot);
+		history.Reserve (handle.slot + 1);
+		if (recorder)
+			recorder->Joined (avatar);
+		return handle;
 	}
 
-	virtual void onDeleting (MemoryBinding * thing) {
-		Avatar * avatar = dynamic_cast<Avatar*>(thing);
-		if (avatar) {
-			perAvatar.erase (perAvatar.begin() + perAvatarIndex[avatar]);
-			perAvatarIndex.erase (avatar);
+	// Removes an avatar from the scenario. Called by the Avatar destructor.
+	void RemoveAvatar (AvatarHandle handle) {
+		if (perAvatar.Index (handle) >= 0) {
+			avatarGrid.Remove (handle.slot);
+			influence.Untrack (handle.slot);
+			if (recorder)
+				recorder->Left (handle);
+		}
+		if (! perAvatar.Remove (handle)) {
+			warning (this, "Removing stale avatar handle (%d, %d)", handle.slot, handle.generation);
+			breakpoint ();
 		}
 	}
 
+	// Sets how many threads run avatar time-steps. (0=one per core, 1=serial)
+	void SetSimThreads (int threads);
+
+	// Sets how many threads plan routes (0=plan on the simulation thread),
+	// and for how many seconds per tick they may run.
+	void SetPathThreads (int threads, double budget);
+
+	// Sets the most memory flow fields may use, in megabytes, and for how
+	// many seconds per tick they may be worked on.
+	void SetFlowFields (int megabytes, double budget);
+
+	// Sets the microseconds per tick avatars may spend thinking.
+	void SetAIBudget (long microseconds) { thinking.SetBudget (microseconds); }
+
+	// Sets the video memory background tiles may take.
+	// Call before the render thread starts.
+	void SetBackgroundBudget (int megabytes) { background.SetBudget (megabytes); }
+
+	// Updates the influence map on a thread of its own, or on the simulation thread.
+	void SetInfluenceThreaded (bool threaded) { influence.SetThreaded (threaded); }
+
+	// Makes each tick depend only on the state before it and the avatars'
+	// intentions, so that peers running the same inputs stay in step (see
+	// Lockstep). Call after the other Set functions; it overrides them.
+	void SetDeterministic (bool on);
+
+	// Ticks run so far.
+	int get_tick () const { return sim_tick; }
+
+	// Microseconds the latest tick spent serializing: saving its state for
+	// rollback, and recording the replay (see NetStats).
+	int64_t get_serialize_us () const { return serialize_us; }
+
+	// Avatars spawned on the map. Call between ticks.
+	int CountOnMap () const;
+
+	// A hash of the scenario's state (avatars in slot order), to compare
+	// with other peers after the same tick.
+	uint32_t Checksum () const;
+
+	// Keeps the state after each of the last ticks ticks, so that the
+	// scenario can be put back to one (RestoreState) and run forward again,
+	// e.g. with an input that arrived late. (0=keep none)
+	void SetRollbackTicks (int ticks);
+
+	// Puts the scenario back to how it was after a tick. Fails, changing
+	// nothing, if the tick is not kept, or if avatars have come or gone or
+	// the paths have been edited since. Call between ticks.
+	bool RestoreState (int tick);
+
+	// The same, with a block of state kept elsewhere (e.g., a replay
+	// keyframe). Call between ticks.
+	void WriteState (StateBlock & block) const;
+	bool ReadState (StateBlock & block);
+
+	// Records every tick's inputs, and avatars coming and going, into a
+	// replay (see Replay.h). Set it before adding avatars, and don't delete
+	// it while it is set. (NULL=stop recording)
+	void SetRecorder (ReplayWriter * _recorder) { recorder = _recorder; }
+
+	// Judges each shot by where its targets were on the shooter's display,
+	// up to this many ticks back (at most PositionHistory::TICKS - 1), so
+	// that a player with a slow connection hits what they aimed at.
+	// (0=judge shots by where everyone is now)
+	void SetMaxRewind (int ticks);
+
+	// How many ticks back to judge the shots of an avatar whose client was
+	// showing view_tick (see Player::ApplyInput). Call between ticks.
+	int RewindTicks (int view_tick) const;
+
+	// Shots that hit something in the latest tick.
+	const std::vector<Hit> & GetHits () const { return hits; }
+
+	// Makes the pixels in the box [x0,x1] x [y0,y1] walls or paths.
+	// Call between ticks, from the simulation thread.
+	void EditPaths (int x0, int y0, int x1, int y1, bool blocked);
+
 	// Receives information from an avatar.
+	// Takes effect at the end of the current tick (see AvatarStore).
 	void UpdateAvatarInfo (const StateAvatarScenario & v, Avatar * avatar);
 
 	// Returns avatars that have requested to join the given team.
 	std::vector<Avatar*> GetJoinList (int team_no);
 
+	// What the scenario says about an avatar, or NULL if the handle is stale.
+	const StateScenarioAvatar * GetAvatarState (AvatarHandle handle) const;
+
+	// An avatar's lasting state, or NULL if the handle is stale.
+	// While avatars are running, each may only use its own.
+	AvatarMemory * GetAvatarMemory (AvatarHandle handle);
+
+	// Spatial queries over avatars on the map. Results are appended to out.
+	// Positions only change between avatar time-steps, so these are safe to
+	// call from Avatar::SimTick.
+	void FindAvatarsNear (float x, float y, float radius, std::vector<AvatarHandle> & out) const;
+	void FindAvatarsIn (float x0, float y0, float x1, float y1, std::vector<AvatarHandle> & out) const;
+
+	// The k avatars nearest to (x,y), nearest first, no farther than max_radius.
+	// (k is limited to SpatialGrid::MAX_NEAREST.) Returns the number found.
+	int FindNearestAvatars (float x, float y, int k, float max_radius, std::vector<AvatarHandle> & out) const;
+
 	// Advances the scenario simulation by one time-step.
 	virtual void SimTick ();
 
-	// Displays map and objects.
+	// Moves an avatar as a tick would, for a client predicting its own
+	// player (see PlayerPredictor). Only straight moves are predicted: an
+	// avatar whose goal is out of sight slides along the wall until the
+	// server's route corrects it. Changes nothing in the scenario.
+	void PredictStep (StateScenarioAvatar & p, const StateAvatarScenario & v) const;
+
+	// Hands the state of the latest tick to the renderer.
+	// lag is how far (0 to 1) real time has already moved into the next tick.
+	// Call from the simulation thread, after one or more SimTicks.
+	void PublishView (float lag, double step_length);
+
+	// Picks up the latest published view for display.
+	// Returns the interpolation alpha to display it with at time now.
+	// Call from the render thread.
+	float AcquireView (double now);
+
+	// Displays map and objects, alpha of the way from the previous tick
+	// to the latest one. Only objects within the visible map rectangle
+	// [x0,x1] x [y0,y1] are drawn, at zoom display pixels per map pixel.
+	// The selected avatar, if on view, is ringed.
 	// target should already be selected on function entry.
-	void Display (ALLEGRO_BITMAP * target);
+	void Display (ALLEGRO_BITMAP * target, float alpha, float x0, float y0, float x1, float y1, float zoom,
+		AvatarHandle selected = AvatarHandle ());
+
+	// The displayed avatar nearest to (x,y), if within radius.
+	// Call from the render thread.
+	AvatarHandle PickAvatar (float x, float y, float radius) const;
 
 private:
+	// Can ticks be run again after RestoreState with the same result?
+	// Only deterministic ticks can.
+	bool Replayable () const { return deterministic && rollback.size() > 0; }
+
+	// Saves the state after the tick just run into the rollback ring.
+	void SaveState ();
+
+	// Hands finished routes to the avatars that asked for them.
+	void TakeRoutes ();
+
+	// Puts an avatar on the team it asked for, and on the map if it isn't
+	// yet (team 0 takes it off).
+	void Join (int i);
+
+	// Picks an open pixel for the avatar in a slot to spawn at.
+	// Returns false if the whole map is blocked.
+	bool FindSpawn (int slot, float & x, float & y) const;
+
+	// Moves an avatar toward its motion goal: straight if nothing is in
+	// the way, else by a shared flow field or a route of its own.
+	void FollowRoute (int i);
+
+	// Fires the shots avatars intend, and notes the hits.
+	void ResolveShots ();
+
+	// The first avatar an avatar's shot hits, judged rewind ticks back.
+	// Returns false if it hits nothing.
+	bool Shoot (int i, int rewind, Hit & hit);
+
+	// Moves an avatar up to AVATAR_SPEED toward (x,y), stopping at walls.
+	// A blocked diagonal move slides along whichever axis is clear.
+	// Returns true if the avatar got to (x,y).
+	bool MoveAvatar (StateScenarioAvatar & p, float x, float y) const;
+
+	// MoveAvatar in deterministic mode: the same, in fixed point.
+	bool MoveAvatarFixed (StateScenarioAvatar & p, float x, float y) const;
+
+	// Are the pixels at the middle and end of a short step open?
+	bool StepClear (fixed x0, fixed y0, fixed x1, fixed y1) const;
+
+	// Sorts the tick's avatar views by grid cell into the view being built.
+	void BuildView ();
+
 	// Loads a play area image.
 	// All play area images should have the same dimensions.
-	ALLEGRO_BITMAP * LoadAreaImage (std::string file_name);
+	// If the image is not required, a missing file is not an error.
+	ALLEGRO_BITMAP * LoadAreaImage (std::string file_name, bool required = true, AssetLoader * loader = NULL);
+
+	// Loads avatar token images from a folder of avatar type folders (or
+	// takes them from loader), and packs them.
+	void LoadTokens (std::string folder, AssetLoader * loader);
+
+	// The token of the avatar at a dense index. (-1=none)
+	int TokenOf (int i);
+
+	// Sets the play area size from the first image, or checks it.
+	void CheckAreaSize (std::string file_name, int width, int height);
 };
 
 #endif
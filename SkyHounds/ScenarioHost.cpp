@@ -0,0 +1,262 @@
+#include "libraries.h"
+
+#include "ScenarioHost.h"
+
+#include "Scenario.h"
+
+const float ScenarioHost::MIN_GAIN = 0.05f;
+const double ScenarioHost::MAX_SLEEP = 0.005;
+
+// Starts the given number of workers. (0=one per core)
+ScenarioHost::ScenarioHost (int threads)
+	: stopping(0), next_id(1), moves(0)
+{
+	if (threads <= 0)
+		threads = cpu_count ();
+	measured_at = al_get_time ();
+
+	int i;
+	for (i = 0; i < threads; i++) {
+		Worker * worker = new Worker;
+		worker->host = this;
+		worker->index = i;
+		worker->mutex = al_create_mutex ();
+		worker->load = 0;
+		worker->thread = al_create_thread (WorkerMain, worker);
+		if (! worker->thread) {
+			warning (this, "Could not create worker thread %d", i);
+			breakpoint ();
+			al_destroy_mutex (worker->mutex);
+			delete worker;
+			continue;
+		}
+		workers.push_back (worker);
+		al_start_thread (worker->thread);
+	}
+}
+
+// Stops the workers, and deletes every match's scenario.
+ScenarioHost::~ScenarioHost () {
+	atomic_exchange (&stopping, 1);
+	int w;
+	for (w = 0; w < (signed) workers.size(); w++)
+		al_join_thread (workers[w]->thread, NULL);
+	for (w = 0; w < (signed) workers.size(); w++) {
+		Worker * worker = workers[w];
+		int m;
+		for (m = 0; m < (signed) worker->matches.size(); m++) {
+			delete worker->matches[m]->scenario;
+			delete worker->matches[m];
+		}
+		al_destroy_thread (worker->thread);
+		al_destroy_mutex (worker->mutex);
+		delete worker;
+	}
+}
+
+// Takes a scenario to run tick_rate ticks a second.
+// It goes to the worker with the fewest matches: until Balance has
+// measured them, matches are assumed to cost the same.
+int ScenarioHost::Add (Scenario * scenario, int tick_rate) {
+	if (workers.size() == 0) {
+		warning (this, "No workers to run a match");
+		breakpoint ();
+		delete scenario;
+		return -1;
+	}
+	Match * match = new Match;
+	match->id = next_id++;
+	match->scenario = scenario;
+	match->step = 1.0 / (tick_rate > 0 ? tick_rate : 60);
+	match->next_tick = al_get_time () + match->step;
+	match->ticks = 0;
+	match->on_map = 0;
+	match->arena_in_use = scenario->GetArena ().get_bytes_in_use ();
+	match->arena_reserved = scenario->GetArena ().get_bytes_reserved ();
+	match->cost = 0;
+	match->worst = 0;
+	match->load = 0;
+	match->peak = 0;
+
+	int best = 0;
+	int w;
+	for (w = 1; w < (signed) workers.size(); w++) {
+		if (workers[w]->matches.size() < workers[best]->matches.size())
+			best = w;
+	}
+	match->worker = best;
+	al_lock_mutex (workers[best]->mutex);
+	workers[best]->matches.push_back (match);
+	al_unlock_mutex (workers[best]->mutex);
+	return match->id;
+}
+
+// Stops running a match, and deletes its scenario.
+void ScenarioHost::Remove (int id) {
+	Match * match = Find (id);
+	if (! match) {
+		warning (this, "No match %d to remove", id);
+		breakpoint ();
+		return;
+	}
+	Worker * worker = workers[match->worker];
+	al_lock_mutex (worker->mutex);
+	worker->matches.erase (std::find (worker->matches.begin(), worker->matches.end(), match));
+	al_unlock_mutex (worker->mutex);
+	delete match->scenario;
+	delete match;
+}
+
+// Measures the load of every match and worker since the last call,
+// and moves at most one match.
+// The move chosen is the match on the busiest worker that brings it and
+// the idlest worker closest to even, without making the idlest the new
+// busiest. One move at a time keeps matches from being shuffled back and
+// forth on a noisy measurement.
+void ScenarioHost::Balance () {
+	double now = al_get_time ();
+	double period = now - measured_at;
+	measured_at = now;
+	if (period <= 0)
+		return;
+
+	int busiest = 0, idlest = 0;
+	int w;
+	for (w = 0; w < (signed) workers.size(); w++) {
+		Worker * worker = workers[w];
+		al_lock_mutex (worker->mutex);
+		worker->load = 0;
+		int m;
+		for (m = 0; m < (signed) worker->matches.size(); m++) {
+			Match * match = worker->matches[m];
+			match->load = (float) (match->cost / (period * 1000000.0));
+			match->peak = match->worst;
+			match->cost = 0;
+			match->worst = 0;
+			worker->load += match->load;
+		}
+		al_unlock_mutex (worker->mutex);
+		if (worker->load > workers[busiest]->load)
+			busiest = w;
+		if (worker->load < workers[idlest]->load)
+			idlest = w;
+	}
+
+	// Only this thread changes which worker has a match, so the busiest
+	// worker's list may be looked at without locking.
+	float gap = workers[busiest]->load - workers[idlest]->load;
+	Match * best = NULL;
+	float best_gain = MIN_GAIN;
+	int m;
+	for (m = 0; m < (signed) workers[busiest]->matches.size(); m++) {
+		Match * match = workers[busiest]->matches[m];
+		// Moving load off the busiest worker gains that much, unless the
+		// idlest worker ends up busier than the busiest was left.
+		float gain = match->load < gap - match->load ? match->load : gap - match->load;
+		if (gain > best_gain) {
+			best = match;
+			best_gain = gain;
+		}
+	}
+	if (best) {
+		workers[busiest]->load -= best->load;
+		workers[idlest]->load += best->load;
+		Move (best, idlest);
+	}
+}
+
+// Each worker's load (shares of a core), as measured by the last Balance.
+float ScenarioHost::get_worker_load (int worker) const {
+	return workers[worker]->load;
+}
+
+// Copies every match, with what was measured by the last Balance.
+void ScenarioHost::GetMatches (std::vector<Match> & out) const {
+	out.clear ();
+	int w;
+	for (w = 0; w < (signed) workers.size(); w++) {
+		al_lock_mutex (workers[w]->mutex);
+		int m;
+		for (m = 0; m < (signed) workers[w]->matches.size(); m++)
+			out.push_back (*workers[w]->matches[m]);
+		al_unlock_mutex (workers[w]->mutex);
+	}
+}
+
+// Moves a match to another worker.
+// Taking it off its worker waits until the worker is between ticks, so
+// the match is never ticked by two workers. The two workers' mutexes are
+// never held together.
+void ScenarioHost::Move (Match * match, int to) {
+	Worker * from = workers[match->worker];
+	al_lock_mutex (from->mutex);
+	from->matches.erase (std::find (from->matches.begin(), from->matches.end(), match));
+	al_unlock_mutex (from->mutex);
+
+	match->worker = to;
+	al_lock_mutex (workers[to]->mutex);
+	workers[to]->matches.push_back (match);
+	al_unlock_mutex (workers[to]->mutex);
+	moves++;
+}
+
+// Finds a match. Returns NULL if there is none.
+// Only the thread that owns the host changes which worker has a match,
+// so it may look without locking.
+ScenarioHost::Match * ScenarioHost::Find (int id) const {
+	int w;
+	for (w = 0; w < (signed) workers.size(); w++) {
+		int m;
+		for (m = 0; m < (signed) workers[w]->matches.size(); m++) {
+			if (workers[w]->matches[m]->id == id)
+				return workers[w]->matches[m];
+		}
+	}
+	return NULL;
+}
+
+// Ticks the worker's matches that are due. Returns when the next is.
+double ScenarioHost::RunDue (Worker * worker) {
+	double now = al_get_time ();
+	double soonest = now + MAX_SLEEP;
+	al_lock_mutex (worker->mutex);
+	int m;
+	for (m = 0; m < (signed) worker->matches.size(); m++) {
+		Match * match = worker->matches[m];
+		if (match->next_tick <= now) {
+			int64_t start = microseconds ();
+			match->scenario->SimTick ();
+			int64_t cost = microseconds () - start;
+			match->ticks++;
+			match->on_map = match->scenario->CountOnMap ();
+			match->arena_in_use = match->scenario->GetArena ().get_bytes_in_use ();
+			match->arena_reserved = match->scenario->GetArena ().get_bytes_reserved ();
+			match->cost += cost;
+			if (cost > match->worst)
+				match->worst = cost;
+			match->next_tick += match->step;
+			if (match->next_tick < now - MAX_BEHIND * match->step)
+				match->next_tick = now;
+			now = al_get_time ();
+		}
+		if (match->next_tick < soonest)
+			soonest = match->next_tick;
+	}
+	al_unlock_mutex (worker->mutex);
+	return soonest;
+}
+
+// A worker: pinned to its core, ticks its matches as they fall due, and
+// sleeps in between.
+void * ScenarioHost::WorkerMain (ALLEGRO_THREAD * thread, void * arg) {
+	Worker * worker = (Worker *) arg;
+	ScenarioHost * host = worker->host;
+	pin_current_thread (worker->index);
+	while (! atomic_read (&host->stopping)) {
+		double soonest = host->RunDue (worker);
+		double wait = soonest - al_get_time ();
+		if (wait > 0)
+			al_rest (wait);
+	}
+	return NULL;
+}
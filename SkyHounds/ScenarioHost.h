@@ -0,0 +1,119 @@
+/**
+A ScenarioHost runs many independent matches, each a Scenario of its own,
+in one process, so that a machine can hold dozens of matches rather than
+one per process.
+
+There is one worker thread per core, pinned to it. Each match belongs to
+one worker at a time, which ticks it at the match's own rate; a worker
+with nothing due sleeps until its next match is. Matches can't share
+anything, so they never wait for each other.
+
+The host measures how much of a core each match uses. Every so often
+(Balance), it moves a match from the busiest worker to the idlest, if
+that evens them out, so a worker whose matches got crowded hands some of
+them on. A match is only moved between its ticks.
+
+Each match's scenario runs serially (one sim thread, no path or influence
+threads): the host's workers are the only threads, and matches are the
+unit of parallelism. Its avatars live in the scenario's own arena (see
+MemoryPool), away from other matches'.
+*/
+
+#ifndef SCENARIO_HOST_H
+#define SCENARIO_HOST_H
+
+class Scenario;  // forward declaration
+
+class ScenarioHost {
+public:
+	// A scenario and how it is run.
+	struct Match {
+		int id;
+		Scenario * scenario;
+		double step;           // Seconds per tick.
+		double next_tick;      // al_get_time() at which the next tick is due.
+		int worker;            // Worker it belongs to.
+
+		// Measured by its worker.
+		int ticks;             // Ticks run in all.
+		int on_map;            // Avatars on the map after its latest tick.
+		size_t arena_in_use;   // Bytes its avatar arena has in use, and has
+		size_t arena_reserved; // reserved, after its latest tick. (The arena
+		                       // itself is only safe to read on the worker.)
+		int64_t cost;          // Microseconds ticking since the last Balance.
+		int64_t worst;         // Longest tick since the last Balance.
+
+		// Measured by Balance, over the time since the one before.
+		float load;            // Share of a core used.
+		int64_t peak;          // Longest tick, in microseconds.
+	};
+
+	// Starts the given number of workers. (0=one per core)
+	ScenarioHost (int workers);
+
+	// Stops the workers, and deletes every match's scenario.
+	~ScenarioHost ();
+
+	int worker_count () const { return (signed) workers.size(); }
+
+	// Takes a scenario to run tick_rate ticks a second, on the least busy
+	// worker. The host owns it from now on. Returns the match's id.
+	int Add (Scenario * scenario, int tick_rate);
+
+	// Stops running a match, and deletes its scenario. Waits if it is
+	// being ticked.
+	void Remove (int id);
+
+	// Measures the load of every match and worker since the last call,
+	// and moves at most one match. Call every second or so.
+	void Balance ();
+
+	// Each worker's load (share of a core), as measured by the last Balance.
+	float get_worker_load (int worker) const;
+
+	// Matches moved between workers so far.
+	int get_moves () const { return moves; }
+
+	// Copies every match, with what was measured by the last Balance.
+	void GetMatches (std::vector<Match> & out) const;
+
+private:
+	struct Worker {
+		ScenarioHost * host;
+		int index;
+		ALLEGRO_THREAD * thread;
+		ALLEGRO_MUTEX * mutex;          // Held while ticking matches.
+		std::vector<Match*> matches;
+		float load;
+	};
+
+	std::vector<Worker*> workers;
+	volatile long stopping;
+	int next_id;
+	int moves;                          // Matches moved, in all.
+	double measured_at;                 // al_get_time() at the last Balance.
+
+	// A move is only worth making if it takes at least this much (share of
+	// a core) off the busiest worker.
+	static const float MIN_GAIN;
+
+	// Sleeps at most this long, so that stopping is noticed.
+	static const double MAX_SLEEP;
+
+	// A match this many ticks behind skips them, rather than racing to
+	// catch up and holding up the rest of its worker's matches.
+	enum { MAX_BEHIND = 5 };
+
+	// Moves a match to another worker.
+	void Move (Match * match, int to);
+
+	// Finds a match and its worker. Returns NULL if there is none.
+	Match * Find (int id) const;
+
+	// Ticks the worker's matches that are due. Returns when the next is.
+	double RunDue (Worker * worker);
+
+	static void * WorkerMain (ALLEGRO_THREAD * thread, void * arg);
+};
+
+#endif
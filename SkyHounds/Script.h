@@ -25,6 +25,11 @@ public:
 		definitions[word] = def;
 	}
 
+	// Is a word defined?
+	bool defines (std::string word) const {
+		return definitions.count(word) > 0;
+	}
+
 	// Get the definition of a word
 	std::string text (std::string word) {
 		if (definitions.count(word) == 0) {
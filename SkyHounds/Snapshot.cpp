@@ -0,0 +1,561 @@
+#include "libraries.h"
+
+#include "Lockstep.h"
+#include "MessageChannel.h"
+#include "Snapshot.h"
+
+// Bits for a fragment's record count.
+static const int COUNT_BITS = 20;
+
+// Bits left for records in a fragment, after the header and record count.
+// Room is left for framing, so a fragment fits in a datagram even when it
+// goes through a MessageChannel.
+static const int FRAGMENT_BITS = MessageChannel::MAX_MESSAGE * 8 - Snapshot::HEADER_BITS - COUNT_BITS;
+
+// Budget assumed for a record's slot number, when choosing what fits.
+static const int SLOT_BITS = 10;
+
+// Highest slot a snapshot may name; guards against damaged packets.
+static const int MAX_SLOT = 1 << 20;
+
+//----- Encoding -----//
+
+static int32_t QuantizePosition (float v) {
+	const int32_t limit = (1 << (Snapshot::POSITION_BITS - 1)) - 1;
+	float q = floor (v * Snapshot::POSITION_SCALE + 0.5f);
+	if (q > limit)
+		return limit;
+	if (q < -limit)
+		return -limit;
+	return (int32_t) q;
+}
+
+static void WritePosition (BitWriter & out, int32_t v) {
+	out.Write ((uint32_t) (v + (1 << (Snapshot::POSITION_BITS - 1))), Snapshot::POSITION_BITS);
+}
+
+static int32_t ReadPosition (BitReader & in) {
+	return (int32_t) in.Read (Snapshot::POSITION_BITS) - (1 << (Snapshot::POSITION_BITS - 1));
+}
+
+// A short delta if the change is small, else the new value.
+static void WriteDelta (BitWriter & out, int32_t base, int32_t now) {
+	int32_t d = now - base;
+	const int32_t half = 1 << (Snapshot::SMALL_BITS - 1);
+	bool small = d >= -half && d < half;
+	out.WriteBool (small);
+	if (small)
+		out.WriteSigned (d, Snapshot::SMALL_BITS);
+	else
+		WritePosition (out, now);
+}
+
+static int32_t ReadDelta (BitReader & in, int32_t base) {
+	if (in.ReadBool ())
+		return base + in.ReadSigned (Snapshot::SMALL_BITS);
+	return ReadPosition (in);
+}
+
+bool Snapshot::Entity::operator== (const Entity & e) const {
+	if (present != e.present)
+		return false;
+	return ! present || (generation == e.generation && team == e.team && on_map == e.on_map &&
+		x == e.x && y == e.y && aim_x == e.aim_x && aim_y == e.aim_y);
+}
+
+// Quantizes an avatar's state.
+void Snapshot::Entity::Set (int slot_generation, const StateScenarioAvatar & p) {
+	present = true;
+	generation = slot_generation & ((1 << GENERATION_BITS) - 1);
+	team = clamp (p.team_assignment, 0, (1 << TEAM_BITS) - 1);
+	on_map = p.on_map;
+	x = QuantizePosition (p.map_x);
+	y = QuantizePosition (p.map_y);
+	aim_x = QuantizePosition (p.aim_x);
+	aim_y = QuantizePosition (p.aim_y);
+}
+
+// The state as the client sees it.
+StateScenarioAvatar Snapshot::Entity::State () const {
+	StateScenarioAvatar p;
+	p.team_assignment = team;
+	p.on_map = on_map;
+	p.map_x = (float) x / POSITION_SCALE;
+	p.map_y = (float) y / POSITION_SCALE;
+	p.aim_x = (float) aim_x / POSITION_SCALE;
+	p.aim_y = (float) aim_y / POSITION_SCALE;
+	return p;
+}
+
+// Writes a record for an avatar: removed, in full, or as a delta from base.
+// A record is in full if the baseline has no avatar in the slot, or a
+// different one (the slot was reused).
+void Snapshot::WriteEntity (BitWriter & out, const Entity & base, const Entity & now) {
+	out.WriteBool (! now.present);
+	if (! now.present)
+		return;
+	bool full = ! base.present || base.generation != now.generation;
+	out.WriteBool (full);
+	if (full) {
+		out.Write (now.generation, GENERATION_BITS);
+		out.Write (now.team, TEAM_BITS);
+		out.WriteBool (now.on_map);
+		WritePosition (out, now.x);
+		WritePosition (out, now.y);
+		WritePosition (out, now.aim_x);
+		WritePosition (out, now.aim_y);
+		return;
+	}
+	bool team = now.team != base.team;
+	bool moved = now.x != base.x || now.y != base.y;
+	bool aimed = now.aim_x != base.aim_x || now.aim_y != base.aim_y;
+	out.WriteBool (team);
+	out.WriteBool (now.on_map != base.on_map);
+	out.WriteBool (moved);
+	out.WriteBool (aimed);
+	if (team)
+		out.Write (now.team, TEAM_BITS);
+	if (moved) {
+		WriteDelta (out, base.x, now.x);
+		WriteDelta (out, base.y, now.y);
+	}
+	if (aimed) {
+		WriteDelta (out, base.aim_x, now.aim_x);
+		WriteDelta (out, base.aim_y, now.aim_y);
+	}
+}
+
+// Reads a record into e, which holds the baseline on entry.
+void Snapshot::ReadEntity (BitReader & in, Entity & e) {
+	if (in.ReadBool ()) {
+		e = Entity ();
+		return;
+	}
+	if (in.ReadBool ()) {
+		e.present = true;
+		e.generation = in.Read (GENERATION_BITS);
+		e.team = in.Read (TEAM_BITS);
+		e.on_map = in.ReadBool ();
+		e.x = ReadPosition (in);
+		e.y = ReadPosition (in);
+		e.aim_x = ReadPosition (in);
+		e.aim_y = ReadPosition (in);
+		return;
+	}
+	bool team = in.ReadBool ();
+	bool toggled = in.ReadBool ();
+	bool moved = in.ReadBool ();
+	bool aimed = in.ReadBool ();
+	if (team)
+		e.team = in.Read (TEAM_BITS);
+	if (toggled)
+		e.on_map = ! e.on_map;
+	if (moved) {
+		e.x = ReadDelta (in, e.x);
+		e.y = ReadDelta (in, e.y);
+	}
+	if (aimed) {
+		e.aim_x = ReadDelta (in, e.aim_x);
+		e.aim_y = ReadDelta (in, e.aim_y);
+	}
+}
+
+void Snapshot::WriteHeader (BitWriter & out, const Header & header) {
+	out.Write (MESSAGE_SNAPSHOT, KIND_BITS);
+	out.Write (header.sequence, 16);
+	out.WriteBool (header.base >= 0);
+	out.Write (header.base >= 0 ? header.base : 0, 16);
+	out.Write ((uint32_t) header.tick, 32);
+	out.WriteBool (header.input_ack >= 0);
+	out.Write (header.input_ack >= 0 ? header.input_ack : 0, 16);
+	out.Write (header.fragment, 4);
+	out.Write (header.fragment_count - 1, 4);
+}
+
+// Returns false if the datagram is not a snapshot, or is cut short.
+bool Snapshot::ReadHeader (BitReader & in, Header & header) {
+	if (in.Read (KIND_BITS) != MESSAGE_SNAPSHOT)
+		return false;
+	header.sequence = in.Read (16);
+	bool has_base = in.ReadBool ();
+	header.base = in.Read (16);
+	if (! has_base)
+		header.base = -1;
+	header.tick = (int) in.Read (32);
+	bool has_input = in.ReadBool ();
+	header.input_ack = in.Read (16);
+	if (! has_input)
+		header.input_ack = -1;
+	header.fragment = in.Read (4);
+	header.fragment_count = in.Read (4) + 1;
+	return ! in.Overflowed ();
+}
+
+const int Snapshot::INPUT_BYTES = (KIND_BITS + 16 + 32 + Lockstep::INPUT_BITS + 7) / 8;
+
+// A client's input: its player's intentions, numbered in the order
+// they were made (16 bits, wrapping), and the tick it was showing.
+void Snapshot::WriteInput (BitWriter & out, int sequence, int view_tick, const StateAvatarScenario & v) {
+	out.Write (MESSAGE_INPUT, KIND_BITS);
+	out.Write (sequence, 16);
+	out.Write ((uint32_t) view_tick, 32);
+	Lockstep::WriteInput (out, v);
+}
+
+// Returns false if the datagram is not an input, or is cut short.
+bool Snapshot::ReadInput (BitReader & in, int & sequence, int & view_tick, StateAvatarScenario & v) {
+	if (in.Read (KIND_BITS) != MESSAGE_INPUT)
+		return false;
+	sequence = in.Read (16);
+	view_tick = (int) in.Read (32);
+	Lockstep::ReadInput (in, v);
+	return ! in.Overflowed ();
+}
+
+//----- Sender -----//
+
+SnapshotSender::SnapshotSender (Transport * _transport)
+	: transport(_transport), byte_budget(Transport::MTU), sequence(0), acked(-1),
+	  input_view_tick(-1), input_sequence(-1), input_taken(-1), bytes_sent(0), stats(NULL)
+{
+	int i;
+	for (i = 0; i < Snapshot::WINDOW; i++)
+		sent_time[i] = 0;
+}
+
+// Sets the most bytes a snapshot may take. (At least one datagram.)
+void SnapshotSender::SetByteBudget (int bytes) {
+	byte_budget = clamp (bytes, (int) Transport::MTU, Snapshot::MAX_FRAGMENTS * FRAGMENT_BITS / 8);
+}
+
+// Reads acknowledgements and inputs from the client.
+// Only acknowledgements of snapshots still in the window are any use; the
+// first of each measures a round trip.
+// Of the inputs, only the newest counts: each holds all of the player's
+// intentions, so it stands in for any older ones lost or overtaken.
+void SnapshotSender::ReadAcks () {
+	const unsigned char * data;
+	int size;
+	while ((size = transport->ReceiveMessage (data)) > 0) {
+		int kind = BitReader (data, size).Read (Snapshot::KIND_BITS);
+		BitReader in (data, size);
+		if (kind == Snapshot::MESSAGE_INPUT) {
+			int seq, view_tick;
+			StateAvatarScenario v;
+			if (! Snapshot::ReadInput (in, seq, view_tick, v))
+				continue;
+			if (input_sequence < 0 || Snapshot::Newer (seq, input_sequence)) {
+				input = v;
+				input_view_tick = view_tick;
+				input_sequence = seq;
+			}
+			continue;
+		}
+		if (in.Read (Snapshot::KIND_BITS) != Snapshot::MESSAGE_ACK)
+			continue;
+		int seq = in.Read (16);
+		if (in.Overflowed () || sent[seq % Snapshot::WINDOW].sequence != seq)
+			continue;
+		if (acked < 0 || Snapshot::Newer (seq, acked)) {
+			acked = seq;
+			if (stats)
+				stats->RoundTrip (al_get_time () - sent_time[seq % Snapshot::WINDOW]);
+		}
+	}
+}
+
+// Takes the client's newest input, if it hasn't been taken yet.
+bool SnapshotSender::TakeInput (StateAvatarScenario & v, int & view_tick) {
+	if (input_sequence < 0 || input_sequence == input_taken)
+		return false;
+	v = input;
+	view_tick = input_view_tick;
+	input_taken = input_sequence;
+	return true;
+}
+
+// Sends a snapshot of the relevant avatars in a store, which must be in
+// slot order. Call between ticks.
+// The relevant avatars are merged with those in the baseline: those no
+// longer relevant are removed. Changes that are due are chosen, most
+// overdue first, until the byte budget is spent; the rest keep their
+// baseline state in this snapshot's view.
+void SnapshotSender::Send (int tick, const AvatarStore & store, const std::vector<Snapshot::Relevant> & relevant) {
+	int64_t start = microseconds ();
+	static const std::vector<Snapshot::Entity> nothing;
+	const std::vector<Snapshot::Entity> * base = &nothing;
+	int base_sequence = -1;
+	if (acked >= 0) {
+		const Snapshot::View & view = sent[acked % Snapshot::WINDOW];
+		if (view.sequence == acked && ((sequence - acked) & 0xFFFF) < Snapshot::WINDOW) {
+			base = &view.entities;
+			base_sequence = acked;
+		} else {
+			acked = -1;
+		}
+	}
+
+	// Merge.
+	was.clear ();
+	current.clear ();
+	changed.clear ();
+	if ((signed) priority.size() < store.slot_count ())
+		priority.resize (store.slot_count (), 0);
+	int b = 0, r = 0;
+	while (b < (signed) base->size() || r < (signed) relevant.size()) {
+		int base_slot = b < (signed) base->size() ? (*base)[b].slot : INT_MAX;
+		int slot = r < (signed) relevant.size() ? relevant[r].who.slot : INT_MAX;
+		if (base_slot < slot)
+			slot = base_slot;
+		Snapshot::Entity before, now;
+		before.slot = now.slot = slot;
+		if (base_slot == slot)
+			before = (*base)[b++];
+		float weight = 1;
+		bool due = true;
+		if (r < (signed) relevant.size() && relevant[r].who.slot == slot) {
+			int i = store.Index (relevant[r].who);
+			if (i >= 0)
+				now.Set (relevant[r].who.generation, store.scenario_p (i));
+			weight = relevant[r].weight;
+			due = relevant[r].due;
+			r++;
+		}
+		int k = (signed) current.size();
+		was.push_back (before);
+		current.push_back (now);
+		if (before == now) {
+			if (slot < (signed) priority.size())
+				priority[slot] = 0;
+		} else if (due && slot < (signed) priority.size()) {
+			priority[slot] += weight;
+			changed.push_back (std::make_pair (-priority[slot], k));
+		}
+	}
+	std::sort (changed.begin(), changed.end());
+
+	// Choose what to send.
+	chosen.clear ();
+	int bits_left = byte_budget * 8 - Snapshot::HEADER_BITS;
+	int i;
+	for (i = 0; i < (signed) changed.size() && bits_left > 0; i++) {
+		int k = changed[i].second;
+		record.Clear ();
+		Snapshot::WriteEntity (record, was[k], current[k]);
+		int cost = record.get_bit_count () + SLOT_BITS;
+		if (cost <= bits_left) {
+			chosen.push_back (k);
+			bits_left -= cost;
+		}
+	}
+	std::sort (chosen.begin(), chosen.end());
+	Fragment ();
+
+	// The client's view once this snapshot arrives.
+	Snapshot::View & next = sent[sequence % Snapshot::WINDOW];
+	next.entities.clear ();
+	next.sequence = sequence;
+	next.tick = tick;
+	int c = 0, k;
+	for (k = 0; k < (signed) current.size(); k++) {
+		bool sending = c < (signed) chosen.size() && chosen[c] == k;
+		if (sending) {
+			c++;
+			priority[current[k].slot] = 0;
+		}
+		const Snapshot::Entity & e = sending ? current[k] : was[k];
+		if (e.present)
+			next.entities.push_back (e);
+	}
+
+	// Send the fragments, written straight into the datagrams.
+	Snapshot::Header header;
+	header.sequence = sequence;
+	header.base = base_sequence;
+	header.tick = tick;
+	header.input_ack = input_taken;
+	header.fragment_count = (signed) fragments.size();
+	int bytes = 0;
+	for (i = 0; i < (signed) fragments.size(); i++) {
+		int bits = Snapshot::HEADER_BITS + COUNT_BITS + fragments[i].get_bit_count ();
+		BitWriter & packet = transport->BeginMessage ((bits + 7) / 8);
+		header.fragment = i;
+		Snapshot::WriteHeader (packet, header);
+		packet.WriteVar (fragment_records[i]);
+		packet.Append (fragments[i]);
+		bytes += packet.get_byte_count ();
+		transport->EndMessage ();
+	}
+	bytes_sent += bytes;
+	sent_time[sequence % Snapshot::WINDOW] = al_get_time ();
+	if (stats)
+		stats->SnapshotSent (bytes, microseconds () - start);
+
+	sequence = (sequence + 1) & 0xFFFF;
+}
+
+// Cuts the chosen records into fragments. Records that don't fit in
+// MAX_FRAGMENTS are dropped from chosen.
+// Slots are written as the gap from the previous record in the fragment.
+void SnapshotSender::Fragment () {
+	fragments.assign (1, BitWriter ());
+	fragment_records.assign (1, 0);
+	int previous = -1;
+	int kept = 0;
+	int i;
+	for (i = 0; i < (signed) chosen.size(); i++) {
+		int k = chosen[i];
+		int slot = current[k].slot;
+		record.Clear ();
+		record.WriteVar (slot - previous - 1);
+		Snapshot::WriteEntity (record, was[k], current[k]);
+		if (fragments.back ().get_bit_count () + record.get_bit_count () > FRAGMENT_BITS) {
+			if ((signed) fragments.size() == Snapshot::MAX_FRAGMENTS)
+				continue;
+			fragments.push_back (BitWriter ());
+			fragment_records.push_back (0);
+			record.Clear ();
+			record.WriteVar (slot);
+			Snapshot::WriteEntity (record, was[k], current[k]);
+		}
+		fragments.back ().Append (record);
+		fragment_records.back ()++;
+		previous = slot;
+		chosen[kept++] = k;
+	}
+	chosen.resize (kept);
+}
+
+//----- Receiver -----//
+
+SnapshotReceiver::SnapshotReceiver (Transport * _transport)
+	: transport(_transport), latest(-1), stats(NULL)
+{
+}
+
+// Reads everything received and acknowledges complete snapshots.
+// Returns true if a newer snapshot is now complete.
+// Fragments of snapshots older than the latest are ignored.
+bool SnapshotReceiver::Receive () {
+	bool newer = false;
+	const unsigned char * data;
+	int size;
+	while ((size = transport->ReceiveMessage (data)) > 0) {
+		BitReader in (data, size);
+		Snapshot::Header header;
+		if (! Snapshot::ReadHeader (in, header))
+			continue;
+		if (latest >= 0 && ! Snapshot::Newer (header.sequence, latest))
+			continue;
+
+		Pending & p = pending[header.sequence];
+		if (p.count == 0) {
+			p.base = header.base;
+			p.tick = header.tick;
+			p.input_ack = header.input_ack;
+			p.count = header.fragment_count;
+			p.fragments.assign (p.count, std::vector<unsigned char> ());
+		}
+		if (header.fragment >= p.count || p.fragments[header.fragment].size() > 0)
+			continue;
+		p.fragments[header.fragment].assign (data, data + size);
+		p.received++;
+		if (p.received < p.count)
+			continue;
+
+		if (Complete (header.sequence, p)) {
+			if (stats)
+				stats->SnapshotReceived (latest >= 0 ? ((header.sequence - latest - 1) & 0xFFFF) : 0);
+			latest = header.sequence;
+			newer = true;
+			BitWriter & ack = transport->BeginMessage (3);
+			ack.Write (Snapshot::MESSAGE_ACK, Snapshot::KIND_BITS);
+			ack.Write (latest, 16);
+			transport->EndMessage ();
+		}
+		pending.erase (header.sequence);
+	}
+
+	// Forget incomplete snapshots that can no longer be used.
+	std::map<int, Pending>::iterator it = pending.begin();
+	while (it != pending.end()) {
+		if (latest >= 0 && ! Snapshot::Newer (it->first, latest))
+			pending.erase (it++);
+		else
+			++it;
+	}
+	while (pending.size() > Snapshot::WINDOW)
+		pending.erase (pending.begin());
+	return newer;
+}
+
+// Decodes a snapshot whose fragments have all arrived.
+// Records come in slot order (fragments follow on from each other), so
+// they are merged with the baseline in one pass.
+// Returns false if its baseline is gone, or a fragment is damaged.
+bool SnapshotReceiver::Complete (int sequence, const Pending & p) {
+	static const std::vector<Snapshot::Entity> nothing;
+	const std::vector<Snapshot::Entity> * base = &nothing;
+	if (p.base >= 0) {
+		const Snapshot::View & view = views[p.base % Snapshot::WINDOW];
+		if (view.sequence != p.base)
+			return false;
+		base = &view.entities;
+	}
+
+	decoded.entities.clear ();
+	int b = 0;
+	int last = -1;
+	int f;
+	for (f = 0; f < p.count; f++) {
+		const std::vector<unsigned char> & datagram = p.fragments[f];
+		BitReader in (&datagram[0], (signed) datagram.size());
+		Snapshot::Header header;
+		Snapshot::ReadHeader (in, header);
+		int count = (int) in.ReadVar ();
+		int slot = -1;
+		int k;
+		for (k = 0; k < count; k++) {
+			slot += 1 + (int) in.ReadVar ();
+			if (in.Overflowed () || slot <= last || slot >= MAX_SLOT)
+				return false;
+			last = slot;
+			while (b < (signed) base->size() && (*base)[b].slot < slot)
+				decoded.entities.push_back ((*base)[b++]);
+			Snapshot::Entity e;
+			if (b < (signed) base->size() && (*base)[b].slot == slot)
+				e = (*base)[b++];
+			Snapshot::ReadEntity (in, e);
+			e.slot = slot;
+			if (e.present)
+				decoded.entities.push_back (e);
+		}
+		if (in.Overflowed ())
+			return false;
+	}
+	while (b < (signed) base->size())
+		decoded.entities.push_back ((*base)[b++]);
+
+	Snapshot::View & view = views[sequence % Snapshot::WINDOW];
+	view.entities.swap (decoded.entities);
+	view.sequence = sequence;
+	view.tick = p.tick;
+	view.input_ack = p.input_ack;
+	return true;
+}
+
+// Position of a slot, or -1 if the client doesn't know of it.
+int SnapshotReceiver::Find (int slot) const {
+	if (latest < 0)
+		return -1;
+	const std::vector<Snapshot::Entity> & entities = Latest ().entities;
+	int low = 0, high = (signed) entities.size();
+	while (low < high) {
+		int middle = (low + high) / 2;
+		if (entities[middle].slot < slot)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low < (signed) entities.size() && entities[low].slot == slot ? low : -1;
+}
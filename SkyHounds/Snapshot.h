@@ -0,0 +1,237 @@
+/**
+Snapshots replicate the scenario's StateScenarioAvatar records from a server
+to a client over a Transport.
+
+Each tick the SnapshotSender for a client sends a snapshot: the avatars
+relevant to the client (see InterestManager) whose state differs from what
+the client is known to have, and the removal of avatars that are no longer
+relevant. Fields are
+quantized (positions to 1/8 pixel) and bit-packed, and each avatar is
+delta-encoded against its state in the newest snapshot the client has
+acknowledged (the baseline), so an avatar that stands still costs nothing
+and one that moves a little costs a few bytes.
+
+A snapshot may be no bigger than the sender's byte budget. When more
+avatars have changed than fit, those that have waited longest go first and
+the rest wait for a later snapshot, so the bandwidth per client stays flat
+however many avatars there are. A snapshot bigger than one datagram is
+split into fragments of at most Transport::MTU bytes; each fragment holds
+whole records, but a snapshot only counts once all of its fragments arrive.
+
+Both ends keep the last WINDOW snapshots as views (every avatar the client
+knows of), so a snapshot can be decoded against whichever baseline the
+sender chose, and lost snapshots need not be resent: the next one is
+encoded against the older, acknowledged baseline. Views only hold relevant
+avatars, so the work per client follows how crowded its surroundings are,
+not how many avatars there are.
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "AvatarStore.h"
+#include "BitStream.h"
+#include "NetStats.h"
+#include "Transport.h"
+
+class Snapshot {
+public:
+	// Kinds of message, in the first bits of each datagram.
+	enum { KIND_BITS = 4 };
+	enum MessageKind {
+		MESSAGE_SNAPSHOT = 1,  // Sender to client.
+		MESSAGE_ACK = 2,       // Client to sender: newest snapshot complete.
+		MESSAGE_FRAME = 3,     // Peer to peer: inputs for a tick (see Lockstep).
+		MESSAGE_INPUT = 4      // Client to sender: its player's intentions (see PlayerPredictor).
+	};
+
+	// Snapshots kept at each end for use as baselines.
+	enum { WINDOW = 32 };
+
+	// Most fragments in a snapshot.
+	enum { MAX_FRAGMENTS = 16 };
+
+	// What a client is told about one avatar, quantized.
+	struct Entity {
+		int slot;
+		bool present;       // Is there an avatar in the slot?
+		int generation;     // Low GENERATION_BITS of the slot's generation.
+		int team;
+		bool on_map;
+		int32_t x, y;       // In 1/POSITION_SCALE pixels.
+		int32_t aim_x, aim_y;
+
+		Entity () : slot(-1), present(false), generation(0), team(0), on_map(false), x(0), y(0), aim_x(0), aim_y(0) { }
+		bool operator== (const Entity & e) const;
+		bool operator!= (const Entity & e) const { return ! (*this == e); }
+
+		// Quantizes an avatar's state.
+		void Set (int slot_generation, const StateScenarioAvatar & p);
+
+		// The state as the client sees it.
+		StateScenarioAvatar State () const;
+	};
+
+	// Every avatar a client knows of, in slot order.
+	struct View {
+		int sequence;       // Snapshot the view is of. (-1=none)
+		int tick;
+		int input_ack;      // Newest client input acted on by then. (-1=none)
+		std::vector<Entity> entities;
+		View () : sequence(-1), tick(0), input_ack(-1) { }
+	};
+
+	// An avatar relevant to a client this tick.
+	struct Relevant {
+		AvatarHandle who;
+		float weight;       // How much its changes matter. (1=normal)
+		bool due;           // Should its changes be sent this tick?
+	};
+
+	// Sequence numbers are 16 bits and wrap. Is a newer than b?
+	static bool Newer (int a, int b) {
+		return a != b && ((a - b) & 0xFFFF) < 0x8000;
+	}
+
+	// Parts of the encoding, shared by both ends.
+	enum { GENERATION_BITS = 8 };
+	enum { TEAM_BITS = 4 };
+	enum { POSITION_SCALE = 8 };
+	enum { POSITION_BITS = 21 };   // Signed, so +/- 2^20 / POSITION_SCALE pixels.
+	enum { SMALL_BITS = 7 };       // A short delta.
+
+	// Writes a record for an avatar: removed, in full, or as a delta from base.
+	static void WriteEntity (BitWriter & out, const Entity & base, const Entity & now);
+
+	// Reads a record into e, which holds the baseline on entry.
+	static void ReadEntity (BitReader & in, Entity & e);
+
+	// The start of each snapshot datagram.
+	struct Header {
+		int sequence;
+		int base;           // Baseline. (-1=none: encoded against nothing)
+		int tick;
+		int input_ack;      // Newest client input acted on. (-1=none)
+		int fragment, fragment_count;
+	};
+	enum { HEADER_BITS = KIND_BITS + 16 + 1 + 16 + 32 + 1 + 16 + 4 + 4 };
+	static void WriteHeader (BitWriter & out, const Header & header);
+
+	// Returns false if the datagram is not a snapshot, or is cut short.
+	static bool ReadHeader (BitReader & in, Header & header);
+
+	// A client's input: its player's intentions, numbered in the order
+	// they were made (16 bits, wrapping), and the tick of the snapshot it
+	// was showing when it made them (-1=none yet), for lag compensation.
+	static void WriteInput (BitWriter & out, int sequence, int view_tick, const StateAvatarScenario & v);
+	static const int INPUT_BYTES;   // Most bytes it takes.
+
+	// Returns false if the datagram is not an input, or is cut short.
+	static bool ReadInput (BitReader & in, int & sequence, int & view_tick, StateAvatarScenario & v);
+};
+
+class SnapshotSender {
+	Transport * transport;
+	int byte_budget;               // Most bytes per snapshot.
+	int sequence;                  // Of the next snapshot.
+	int acked;                     // Newest snapshot the client has. (-1=none)
+	Snapshot::View sent[Snapshot::WINDOW];  // What the client will have after each snapshot.
+	double sent_time[Snapshot::WINDOW];     // al_get_time() each went out at.
+	std::vector<float> priority;   // By slot: how long each change has waited.
+
+	// The client's newest input, and the newest taken to act on. (-1=none)
+	StateAvatarScenario input;
+	int input_view_tick;
+	int input_sequence, input_taken;
+
+	// Scratch, for the relevant avatars and those in the baseline, in slot order.
+	std::vector<Snapshot::Entity> was, current;
+	std::vector<std::pair<float,int> > changed;     // (-priority, position)
+	std::vector<int> chosen;                        // Positions.
+	BitWriter record;
+	std::vector<BitWriter> fragments;
+	std::vector<int> fragment_records;
+
+	long bytes_sent;
+	NetStats * stats;
+
+public:
+	SnapshotSender (Transport * _transport);
+
+	// Sets the most bytes a snapshot may take. (At least one datagram.)
+	void SetByteBudget (int bytes);
+
+	// Counts snapshots sent, the time taken to encode them, and round trip
+	// times into stats from now on. (NULL=don't)
+	void SetStats (NetStats * _stats) { stats = _stats; }
+
+	// Reads acknowledgements and inputs from the client.
+	void ReadAcks ();
+
+	// Takes the client's newest input, and the tick the client was showing
+	// when it made it, if it hasn't been taken yet. Act on it in the next
+	// tick; snapshots sent after that tick acknowledge it.
+	bool TakeInput (StateAvatarScenario & v, int & view_tick);
+
+	// Sends a snapshot of the relevant avatars in a store, which must be in
+	// slot order. Call between ticks.
+	void Send (int tick, const AvatarStore & store, const std::vector<Snapshot::Relevant> & relevant);
+
+	// Total bytes sent, for measuring bandwidth.
+	long get_bytes_sent () const { return bytes_sent; }
+
+private:
+	// Cuts the chosen records into fragments. Records that don't fit in
+	// MAX_FRAGMENTS are dropped from chosen.
+	void Fragment ();
+};
+
+class SnapshotReceiver {
+	Transport * transport;
+	Snapshot::View views[Snapshot::WINDOW];  // Complete snapshots, by sequence.
+	int latest;                    // Newest complete snapshot. (-1=none)
+
+	// Snapshots with fragments still missing, by sequence.
+	struct Pending {
+		int base, tick, input_ack, count, received;
+		std::vector< std::vector<unsigned char> > fragments;
+		Pending () : base(-1), tick(0), input_ack(-1), count(0), received(0) { }
+	};
+	std::map<int, Pending> pending;
+	Snapshot::View decoded;        // Scratch.
+	NetStats * stats;
+
+public:
+	SnapshotReceiver (Transport * _transport);
+
+	// Counts snapshots received and lost into stats from now on. (NULL=don't)
+	void SetStats (NetStats * _stats) { stats = _stats; }
+
+	// Reads everything received and acknowledges complete snapshots.
+	// Returns true if a newer snapshot is now complete.
+	bool Receive ();
+
+	// The newest complete snapshot.
+	// Tick is the server tick it was taken at. (-1=none yet)
+	int get_tick () const { return latest >= 0 ? Latest ().tick : -1; }
+
+	// The newest of this client's inputs the server had acted on when it
+	// took the snapshot. (-1=none)
+	int get_input_ack () const { return latest >= 0 ? Latest ().input_ack : -1; }
+
+	// Avatars in it, by position k in slot order.
+	int size () const { return latest >= 0 ? (signed) Latest ().entities.size() : 0; }
+	int Slot (int k) const { return Latest ().entities[k].slot; }
+	StateScenarioAvatar State (int k) const { return Latest ().entities[k].State (); }
+
+	// Position of a slot, or -1 if the client doesn't know of it.
+	int Find (int slot) const;
+
+private:
+	const Snapshot::View & Latest () const { return views[latest % Snapshot::WINDOW]; }
+
+	// Decodes a snapshot whose fragments have all arrived.
+	bool Complete (int sequence, const Pending & p);
+};
+
+#endif
@@ -0,0 +1,184 @@
+#include "libraries.h"
+
+#include "SpatialGrid.h"
+
+#include "RollbackRing.h"
+
+// Sets the area covered and the cell size. Empties the grid.
+void SpatialGrid::Resize (float width, float height, float _cell_size) {
+	cell_size = _cell_size > 0 ? _cell_size : 1;
+	columns = (int) (width / cell_size) + 1;
+	rows = (int) (height / cell_size) + 1;
+	cell_head.assign (columns * rows, -1);
+	item_cell.assign (item_cell.size(), -1);
+}
+
+// Adds an item.
+void SpatialGrid::Insert (int item, float x, float y) {
+	if (item >= (signed) item_cell.size()) {
+		int n = item + 1;
+		item_cell.resize (n, -1);
+		item_next.resize (n, -1);
+		item_prev.resize (n, -1);
+		item_x.resize (n, 0);
+		item_y.resize (n, 0);
+	}
+	if (item_cell[item] >= 0) {
+		warning (this, "Item %d inserted twice", item);
+		breakpoint ();
+		Unlink (item);
+	}
+	item_x[item] = x;
+	item_y[item] = y;
+	Link (item, CellAt (x, y));
+}
+
+// Moves an item. Only re-buckets it if it changed cells.
+void SpatialGrid::Move (int item, float x, float y) {
+	if (! Contains (item)) {
+		Insert (item, x, y);
+		return;
+	}
+	item_x[item] = x;
+	item_y[item] = y;
+	int cell = CellAt (x, y);
+	if (cell != item_cell[item]) {
+		Unlink (item);
+		Link (item, cell);
+	}
+}
+
+// Removes an item.
+void SpatialGrid::Remove (int item) {
+	if (Contains (item))
+		Unlink (item);
+}
+
+// The k items nearest to (x,y), nearest first, no farther than max_radius.
+// Searches rings of cells outward from (x,y), and stops once no unsearched
+// cell can hold anything nearer than the k-th best so far.
+int SpatialGrid::Nearest (float x, float y, int k, float max_radius, int * items) const {
+	if (cell_head.size() == 0 || k <= 0)
+		return 0;
+	if (k > MAX_NEAREST)
+		k = MAX_NEAREST;
+
+	// Best so far, kept sorted by distance.
+	int best[MAX_NEAREST];
+	float best_d2[MAX_NEAREST];
+	int found = 0;
+
+	float max_d2 = max_radius * max_radius;
+	int cx = Column (x), cy = Row (y);
+	int max_ring = (int) (max_radius / cell_size) + 1;
+	int ring;
+	for (ring = 0; ring <= max_ring; ring++) {
+		// Nothing in this ring or beyond is nearer than (ring - 1) cells away.
+		if (ring > 0 && found == k) {
+			float reach = (ring - 1) * cell_size;
+			if (reach * reach > best_d2[k - 1])
+				break;
+		}
+		if (cx - ring < 0 && cy - ring < 0 && cx + ring >= columns && cy + ring >= rows)
+			break;  // ring is entirely off the grid
+
+		int r, c;
+		for (r = cy - ring; r <= cy + ring; r++) {
+			if (r < 0 || r >= rows)
+				continue;
+			// Interior rows of the ring only have their two end cells.
+			int step = (r == cy - ring || r == cy + ring) ? 1 : 2 * ring;
+			if (step == 0)
+				step = 1;
+			for (c = cx - ring; c <= cx + ring; c += step) {
+				if (c < 0 || c >= columns)
+					continue;
+				int item;
+				for (item = cell_head[r * columns + c]; item >= 0; item = item_next[item]) {
+					float dx = item_x[item] - x;
+					float dy = item_y[item] - y;
+					float d2 = dx * dx + dy * dy;
+					if (d2 > max_d2 || (found == k && d2 >= best_d2[k - 1]))
+						continue;
+					// Insertion into the sorted best list.
+					int j = found < k ? found++ : k - 1;
+					while (j > 0 && best_d2[j - 1] > d2) {
+						best[j] = best[j - 1];
+						best_d2[j] = best_d2[j - 1];
+						j--;
+					}
+					best[j] = item;
+					best_d2[j] = d2;
+				}
+			}
+		}
+	}
+
+	int i;
+	for (i = 0; i < found; i++)
+		items[i] = best[i];
+	return found;
+}
+
+// Cell containing (x,y), clamped to the grid.
+int SpatialGrid::CellAt (float x, float y) const {
+	return Row (y) * columns + Column (x);
+}
+
+// Links an item into the head of a cell's list.
+void SpatialGrid::Link (int item, int cell) {
+	item_cell[item] = cell;
+	item_prev[item] = -1;
+	item_next[item] = cell_head[cell];
+	if (cell_head[cell] >= 0)
+		item_prev[cell_head[cell]] = item;
+	cell_head[cell] = item;
+}
+
+// Unlinks an item from its cell's list.
+void SpatialGrid::Unlink (int item) {
+	int cell = item_cell[item];
+	if (item_prev[item] >= 0)
+		item_next[item_prev[item]] = item_next[item];
+	else
+		cell_head[cell] = item_next[item];
+	if (item_next[item] >= 0)
+		item_prev[item_next[item]] = item_prev[item];
+	item_cell[item] = -1;
+}
+
+// Column of a coordinate, clamped to the grid.
+int SpatialGrid::Column (float x) const {
+	int c = (int) (x / cell_size);
+	if (c < 0) return 0;
+	if (c >= columns) return columns - 1;
+	return c;
+}
+
+// Row of a coordinate, clamped to the grid.
+int SpatialGrid::Row (float y) const {
+	int r = (int) (y / cell_size);
+	if (r < 0) return 0;
+	if (r >= rows) return rows - 1;
+	return r;
+}
+
+// Saves the items and their lists.
+void SpatialGrid::Save (StateBlock & block) const {
+	block.PutArray (cell_head);
+	block.PutArray (item_cell);
+	block.PutArray (item_next);
+	block.PutArray (item_prev);
+	block.PutArray (item_x);
+	block.PutArray (item_y);
+}
+
+// Puts back what Save saved.
+void SpatialGrid::Restore (StateBlock & block) {
+	block.GetArray (cell_head);
+	block.GetArray (item_cell);
+	block.GetArray (item_next);
+	block.GetArray (item_prev);
+	block.GetArray (item_x);
+	block.GetArray (item_y);
+}
@@ -0,0 +1,151 @@
+/**
+A SpatialGrid answers "what is near (x,y)" for a set of points on the map.
+
+The map is divided into square cells, and each cell keeps a linked list of
+the items in it. Items are small non-negative integers chosen by the owner
+(e.g., avatar slots); the per-item arrays grow to fit the largest one.
+Moving an item only touches the lists if it changed cells.
+
+Queries either call a visitor for each item found, or append item numbers
+to a caller-supplied vector, so queries allocate nothing in the steady state.
+Queries are const and may run concurrently with each other, but not with
+Insert/Move/Remove.
+*/
+
+#ifndef SPATIAL_GRID_H
+#define SPATIAL_GRID_H
+
+class StateBlock;  // forward declaration
+
+class SpatialGrid {
+	float cell_size;
+	int columns, rows;
+
+	std::vector<int> cell_head;   // First item in each cell. (-1=empty)
+
+	// Per-item arrays.
+	std::vector<int> item_cell;   // Cell holding each item. (-1=not in grid)
+	std::vector<int> item_next;   // Next item in the same cell. (-1=end)
+	std::vector<int> item_prev;   // Previous item in the same cell. (-1=head)
+	std::vector<float> item_x, item_y;
+
+public:
+	// Most items QueryNearest can return.
+	enum { MAX_NEAREST = 32 };
+
+	SpatialGrid () : cell_size(1), columns(0), rows(0) { }
+
+	// Sets the area covered and the cell size. Empties the grid.
+	void Resize (float width, float height, float _cell_size);
+
+	// Adds, moves or removes an item.
+	void Insert (int item, float x, float y);
+	void Move (int item, float x, float y);
+	void Remove (int item);
+
+	bool Contains (int item) const {
+		return item >= 0 && item < (signed) item_cell.size() && item_cell[item] >= 0;
+	}
+
+	// Calls visit(item) for each item within the rectangle [x0,x1] x [y0,y1].
+	template <class Visitor>
+	void VisitRect (float x0, float y0, float x1, float y1, Visitor & visit) const {
+		if (cell_head.size() == 0)
+			return;
+		int c0 = Column (x0), c1 = Column (x1);
+		int r0 = Row (y0), r1 = Row (y1);
+		int r, c;
+		for (r = r0; r <= r1; r++) {
+			for (c = c0; c <= c1; c++) {
+				int item;
+				for (item = cell_head[r * columns + c]; item >= 0; item = item_next[item]) {
+					if (item_x[item] >= x0 && item_x[item] <= x1 &&
+							item_y[item] >= y0 && item_y[item] <= y1)
+						visit (item);
+				}
+			}
+		}
+	}
+
+	// Calls visit(item) for each item within radius of (x,y).
+	template <class Visitor>
+	void VisitRadius (float x, float y, float radius, Visitor & visit) const {
+		if (cell_head.size() == 0)
+			return;
+		float r2 = radius * radius;
+		int c0 = Column (x - radius), c1 = Column (x + radius);
+		int r0 = Row (y - radius), r1 = Row (y + radius);
+		int r, c;
+		for (r = r0; r <= r1; r++) {
+			for (c = c0; c <= c1; c++) {
+				int item;
+				for (item = cell_head[r * columns + c]; item >= 0; item = item_next[item]) {
+					float dx = item_x[item] - x;
+					float dy = item_y[item] - y;
+					if (dx * dx + dy * dy <= r2)
+						visit (item);
+				}
+			}
+		}
+	}
+
+	// Items within the rectangle [x0,x1] x [y0,y1].
+	void QueryRect (float x0, float y0, float x1, float y1, std::vector<int> & out) const {
+		Collector collect (out);
+		VisitRect (x0, y0, x1, y1, collect);
+	}
+
+	// Items within radius of (x,y).
+	void QueryRadius (float x, float y, float radius, std::vector<int> & out) const {
+		Collector collect (out);
+		VisitRadius (x, y, radius, collect);
+	}
+
+	// The k items nearest to (x,y), nearest first, no farther than max_radius.
+	// (k is limited to MAX_NEAREST.) items must have room for k entries.
+	// Returns the number found.
+	int Nearest (float x, float y, int k, float max_radius, int * items) const;
+
+	// As above, appending to a vector.
+	int QueryNearest (float x, float y, int k, float max_radius, std::vector<int> & out) const {
+		int items[MAX_NEAREST];
+		int found = Nearest (x, y, k, max_radius, items);
+		out.insert (out.end(), items, items + found);
+		return found;
+	}
+
+	// Position of an item in the grid.
+	float get_x (int item) const { return item_x[item]; }
+	float get_y (int item) const { return item_y[item]; }
+
+	// Grid geometry, for owners that index their own data by cell.
+	int CellOf (int item) const { return item_cell[item]; }
+	int CellAt (float x, float y) const;
+	int cell_count () const { return columns * rows; }
+	int get_columns () const { return columns; }
+	int get_rows () const { return rows; }
+	float get_cell_size () const { return cell_size; }
+
+	// Saves the items and their lists, or puts back what was saved.
+	// The geometry is not saved: restore into a grid of the same size.
+	void Save (StateBlock & block) const;
+	void Restore (StateBlock & block);
+
+private:
+	// Visitor that appends items to a vector.
+	struct Collector {
+		std::vector<int> & out;
+		Collector (std::vector<int> & _out) : out(_out) { }
+		void operator() (int item) { out.push_back (item); }
+	};
+
+	// Links an item into the head of a cell's list, or unlinks it.
+	void Link (int item, int cell);
+	void Unlink (int item);
+
+	// Column or row of a coordinate, clamped to the grid.
+	int Column (float x) const;
+	int Row (float y) const;
+};
+
+#endif
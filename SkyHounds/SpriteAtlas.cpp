@@ -0,0 +1,138 @@
+#include "libraries.h"
+
+#include "SpriteAtlas.h"
+
+// Sprites go before the pages they are sub-bitmaps of.
+SpriteAtlas::~SpriteAtlas () {
+	int i;
+	for (i = 0; i < (signed) sprites.size(); i++) {
+		if (sprites[i].image)
+			al_destroy_bitmap (sprites[i].image);
+		if (sprites[i].region)
+			al_destroy_bitmap (sprites[i].region);
+	}
+	for (i = 0; i < (signed) pages.size(); i++)
+		al_destroy_bitmap (pages[i]);
+}
+
+// Adds an image to be packed, and returns its sprite number.
+int SpriteAtlas::Add (ALLEGRO_BITMAP * image) {
+	if (packed) {
+		warning (this, "Sprite added after packing");
+		breakpoint ();
+	}
+	Sprite sprite;
+	sprite.image = image;
+	sprite.region = NULL;
+	sprite.page = -1;
+	sprite.x = sprite.y = 0;
+	sprites.push_back (sprite);
+	return (signed) sprites.size() - 1;
+}
+
+// Places the sprites, makes the pages, and frees the images.
+bool SpriteAtlas::Pack () {
+	packed = true;
+	std::vector<std::pair<int,int> > page_sizes;
+	Place (page_sizes);
+	bool made = true;
+	int page, i;
+	for (page = 0; page < (signed) page_sizes.size(); page++) {
+		ALLEGRO_BITMAP * bitmap = MakePage (page, page_sizes[page].first, page_sizes[page].second);
+		if (! bitmap)
+			made = false;
+		pages.push_back (bitmap);
+	}
+	for (i = 0; i < (signed) sprites.size(); i++) {
+		Sprite & sprite = sprites[i];
+		if (pages[sprite.page]) {
+			sprite.region = al_create_sub_bitmap (pages[sprite.page], sprite.x, sprite.y,
+				al_get_bitmap_width (sprite.image), al_get_bitmap_height (sprite.image));
+		}
+		al_destroy_bitmap (sprite.image);
+		sprite.image = NULL;
+	}
+	return made;
+}
+
+// Tallest first, left to right along shelves, a new shelf when one is
+// full and a new page when a page is. Pages are trimmed to what is on
+// them.
+void SpriteAtlas::Place (std::vector<std::pair<int,int> > & page_sizes) {
+	std::vector<std::pair<int,int> > order;  // (-height, sprite)
+	int i;
+	for (i = 0; i < (signed) sprites.size(); i++)
+		order.push_back (std::make_pair (-al_get_bitmap_height (sprites[i].image), i));
+	std::sort (order.begin(), order.end());
+
+	int shelf_page = -1;
+	int shelf_x = 0, shelf_y = 0, shelf_height = 0;
+	for (i = 0; i < (signed) order.size(); i++) {
+		Sprite & sprite = sprites[order[i].second];
+		int width = al_get_bitmap_width (sprite.image) + 2 * PADDING;
+		int height = al_get_bitmap_height (sprite.image) + 2 * PADDING;
+		if (width > PAGE_SIZE || height > PAGE_SIZE) {
+			// A page of its own.
+			sprite.page = (signed) page_sizes.size();
+			sprite.x = sprite.y = PADDING;
+			page_sizes.push_back (std::make_pair (width, height));
+			continue;
+		}
+		if (shelf_page >= 0 && shelf_x + width > PAGE_SIZE) {
+			shelf_x = 0;
+			shelf_y += shelf_height;
+			shelf_height = 0;
+		}
+		if (shelf_page < 0 || shelf_y + height > PAGE_SIZE) {
+			shelf_page = (signed) page_sizes.size();
+			page_sizes.push_back (std::make_pair (0, 0));
+			shelf_x = shelf_y = shelf_height = 0;
+		}
+		sprite.page = shelf_page;
+		sprite.x = shelf_x + PADDING;
+		sprite.y = shelf_y + PADDING;
+		shelf_x += width;
+		if (height > shelf_height)
+			shelf_height = height;
+		std::pair<int,int> & size = page_sizes[shelf_page];
+		size.first = std::max (size.first, shelf_x);
+		size.second = std::max (size.second, shelf_y + height);
+	}
+}
+
+// Copies a page's sprites onto a clear memory bitmap, as they are (no
+// blending), and makes a texture of it with the caller's bitmap flags.
+// The target bitmap and blender are put back as they were.
+ALLEGRO_BITMAP * SpriteAtlas::MakePage (int page, int page_width, int page_height) {
+	int flags = al_get_new_bitmap_flags ();
+	al_set_new_bitmap_flags (ALLEGRO_MEMORY_BITMAP);
+	ALLEGRO_BITMAP * sheet = al_create_bitmap (page_width, page_height);
+	al_set_new_bitmap_flags (flags);
+	if (! sheet) {
+		warning (this, "Can't make a %d x %d sprite page", page_width, page_height);
+		breakpoint ();
+		return NULL;
+	}
+
+	ALLEGRO_BITMAP * target = al_get_target_bitmap ();
+	int op, source, dest;
+	al_get_blender (&op, &source, &dest);
+	al_set_target_bitmap (sheet);
+	al_set_blender (ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ZERO);
+	al_clear_to_color (al_map_rgba (0, 0, 0, 0));
+	int i;
+	for (i = 0; i < (signed) sprites.size(); i++) {
+		if (sprites[i].page == page)
+			al_draw_bitmap (sprites[i].image, (float) sprites[i].x, (float) sprites[i].y, 0);
+	}
+	al_set_target_bitmap (target);
+	al_set_blender (op, source, dest);
+
+	ALLEGRO_BITMAP * texture = al_clone_bitmap (sheet);
+	al_destroy_bitmap (sheet);
+	if (! texture) {
+		warning (this, "Can't make a texture for a %d x %d sprite page", page_width, page_height);
+		breakpoint ();
+	}
+	return texture;
+}
@@ -0,0 +1,67 @@
+/**
+A SpriteAtlas packs many small images (avatar tokens and their animation
+frames) into a few large textures, its pages, so that drawing them doesn't
+switch textures from one to the next. Each sprite is a sub-bitmap of its
+page, so it is drawn like any other bitmap; with al_hold_bitmap_drawing on,
+Allegro gathers draws from the same page into one call.
+
+Images are added as memory bitmaps while loading, then packed all at once:
+tallest first, in rows (shelves) across each page, with a pixel of clear
+space round each so that filtering doesn't bleed one into the next. An
+image too large for a page gets a page of its own.
+
+Pack makes textures, so call it on the thread with the display. Nothing
+is added after.
+*/
+
+#ifndef SPRITE_ATLAS_H
+#define SPRITE_ATLAS_H
+
+class SpriteAtlas {
+public:
+	// Width and height of a page, in pixels. (2048 is within what any
+	// graphics card we run on can hold.)
+	enum { PAGE_SIZE = 2048 };
+
+	// Clear pixels between sprites.
+	enum { PADDING = 1 };
+
+	SpriteAtlas () : packed(false) { }
+	~SpriteAtlas ();
+
+	// Adds an image to be packed, and returns its sprite number. The atlas
+	// takes the image (a memory bitmap) and frees it when packed.
+	int Add (ALLEGRO_BITMAP * image);
+
+	// Packs the images added into pages, as textures. Returns false if a
+	// page couldn't be made.
+	bool Pack ();
+
+	int sprite_count () const { return (signed) sprites.size(); }
+	int page_count () const { return (signed) pages.size(); }
+
+	// A sprite, as a sub-bitmap of its page. (NULL=not packed)
+	ALLEGRO_BITMAP * get_sprite (int sprite) const { return sprites[sprite].region; }
+
+	// The page a sprite is on, for drawing sprites in page order.
+	int get_page (int sprite) const { return sprites[sprite].page; }
+
+private:
+	struct Sprite {
+		ALLEGRO_BITMAP * image;   // Until packed.
+		ALLEGRO_BITMAP * region;  // Once packed.
+		int page;
+		int x, y;
+	};
+	std::vector<Sprite> sprites;
+	std::vector<ALLEGRO_BITMAP*> pages;
+	bool packed;
+
+	// Places sprites on pages, and returns each page's size.
+	void Place (std::vector<std::pair<int,int> > & page_sizes);
+
+	// Copies a page's sprites onto a memory bitmap, and makes it a texture.
+	ALLEGRO_BITMAP * MakePage (int page, int page_width, int page_height);
+};
+
+#endif
@@ -20,6 +20,7 @@ struct StateAvatarScenario {
 	float target_x, target_y;            // Where do I want to aim?
 	int desired_weapon_id;               // What weapon do I want to use?
 	bool fire_impulse;                   // Do I want to fire my weapon?
+	int fire_rewind;                     // How many ticks behind the server was my view? (set by the server)
 };
 
 // CONTROL PROTOCOL:
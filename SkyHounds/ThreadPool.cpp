@@ -0,0 +1,172 @@
+#include "libraries.h"
+
+#include "ThreadPool.h"
+
+// Starts the given number of worker threads.
+ThreadPool::ThreadPool (int threads)
+	: generation(0), stopping(false), remaining(0)
+{
+	mutex = al_create_mutex ();
+	wake = al_create_cond ();
+	done = al_create_cond ();
+
+	int i;
+	for (i = 0; i <= threads; i++) {
+		Queue * queue = new Queue;
+		queue->mutex = al_create_mutex ();
+		queues.push_back (queue);
+	}
+
+	for (i = 0; i < threads; i++) {
+		Worker * worker = new Worker;
+		worker->pool = this;
+		worker->index = i;
+		worker->thread = al_create_thread (WorkerMain, worker);
+		if (! worker->thread) {
+			warning (this, "Could not create worker thread %d", i);
+			breakpoint ();
+			delete worker;
+			continue;
+		}
+		workers.push_back (worker);
+		al_start_thread (worker->thread);
+	}
+}
+
+ThreadPool::~ThreadPool () {
+	al_lock_mutex (mutex);
+	stopping = true;
+	al_broadcast_cond (wake);
+	al_unlock_mutex (mutex);
+
+	int i;
+	for (i = 0; i < (signed) workers.size(); i++) {
+		al_join_thread (workers[i]->thread, NULL);
+		al_destroy_thread (workers[i]->thread);
+		delete workers[i];
+	}
+	for (i = 0; i < (signed) queues.size(); i++) {
+		al_destroy_mutex (queues[i]->mutex);
+		delete queues[i];
+	}
+	al_destroy_cond (done);
+	al_destroy_cond (wake);
+	al_destroy_mutex (mutex);
+}
+
+// Runs job over items [0, count), in ranges of at most grain items.
+// Returns when every range has finished.
+void ThreadPool::ParallelFor (Job * job, int count, int grain) {
+	if (count <= 0)
+		return;
+	if (grain < 1)
+		grain = 1;
+
+	// No workers: just run it here.
+	int self = (signed) queues.size() - 1;
+	if (self == 0) {
+		job->Run (0, count);
+		return;
+	}
+
+	// Deal ranges out round-robin, so every queue starts with a fair share.
+	int n_ranges = (count + grain - 1) / grain;
+	atomic_exchange (&remaining, n_ranges);
+	int r;
+	for (r = 0; r < n_ranges; r++) {
+		Range range;
+		range.job = job;
+		range.begin = r * grain;
+		range.end = range.begin + grain < count ? range.begin + grain : count;
+		Queue * queue = queues[r % queues.size()];
+		al_lock_mutex (queue->mutex);
+		queue->ranges.push_back (range);
+		al_unlock_mutex (queue->mutex);
+	}
+
+	// Wake the workers.
+	al_lock_mutex (mutex);
+	generation++;
+	al_broadcast_cond (wake);
+	al_unlock_mutex (mutex);
+
+	// Work alongside them until nothing is left to take.
+	while (RunOne (self))
+		;
+
+	// Wait for ranges still running on other threads.
+	al_lock_mutex (mutex);
+	while (atomic_read (&remaining) > 0)
+		al_wait_cond (done, mutex);
+	al_unlock_mutex (mutex);
+}
+
+// Takes one range (own queue first, then steal) and runs it.
+// Returns false if there was nothing to take.
+bool ThreadPool::RunOne (int self) {
+	Range range;
+	bool found = false;
+
+	// Own queue: take from the front.
+	Queue * own = queues[self];
+	al_lock_mutex (own->mutex);
+	if (own->ranges.size() > 0) {
+		range = own->ranges.front ();
+		own->ranges.pop_front ();
+		found = true;
+	}
+	al_unlock_mutex (own->mutex);
+
+	// Steal from the back of the other queues, starting with our neighbour.
+	int n = (signed) queues.size();
+	int k;
+	for (k = 1; k < n && ! found; k++) {
+		Queue * victim = queues[(self + k) % n];
+		al_lock_mutex (victim->mutex);
+		if (victim->ranges.size() > 0) {
+			range = victim->ranges.back ();
+			victim->ranges.pop_back ();
+			found = true;
+		}
+		al_unlock_mutex (victim->mutex);
+	}
+
+	if (! found)
+		return false;
+
+	range.job->Run (range.begin, range.end);
+
+	// Last one out wakes the caller.
+	if (atomic_decrement (&remaining) == 0) {
+		al_lock_mutex (mutex);
+		al_broadcast_cond (done);
+		al_unlock_mutex (mutex);
+	}
+	return true;
+}
+
+// Worker thread: runs ranges of each job posted. A pool made from a pinned
+// thread (e.g., the render thread) would share its core, so workers let go
+// of it first.
+void * ThreadPool::WorkerMain (ALLEGRO_THREAD * thread, void * arg) {
+	Worker * worker = (Worker *) arg;
+	ThreadPool * pool = worker->pool;
+	unpin_current_thread ();
+	int seen = 0;
+	for (;;) {
+		// Sleep until a new job is posted.
+		al_lock_mutex (pool->mutex);
+		while (pool->generation == seen && ! pool->stopping)
+			al_wait_cond (pool->wake, pool->mutex);
+		if (pool->stopping) {
+			al_unlock_mutex (pool->mutex);
+			return NULL;
+		}
+		seen = pool->generation;
+		al_unlock_mutex (pool->mutex);
+
+		// Work until no queue has anything left.
+		while (pool->RunOne (worker->index))
+			;
+	}
+}
@@ -0,0 +1,69 @@
+/**
+A ThreadPool runs data-parallel jobs on a fixed set of worker threads.
+
+A job is split into ranges of items. Each worker has its own queue of
+ranges; it takes work from the front of its own queue, and when that runs
+dry it steals from the back of another worker's queue. The thread that
+calls ParallelFor works too, so a pool of N threads uses N+1 cores.
+*/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+class ThreadPool {
+public:
+	// Work to be done on a range of items [begin, end).
+	// Run may be called concurrently on different ranges.
+	class Job {
+	public:
+		virtual ~Job () { }
+		virtual void Run (int begin, int end) = 0;
+	};
+
+	// Starts the given number of worker threads.
+	ThreadPool (int threads);
+	~ThreadPool ();
+
+	// Number of worker threads (not counting the caller).
+	int size () const { return (signed) workers.size(); }
+
+	// Runs job over items [0, count), in ranges of at most grain items.
+	// Returns when every range has finished.
+	void ParallelFor (Job * job, int count, int grain);
+
+private:
+	struct Range {
+		Job * job;
+		int begin, end;
+	};
+
+	// One queue per worker, plus one for the calling thread (the last).
+	struct Queue {
+		ALLEGRO_MUTEX * mutex;
+		std::deque<Range> ranges;
+	};
+
+	struct Worker {
+		ThreadPool * pool;
+		int index;
+		ALLEGRO_THREAD * thread;
+	};
+
+	std::vector<Queue*> queues;
+	std::vector<Worker*> workers;
+
+	ALLEGRO_MUTEX * mutex;   // Guards generation, stopping, and the conditions.
+	ALLEGRO_COND * wake;     // Signalled when a new job is posted.
+	ALLEGRO_COND * done;     // Signalled when the last range finishes.
+	int generation;          // Incremented for each job posted.
+	bool stopping;
+	volatile long remaining; // Ranges not yet finished.
+
+	// Takes one range (own queue first, then steal) and runs it.
+	// Returns false if there was nothing to take.
+	bool RunOne (int self);
+
+	static void * WorkerMain (ALLEGRO_THREAD * thread, void * arg);
+};
+
+#endif
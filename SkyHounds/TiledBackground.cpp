@@ -0,0 +1,451 @@
+#include "libraries.h"
+
+#include "Script.h"
+#include "TiledBackground.h"
+
+TiledBackground::TiledBackground ()
+	: width(0), height(0), frame(0), resident(0), max_resident(64), loader(NULL)
+{
+	mutex = al_create_mutex ();
+	wake = al_create_cond ();
+}
+
+// Stops the loader, and frees every tile.
+TiledBackground::~TiledBackground () {
+	if (loader) {
+		al_set_thread_should_stop (loader);
+		al_lock_mutex (mutex);
+		al_broadcast_cond (wake);
+		al_unlock_mutex (mutex);
+		al_join_thread (loader, NULL);
+		al_destroy_thread (loader);
+	}
+	int i;
+	for (i = 0; i < (signed) tiles.size(); i++) {
+		if (tiles[i].texture)
+			al_destroy_bitmap (tiles[i].texture);
+	}
+	for (i = 0; i < (signed) loaded.size(); i++)
+		al_destroy_bitmap (loaded[i].second);
+	al_destroy_cond (wake);
+	al_destroy_mutex (mutex);
+}
+
+// Levels in a pyramid for an image of this size (see MakeLevels).
+static int LevelCount (int width, int height) {
+	int count = 1;
+	while (width > TiledBackground::TILE_SIZE || height > TiledBackground::TILE_SIZE) {
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+		count++;
+	}
+	return count;
+}
+
+// Opens the tiles in folder/tiles/, cutting them from image, or from
+// folder/background.png if not given, unless they are cut already.
+bool TiledBackground::Open (std::string folder, ALLEGRO_BITMAP * image) {
+	tile_folder = folder + "tiles/";
+	if (IsCut (folder, &width, &height)) {
+		MakeLevels ();
+		if (image)
+			al_destroy_bitmap (image);
+	} else if (! Cut (folder, image)) {
+		levels.clear ();
+		tiles.clear ();
+		return false;
+	}
+
+	loader = al_create_thread (LoaderMain, this);
+	if (! loader) {
+		warning (this, "Could not create background loader thread");
+		breakpoint ();
+		levels.clear ();
+		tiles.clear ();
+		return false;
+	}
+	al_start_thread (loader);
+	return true;
+}
+
+// Is there an index in folder/tiles/ for this tile size and pyramid? The
+// index is written last, so tiles half cut don't count.
+bool TiledBackground::IsCut (std::string folder, int * width, int * height) {
+	std::string index = folder + "tiles/tiles.txt";
+	if (! al_filename_exists (index.c_str()))
+		return false;
+	Script info (index);
+	int cut_width = info.integer ("width");
+	int cut_height = info.integer ("height");
+	if (cut_width <= 0 || cut_height <= 0 || info.integer ("tile_size") != TILE_SIZE || ! info.defines ("levels") ||
+			info.integer ("levels") != LevelCount (cut_width, cut_height))
+		return false;
+	if (width)
+		*width = cut_width;
+	if (height)
+		*height = cut_height;
+	return true;
+}
+
+// Sets the video memory tiles may take, at 4 bytes a pixel.
+void TiledBackground::SetBudget (int megabytes) {
+	max_resident = (int) ((int64_t) megabytes * 1024 * 1024 / (TILE_SIZE * TILE_SIZE * 4));
+	if (max_resident < 1)
+		max_resident = 1;
+}
+
+// Draws the tiles overlapping [x0,x1] x [y0,y1] at the level for zoom,
+// takes back what the loader has loaded, asks for what is missing in the
+// window, and evicts.
+// Level L is used once zoom is at most 1/2^L, when its texels are still no
+// larger than display pixels.
+void TiledBackground::Draw (float x0, float y0, float x1, float y1, float zoom) {
+	if (levels.size() == 0)
+		return;
+	frame++;
+	int level = 0;
+	while (level + 1 < level_count () && zoom <= 1.0f / (2 << level))
+		level++;
+	const Level & l = levels[level];
+	float span = (float) (TILE_SIZE << level);
+	int c0 = clamp ((int) floor (x0 / span), 0, l.columns - 1);
+	int r0 = clamp ((int) floor (y0 / span), 0, l.rows - 1);
+	int c1 = clamp ((int) floor (x1 / span), 0, l.columns - 1);
+	int r1 = clamp ((int) floor (y1 / span), 0, l.rows - 1);
+	int wc0 = c0 > 0 ? c0 - 1 : 0;
+	int wr0 = r0 > 0 ? r0 - 1 : 0;
+	int wc1 = c1 < l.columns - 1 ? c1 + 1 : c1;
+	int wr1 = r1 < l.rows - 1 ? r1 + 1 : r1;
+	TakeLoaded (level, wc0, wr0, wc1, wr1);
+
+	// The last level's tile stands in for any not loaded yet, so it is
+	// wanted before anything else.
+	order.clear ();
+	int last = levels.back ().first;
+	tiles[last].last_used = frame;
+	if (! tiles[last].texture && last != l.first)
+		order.push_back (std::make_pair (1.0f, last));
+
+	// Draw what is on view, and list what is missing from the window.
+	float centre_x = (x0 + x1) / 2;
+	float centre_y = (y0 + y1) / 2;
+	int r, c;
+	for (r = wr0; r <= wr1; r++) {
+		for (c = wc0; c <= wc1; c++) {
+			int i = l.first + r * l.columns + c;
+			Tile & tile = tiles[i];
+			tile.last_used = frame;
+			if (c >= c0 && c <= c1 && r >= r0 && r <= r1)
+				DrawTile (level, c, r);
+			if (! tile.texture) {
+				float dx = (c + 0.5f) * span - centre_x;
+				float dy = (r + 0.5f) * span - centre_y;
+				order.push_back (std::make_pair (-(dx * dx + dy * dy), i));
+			}
+		}
+	}
+
+	// Ask for them, nearest last, in place of what was asked for before.
+	std::sort (order.begin(), order.end());
+	al_lock_mutex (mutex);
+	wanted.clear ();
+	int i;
+	for (i = 0; i < (signed) order.size(); i++) {
+		if (! tiles[order[i].second].loading)
+			wanted.push_back (order[i].second);
+	}
+	if (wanted.size() > 0)
+		al_signal_cond (wake);
+	al_unlock_mutex (mutex);
+
+	Evict ();
+}
+
+// Levels from the image size down, each half the last (rounding up),
+// until one fits in a tile.
+void TiledBackground::MakeLevels () {
+	levels.clear ();
+	int level_width = width;
+	int level_height = height;
+	int first = 0;
+	for (;;) {
+		Level l;
+		l.columns = (level_width + TILE_SIZE - 1) / TILE_SIZE;
+		l.rows = (level_height + TILE_SIZE - 1) / TILE_SIZE;
+		l.first = first;
+		first += l.columns * l.rows;
+		levels.push_back (l);
+		if (level_width <= TILE_SIZE && level_height <= TILE_SIZE)
+			break;
+		level_width = (level_width + 1) / 2;
+		level_height = (level_height + 1) / 2;
+	}
+	tiles.assign (first, Tile ());
+}
+
+// Cuts background.png, loaded as a memory bitmap (or image, if given), into
+// tile files at every level, and writes the index. Edge tiles are only as large as what is left.
+bool TiledBackground::Cut (std::string folder, ALLEGRO_BITMAP * image) {
+	std::string file_name = folder + "background.png";
+	int flags = al_get_new_bitmap_flags ();
+	al_set_new_bitmap_flags (ALLEGRO_MEMORY_BITMAP);
+	if (! image)
+		image = al_load_bitmap (file_name.c_str());
+	if (! image) {
+		al_set_new_bitmap_flags (flags);
+		warning (this, "Can't load %s", file_name.c_str());
+		breakpoint ();
+		return false;
+	}
+	width = al_get_bitmap_width (image);
+	height = al_get_bitmap_height (image);
+	MakeLevels ();
+	al_make_directory (tile_folder.c_str());
+	int level;
+	for (level = 0; level < level_count (); level++) {
+		char name[16];
+		sprintf (name, "%d/", level);
+		al_make_directory ((tile_folder + name).c_str());
+		const Level & l = levels[level];
+		int image_width = al_get_bitmap_width (image);
+		int image_height = al_get_bitmap_height (image);
+		int r, c;
+		for (r = 0; r < l.rows; r++) {
+			for (c = 0; c < l.columns; c++) {
+				int x = c * TILE_SIZE;
+				int y = r * TILE_SIZE;
+				ALLEGRO_BITMAP * part = al_create_sub_bitmap (image, x, y,
+					std::min ((int) TILE_SIZE, image_width - x), std::min ((int) TILE_SIZE, image_height - y));
+				std::string tile_name = TileFile (l.first + r * l.columns + c);
+				if (! al_save_bitmap (tile_name.c_str(), part)) {
+					warning (this, "Can't save %s", tile_name.c_str());
+					breakpoint ();
+				}
+				al_destroy_bitmap (part);
+			}
+		}
+		if (level + 1 < level_count ()) {
+			ALLEGRO_BITMAP * half = Halve (image);
+			al_destroy_bitmap (image);
+			image = half;
+			if (! image) {
+				al_set_new_bitmap_flags (flags);
+				return false;
+			}
+		}
+	}
+	al_destroy_bitmap (image);
+	al_set_new_bitmap_flags (flags);
+
+	std::string index = tile_folder + "tiles.txt";
+	FILE * fp = fopen (index.c_str(), "wb");
+	if (! fp) {
+		warning (this, "Can't write %s", index.c_str());
+		breakpoint ();
+		return true;   // (the tiles are there; they will be cut again next time)
+	}
+	fprintf (fp, "width = %d\nheight = %d\ntile_size = %d\nlevels = %d\n",
+		width, height, (int) TILE_SIZE, level_count ());
+	fclose (fp);
+	return true;
+}
+
+// Halves an image, rounding up, each pixel the average of the 2x2 block
+// beneath it (an odd last row or column is counted twice). Makes whatever
+// the new bitmap flags say: memory, when cutting.
+ALLEGRO_BITMAP * TiledBackground::Halve (ALLEGRO_BITMAP * image) {
+	int image_width = al_get_bitmap_width (image);
+	int image_height = al_get_bitmap_height (image);
+	int half_width = (image_width + 1) / 2;
+	int half_height = (image_height + 1) / 2;
+	ALLEGRO_BITMAP * half = al_create_bitmap (half_width, half_height);
+	if (! half) {
+		warning (this, "Can't make a %d x %d background level", half_width, half_height);
+		breakpoint ();
+		return NULL;
+	}
+
+	// Bytes are R, G, B, A in memory order with this format.
+	ALLEGRO_LOCKED_REGION * from = al_lock_bitmap (image,
+		ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+	ALLEGRO_LOCKED_REGION * to = al_lock_bitmap (half,
+		ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_WRITEONLY);
+	if (! from || ! to) {
+		warning (this, "Can't lock background level");
+		breakpoint ();
+		if (from)
+			al_unlock_bitmap (image);
+		if (to)
+			al_unlock_bitmap (half);
+		al_destroy_bitmap (half);
+		return NULL;
+	}
+	int x, y, k;
+	for (y = 0; y < half_height; y++) {
+		const unsigned char * top = (const unsigned char *) from->data + 2 * y * from->pitch;
+		const unsigned char * bottom = 2 * y + 1 < image_height ? top + from->pitch : top;
+		unsigned char * pixel = (unsigned char *) to->data + y * to->pitch;
+		for (x = 0; x < half_width; x++, pixel += 4) {
+			int left = 8 * x;
+			int right = 2 * x + 1 < image_width ? left + 4 : left;
+			for (k = 0; k < 4; k++)
+				pixel[k] = (unsigned char) ((top[left + k] + top[right + k] + bottom[left + k] + bottom[right + k] + 2) / 4);
+		}
+	}
+	al_unlock_bitmap (half);
+	al_unlock_bitmap (image);
+	return half;
+}
+
+// The level a tile belongs to.
+int TiledBackground::LevelOf (int index) const {
+	int level;
+	for (level = level_count () - 1; level > 0; level--) {
+		if (index >= levels[level].first)
+			break;
+	}
+	return level;
+}
+
+// tiles/LEVEL/X_Y.png, in tiles of the level across and down.
+std::string TiledBackground::TileFile (int index) const {
+	int level = LevelOf (index);
+	const Level & l = levels[level];
+	int local = index - l.first;
+	char name[48];
+	sprintf (name, "%d/%d_%d.png", level, local % l.columns, local / l.columns);
+	return tile_folder + name;
+}
+
+// Is a tile in [c0,c1] x [r0,r1] of level?
+bool TiledBackground::Within (int index, int level, int c0, int r0, int c1, int r1) const {
+	if (LevelOf (index) != level)
+		return false;
+	const Level & l = levels[level];
+	int c = (index - l.first) % l.columns;
+	int r = (index - l.first) / l.columns;
+	return c >= c0 && c <= c1 && r >= r0 && r <= r1;
+}
+
+// Draws tile (c,r) of level from the first level at or above it that has
+// the tile covering it resident: the whole tile at its own level, or the
+// part of a coarser tile over the same map rectangle, stretched. The tile
+// drawn from is marked drawn, so it isn't evicted from under the view.
+void TiledBackground::DrawTile (int level, int c, int r) {
+	int k;
+	for (k = level; k < level_count (); k++) {
+		int shift = k - level;
+		const Level & l = levels[k];
+		int column = c >> shift;
+		int row = r >> shift;
+		Tile & tile = tiles[l.first + row * l.columns + column];
+		ALLEGRO_BITMAP * texture = tile.texture;
+		if (! texture)
+			continue;
+		tile.last_used = tile.last_drawn = frame;
+		float size = (float) TILE_SIZE / (1 << shift);
+		float sx = (c - (column << shift)) * size;
+		float sy = (r - (row << shift)) * size;
+		float sw = std::min (size, al_get_bitmap_width (texture) - sx);
+		float sh = std::min (size, al_get_bitmap_height (texture) - sy);
+		if (sw <= 0 || sh <= 0)
+			return;
+		float scale = (float) (1 << k);
+		al_draw_scaled_bitmap (texture, sx, sy, sw, sh,
+			(column * TILE_SIZE + sx) * scale, (row * TILE_SIZE + sy) * scale,
+			sw * scale, sh * scale, 0);
+		return;
+	}
+}
+
+// Turns up to UPLOADS_PER_FRAME loaded tiles into textures: those in the
+// window [c0,c1] x [r0,r1] of level, and the last level's. Any others are
+// thrown away; the rest wait for the next frame.
+void TiledBackground::TakeLoaded (int level, int c0, int r0, int c1, int r1) {
+	al_lock_mutex (mutex);
+	std::vector<std::pair<int, ALLEGRO_BITMAP*> > taken;
+	taken.swap (loaded);
+	int last = levels.back ().first;
+	int uploads = 0;
+	int i;
+	for (i = 0; i < (signed) taken.size(); i++) {
+		int index = taken[i].first;
+		ALLEGRO_BITMAP * bitmap = taken[i].second;
+		Tile & tile = tiles[index];
+		bool keep = index == last || Within (index, level, c0, r0, c1, r1);
+		if (keep && ! tile.texture && uploads == UPLOADS_PER_FRAME) {
+			loaded.push_back (taken[i]);
+			continue;
+		}
+		if (keep && ! tile.texture) {
+			tile.texture = al_clone_bitmap (bitmap);
+			uploads++;
+			if (tile.texture)
+				resident++;
+			else {
+				warning (this, "Can't make a texture for %s", TileFile (index).c_str());
+				breakpoint ();
+			}
+		}
+		al_destroy_bitmap (bitmap);
+		tile.loading = false;
+	}
+	al_unlock_mutex (mutex);
+}
+
+// Evicts the least recently used tiles, other than those drawn this frame
+// (on view, or standing in for one) and the last level's, until within the
+// budget. Tiles in the window were used this frame, so those outside it go
+// first.
+void TiledBackground::Evict () {
+	if (resident <= max_resident)
+		return;
+	order.clear ();
+	int last = levels.back ().first;
+	int i;
+	for (i = 0; i < (signed) tiles.size(); i++) {
+		if (tiles[i].texture && i != last && tiles[i].last_drawn != frame)
+			order.push_back (std::make_pair ((float) tiles[i].last_used, i));
+	}
+	std::sort (order.begin(), order.end());
+	for (i = 0; i < (signed) order.size() && resident > max_resident; i++) {
+		Tile & tile = tiles[order[i].second];
+		al_destroy_bitmap (tile.texture);
+		tile.texture = NULL;
+		resident--;
+	}
+}
+// Loader thread: loads the nearest tile asked for into a memory bitmap,
+// and hands it back. A tile that can't be loaded is never asked for
+// again (it stays loading). Runs on any core, not the render thread's.
+void * TiledBackground::LoaderMain (ALLEGRO_THREAD * thread, void * arg) {
+	TiledBackground * background = (TiledBackground *) arg;
+	unpin_current_thread ();
+	al_set_new_bitmap_flags (ALLEGRO_MEMORY_BITMAP);
+	al_lock_mutex (background->mutex);
+	for (;;) {
+		while (background->wanted.empty () && ! al_get_thread_should_stop (thread))
+			al_wait_cond (background->wake, background->mutex);
+		if (al_get_thread_should_stop (thread))
+			break;
+		int index = background->wanted.back ();
+		background->wanted.pop_back ();
+		if (background->tiles[index].loading)
+			continue;
+		background->tiles[index].loading = true;
+		std::string file_name = background->TileFile (index);
+		al_unlock_mutex (background->mutex);
+
+		ALLEGRO_BITMAP * bitmap = al_load_bitmap (file_name.c_str());
+
+		al_lock_mutex (background->mutex);
+		if (bitmap)
+			background->loaded.push_back (std::make_pair (index, bitmap));
+		else {
+			warning (background, "Can't load %s", file_name.c_str());
+			breakpoint ();
+		}
+	}
+	al_unlock_mutex (background->mutex);
+	return NULL;
+}
@@ -0,0 +1,136 @@
+/**
+A TiledBackground draws a scenario's background image in square tiles,
+loading only those near the view, so that a map can be far larger than the
+largest texture the graphics card can hold, or than video memory.
+
+The background is kept as a pyramid of levels: level 0 is the image
+itself, and each level after it is half the width and height of the one
+before (each pixel the average of four), down to one that fits in a single
+tile. Drawing uses the coarsest level that still has a texel for every
+display pixel, so a zoomed-out view reads and fills about as many texels
+as it has pixels, rather than the whole map's worth.
+
+The tiles are kept on disk, as PNGs in the scenario's tiles folder, one
+folder per level. The first time a background is opened, background.png is
+loaded into memory (not as a texture, so its size doesn't matter), halved
+level by level and cut up; after that only the tiles are read.
+
+Drawing asks for the tiles that overlap the view, and those within a tile
+of it (the residency window), nearest to the centre first. A loader thread
+decodes them into memory bitmaps; the render thread turns a few a frame
+into textures, so a quick scroll doesn't stall a frame. A tile not yet
+loaded is drawn from a coarser level that is, if any; the last level is
+always kept, so once it has loaded there is one. Textures are kept within
+a budget: when it is full, the tiles used longest ago outside the window
+go first. Tiles on view are always kept, even over the budget, as are
+coarser tiles standing in for them.
+
+Everything but Open and the budget belongs to the render thread.
+*/
+
+#ifndef TILED_BACKGROUND_H
+#define TILED_BACKGROUND_H
+
+class TiledBackground {
+public:
+	// Width and height of a tile, in pixels of its level.
+	enum { TILE_SIZE = 512 };
+
+	// Most tiles turned into textures in one frame.
+	enum { UPLOADS_PER_FRAME = 4 };
+
+	TiledBackground ();
+	~TiledBackground ();
+
+	// Opens the background in a scenario's image folder: the tiles in
+	// folder/tiles/LEVEL/, cut from folder/background.png if they aren't
+	// there yet (delete the tiles after changing the background). If image
+	// is given, it is background.png, already loaded as a memory bitmap,
+	// and is freed. Starts the loader. Returns false if there is neither.
+	bool Open (std::string folder, ALLEGRO_BITMAP * image = NULL);
+
+	// Have the tiles in a scenario's image folder been cut? If so, gives
+	// the background's size.
+	static bool IsCut (std::string folder, int * width = NULL, int * height = NULL);
+
+	bool is_open () const { return levels.size() > 0; }
+	int get_width () const { return width; }
+	int get_height () const { return height; }
+	int level_count () const { return (signed) levels.size(); }
+
+	// Sets the video memory tiles may take. (At least a screenful is kept.)
+	void SetBudget (int megabytes);
+
+	// Draws the tiles that overlap the map rectangle [x0,x1] x [y0,y1],
+	// with the current transformation, at the level for zoom (display
+	// pixels per map pixel), and pages tiles in and out around it. Call
+	// from the render thread.
+	void Draw (float x0, float y0, float x1, float y1, float zoom);
+
+	// Tiles held as textures.
+	int get_resident () const { return resident; }
+
+private:
+	struct Tile {
+		ALLEGRO_BITMAP * texture;   // (NULL=not resident)
+		int last_used;              // Frame it was last in the window, or drawn.
+		int last_drawn;             // Frame it was last drawn, itself or in place of a finer tile.
+		bool loading;               // Asked for, and not yet taken back. (Guarded)
+		Tile () : texture(NULL), last_used(-1), last_drawn(-1), loading(false) { }
+	};
+
+	// Tiles of a level are tiles[first .. first + columns * rows - 1],
+	// row by row. A tile of level L covers TILE_SIZE << L map pixels.
+	struct Level {
+		int columns, rows;
+		int first;
+	};
+
+	int width, height;
+	std::string tile_folder;
+	std::vector<Level> levels;
+	std::vector<Tile> tiles;
+	int frame;
+	int resident;
+	int max_resident;
+
+	// Shared with the loader.
+	ALLEGRO_THREAD * loader;
+	ALLEGRO_MUTEX * mutex;
+	ALLEGRO_COND * wake;
+	std::vector<int> wanted;        // Tiles to load, nearest last.
+	std::vector<std::pair<int, ALLEGRO_BITMAP*> > loaded;  // Memory bitmaps.
+
+	std::vector<std::pair<float,int> > order;  // Scratch: (-distance, tile).
+
+	// Sets up levels for the image size, down to one tile.
+	void MakeLevels ();
+
+	// Cuts background.png (or image, which is freed) into tiles at every
+	// level, and writes the index. Returns false if there is no background.
+	bool Cut (std::string folder, ALLEGRO_BITMAP * image);
+
+	// Halves a memory bitmap, averaging each 2x2 block, into a new one.
+	ALLEGRO_BITMAP * Halve (ALLEGRO_BITMAP * image);
+
+	int LevelOf (int index) const;
+	std::string TileFile (int index) const;
+
+	// Is a tile in [c0,c1] x [r0,r1] of level?
+	bool Within (int index, int level, int c0, int r0, int c1, int r1) const;
+
+	// Draws a tile of a level from the nearest resident level at or above
+	// it, if any, and marks the tile drawn from as used.
+	void DrawTile (int level, int c, int r);
+
+	// Turns loaded tiles into textures, and lets go of those not wanted.
+	void TakeLoaded (int level, int c0, int r0, int c1, int r1);
+
+	// Removes the least recently used tiles, other than those drawn this
+	// frame and the last level's, while over the budget.
+	void Evict ();
+
+	static void * LoaderMain (ALLEGRO_THREAD * thread, void * arg);
+};
+
+#endif
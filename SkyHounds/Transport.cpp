@@ -0,0 +1,109 @@
+#include "libraries.h"
+
+#include "Transport.h"
+
+// Sends several datagrams, one at a time.
+int Transport::SendBatch (const Datagram * datagrams, int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		if (! Send (datagrams[i].data, datagrams[i].size))
+			break;
+	}
+	return i;
+}
+
+// Takes up to count datagrams received, one at a time.
+int Transport::ReceiveBatch (Datagram * datagrams, int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		datagrams[i].size = Receive (datagrams[i].data, MTU);
+		if (datagrams[i].size <= 0)
+			break;
+	}
+	return i;
+}
+
+// Starts a message of at most max_bytes, written where it is sent from.
+// A plain transport sends each message as a datagram.
+BitWriter & Transport::BeginMessage (int max_bytes) {
+	writer.Reset (outgoing, max_bytes < MTU ? max_bytes : MTU);
+	return writer;
+}
+
+// Sends the message begun, unless it didn't fit.
+void Transport::EndMessage () {
+	if (writer.Overflowed ()) {
+		warning (this, "Message is larger than it was begun for");
+		breakpoint ();
+		return;
+	}
+	Send (outgoing, writer.get_byte_count ());
+}
+
+// Takes the next message received, where it was received.
+int Transport::ReceiveMessage (const unsigned char * & data) {
+	data = incoming;
+	return Receive (incoming, MTU);
+}
+
+LoopbackTransport::LoopbackTransport ()
+	: peer(NULL), loss_percent(0), latency(0), random(12345)
+{
+	mutex = al_create_mutex ();
+}
+
+LoopbackTransport::~LoopbackTransport () {
+	if (peer)
+		peer->peer = NULL;
+	al_destroy_mutex (mutex);
+}
+
+// Connects two transports to each other.
+void LoopbackTransport::Connect (LoopbackTransport & a, LoopbackTransport & b) {
+	a.peer = &b;
+	b.peer = &a;
+}
+
+// Puts a copy of the datagram in the peer's inbox, unless it is lost,
+// to arrive after the latency.
+// Like UDP, sending to nobody is not an error.
+bool LoopbackTransport::Send (const unsigned char * data, int size) {
+	if (size > MTU) {
+		warning (this, "Datagram of %d bytes is larger than the MTU", size);
+		breakpoint ();
+		return false;
+	}
+	random = random * 1103515245 + 12345;
+	if (loss_percent > 0 && (int) ((random >> 16) % 100) < loss_percent)
+		return true;
+	if (! peer)
+		return true;
+	std::vector<unsigned char> datagram (data, data + size);
+	double arrival = latency > 0 ? al_get_time () + latency : 0;
+	al_lock_mutex (peer->mutex);
+	peer->inbox.push_back (std::vector<unsigned char> ());
+	peer->inbox.back ().swap (datagram);
+	peer->due.push_back (arrival);
+	al_unlock_mutex (peer->mutex);
+	return true;
+}
+
+// Takes the oldest datagram from the inbox, once it has arrived.
+// (The latency is the same for all, so they arrive in order.)
+int LoopbackTransport::Receive (unsigned char * buffer, int capacity) {
+	al_lock_mutex (mutex);
+	if (inbox.empty () || due.front () > al_get_time ()) {
+		al_unlock_mutex (mutex);
+		return 0;
+	}
+	std::vector<unsigned char> datagram;
+	datagram.swap (inbox.front ());
+	inbox.pop_front ();
+	due.pop_front ();
+	al_unlock_mutex (mutex);
+
+	int size = (signed) datagram.size() < capacity ? (signed) datagram.size() : capacity;
+	if (size > 0)
+		memcpy (buffer, &datagram[0], size);
+	return size;
+}
@@ -0,0 +1,102 @@
+/**
+A Transport sends and receives datagrams: packets that arrive whole or not
+at all, possibly out of order, like UDP.
+
+Messages can also be written in place (BeginMessage), and read where they
+were received (ReceiveMessage), to save copying them about. A plain
+transport sends each message as a datagram of its own; a MessageChannel
+wraps one, and packs a tick's messages into as few datagrams as it can.
+Several datagrams can go in one call (SendBatch), which for UDP on Linux
+is one system call.
+
+LoopbackTransport stands in for a UDP socket within one process. Two of
+them are connected back to back; what one sends, the other receives. It
+can drop a share of packets, and hold them back for a while, so that code
+built on it can be tested against loss and latency without a network.
+*/
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include "BitStream.h"
+
+class Transport {
+public:
+	// Largest datagram worth sending: small enough to pass most links
+	// without being split up on the way.
+	enum { MTU = 1200 };
+
+	// A datagram to send, or a buffer of MTU bytes to receive one into.
+	struct Datagram {
+		unsigned char * data;
+		int size;
+	};
+
+	Transport () { }
+	virtual ~Transport () { }
+
+	// Sends a datagram of up to MTU bytes. Returns false if it couldn't be sent.
+	virtual bool Send (const unsigned char * data, int size) = 0;
+
+	// Takes the next datagram received into buffer. Returns its size, or 0
+	// if nothing is waiting. A datagram larger than capacity is cut short.
+	virtual int Receive (unsigned char * buffer, int capacity) = 0;
+
+	// Sends several datagrams. Returns how many were sent.
+	virtual int SendBatch (const Datagram * datagrams, int count);
+
+	// Takes up to count datagrams received, into the buffers given, and
+	// sets their sizes. Returns how many.
+	virtual int ReceiveBatch (Datagram * datagrams, int count);
+
+	// Starts a message of at most max_bytes, and returns the writer to put
+	// it in, which writes straight into the buffer it goes out from.
+	// EndMessage sends it. One message at a time.
+	virtual BitWriter & BeginMessage (int max_bytes);
+	virtual void EndMessage ();
+
+	// Sends the messages held back to go together. Call once a tick, when
+	// everything for the peer has been written.
+	virtual void Flush () { }
+
+	// Takes the next message received, without copying it: data points at
+	// it until the next call. Returns its size, or 0 if nothing is waiting.
+	virtual int ReceiveMessage (const unsigned char * & data);
+
+private:
+	BitWriter writer;
+	unsigned char outgoing[MTU];   // Messages as written.
+	unsigned char incoming[MTU];   // Messages as received.
+
+	// Not copyable: the writer may point into outgoing.
+	Transport (const Transport &);
+	Transport & operator= (const Transport &);
+};
+
+class LoopbackTransport : public Transport {
+	LoopbackTransport * peer;
+	ALLEGRO_MUTEX * mutex;                       // Guards inbox.
+	std::deque< std::vector<unsigned char> > inbox;
+	std::deque<double> due;                      // When each datagram in inbox arrives.
+	int loss_percent;
+	double latency;                              // Seconds each way.
+	uint32_t random;                             // For choosing packets to lose.
+
+public:
+	LoopbackTransport ();
+	virtual ~LoopbackTransport ();
+
+	// Connects two transports to each other.
+	static void Connect (LoopbackTransport & a, LoopbackTransport & b);
+
+	// Loses about this many in a hundred of the datagrams sent.
+	void SetLoss (int percent) { loss_percent = percent; }
+
+	// Delivers datagrams sent from here this many seconds later.
+	void SetLatency (double seconds) { latency = seconds; }
+
+	virtual bool Send (const unsigned char * data, int size);
+	virtual int Receive (unsigned char * buffer, int capacity);
+};
+
+#endif
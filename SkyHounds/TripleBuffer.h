@@ -0,0 +1,47 @@
+/**
+A TripleBuffer hands a value from one writer thread to one reader thread
+without locks.
+
+The writer fills Back() and calls Publish(). The reader calls Update() and
+then reads Front(). Neither side ever waits for the other: the writer always
+has a buffer to fill, and the reader always has the latest complete one.
+Values the reader never picked up are simply overwritten.
+*/
+
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+template <class T>
+class TripleBuffer {
+	enum { INDEX = 3, FRESH = 4 };
+
+	T buffers[3];
+	volatile long middle;  // Buffer held between the two sides, plus FRESH if unread.
+	int back;              // Owned by the writer.
+	int front;             // Owned by the reader.
+
+public:
+	TripleBuffer () : middle(1), back(0), front(2) { }
+
+	// Writer side: the buffer to fill.
+	T & Back () { return buffers[back]; }
+
+	// Writer side: makes Back() available to the reader, and takes a new Back().
+	void Publish () {
+		back = atomic_exchange (&middle, back | FRESH) & INDEX;
+	}
+
+	// Reader side: picks up the latest published buffer, if there is a new one.
+	// Returns true if Front() changed.
+	bool Update () {
+		if ((atomic_read (&middle) & FRESH) == 0)
+			return false;
+		front = atomic_exchange (&middle, front) & INDEX;
+		return true;
+	}
+
+	// Reader side: the latest buffer picked up by Update().
+	const T & Front () const { return buffers[front]; }
+};
+
+#endif
@@ -0,0 +1,192 @@
+#include "libraries.h"
+
+#include "UdpTransport.h"
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+typedef SOCKET socket_t;
+static bool would_block () { return WSAGetLastError () == WSAEWOULDBLOCK; }
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+typedef int socket_t;
+static bool would_block () { return errno == EAGAIN || errno == EWOULDBLOCK; }
+#endif
+
+UdpTransport::UdpTransport ()
+	: handle(-1), port(0)
+{
+}
+
+UdpTransport::~UdpTransport () {
+	Close ();
+}
+
+// Opens a non-blocking socket on a local port. (0=any free one)
+bool UdpTransport::Open (int _port) {
+	Close ();
+#ifdef _WIN32
+	static bool started = false;
+	if (! started) {
+		WSADATA data;
+		if (WSAStartup (MAKEWORD (2, 2), &data) != 0) {
+			warning (this, "Could not start Winsock");
+			return false;
+		}
+		started = true;
+	}
+#endif
+	socket_t s = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (s == (socket_t) -1) {
+		warning (this, "Could not create a socket");
+		return false;
+	}
+	handle = (intptr_t) s;
+
+	sockaddr_in address;
+	memset (&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl (INADDR_ANY);
+	address.sin_port = htons ((unsigned short) _port);
+	if (bind (s, (sockaddr *) &address, sizeof(address)) != 0) {
+		warning (this, "Could not open port %d", _port);
+		Close ();
+		return false;
+	}
+	socklen_t length = sizeof(address);
+	getsockname (s, (sockaddr *) &address, &length);
+	port = ntohs (address.sin_port);
+
+#ifdef _WIN32
+	u_long nonblocking = 1;
+	ioctlsocket (s, FIONBIO, &nonblocking);
+#else
+	fcntl (s, F_SETFL, fcntl (s, F_GETFL, 0) | O_NONBLOCK);
+#endif
+	return true;
+}
+
+// Sends to, and receives from, only one peer from now on.
+bool UdpTransport::Connect (const std::string & host, int peer_port) {
+	if (handle == -1)
+		return false;
+	addrinfo hints;
+	memset (&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	addrinfo * found = NULL;
+	if (getaddrinfo (host.c_str (), NULL, &hints, &found) != 0 || ! found) {
+		warning (this, "Could not find host %s", host.c_str ());
+		return false;
+	}
+	sockaddr_in address = *(sockaddr_in *) found->ai_addr;
+	freeaddrinfo (found);
+	address.sin_port = htons ((unsigned short) peer_port);
+	if (connect ((socket_t) handle, (sockaddr *) &address, sizeof(address)) != 0) {
+		warning (this, "Could not connect to %s:%d", host.c_str (), peer_port);
+		return false;
+	}
+	return true;
+}
+
+// Closes the socket.
+void UdpTransport::Close () {
+	if (handle == -1)
+		return;
+#ifdef _WIN32
+	closesocket ((socket_t) handle);
+#else
+	close ((socket_t) handle);
+#endif
+	handle = -1;
+	port = 0;
+}
+
+// Sends a datagram to the peer. A full send buffer loses it, as the
+// network might, rather than waiting.
+bool UdpTransport::Send (const unsigned char * data, int size) {
+	if (size > MTU) {
+		warning (this, "Datagram of %d bytes is larger than the MTU", size);
+		breakpoint ();
+		return false;
+	}
+	if (handle == -1)
+		return false;
+	return send ((socket_t) handle, (const char *) data, size, 0) == size || would_block ();
+}
+
+// Takes the next datagram from the peer. Errors (such as the peer's port
+// not being open yet) count as nothing waiting.
+int UdpTransport::Receive (unsigned char * buffer, int capacity) {
+	if (handle == -1)
+		return 0;
+	int size = (int) recv ((socket_t) handle, (char *) buffer, capacity, 0);
+	return size > 0 ? size : 0;
+}
+
+#ifdef __linux__
+
+// Sends several datagrams in one system call.
+int UdpTransport::SendBatch (const Datagram * datagrams, int count) {
+	if (handle == -1)
+		return 0;
+	mmsghdr messages[64];
+	iovec parts[64];
+	int sent = 0;
+	while (sent < count) {
+		int n = count - sent < 64 ? count - sent : 64;
+		int i;
+		for (i = 0; i < n; i++) {
+			parts[i].iov_base = datagrams[sent + i].data;
+			parts[i].iov_len = datagrams[sent + i].size;
+			memset (&messages[i], 0, sizeof(messages[i]));
+			messages[i].msg_hdr.msg_iov = &parts[i];
+			messages[i].msg_hdr.msg_iovlen = 1;
+		}
+		int done = sendmmsg ((socket_t) handle, messages, n, 0);
+		if (done <= 0)
+			break;
+		sent += done;
+	}
+	return sent;
+}
+
+// Takes up to count datagrams in one system call.
+int UdpTransport::ReceiveBatch (Datagram * datagrams, int count) {
+	if (handle == -1)
+		return 0;
+	mmsghdr messages[64];
+	iovec parts[64];
+	int n = count < 64 ? count : 64;
+	int i;
+	for (i = 0; i < n; i++) {
+		parts[i].iov_base = datagrams[i].data;
+		parts[i].iov_len = MTU;
+		memset (&messages[i], 0, sizeof(messages[i]));
+		messages[i].msg_hdr.msg_iov = &parts[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+	int received = recvmmsg ((socket_t) handle, messages, n, MSG_DONTWAIT, NULL);
+	if (received <= 0)
+		return 0;
+	for (i = 0; i < received; i++)
+		datagrams[i].size = (int) messages[i].msg_len;
+	return received;
+}
+
+#else
+
+// Sends several datagrams, one at a time.
+int UdpTransport::SendBatch (const Datagram * datagrams, int count) {
+	return Transport::SendBatch (datagrams, count);
+}
+
+// Takes up to count datagrams, one at a time.
+int UdpTransport::ReceiveBatch (Datagram * datagrams, int count) {
+	return Transport::ReceiveBatch (datagrams, count);
+}
+
+#endif
@@ -0,0 +1,46 @@
+/**
+A UdpTransport is a UDP socket, connected to one peer: it only sends to
+that peer, and only takes datagrams from it. It never blocks; Receive
+returns 0 when nothing is waiting.
+
+On Linux, batches of datagrams go in one system call each way (sendmmsg,
+recvmmsg). Elsewhere they go one at a time.
+
+Two of them on 127.0.0.1 make a local loopback link through the network
+stack, for testing what runs over a real socket.
+*/
+
+#ifndef UDP_TRANSPORT_H
+#define UDP_TRANSPORT_H
+
+#include "Transport.h"
+
+class UdpTransport : public Transport {
+	intptr_t handle;       // The socket. (-1=none)
+	int port;              // Local port.
+
+public:
+	UdpTransport ();
+	virtual ~UdpTransport ();
+
+	// Opens a socket on a local port. (0=any free one)
+	// Returns false if it couldn't.
+	bool Open (int _port);
+
+	// Sends to, and receives from, only the peer at host and port from now
+	// on. Returns false if the host can't be found.
+	bool Connect (const std::string & host, int peer_port);
+
+	// Closes the socket.
+	void Close ();
+
+	bool is_open () const { return handle != -1; }
+	int get_port () const { return port; }
+
+	virtual bool Send (const unsigned char * data, int size);
+	virtual int Receive (unsigned char * buffer, int capacity);
+	virtual int SendBatch (const Datagram * datagrams, int count);
+	virtual int ReceiveBatch (Datagram * datagrams, int count);
+};
+
+#endif
@@ -4,6 +4,9 @@
 
 static std::set<std::string> all_messages;
 
+// Warnings may come from worker threads; this spin lock guards all_messages.
+static volatile long messages_lock = 0;
+
 std::string Warning (std::string object_type, const char * file_name, int line,
 		const std::string & message)
 {
@@ -19,6 +22,8 @@ std::string Warning (std::string object_type, const char * file_name, int line,
 	std::string full_message (s.str());
 	
 	// Output the message if it is not a duplicate.
+	while (atomic_compare_exchange (&messages_lock, 1, 0) != 0)
+		;
 	if (all_messages.count (full_message) == 0) {
 		all_messages.insert (full_message);
 
@@ -29,6 +34,7 @@ std::string Warning (std::string object_type, const char * file_name, int line,
 		// Output to Visual Studio debug console
 		OutputDebugString (full_message.c_str());
 	}
+	atomic_exchange (&messages_lock, 0);
 	
 	return full_message;
 }
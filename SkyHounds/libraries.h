@@ -4,25 +4,34 @@ Main headers.
 
 // OS headers
 #ifdef _WIN32
+#include <winsock2.h>  // Before Windows.h, which would bring in the old winsock.h.
 #include <Windows.h>
 #endif
 
 // Standard libraries
+#include <algorithm>
 #include <cctype>
+#include <climits>
+#include <cmath>
 #include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <new>
 #include <set>
 #include <sstream>
+#include <stdint.h>
 #include <string>
 #include <vector>
 
 // Non-standard libraries
 #include <allegro5/allegro.h>
 #include <allegro5/allegro_image.h>
+#include <allegro5/allegro_primitives.h>
 
 // Game-wide headers
 #include "errors.h"
@@ -2,7 +2,9 @@
 
 #include "libraries.h"
 
+#include "AssetLoader.h"
 #include "Control.h"
+#include "FixedStep.h"
 #include "Scenario.h"
 
 struct SystemState {
@@ -13,12 +15,21 @@ struct SystemState {
 
 	ALLEGRO_DISPLAY * display;
 	ALLEGRO_EVENT_QUEUE * event_queue;
-	ALLEGRO_TIMER * frame_timer;
+	ALLEGRO_TIMER * frame_timer;    // Display refresh.
+
+	// Runs the simulation at a fixed rate, independently of the display.
+	ALLEGRO_THREAD * sim_thread;
 };
 
+// Simulation rate, and the most ticks to run at once when catching up.
+static const double SIM_STEP = 1.0 / 60.0;
+static const int SIM_MAX_CATCHUP = 5;
+
 static SystemState s_system;
 
 void SystemInitialize ();
+bool SystemLoad (AssetLoader & loader);
+void SystemStartSimulation ();
 void SystemEventLoop ();
 void SystemClose ();
 
@@ -31,8 +42,30 @@ int main () {
 	Script local_options ("local_options.txt");
 	std::string dropbox = as_folder (local_options.text ("dropbox"));
 
-	s_system.scenario = new Scenario (initial_scenario, dropbox);
+	// Decode the scenario's images and parse scripts on every core, with a
+	// progress bar, then make the scenario from them.
+	AssetLoader loader;
+	Scenario::Preload (loader, initial_scenario, dropbox);
+	loader.Start (options.integer ("load_threads"));
+	if (! SystemLoad (loader)) {
+		SystemClose ();
+		return 0;
+	}
+	s_system.scenario = new Scenario (initial_scenario, dropbox, false, &loader);
+	s_system.scenario->SetSimThreads (options.integer ("sim_threads"));
+	s_system.scenario->SetPathThreads (options.integer ("path_threads"),
+		options.integer ("path_budget_us") / 1000000.0);
+	s_system.scenario->SetFlowFields (options.integer ("flow_field_mb"),
+		options.integer ("flow_budget_us") / 1000000.0);
+	s_system.scenario->SetInfluenceThreaded (options.integer ("influence_thread") != 0);
+	s_system.scenario->SetAIBudget (options.integer ("ai_budget_us"));
+	s_system.scenario->SetDeterministic (options.integer ("deterministic") != 0);
+	s_system.scenario->SetRollbackTicks (options.integer ("rollback_ticks"));
+	s_system.scenario->SetMaxRewind (options.integer ("max_rewind_ticks"));
+	s_system.scenario->SetBackgroundBudget (options.integer ("background_mb"));
 	s_system.control = new Control (s_system.scenario, s_system.display);
+	s_system.control->ShowNetOverlay (options.integer ("net_overlay") != 0);
+	SystemStartSimulation ();
 	SystemEventLoop ();
 	SystemClose ();
 	return 0;
@@ -51,6 +84,12 @@ void SystemInitialize () {
 		exit (-1);
 	}
 
+	// For the network overlay, and the loading screen.
+	if (! al_init_primitives_addon ()) {
+		breakpoint ();
+		exit (-1);
+	}
+
 	// Event Queue
 	s_system.event_queue = al_create_event_queue();
 	if (! s_system.event_queue) {
@@ -84,8 +123,11 @@ void SystemInitialize () {
 	al_register_event_source (s_system.event_queue,
 		al_get_display_event_source (s_system.display));
 
-	// Frame Timer
-	s_system.frame_timer = al_create_timer (1.0 / 60.0);
+	// Frame Timer, at the display's refresh rate if known.
+	int refresh_rate = al_get_display_refresh_rate (s_system.display);
+	if (refresh_rate <= 0)
+		refresh_rate = 60;
+	s_system.frame_timer = al_create_timer (1.0 / refresh_rate);
 	if(! s_system.frame_timer) {
 		breakpoint ();
 		exit (-1);
@@ -93,6 +135,65 @@ void SystemInitialize () {
 	al_register_event_source (s_system.event_queue,
 		al_get_timer_event_source (s_system.frame_timer));
 	al_start_timer (s_system.frame_timer);
+
+	// Rendering stays on this thread; the simulation gets its own core.
+	// (Worker threads started from here unpin themselves, see porting.h.)
+	pin_current_thread (0);
+}
+
+// Shows a progress bar until the loader has finished. Returns false if the
+// window was closed, or Escape pressed, first.
+bool SystemLoad (AssetLoader & loader) {
+	while (! loader.is_ready ()) {
+		ALLEGRO_EVENT ev;
+		al_wait_for_event (s_system.event_queue, &ev);
+		if (ALLEGRO_EVENT_DISPLAY_CLOSE == ev.type)
+			return false;
+		if (ALLEGRO_EVENT_KEY_DOWN == ev.type && ALLEGRO_KEY_ESCAPE == ev.keyboard.keycode)
+			return false;
+		if (ALLEGRO_EVENT_TIMER == ev.type && al_is_event_queue_empty (s_system.event_queue)) {
+			float width = (float) al_get_display_width (s_system.display);
+			float height = (float) al_get_display_height (s_system.display);
+			float left = width / 4;
+			float right = width * 3 / 4;
+			float top = height / 2 - 8;
+			al_clear_to_color (al_map_rgb (0, 0, 0));
+			al_draw_filled_rectangle (left, top, right, top + 16, al_map_rgb (64, 64, 64));
+			al_draw_filled_rectangle (left, top, left + (right - left) * loader.get_progress (), top + 16,
+				al_map_rgb (200, 200, 200));
+			al_flip_display ();
+		}
+	}
+	return true;
+}
+
+// Simulation thread body.
+// Runs as many fixed-length ticks as real time calls for, then hands the
+// result to the render thread.
+static void * SimulationThread (ALLEGRO_THREAD * thread, void * arg) {
+	pin_current_thread (1);
+	FixedStep stepper (SIM_STEP, SIM_MAX_CATCHUP);
+	stepper.Start (al_get_time ());
+	while (! al_get_thread_should_stop (thread)) {
+		int steps = stepper.Advance (al_get_time ());
+		if (steps > 0) {
+			int i;
+			for (i = 0; i < steps; i++)
+				s_system.control->SimTick ();
+			s_system.scenario->PublishView (stepper.Alpha (), stepper.StepLength ());
+		}
+		al_rest (stepper.TimeToNextStep ());
+	}
+	return NULL;
+}
+
+void SystemStartSimulation () {
+	s_system.sim_thread = al_create_thread (SimulationThread, NULL);
+	if (! s_system.sim_thread) {
+		breakpoint ();
+		exit (-1);
+	}
+	al_start_thread (s_system.sim_thread);
 }
 
 void SystemEventLoop () {
@@ -107,9 +208,9 @@ void SystemEventLoop () {
 
 		// Timer event.
 		else if (ALLEGRO_EVENT_TIMER == ev.type) {
-			// Frame timer. Step physics, flag display redraw.
+			// Frame timer. Flag display redraw.
+			// (Physics is stepped on the simulation thread.)
 			if (ev.timer.source == s_system.frame_timer) {
-				s_system.control->SimTick ();
 				redraw = true;
 			}
 		}
@@ -163,7 +264,8 @@ void SystemEventLoop () {
 
 		// Draw next frame.
 		if (redraw && al_is_event_queue_empty (s_system.event_queue)) {
-			s_system.control->Display (s_system.display);
+			float alpha = s_system.scenario->AcquireView (al_get_time ());
+			s_system.control->Display (s_system.display, alpha);
 			al_flip_display ();
 			redraw = false;
 		}
@@ -171,6 +273,12 @@ void SystemEventLoop () {
 }
 
 void SystemClose () {
+	// Stop the simulation before tearing down what it uses. (If loading
+	// was cut short, there is no simulation.)
+	if (s_system.sim_thread) {
+		al_join_thread (s_system.sim_thread, NULL);
+		al_destroy_thread (s_system.sim_thread);
+	}
 	delete s_system.control;
 	delete s_system.scenario;
 	al_destroy_timer (s_system.frame_timer);
@@ -7,7 +7,108 @@
 #include <intrin.h>
 #define breakpoint()  __debugbreak()
 #else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
 #define breakpoint()  __builtin_trap()
 #endif
 
-#endif
\ No newline at end of file
+// SSE2 vector instructions. Every x64 processor has them; on 32-bit x86
+// they need /arch:SSE2 (MSVC) or -msse2 (gcc).
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Atomic operations on a shared long. Each is a full memory barrier.
+// Increment/decrement/add return the new value; exchange and compare_exchange
+// return the value that was there before.
+#ifdef _WIN32
+inline long atomic_increment (volatile long * x) { return _InterlockedIncrement (x); }
+inline long atomic_add (volatile long * x, long value) { return _InterlockedExchangeAdd (x, value) + value; }
+inline long atomic_decrement (volatile long * x) { return _InterlockedDecrement (x); }
+inline long atomic_exchange (volatile long * x, long value) { return _InterlockedExchange (x, value); }
+inline long atomic_compare_exchange (volatile long * x, long value, long expected) {
+	return _InterlockedCompareExchange (x, value, expected);
+}
+#else
+inline long atomic_increment (volatile long * x) { return __sync_add_and_fetch (x, 1); }
+inline long atomic_add (volatile long * x, long value) { return __sync_add_and_fetch (x, value); }
+inline long atomic_decrement (volatile long * x) { return __sync_sub_and_fetch (x, 1); }
+inline long atomic_exchange (volatile long * x, long value) {
+	return __atomic_exchange_n (x, value, __ATOMIC_SEQ_CST);
+}
+inline long atomic_compare_exchange (volatile long * x, long value, long expected) {
+	return __sync_val_compare_and_swap (x, expected, value);
+}
+#endif
+
+// Reads a shared long with a full memory barrier.
+inline long atomic_read (volatile long * x) { return atomic_compare_exchange (x, 0, 0); }
+
+// A steady clock in microseconds, for timing short pieces of work.
+// (Only differences between readings mean anything.)
+#ifdef _WIN32
+inline int64_t microseconds () {
+	static LARGE_INTEGER frequency;
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency (&frequency);
+	LARGE_INTEGER now;
+	QueryPerformanceCounter (&now);
+	return (int64_t) (now.QuadPart / frequency.QuadPart * 1000000 +
+		now.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+}
+#else
+inline int64_t microseconds () {
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+#endif
+
+// Number of processor cores available.
+inline int cpu_count () {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo (&info);
+	return (int) info.dwNumberOfProcessors;
+#else
+	long n = sysconf (_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+#endif
+}
+
+// Restricts the calling thread to one processor core.
+// Core numbers wrap around if there are fewer cores than asked for.
+inline void pin_current_thread (int core) {
+	core = core % cpu_count ();
+#ifdef _WIN32
+	SetThreadAffinityMask (GetCurrentThread (), (DWORD_PTR) 1 << core);
+#else
+	cpu_set_t set;
+	CPU_ZERO (&set);
+	CPU_SET (core, &set);
+	pthread_setaffinity_np (pthread_self (), sizeof(set), &set);
+#endif
+}
+
+// Lets the calling thread run on any core again. Threads started from a
+// pinned thread are pinned with it on Linux, so every worker thread calls
+// this first.
+inline void unpin_current_thread () {
+#ifdef _WIN32
+	DWORD_PTR process, system;
+	if (GetProcessAffinityMask (GetCurrentProcess (), &process, &system))
+		SetThreadAffinityMask (GetCurrentThread (), process);
+#else
+	cpu_set_t set;
+	CPU_ZERO (&set);
+	int core;
+	for (core = 0; core < cpu_count (); core++)
+		CPU_SET (core, &set);
+	pthread_setaffinity_np (pthread_self (), sizeof(set), &set);
+#endif
+}
+
+#endif
@@ -10,4 +10,19 @@ inline std::string as_folder (std::string in) {
 		return in + '/';
 }
 
+// The last part of a path: a file or folder name, without the folder it
+// is in (or a trailing '/').
+inline std::string base_name (std::string path) {
+	while (path.size() > 1 && (*(path.end() - 1) == '/' || *(path.end() - 1) == '\\'))
+		path.erase (path.end() - 1);
+	std::string::size_type slash = path.find_last_of ("/\\");
+	return slash == std::string::npos ? path : path.substr (slash + 1);
+}
+
+// Limits x to the range [low, high].
+template <class T>
+inline T clamp (T x, T low, T high) {
+	return x < low ? low : (x > high ? high : x);
+}
+
 #endif
@@ -0,0 +1,561 @@
+// Dedicated Server
+// Runs a scenario with no display, keyboard or mouse.
+
+#include "libraries.h"
+
+#include "FixedStep.h"
+#include "InterestManager.h"
+#include "MessageChannel.h"
+#include "Player.h"
+#include "PlayerPredictor.h"
+#include "Replay.h"
+#include "Scenario.h"
+#include "ScenarioHost.h"
+#include "Snapshot.h"
+#include "Transport.h"
+#include "UdpTransport.h"
+
+// A client in the same process, connected by loopback, for trying out
+// replication without a network. Each watches one of the AI avatars, as
+// if it were playing it on a display-sized view, or plays a Player avatar
+// of its own, wandering about, with its moves predicted.
+// Its link is in-process, or a pair of UDP sockets on 127.0.0.1; either
+// way, each end packs its messages for a tick into one datagram.
+struct LoopbackClient {
+	LoopbackTransport server_end, client_end;
+	UdpTransport server_socket, client_socket;
+	MessageChannel server_channel, client_channel;
+	SnapshotSender sender;
+	SnapshotReceiver receiver;
+	InterestManager::ClientView view;
+
+	Player * player;              // (NULL=watching an AI avatar)
+	PlayerPredictor predictor;
+	StateAvatarScenario input;    // What the client wants; sent every tick.
+	uint32_t random;              // For choosing where to go.
+
+	// What each end counted since the last report.
+	NetStats server_stats, client_stats;
+
+	LoopbackClient (DatagramPool * pool, bool udp)
+		: server_channel(udp ? (Transport *) &server_socket : &server_end, pool),
+		  client_channel(udp ? (Transport *) &client_socket : &client_end, pool),
+		  sender(&server_channel), receiver(&client_channel),
+		  player(NULL), predictor(&client_channel), random(1) {
+		LoopbackTransport::Connect (server_end, client_end);
+		server_channel.SetStats (&server_stats);
+		client_channel.SetStats (&client_stats);
+		sender.SetStats (&server_stats);
+		receiver.SetStats (&client_stats);
+		if (udp && server_socket.Open (0) && client_socket.Open (0)) {
+			server_socket.Connect ("127.0.0.1", client_socket.get_port ());
+			client_socket.Connect ("127.0.0.1", server_socket.get_port ());
+		}
+	}
+};
+
+struct ServerState {
+	Scenario * scenario;
+
+	int tick_rate;   // Ticks per second. (0=as fast as possible)
+	int ticks;       // Ticks to run before quitting. (0=forever)
+	bool deterministic;  // Report checksums, to compare runs.
+	int rollback_ticks;  // Ticks to roll back and run again with each report.
+
+	ReplayWriter * recorder;  // (NULL=not recording)
+
+	DatagramPool pool;  // For the clients' channels.
+	std::vector<LoopbackClient*> clients;
+	NetStats scenario_stats;     // The scenario's serializing, since the last report.
+	std::string net_stats_file;  // Where to dump the clients' stats. ("none"=nowhere)
+	bool net_stats_json;         // As JSON, one line a report, rather than text.
+	InterestManager interest;
+	std::vector<Snapshot::Relevant> relevant;  // Scratch.
+};
+
+// Size of a loopback client's view, in map pixels.
+static const float CLIENT_VIEW_WIDTH = 640;
+static const float CLIENT_VIEW_HEIGHT = 480;
+
+static ServerState s_server;
+
+void ServerInitialize ();
+void ServerLoop ();
+void ServerTakeInputs ();
+void ServerReplicate (int tick);
+void ServerPlayClient (LoopbackClient * client);
+void ServerRollBack ();
+void ServerDumpNetStats (int tick, double seconds);
+void ServerPlayBack (ReplayReader & replay, int from);
+void ServerHost (Script & options, std::string dropbox, int count);
+void ServerClose ();
+
+int main () {
+	ServerInitialize ();
+
+	Script options ("server_options.txt");
+	std::string initial_scenario = options.text ("initial_scenario");
+	s_server.tick_rate = options.integer ("tick_rate");
+	s_server.ticks = options.integer ("ticks");
+
+	Script local_options ("local_options.txt");
+	std::string dropbox = as_folder (local_options.text ("dropbox"));
+
+	// Host many matches at once, rather than one.
+	int host_matches = options.integer ("host_matches");
+	if (host_matches > 0) {
+		ServerHost (options, dropbox, host_matches);
+		return 0;
+	}
+
+	// What changes how ticks turn out: from the options, or as it was
+	// when a replay being played back was recorded.
+	ReplaySettings settings;
+	settings.scenario_name = initial_scenario;
+	settings.deterministic = options.integer ("deterministic") != 0;
+	settings.rollback_ticks = options.integer ("rollback_ticks");
+	settings.flow_field_mb = options.integer ("flow_field_mb");
+	std::string replay_play = options.text ("replay_play");
+	ReplayReader replay;
+	if (replay_play != "none") {
+		if (! replay.Open (replay_play))
+			exit (-1);
+		settings = replay.get_settings ();
+	}
+
+	s_server.scenario = new Scenario (settings.scenario_name, dropbox, true);
+	s_server.scenario->SetSimThreads (options.integer ("sim_threads"));
+	s_server.scenario->SetPathThreads (options.integer ("path_threads"),
+		options.integer ("path_budget_us") / 1000000.0);
+	s_server.scenario->SetFlowFields (settings.flow_field_mb,
+		options.integer ("flow_budget_us") / 1000000.0);
+	s_server.scenario->SetInfluenceThreaded (options.integer ("influence_thread") != 0);
+	s_server.scenario->SetAIBudget (options.integer ("ai_budget_us"));
+	s_server.deterministic = settings.deterministic;
+	s_server.scenario->SetDeterministic (s_server.deterministic);
+	s_server.rollback_ticks = settings.rollback_ticks;
+	s_server.scenario->SetRollbackTicks (s_server.rollback_ticks);
+	s_server.scenario->SetMaxRewind (options.integer ("max_rewind_ticks"));
+
+	// Play a replay back instead of running AI.
+	if (replay_play != "none") {
+		replay.SetLiveAI (options.integer ("replay_live_ai") != 0);
+		ServerPlayBack (replay, options.integer ("replay_from"));
+		ServerClose ();
+		return 0;
+	}
+
+	// Record from the start, before any avatars are added.
+	std::string replay_record = options.text ("replay_record");
+	if (replay_record != "none") {
+		s_server.recorder = new ReplayWriter;
+		if (s_server.recorder->Open (replay_record, settings)) {
+			s_server.recorder->SetKeyframeTicks (options.integer ("replay_keyframe_ticks"));
+			s_server.scenario->SetRecorder (s_server.recorder);
+		}
+	}
+
+	// Populate the scenario with AI avatars, alternating teams.
+	int ai_count = options.integer ("ai_count");
+	std::string ai_type = options.text ("ai_type");
+	std::vector<Avatar*> ai;
+	int i;
+	for (i = 0; i < ai_count; i++) {
+		Avatar * avatar = Avatar::Make (ai_type, "ai", s_server.scenario);
+		if (avatar) {
+			avatar->JoinGame (1 + i % 2);
+			ai.push_back (avatar);
+		}
+	}
+
+	int client_count = options.integer ("loopback_clients");
+	int player_count = options.integer ("loopback_players");
+	double latency = options.integer ("loopback_latency_ms") / 2000.0;
+	bool udp = options.integer ("loopback_udp") != 0;
+	s_server.net_stats_file = options.text ("net_stats_file");
+	s_server.net_stats_json = options.text ("net_stats_format") == "json";
+	for (i = 0; i < client_count; i++) {
+		LoopbackClient * client = new LoopbackClient (&s_server.pool, udp);
+		client->sender.SetByteBudget (options.integer ("snapshot_bytes"));
+		client->server_end.SetLoss (options.integer ("loopback_loss"));
+		client->server_end.SetLatency (latency);
+		client->client_end.SetLatency (latency);
+		Avatar * avatar = i < player_count ? Avatar::Make (ai_type, "player", s_server.scenario) : NULL;
+		if (avatar) {
+			client->player = (Player *) avatar;
+			client->player->JoinGame (1 + i % 2);
+			client->input = client->player->GetInput ();
+			client->input.playing = true;
+			client->random = 1 + i;
+			client->view.focus = avatar->GetHandle ();
+			client->view.team = 1 + i % 2;
+			client->predictor.SetPlayer (avatar->GetHandle ().slot);
+		} else if (ai.size() > 0) {
+			client->view.focus = ai[i % ai.size()]->GetHandle ();
+			client->view.team = 1 + i % ai.size() % 2;
+		}
+		s_server.clients.push_back (client);
+	}
+
+	ServerLoop ();
+	ServerClose ();
+	return 0;
+}
+
+//----- Function Implementations -----//
+
+void ServerInitialize () {
+	// Allegro core and image loading only. No display, so no GPU needed.
+	if (! al_init ()) {
+		breakpoint ();
+		exit (-1);
+	}
+
+	if (! al_init_image_addon ()) {
+		breakpoint ();
+		exit (-1);
+	}
+}
+
+void ServerLoop () {
+	double step = s_server.tick_rate > 0 ? 1.0 / s_server.tick_rate : 1.0 / 60.0;
+	FixedStep stepper (step, 5);
+	stepper.Start (al_get_time ());
+
+	// Report tick rate (and bandwidth per client) every few seconds.
+	double report_time = al_get_time ();
+	int report_ticks = 0;
+	long report_bytes = 0;
+
+	int tick = 0;
+	while (s_server.ticks <= 0 || tick < s_server.ticks) {
+		// Fixed rate: run the ticks that are due, then sleep.
+		// Uncapped: run one tick after another.
+		int steps = s_server.tick_rate > 0 ? stepper.Advance (al_get_time ()) : 1;
+		int i;
+		for (i = 0; i < steps && (s_server.ticks <= 0 || tick < s_server.ticks); i++) {
+			ServerTakeInputs ();
+			s_server.scenario->SimTick ();
+			s_server.scenario_stats.Tick (s_server.scenario->get_serialize_us ());
+			tick++;
+			report_ticks++;
+			ServerReplicate (tick);
+		}
+		if (s_server.tick_rate > 0)
+			al_rest (stepper.TimeToNextStep ());
+
+		double now = al_get_time ();
+		if (now - report_time >= 5.0) {
+			printf ("tick %d: %.1f ticks/s, %d avatars on the map\n", tick,
+				report_ticks / (now - report_time), s_server.scenario->CountOnMap ());
+			if (s_server.deterministic)
+				printf ("  checksum %08x\n", (unsigned) s_server.scenario->Checksum ());
+			if (s_server.rollback_ticks > 0)
+				ServerRollBack ();
+			long bytes = 0;
+			long messages = 0, datagrams = 0;
+			int corrections = 0;
+			double total_error = 0;
+			float worst_error = 0;
+			int c;
+			for (c = 0; c < (signed) s_server.clients.size(); c++) {
+				LoopbackClient * client = s_server.clients[c];
+				bytes += client->sender.get_bytes_sent ();
+				messages += client->server_channel.get_messages_sent () + client->client_channel.get_messages_sent ();
+				datagrams += client->server_channel.get_datagrams_sent () + client->client_channel.get_datagrams_sent ();
+				if (client->player) {
+					PlayerPredictor & predictor = client->predictor;
+					corrections += predictor.get_corrections ();
+					total_error += predictor.get_average_error () * predictor.get_corrections ();
+					if (predictor.get_worst_error () > worst_error)
+						worst_error = predictor.get_worst_error ();
+					predictor.ResetStats ();
+				}
+			}
+			if (s_server.clients.size() > 0) {
+				printf ("  %.0f bytes/s per client\n",
+					(bytes - report_bytes) / (now - report_time) / s_server.clients.size());
+				printf ("  %.2f messages per datagram, %d buffers\n",
+					datagrams > 0 ? (double) messages / datagrams : 0.0, s_server.pool.get_allocated ());
+			}
+			if (corrections > 0) {
+				printf ("  players predicted %.2f pixels out on average, %.2f at worst\n",
+					total_error / corrections, worst_error);
+			}
+			ServerDumpNetStats (tick, now - report_time);
+			fflush (stdout);
+			report_time = now;
+			report_ticks = 0;
+			report_bytes = bytes;
+		}
+	}
+}
+
+// Reports what the clients' links carried over the last seconds: round
+// trips, loss and serializing time to the console, and everything each end
+// counted to net_stats_file, if set. Then starts counting afresh.
+void ServerDumpNetStats (int tick, double seconds) {
+	NetStats sent, received;
+	int c;
+	for (c = 0; c < (signed) s_server.clients.size(); c++) {
+		sent.Add (s_server.clients[c]->server_stats);
+		received.Add (s_server.clients[c]->client_stats);
+	}
+	const NetStats & scenario = s_server.scenario_stats;
+	printf ("  serializing %.0f us per tick in the scenario, %.0f us per tick in snapshots\n",
+		scenario.ticks > 0 ? (double) scenario.serialize_us / scenario.ticks : 0.0,
+		scenario.ticks > 0 ? (double) sent.serialize_us / scenario.ticks : 0.0);
+	if (sent.round_trips > 0) {
+		printf ("  round trip %.1f ms on average, %.1f ms at worst; %.1f%% of snapshots lost\n",
+			sent.total_rtt / sent.round_trips * 1000, sent.worst_rtt * 1000, received.get_loss () * 100);
+	}
+
+	if (s_server.net_stats_file != "none") {
+		FILE * file = fopen (s_server.net_stats_file.c_str (), "a");
+		if (file) {
+			if (s_server.net_stats_json) {
+				fprintf (file, "{\"tick\":%d,\"scenario\":", tick);
+				scenario.WriteJson (file, seconds);
+				fprintf (file, ",\"clients\":[");
+				for (c = 0; c < (signed) s_server.clients.size(); c++) {
+					fprintf (file, "%s{\"server_end\":", c > 0 ? "," : "");
+					s_server.clients[c]->server_stats.WriteJson (file, seconds);
+					fprintf (file, ",\"client_end\":");
+					s_server.clients[c]->client_stats.WriteJson (file, seconds);
+					fprintf (file, "}");
+				}
+				fprintf (file, "]}\n");
+			} else {
+				fprintf (file, "tick %d, over %.1f s\n", tick, seconds);
+				scenario.WriteText (file, seconds, "  scenario: ");
+				for (c = 0; c < (signed) s_server.clients.size(); c++) {
+					fprintf (file, "  client %d, server end:\n", c);
+					s_server.clients[c]->server_stats.WriteText (file, seconds, "    ");
+					fprintf (file, "  client %d, client end:\n", c);
+					s_server.clients[c]->client_stats.WriteText (file, seconds, "    ");
+				}
+			}
+			fclose (file);
+		}
+	}
+
+	for (c = 0; c < (signed) s_server.clients.size(); c++) {
+		s_server.clients[c]->server_stats.Reset ();
+		s_server.clients[c]->client_stats.Reset ();
+	}
+	s_server.scenario_stats.Reset ();
+}
+
+// Tries out rollback: goes back rollback_ticks ticks and runs them again,
+// then reports how long that took, and whether the state came out the same
+// as the first time (only expected in deterministic mode).
+void ServerRollBack () {
+	Scenario * scenario = s_server.scenario;
+	int tick = scenario->get_tick ();
+	uint32_t checksum = scenario->Checksum ();
+	int64_t start = microseconds ();
+	if (! scenario->RestoreState (tick - s_server.rollback_ticks)) {
+		printf ("  can't roll back %d ticks\n", s_server.rollback_ticks);
+		return;
+	}
+	while (scenario->get_tick () < tick)
+		scenario->SimTick ();
+	printf ("  rolled back %d ticks and ran them again in %.2f ms: %s\n",
+		s_server.rollback_ticks, (microseconds () - start) / 1000.0,
+		scenario->Checksum () == checksum ? "same state" : "state differs");
+}
+
+// Plays a replay back as fast as it goes, from a tick, then reports how
+// long ticks took, and where playback went differently from the recording.
+void ServerPlayBack (ReplayReader & replay, int from) {
+	Scenario * scenario = s_server.scenario;
+	int64_t start = microseconds ();
+	if (! replay.Seek (*scenario, from)) {
+		printf ("replay: can't play up to tick %d\n", from);
+		return;
+	}
+	printf ("replay: at tick %d in %.1f ms\n", scenario->get_tick (), (microseconds () - start) / 1000.0);
+
+	double report_time = al_get_time ();
+	int64_t total = 0, worst = 0;
+	int ticks = 0;
+	for (;;) {
+		int64_t tick_start = microseconds ();
+		if (! replay.Step (*scenario))
+			break;
+		int64_t cost = microseconds () - tick_start;
+		total += cost;
+		if (cost > worst)
+			worst = cost;
+		ticks++;
+
+		double now = al_get_time ();
+		if (now - report_time >= 5.0) {
+			printf ("tick %d of %d\n", scenario->get_tick (), replay.get_last_tick ());
+			fflush (stdout);
+			report_time = now;
+		}
+	}
+
+	printf ("replay: %d ticks, %.1f us each on average, %.1f us at worst\n",
+		ticks, ticks > 0 ? (double) total / ticks : 0.0, (double) worst);
+	if (s_server.deterministic) {
+		if (replay.get_desync_tick () >= 0)
+			printf ("  state first differs from the recording at tick %d\n", replay.get_desync_tick ());
+		else
+			printf ("  state matches the recording\n");
+	}
+	if (replay.get_ai_mismatches () > 0) {
+		printf ("  AI decided differently %d times, first at tick %d\n",
+			replay.get_ai_mismatches (), replay.get_ai_mismatch_tick ());
+	}
+}
+
+// Runs count matches of the initial scenario side by side, each with
+// ai_count AI avatars, on a ScenarioHost, until each has run ticks ticks
+// (0=forever). Reports each worker's load, and the matches' tick times.
+// Matches run serially (see ScenarioHost), whatever the thread options say.
+void ServerHost (Script & options, std::string dropbox, int count) {
+	ScenarioHost host (options.integer ("host_threads"));
+	std::string ai_type = options.text ("ai_type");
+	int ai_count = options.integer ("ai_count");
+	int i;
+	for (i = 0; i < count; i++) {
+		Scenario * scenario = new Scenario (options.text ("initial_scenario"), dropbox, true);
+		scenario->SetSimThreads (1);
+		scenario->SetPathThreads (0, options.integer ("path_budget_us") / 1000000.0);
+		scenario->SetFlowFields (options.integer ("flow_field_mb"),
+			options.integer ("flow_budget_us") / 1000000.0);
+		scenario->SetInfluenceThreaded (false);
+		scenario->SetAIBudget (options.integer ("ai_budget_us"));
+		scenario->SetDeterministic (options.integer ("deterministic") != 0);
+		scenario->SetRollbackTicks (options.integer ("rollback_ticks"));
+		scenario->SetMaxRewind (options.integer ("max_rewind_ticks"));
+		int a;
+		for (a = 0; a < ai_count; a++) {
+			Avatar * avatar = Avatar::Make (ai_type, "ai", scenario);
+			if (avatar)
+				avatar->JoinGame (1 + a % 2);
+		}
+		host.Add (scenario, s_server.tick_rate);
+	}
+	printf ("hosting %d matches on %d workers\n", count, host.worker_count ());
+
+	std::vector<ScenarioHost::Match> matches;
+	double report_time = al_get_time ();
+	for (;;) {
+		al_rest (1.0);
+		host.Balance ();
+		host.GetMatches (matches);
+		int fewest = INT_MAX;
+		int m;
+		for (m = 0; m < (signed) matches.size(); m++) {
+			if (matches[m].ticks < fewest)
+				fewest = matches[m].ticks;
+		}
+		if (s_server.ticks > 0 && fewest >= s_server.ticks)
+			break;
+
+		double now = al_get_time ();
+		if (now - report_time < 5.0)
+			continue;
+		report_time = now;
+		int on_map = 0;
+		for (m = 0; m < (signed) matches.size(); m++)
+			on_map += matches[m].on_map;
+		printf ("tick %d: %d moves so far, %d avatars on the map\n", fewest, host.get_moves (), on_map);
+		int w;
+		for (w = 0; w < host.worker_count (); w++) {
+			int hosted = 0;
+			int64_t peak = 0;
+			for (m = 0; m < (signed) matches.size(); m++) {
+				if (matches[m].worker != w)
+					continue;
+				hosted++;
+				if (matches[m].peak > peak)
+					peak = matches[m].peak;
+			}
+			printf ("  worker %d: %d matches, %.0f%% busy, longest tick %.2f ms\n",
+				w, hosted, host.get_worker_load (w) * 100, peak / 1000.0);
+		}
+		size_t bytes = 0;
+		for (m = 0; m < (signed) matches.size(); m++)
+			bytes += matches[m].arena_reserved;
+		printf ("  %.1f KB of avatars per match\n", bytes / 1024.0 / matches.size());
+		fflush (stdout);
+	}
+}
+
+// Hands players the inputs their clients sent, to act on in the next tick.
+void ServerTakeInputs () {
+	int c;
+	for (c = 0; c < (signed) s_server.clients.size(); c++) {
+		LoopbackClient * client = s_server.clients[c];
+		StateAvatarScenario v;
+		int view_tick;
+		client->sender.ReadAcks ();
+		if (client->player && client->sender.TakeInput (v, view_tick))
+			client->player->ApplyInput (v, view_tick);
+	}
+}
+
+// Sends each client a snapshot of the tick just run: what is relevant to
+// the client is gathered first, and only that is put in the snapshot.
+// Clients with players then take their turn.
+void ServerReplicate (int tick) {
+	int c;
+	for (c = 0; c < (signed) s_server.clients.size(); c++) {
+		LoopbackClient * client = s_server.clients[c];
+		const StateScenarioAvatar * focus = s_server.scenario->GetAvatarState (client->view.focus);
+		if (focus && focus->on_map)
+			client->view.CentreOn (focus->map_x, focus->map_y, CLIENT_VIEW_WIDTH, CLIENT_VIEW_HEIGHT);
+
+		s_server.relevant.clear ();
+		s_server.interest.Gather (*s_server.scenario, tick, client->view, s_server.relevant);
+		client->sender.ReadAcks ();
+		client->sender.Send (tick, s_server.scenario->GetAvatars (), s_server.relevant);
+		client->server_channel.Flush ();
+		bool newer = client->receiver.Receive ();
+		if (client->player) {
+			if (newer)
+				client->predictor.Reconcile (*s_server.scenario, client->receiver);
+			ServerPlayClient (client);
+		} else {
+			client->client_channel.Flush ();
+		}
+	}
+}
+
+// A number from 0 to n-1, from a client's own random sequence.
+static int ClientRandom (LoopbackClient * client, int n) {
+	client->random = client->random * 1103515245 + 12345;
+	return (int) ((client->random >> 16) % n);
+}
+
+// A loopback client's tick: heads somewhere new now and then, and sends
+// that as its input. (The client shares the server's scenario for the map.)
+void ServerPlayClient (LoopbackClient * client) {
+	PlayerPredictor & predictor = client->predictor;
+	StateAvatarScenario & input = client->input;
+	const StateScenarioAvatar & p = predictor.get_predicted ();
+	if (predictor.is_predicting ()) {
+		float dx = input.motion_goal_x - p.map_x;
+		float dy = input.motion_goal_y - p.map_y;
+		if (dx * dx + dy * dy < 4.0f || ClientRandom (client, 240) == 0) {
+			float width = (float) s_server.scenario->get_map_width ();
+			float height = (float) s_server.scenario->get_map_height ();
+			input.motion_goal_x = clamp (p.map_x + ClientRandom (client, 401) - 200, 0.0f, width - 1);
+			input.motion_goal_y = clamp (p.map_y + ClientRandom (client, 401) - 200, 0.0f, height - 1);
+		}
+	}
+	predictor.Tick (*s_server.scenario, input, client->receiver.get_tick ());
+}
+
+void ServerClose () {
+	int c;
+	for (c = 0; c < (signed) s_server.clients.size(); c++)
+		delete s_server.clients[c];
+	s_server.scenario->SetRecorder (NULL);
+	delete s_server.scenario;
+	delete s_server.recorder;
+}